@@ -62,7 +62,6 @@ int validate_aivdo(xambit_parcel_hdr_t *hdr, void *data)
 int main(int argc, char **argv)
 {
     char		*fifo_path;
-    void		*outbuf;
     int			err = 0;
     xambit_channel_t	*ch = NULL;
     struct sigaction	sig_close;
@@ -134,20 +133,21 @@ int main(int argc, char **argv)
 
     while (1)
     {
-	int		    err;
-	xambit_parcel_hdr_t *phdr = NULL;
+	xambit_parcel_t	    parcels[XAMBIT_BATCH_MAX];
+	int		    i;
+	int		    n;
 
 	if (do_close)
 	    goto out;
 
-	outbuf = NULL;
-	phdr = NULL;
-	err = channel_receive(ch, &outbuf, &phdr);
-	if (err >= 0)
+	/* Drain everything the FIFO has buffered in one go */
+	n = channel_receive_batch(ch, parcels, XAMBIT_BATCH_MAX);
+	for (i = 0; i < n; i++)
 	{
-	    fprintf(stdout, "%*.*s\n", (int)phdr->length, (int)phdr->length, (char *)outbuf);
-	    free(outbuf);
-	    free(phdr);
+	    xambit_parcel_hdr_t *phdr = &parcels[i].hdr;
+
+	    fprintf(stdout, "%*.*s\n", (int)phdr->length, (int)phdr->length,
+		    (char *)parcels[i].data);
 	}
     }
 
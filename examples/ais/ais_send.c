@@ -49,20 +49,9 @@ static void handle_signal(int signo, siginfo_t *siginfo, void *context)
     }
 }
 
-int validate_aivdm(xambit_parcel_hdr_t *hdr, void *data)
-{
-    /* Demo Filter - if message checksum = 2B, then drop message */
-    char    *csum;
-    char    csum_s[4];
-
-    csum = (char *)data + hdr->length - 4;
-    snprintf(csum_s, 4, "%3.3s%c", csum, '\0');
-
-    if (strcmp(csum_s, "*2B") == 0)
-	return -1;
-
-    return 0;
-}
+/* Demo Filter - if message checksum = 2B, then drop message */
+static const char aivdm_rules[] =
+    "forbid /\\*2B.$/\n";
 
 int validate_aivdo(xambit_parcel_hdr_t *hdr, void *data)
 {
@@ -128,7 +117,7 @@ int main(int argc, char **argv)
     }
     printf("done\n");
 
-    err = channel_register_type(ch, XT_AIVDM, validate_aivdm);
+    err = channel_register_rules(ch, XT_AIVDM, aivdm_rules);
     if (err < 0)
     {
 	fprintf(stderr, "Could not register type %d\n", XT_FILE);
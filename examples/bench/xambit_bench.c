@@ -0,0 +1,800 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems Electronic Systems, Inc.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Throughput benchmark. A child process receives over a FIFO, or a shared
+ * memory ring, Unix socket or loopback UDP for the shm, sock and udp modes,
+ * while the parent sends <count> parcels of <size> bytes using the chosen
+ * send mode, from several threads at once in the threads, tbuffered and
+ * shared modes. The rules and naive modes check each parcel, at both ends,
+ * against the same declarative rules or a hand written callback. The rcheck
+ * and pipeline modes run the callback at the receiver only, the latter on
+ * BENCH_THREADS workers with the channel pipelined. The uring and uringfile
+ * modes move the data through an io_uring at both ends, where the kernel
+ * has one. The zlib modes compress at both ends, parcels of words in zlib
+ * and zlibpar, the latter deflating each on BENCH_THREADS workers, and of
+ * random bytes, which should be sent as they are, in zlibrand. The tofile
+ * and dedup modes receive each parcel into a file, the same file sent over
+ * and over, by reference once the receiver has kept it in dedup. The
+ * changed and delta modes do the same with a few bytes of the file changed
+ * each time, sent as a delta from the last version in delta. CPU time is
+ * that of both processes, per GB of payload.
+ *
+ *	xbench <mode> [count] [size]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "../include/ex_types.h"
+
+#define BENCH_FIFO_TMPL	"/tmp/xbenchXXXXXX"
+#define BENCH_THREADS	4	    /* Senders, or pipeline workers */
+#define BENCH_EXTENT	(1 << 20)   /* Extent of the journal mode */
+
+struct bench_mode {
+    const char	*name;
+    int		(*send)(xambit_channel_t *ch, char *buf, long count, long size);
+    int		(*receive)(xambit_channel_t *ch, long count);
+    int		flags;
+    xambit_channel_t *(*open)(const char *path, int flags, int write);
+    int		(*setup)(xambit_channel_t *ch);	/* Both ends, once open */
+    void	(*fill)(char *buf, long size);	/* Default all 'x' */
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int send_plain(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    long i;
+
+    for (i = 0; i < count; i++)
+    {
+	if (channel_send(ch, buf, size, XT_BIN) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+static int send_batch(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    xambit_send_vec_t	vec[XAMBIT_BATCH_MAX];
+    long		i;
+    int			n;
+
+    for (i = 0; i < XAMBIT_BATCH_MAX; i++)
+    {
+	vec[i].buf = buf;
+	vec[i].size = size;
+	vec[i].tid = XT_BIN;
+    }
+
+    for (i = 0; i < count; i += n)
+    {
+	n = count - i < XAMBIT_BATCH_MAX ? count - i : XAMBIT_BATCH_MAX;
+	if (channel_send_batch(ch, vec, n) != n)
+	    return -1;
+    }
+    return 0;
+}
+
+static int send_buffered(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    if (send_plain(ch, buf, count, size) < 0)
+	return -1;
+    return channel_flush(ch);
+}
+
+static int send_file(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    char    path[] = "/tmp/xbenchfileXXXXXX";
+    long    i;
+    int	    fd;
+    int	    err = 0;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+	return -1;
+    if (write(fd, buf, size) != size)
+	err = -1;
+    close(fd);
+
+    for (i = 0; i < count && err == 0; i++)
+	err = channel_send_file(ch, path, XT_BIN);
+
+    unlink(path);
+    return err;
+}
+
+/* A file of size bytes with only its first quarter written, the rest a hole */
+static int send_sparse(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    char    path[] = "/tmp/xbenchfileXXXXXX";
+    long    i;
+    int	    fd;
+    int	    err = 0;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+	return -1;
+    if (ftruncate(fd, size) < 0 || write(fd, buf, size / 4) != size / 4)
+	err = -1;
+    close(fd);
+
+    for (i = 0; i < count && err == 0; i++)
+	err = channel_send_file(ch, path, XT_BIN);
+
+    unlink(path);
+    return err;
+}
+
+/* The same file sent over and over, but with a few bytes changed each time
+ * somewhere along it */
+static int send_changed(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    char    path[] = "/tmp/xbenchfileXXXXXX";
+    long    off;
+    long    i;
+    int	    fd;
+    int	    err = 0;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+	return -1;
+    if (write(fd, buf, size) != size)
+	err = -1;
+
+    for (i = 0; i < count && err == 0; i++)
+    {
+	off = (i * 7919 * 64) % (size > 16 ? size - 16 : 1);
+	memset(buf + off, (int)i, size > 16 ? 16 : size);
+	if (pwrite(fd, buf + off, size > 16 ? 16 : size, off) < 0)
+	    err = -1;
+	else
+	    err = channel_send_file(ch, path, XT_BIN);
+    }
+
+    close(fd);
+    unlink(path);
+    return err;
+}
+
+struct bench_thread {
+    pthread_t	    thread;
+    xambit_channel_t *ch;
+    char	    *buf;
+    long	    count;
+    long	    size;
+    int		    err;
+};
+
+static void *send_thread(void *arg)
+{
+    struct bench_thread *t = arg;
+
+    t->err = send_plain(t->ch, t->buf, t->count, t->size);
+    return NULL;
+}
+
+/* Share the parcels out between BENCH_THREADS threads on the one channel */
+static int send_threads(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    struct bench_thread	t[BENCH_THREADS];
+    int			err = 0;
+    int			i;
+
+    for (i = 0; i < BENCH_THREADS; i++)
+    {
+	t[i].ch = ch;
+	t[i].buf = buf;
+	t[i].count = count / BENCH_THREADS +
+		     (i < count % BENCH_THREADS ? 1 : 0);
+	t[i].size = size;
+	if (pthread_create(&t[i].thread, NULL, send_thread, &t[i]) != 0)
+	    t[i].count = -1;
+    }
+
+    for (i = 0; i < BENCH_THREADS; i++)
+    {
+	if (t[i].count < 0)
+	{
+	    err = -1;
+	    continue;
+	}
+	pthread_join(t[i].thread, NULL);
+	if (t[i].err < 0)
+	    err = -1;
+    }
+    if (err == 0)
+	err = channel_flush(ch);
+    return err;
+}
+
+static int send_unpaced(xambit_channel_t *ch, char *buf, long count,
+			long size)
+{
+    if (channel_set_pacing(ch, 0, 0) < 0)
+	return -1;
+    return send_buffered(ch, buf, count, size);
+}
+
+/* Lose 1% of datagrams, as a poor link might */
+static int setup_loss(xambit_channel_t *ch)
+{
+    if (ch->direction == XAMBIT_CHOUT)
+	return channel_set_loss(ch, 10000);
+    return 0;
+}
+
+/* ... and win them back with 4 repair datagrams in every 32 */
+static int setup_fec(xambit_channel_t *ch)
+{
+    if (channel_set_fec(ch, 28, 4) < 0)
+	return -1;
+    return setup_loss(ch);
+}
+
+/* A rule set, and a callback written by hand to the same effect, for the
+ * rules and naive modes */
+static const char bench_rules[] =
+    "bytes [\\t\\n\\r\\x20-\\x7e]\n"
+    "require /^[a-z]/\n"
+    "forbid \"<script\"\n"
+    "forbid \"DROP TABLE\"\n"
+    "forbid \"../\"\n";
+
+static int naive_validator(xambit_parcel_hdr_t *hdr, void *data)
+{
+    static const char	*bad[] = { "<script", "DROP TABLE", "../" };
+    static const size_t	len[] = { 7, 10, 3 };
+    const unsigned char	*p = data;
+    uint64_t		i;
+    int			j;
+
+    if (hdr->length == 0 || p[0] < 'a' || p[0] > 'z')
+	return -1;
+
+    for (i = 0; i < hdr->length; i++)
+    {
+	if ((p[i] < 0x20 || p[i] > 0x7e) && p[i] != '\t' && p[i] != '\n' &&
+	    p[i] != '\r')
+	    return -1;
+	for (j = 0; j < 3; j++)
+	    if (p[i] == bad[j][0] && hdr->length - i >= len[j] &&
+		memcmp(p + i, bad[j], len[j]) == 0)
+		return -1;
+    }
+    return 0;
+}
+
+static int setup_rules(xambit_channel_t *ch)
+{
+    return channel_register_rules(ch, XT_BIN, bench_rules);
+}
+
+static int setup_naive(xambit_channel_t *ch)
+{
+    return channel_register_type(ch, XT_BIN, naive_validator);
+}
+
+static int setup_rcheck(xambit_channel_t *ch)
+{
+    if (ch->direction == XAMBIT_CHOUT)
+	return 0;
+    return setup_naive(ch);
+}
+
+static int setup_pipeline(xambit_channel_t *ch)
+{
+    if (ch->direction == XAMBIT_CHOUT)
+	return 0;
+    if (setup_naive(ch) < 0 || channel_set_workers(ch, BENCH_THREADS, 0) < 0)
+	return -1;
+    return channel_set_pipeline(ch, 16 << 20);
+}
+
+/* The writer's index and the reader's store, named after the parent */
+static void dedup_dir(char *dir, size_t len, pid_t parent, int write)
+{
+    snprintf(dir, len, "/tmp/xbenchdd%d%c", (int)parent, write ? 'w' : 'r');
+}
+
+static int setup_dedup(xambit_channel_t *ch)
+{
+    char    dir[64];
+    int	    write = ch->direction == XAMBIT_CHOUT;
+
+    dedup_dir(dir, sizeof(dir), write ? getpid() : getppid(), write);
+    return channel_set_dedup(ch, dir, 0);
+}
+
+/* Remove dir and all in it: files, and the writer's history directory */
+static void remove_dir(const char *dir)
+{
+    struct dirent   *de;
+    DIR		    *d;
+    char	    path[PATH_MAX];
+
+    d = opendir(dir);
+    if (d == NULL)
+	return;
+    while ((de = readdir(d)) != NULL)
+    {
+	snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	if ((de->d_name[0] != '.' || de->d_name[1] > '.') &&
+	    unlink(path) < 0 && errno == EISDIR)
+	    remove_dir(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/* Files sent as extents of BENCH_EXTENT bytes, journaled where the dedup
+ * modes keep their files */
+static int setup_journal(xambit_channel_t *ch)
+{
+    char    dir[64];
+    int	    write = ch->direction == XAMBIT_CHOUT;
+
+    dedup_dir(dir, sizeof(dir), write ? getpid() : getppid(), write);
+    return channel_set_journal(ch, dir, BENCH_EXTENT, 4);
+}
+
+static void dedup_remove(pid_t parent, int write)
+{
+    char    dir[64];
+
+    dedup_dir(dir, sizeof(dir), parent, write);
+    remove_dir(dir);
+}
+
+static int setup_zworkers(xambit_channel_t *ch)
+{
+    return channel_set_workers(ch, BENCH_THREADS, 0);
+}
+
+/* Words of text, which deflate to under a fifth ... */
+static void fill_text(char *buf, long size)
+{
+    static const char	*words[] = { "alpha ", "bravo ", "charlie ",
+				     "delta ", "echo ", "foxtrot ", "golf ",
+				     "hotel ", "india ", "juliet\n" };
+    unsigned int	seed = 1;
+    const char		*w;
+    long		i = 0;
+
+    while (i < size)
+    {
+	seed = seed * 1103515245 + 12345;
+	for (w = words[(seed >> 16) % 10]; *w != '\0' && i < size; w++)
+	    buf[i++] = *w;
+    }
+}
+
+/* ... and random bytes, which do not deflate at all */
+static void fill_random(char *buf, long size)
+{
+    unsigned int	seed = 1;
+    long		i;
+
+    for (i = 0; i < size; i++)
+    {
+	seed = seed * 1103515245 + 12345;
+	buf[i] = seed >> 16;
+    }
+}
+
+static int send_gift(xambit_channel_t *ch, char *buf, long count, long size)
+{
+    void    *p;
+    long    i;
+
+    for (i = 0; i < count; i++)
+    {
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	    return -1;
+	memcpy(p, buf, size);
+	if (channel_send_gift(ch, p, size, XT_BIN) < 0)
+	    return -1;
+	munmap(p, size);
+    }
+    return 0;
+}
+
+static int receive_plain(xambit_channel_t *ch, long count)
+{
+    xambit_parcel_hdr_t *hdr;
+    void		*data;
+    long		i;
+
+    for (i = 0; i < count; i++)
+    {
+	if (channel_receive(ch, &data, &hdr) < 0)
+	    return -1;
+	free(data);
+	free(hdr);
+    }
+    return 0;
+}
+
+static int receive_batch(xambit_channel_t *ch, long count)
+{
+    xambit_parcel_t	p[XAMBIT_BATCH_MAX];
+    long		i;
+    int			n;
+
+    for (i = 0; i < count; i += n)
+    {
+	n = channel_receive_batch(ch, p, XAMBIT_BATCH_MAX);
+	if (n < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/* Over UDP parcels may be lost, so read until the sender closes */
+static int receive_drain(xambit_channel_t *ch, long count)
+{
+    xambit_parcel_t	p[XAMBIT_BATCH_MAX];
+
+    (void)count;
+    while (channel_receive_batch(ch, p, XAMBIT_BATCH_MAX) >= 0)
+	;
+    return errno == EINVAL ? 0 : -1;
+}
+
+static int receive_into(xambit_channel_t *ch, long count)
+{
+    xambit_parcel_hdr_t hdr;
+    static char		buf[1 << 20];
+    long		i;
+
+    for (i = 0; i < count; i++)
+    {
+	if (channel_receive_into(ch, &hdr, buf, sizeof(buf)) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+static int receive_file(xambit_channel_t *ch, long count)
+{
+    char    path[] = "/tmp/xbenchrecvXXXXXX";
+    long    i;
+    int	    fd;
+    int	    err = 0;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+	return -1;
+    close(fd);
+
+    for (i = 0; i < count && err == 0; i++)
+	err = channel_receive_to_file(ch, path, O_WRONLY | O_TRUNC, 0600);
+
+    unlink(path);
+    return err < 0 ? -1 : 0;
+}
+
+static int receive_pool(xambit_channel_t *ch, long count)
+{
+    xambit_parcel_hdr_t *hdr;
+    void		*data;
+    long		i;
+
+    if (channel_set_pool(ch, 1 << 20) < 0)
+	return -1;
+
+    for (i = 0; i < count; i++)
+    {
+	if (channel_receive(ch, &data, &hdr) < 0)
+	    return -1;
+	channel_release(ch, data, hdr);
+    }
+    return 0;
+}
+
+static struct bench_mode modes[] = {
+    { .name = "send", .send = send_plain, .receive = receive_plain },
+    { .name = "batch", .send = send_batch, .receive = receive_plain },
+    { .name = "buffered", .send = send_buffered, .receive = receive_plain,
+      .flags = XAMBIT_BUFFERED },
+    { .name = "rbatch", .send = send_buffered, .receive = receive_batch,
+      .flags = XAMBIT_BUFFERED },
+    { .name = "rinto", .send = send_buffered, .receive = receive_into,
+      .flags = XAMBIT_BUFFERED },
+    { .name = "rpool", .send = send_buffered, .receive = receive_pool,
+      .flags = XAMBIT_BUFFERED },
+    { .name = "file", .send = send_file, .receive = receive_batch },
+    { .name = "gift", .send = send_gift, .receive = receive_batch },
+    { .name = "csum", .send = send_plain, .receive = receive_plain,
+      .flags = XAMBIT_CHECKSUM },
+    { .name = "threads", .send = send_threads, .receive = receive_plain,
+      .flags = XAMBIT_THREADED },
+    { .name = "tbuffered", .send = send_threads, .receive = receive_batch,
+      .flags = XAMBIT_THREADED | XAMBIT_BUFFERED },
+    { .name = "shared", .send = send_threads, .receive = receive_plain,
+      .flags = XAMBIT_SHARED },
+    { .name = "bcsum", .send = send_buffered, .receive = receive_into,
+      .flags = XAMBIT_BUFFERED | XAMBIT_CHECKSUM },
+    { .name = "rules", .send = send_plain, .receive = receive_plain,
+      .setup = setup_rules },
+    { .name = "naive", .send = send_plain, .receive = receive_plain,
+      .setup = setup_naive },
+    { .name = "rcheck", .send = send_buffered, .receive = receive_batch,
+      .flags = XAMBIT_BUFFERED, .setup = setup_rcheck },
+    { .name = "pipeline", .send = send_buffered, .receive = receive_batch,
+      .flags = XAMBIT_BUFFERED, .setup = setup_pipeline },
+    { .name = "uring", .send = send_buffered, .receive = receive_batch,
+      .flags = XAMBIT_BUFFERED | XAMBIT_URING },
+    { .name = "uringfile", .send = send_file, .receive = receive_batch,
+      .flags = XAMBIT_URING },
+    { .name = "shm", .send = send_plain, .receive = receive_plain,
+      .open = channel_shm_open },
+    { .name = "shmbatch", .send = send_buffered, .receive = receive_batch,
+      .flags = XAMBIT_BUFFERED, .open = channel_shm_open },
+    { .name = "sock", .send = send_plain, .receive = receive_plain,
+      .open = channel_sock_open },
+    { .name = "sockbatch", .send = send_buffered, .receive = receive_batch,
+      .flags = XAMBIT_BUFFERED, .open = channel_sock_open },
+    { .name = "sockfile", .send = send_file, .receive = receive_batch,
+      .open = channel_sock_open },
+    { .name = "sockfd", .send = send_file, .receive = receive_batch,
+      .flags = XAMBIT_FDPASS, .open = channel_sock_open },
+    { .name = "udp", .send = send_buffered, .receive = receive_drain,
+      .flags = XAMBIT_BUFFERED, .open = channel_udp_open },
+    { .name = "udpmax", .send = send_unpaced, .receive = receive_drain,
+      .flags = XAMBIT_BUFFERED, .open = channel_udp_open },
+    { .name = "udploss", .send = send_buffered, .receive = receive_drain,
+      .flags = XAMBIT_BUFFERED, .open = channel_udp_open,
+      .setup = setup_loss },
+    { .name = "udpfec", .send = send_buffered, .receive = receive_drain,
+      .flags = XAMBIT_BUFFERED, .open = channel_udp_open, .setup = setup_fec },
+    { .name = "zlib", .send = send_plain, .receive = receive_plain,
+      .flags = XAMBIT_COMPRESS, .fill = fill_text },
+    { .name = "zlibrand", .send = send_plain, .receive = receive_plain,
+      .flags = XAMBIT_COMPRESS, .fill = fill_random },
+    { .name = "zlibpar", .send = send_plain, .receive = receive_plain,
+      .flags = XAMBIT_COMPRESS, .setup = setup_zworkers, .fill = fill_text },
+    { .name = "tofile", .send = send_file, .receive = receive_file },
+    { .name = "dedup", .send = send_file, .receive = receive_file,
+      .setup = setup_dedup },
+    { .name = "changed", .send = send_changed, .receive = receive_file,
+      .fill = fill_random },
+    { .name = "delta", .send = send_changed, .receive = receive_file,
+      .flags = XAMBIT_DIFF, .setup = setup_dedup, .fill = fill_random },
+    { .name = "journal", .send = send_file, .receive = receive_file,
+      .setup = setup_journal },
+    { .name = "holes", .send = send_sparse, .receive = receive_file },
+    { .name = "sparse", .send = send_sparse, .receive = receive_file,
+      .flags = XAMBIT_SPARSE },
+    { .name = NULL }
+};
+
+/* ready is written to once the channel is open, for the UDP modes, whose
+ * writer would otherwise send before there is anyone to receive */
+static int run_receiver(const char *path, struct bench_mode *m, long count,
+			int ready)
+{
+    xambit_channel_t	*ch;
+    xambit_stats_t	st;
+    int			err;
+
+    ch = m->open(path, m->flags & (XAMBIT_URING | XAMBIT_COMPRESS),
+		 XAMBIT_CHIN);
+    if (ch == NULL || (m->setup != NULL && m->setup(ch) < 0))
+	return 1;
+    if (write(ready, "", 1) != 1)
+	return 1;
+
+    channel_register_type(ch, XT_BIN, null_validator);
+    err = m->receive(ch, count);
+    channel_get_stats(ch, &st);
+    channel_close(ch);
+
+    if (err == 0 && count > 0)
+	printf("%-10s receiver: %6.3f reads/parcel %6.3f allocs/parcel\n",
+	       m->name, (double)st.read_calls / count,
+	       (double)st.allocs / count);
+    if (err == 0 && m->open == channel_udp_open)
+	printf("%-10s receiver: %llu parcels %llu datagrams lost %llu "
+	       "recovered %llu parcels dropped\n", m->name,
+	       (unsigned long long)st.parcels_received,
+	       (unsigned long long)st.dgrams_lost,
+	       (unsigned long long)st.dgrams_recovered,
+	       (unsigned long long)st.parcels_dropped);
+    fflush(stdout);
+
+    return err < 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    char		dir[] = BENCH_FIFO_TMPL;
+    char		path[64];
+    struct bench_mode	*m;
+    xambit_channel_t	*ch;
+    xambit_stats_t	st;
+    long		count = 1000000;
+    long		size = 80;
+    char		*buf;
+    double		t0, t1;
+    double		cpu;
+    struct rusage	ru, rc;
+    pid_t		pid;
+    int			ready[2];
+    char		c;
+    int			status;
+    int			err;
+
+    if (argc < 2)
+    {
+	fprintf(stderr, "usage: %s <mode> [count] [size]\nmodes:", argv[0]);
+	for (m = modes; m->name != NULL; m++)
+	    fprintf(stderr, " %s", m->name);
+	fprintf(stderr, "\n");
+	return 1;
+    }
+
+    for (m = modes; m->name != NULL; m++)
+	if (strcmp(m->name, argv[1]) == 0)
+	    break;
+    if (m->name == NULL)
+    {
+	fprintf(stderr, "Unknown mode %s\n", argv[1]);
+	return 1;
+    }
+    if (argc > 2)
+	count = atol(argv[2]);
+    if (argc > 3)
+	size = atol(argv[3]);
+
+    if (mkdtemp(dir) == NULL)
+    {
+	fprintf(stderr, "mkdtemp failed: errno: %d\n", errno);
+	return 1;
+    }
+    /* The ring is named after the directory, which keeps the name unique */
+    if (m->open == channel_shm_open)
+	snprintf(path, sizeof(path), "%s", strrchr(dir, '/'));
+    else if (m->open == channel_udp_open)
+	snprintf(path, sizeof(path), "127.0.0.1:%d", 20000 + getpid() % 20000);
+    else
+	snprintf(path, sizeof(path), "%s/%s", dir,
+		 m->open != NULL ? "sock" : "fifo");
+    if (m->open == NULL && mkfifo(path, 0600) < 0)
+    {
+	fprintf(stderr, "mkfifo failed: errno: %d\n", errno);
+	rmdir(dir);
+	return 1;
+    }
+
+    if (m->open == NULL)
+	m->open = channel_fifo_open;
+
+    if (pipe(ready) < 0)
+    {
+	fprintf(stderr, "pipe failed: errno: %d\n", errno);
+	rmdir(dir);
+	return 1;
+    }
+
+    pid = fork();
+    if (pid == 0)
+	_exit(run_receiver(path, m, count, ready[1]));
+    close(ready[1]);
+    if (m->open == channel_udp_open && read(ready[0], &c, 1) != 1)
+    {
+	fprintf(stderr, "%s: receiver failed to open\n", m->name);
+	waitpid(pid, &status, 0);
+	rmdir(dir);
+	return 1;
+    }
+
+    buf = malloc(size);
+    if (m->fill != NULL)
+	m->fill(buf, size);
+    else
+	memset(buf, 'x', size);
+
+    ch = m->open(path, m->flags, XAMBIT_CHOUT);
+    if (ch == NULL || (m->setup != NULL && m->setup(ch) < 0))
+    {
+	fprintf(stderr, "Failed to open the channel: errno: %d\n", errno);
+	err = -1;
+	goto out;
+    }
+    channel_register_type(ch, XT_BIN, null_validator);
+
+    t0 = now();
+    err = m->send(ch, buf, count, size);
+    channel_get_stats(ch, &st);
+    channel_close(ch);
+    waitpid(pid, &status, 0);
+    t1 = now();
+    getrusage(RUSAGE_SELF, &ru);
+    getrusage(RUSAGE_CHILDREN, &rc);
+    cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + rc.ru_utime.tv_sec +
+	  rc.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec +
+	  rc.ru_utime.tv_usec + rc.ru_stime.tv_usec) / 1e6;
+
+    if (err < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+	fprintf(stderr, "%s: transfer failed\n", m->name);
+	err = -1;
+	goto out;
+    }
+
+    printf("%-10s %9ld x %7ld B: %8.3f s %12.0f parcels/s %9.1f MB/s "
+	   "%6.3f writes/parcel %7.3f CPU s/GB\n",
+	   m->name, count, size, t1 - t0, count / (t1 - t0),
+	   count * (double)size / (t1 - t0) / 1e6,
+	   (double)st.write_calls / count, cpu * 1e9 / (count * (double)size));
+    if (m->flags & XAMBIT_COMPRESS)
+	printf("%-10s sender: %llu parcels deflated %llu sent as they were "
+	       "%.1f%% saved %.3f s deflating\n", m->name,
+	       (unsigned long long)st.zlib_parcels,
+	       (unsigned long long)st.zlib_skipped,
+	       100.0 * st.zlib_saved / (count * (double)size),
+	       st.zlib_usec / 1e6);
+    if (m->setup == setup_dedup)
+	printf("%-10s sender: %llu files sent by reference %llu as deltas "
+	       "%.1f%% saved\n", m->name, (unsigned long long)st.dedup_refs,
+	       (unsigned long long)st.dedup_deltas,
+	       100.0 * st.dedup_saved / (count * (double)size));
+    if (m->setup == setup_journal)
+	printf("%-10s sender: %llu extents\n", m->name,
+	       (unsigned long long)st.extents);
+
+out:
+    if (m->setup == setup_dedup || m->setup == setup_journal)
+    {
+	dedup_remove(getpid(), 1);
+	dedup_remove(getpid(), 0);
+    }
+    free(buf);
+    close(ready[0]);
+    if (m->open != channel_shm_open && m->open != channel_udp_open)
+	unlink(path);
+    rmdir(dir);
+    return err < 0 ? 1 : 0;
+}
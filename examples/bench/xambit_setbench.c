@@ -0,0 +1,303 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems Electronic Systems, Inc.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Channel set benchmark. A child process opens <channels> non-blocking FIFO
+ * channels, sharing one type registry, and services them all from one
+ * channel set while the parent sends <count> parcels of <size> bytes spread
+ * over the channels, <gap> microseconds apart, each stamped with the time
+ * it was sent. The receiver reports the memory each open channel costs it,
+ * before any traffic and once every channel has its read-ahead buffer, and
+ * the time from send to receipt.
+ *
+ *	xsetbench [channels] [count] [size] [gap]
+ */
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "../include/ex_types.h"
+
+#define BENCH_DIR_TMPL	"/tmp/xsetbenchXXXXXX"
+/* The least a channel may read ahead, as 10000 of the default would be 640 MB */
+#define BENCH_READAHEAD	(sizeof(xambit_parcel_hdr_t) + MAX_STREAM_SIZE)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t heap_used(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.uordblks + mi.hblkhd;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Open more descriptors than the usual soft limit allows */
+static void raise_nofile(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int run_receiver(const char *dir, long nch, long count, long size,
+			int ready)
+{
+    xambit_channel_t	**ch;
+    xambit_channel_t	*c;
+    xambit_registry_t	*reg;
+    xambit_set_t	*set;
+    xambit_parcel_hdr_t hdr;
+    char		path[64];
+    uint64_t		*lat;
+    uint64_t		stamp;
+    uint64_t		sum = 0;
+    size_t		heap0, heap1, heap2;
+    char		*buf;
+    long		got = 0;
+    long		waits = 0;
+    long		i;
+    int			err = 0;
+
+    ch = calloc(nch, sizeof(*ch));
+    lat = malloc(count * sizeof(*lat));
+    buf = malloc(size);
+    reg = xambit_registry_new();
+    set = xambit_set_new();
+    if (ch == NULL || lat == NULL || buf == NULL || reg == NULL ||
+	set == NULL)
+	return 1;
+    xambit_registry_register_ops(reg, XT_BIN, &(xambit_validator_ops_t){
+				     .validate = null_validator });
+
+    heap0 = heap_used();
+    for (i = 0; i < nch; i++)
+    {
+	snprintf(path, sizeof(path), "%s/%ld", dir, i);
+	ch[i] = channel_fifo_open(path, XAMBIT_NONBLOCK, XAMBIT_CHIN);
+	if (ch[i] == NULL || channel_set_registry(ch[i], reg) < 0 ||
+	    channel_set_readahead(ch[i], BENCH_READAHEAD) < 0 ||
+	    xambit_set_add(set, ch[i], NULL) < 0)
+	{
+	    fprintf(stderr, "receiver: channel %ld: errno: %d\n", i, errno);
+	    return 1;
+	}
+    }
+    heap1 = heap_used();
+    if (write(ready, "", 1) != 1)
+	return 1;
+
+    while (got < count && err == 0)
+    {
+	if (xambit_set_wait(set, -1) < 0)
+	{
+	    err = errno != EINTR;
+	    continue;
+	}
+	waits++;
+
+	while (got < count && (c = xambit_set_next(set, NULL)) != NULL)
+	{
+	    if (channel_receive_into(c, &hdr, buf, size) < 0)
+	    {
+		if (errno == EAGAIN)
+		    continue;
+		err = 1;
+		break;
+	    }
+	    memcpy(&stamp, buf, sizeof(stamp));
+	    lat[got] = now_ns() - stamp;
+	    sum += lat[got];
+	    got++;
+	}
+    }
+    heap2 = heap_used();
+
+    for (i = 0; i < nch; i++)
+	channel_close(ch[i]);
+    xambit_set_free(set);
+    xambit_registry_free(reg);
+
+    if (err)
+    {
+	fprintf(stderr, "receiver: failed after %ld parcels: errno: %d\n",
+		got, errno);
+	return 1;
+    }
+
+    qsort(lat, got, sizeof(*lat), cmp_u64);
+    printf("%ld channels: %zu B struct, %zu B/channel open, %zu B/channel "
+	   "with read-ahead\n", nch, sizeof(xambit_channel_t),
+	   (heap1 - heap0) / nch, (heap2 - heap0) / nch);
+    printf("%ld parcels: latency mean %.1f us p50 %.1f us p99 %.1f us max "
+	   "%.1f us, %.2f parcels/wait\n", got, sum / 1e3 / got,
+	   lat[got / 2] / 1e3, lat[got * 99 / 100] / 1e3, lat[got - 1] / 1e3,
+	   (double)got / waits);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char		dir[] = BENCH_DIR_TMPL;
+    char		path[64];
+    xambit_channel_t	**ch;
+    long		nch = 10000;
+    long		count = 100000;
+    long		size = 64;
+    long		gap = 10;
+    uint64_t		stamp;
+    uint64_t		t;
+    char		*buf;
+    pid_t		pid;
+    int			ready[2];
+    char		c;
+    int			status;
+    int			err = 0;
+    long		i;
+
+    if (argc > 1)
+	nch = atol(argv[1]);
+    if (argc > 2)
+	count = atol(argv[2]);
+    if (argc > 3)
+	size = atol(argv[3]);
+    if (argc > 4)
+	gap = atol(argv[4]);
+    if (nch < 1 || count < 1 || size < (long)sizeof(stamp))
+    {
+	fprintf(stderr, "usage: %s [channels] [count] [size >= %zu] [gap]\n",
+		argv[0], sizeof(stamp));
+	return 1;
+    }
+
+    raise_nofile();
+    if (mkdtemp(dir) == NULL)
+    {
+	fprintf(stderr, "mkdtemp failed: errno: %d\n", errno);
+	return 1;
+    }
+    for (i = 0; i < nch; i++)
+    {
+	snprintf(path, sizeof(path), "%s/%ld", dir, i);
+	if (mkfifo(path, 0600) < 0)
+	{
+	    fprintf(stderr, "mkfifo failed: errno: %d\n", errno);
+	    nch = i;
+	    err = -1;
+	    goto out;
+	}
+    }
+
+    if (pipe(ready) < 0)
+    {
+	fprintf(stderr, "pipe failed: errno: %d\n", errno);
+	err = -1;
+	goto out;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+	err = run_receiver(dir, nch, count, size, ready[1]);
+	fflush(stdout);
+	_exit(err);
+    }
+    close(ready[1]);
+
+    ch = calloc(nch, sizeof(*ch));
+    buf = malloc(size);
+    memset(buf, 'x', size);
+    for (i = 0; i < nch; i++)
+    {
+	snprintf(path, sizeof(path), "%s/%ld", dir, i);
+	ch[i] = channel_fifo_open(path, 0, XAMBIT_CHOUT);
+	if (ch[i] == NULL)
+	{
+	    fprintf(stderr, "Failed to open channel %ld: errno: %d\n", i,
+		    errno);
+	    err = -1;
+	    break;
+	}
+	channel_register_type(ch[i], XT_BIN, null_validator);
+    }
+
+    /* The receiver has every channel in its set before the clock starts */
+    if (err == 0 && read(ready[0], &c, 1) != 1)
+	err = -1;
+
+    for (i = 0; i < count && err == 0; i++)
+    {
+	stamp = now_ns();
+	memcpy(buf, &stamp, sizeof(stamp));
+	if (channel_send(ch[(i * 7919) % nch], buf, size, XT_BIN) < 0)
+	    err = -1;
+	for (t = now_ns(); now_ns() - t < (uint64_t)gap * 1000; )
+	    ;
+    }
+
+    for (i = 0; i < nch && ch[i] != NULL; i++)
+	channel_close(ch[i]);
+    waitpid(pid, &status, 0);
+    if (err < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+	fprintf(stderr, "transfer failed\n");
+	err = -1;
+    }
+    free(buf);
+    free(ch);
+    close(ready[0]);
+
+out:
+    for (i = 0; i < nch; i++)
+    {
+	snprintf(path, sizeof(path), "%s/%ld", dir, i);
+	unlink(path);
+    }
+    rmdir(dir);
+    return err < 0 ? 1 : 0;
+}
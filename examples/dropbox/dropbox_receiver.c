@@ -40,6 +40,7 @@
 #include "../include/ex_types.h"
 
 #define SAVE_DIR "incoming"
+#define DB_STORE ".dbrec-store"	    /* Copies of the files received */
 
 static int do_close;
 
@@ -148,6 +149,13 @@ int main(int argc, char **argv)
 	goto out;
     }
 
+    /* Files sent again arrive as references to the copies kept here */
+    if (channel_set_dedup(ch, DB_STORE, 0) < 0)
+    {
+	fprintf(stderr, "Could not open %s: errno: %d\n", DB_STORE, errno);
+	goto out;
+    }
+
     for (i=0;;i++)
     {
 	if (do_close)
@@ -156,6 +164,12 @@ int main(int argc, char **argv)
 	snprintf(path, sizeof(path), "%s/%d", SAVE_DIR, i);
 	if ((err = channel_receive_to_file(ch, path, O_CREAT | O_RDWR, 00666)) < 0)
 	{
+	    if (err == XAMBIT_ERR_DEDUP)
+	    {
+		fprintf(stderr, "A file sent by reference is not in %s\n",
+			DB_STORE);
+		continue;
+	    }
 	    fprintf(stderr, "channel_receive failed - ret: %d\n", err);
 	    break;
 	}
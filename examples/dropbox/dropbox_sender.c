@@ -39,6 +39,7 @@
 #include "../include/ex_types.h"
 
 #define DB_DIR	"outgoing"
+#define DB_INDEX ".dbsend-index"    /* Digests of the files already sent */
 
 #define WATCH_FLAGS (IN_CLOSE_WRITE | IN_MOVED_TO)
 
@@ -147,7 +148,7 @@ int main(int argc, char **argv)
     /* Initialize the xambit channel */
     printf("Opening channel... ");
     fflush(stdout);
-    ch = channel_fifo_open(fifo_path, 0, XAMBIT_CHOUT);
+    ch = channel_fifo_open(fifo_path, XAMBIT_DIFF, XAMBIT_CHOUT);
     if (ch == NULL)
     {
 	fprintf(stderr, "Failed to open the fifo channel: errno: %d\n", errno);
@@ -162,6 +163,15 @@ int main(int argc, char **argv)
 	goto out;
     }
 
+    /* A file dropped in again crosses as a reference to the copy the
+     * receiver kept the first time, or if it has changed as a delta from
+     * that copy */
+    if (channel_set_dedup(ch, DB_INDEX, 0) < 0)
+    {
+	fprintf(stderr, "Could not open %s: errno: %d\n", DB_INDEX, errno);
+	goto out;
+    }
+
     while (1)
     {
 	char			    buf[16 * 1024];
@@ -35,18 +35,35 @@
 #include <inttypes.h>
 
 #define XAMBIT_CH_FIFO		0x00
-#ifdef NOT_YET
-#define XAMBIT_CH_SOCK		0x01
-#endif
+#define XAMBIT_CH_SOCK		0x01	    /* Unix SOCK_SEQPACKET socket */
+#define XAMBIT_CH_SHM		0x02	    /* Shared memory ring */
+#define XAMBIT_CH_UDP		0x03	    /* One-way UDP datagrams */
 
 /* Parcel Flags */
 #define XAMBIT_BLOCK		0x00	    /* 0 = Block data where data is
 					       complete within a single parcel */
-#if 0
 #define XAMBIT_STREAM		0x01	    /* 1 = Stream data where parcel data
 					       may be segmented into
 					       MAX_STREAM_SIZE byte chunks. */
-#endif
+#define XAMBIT_STREAM_END	0x02	    /* Last segment of a stream */
+#define XAMBIT_STREAM_ABORT	0x04	    /* Sender abandoned the stream */
+#define XAMBIT_DATA_CSUM	0x08	    /* data_checksum holds the CRC32C
+					       of the parcel data */
+#define XAMBIT_FD		0x10	    /* The data is in a sealed memfd
+					       passed with the header rather
+					       than following it */
+#define XAMBIT_ZLIB		0x20	    /* The data is deflated; see
+					       channel_set_compression */
+#define XAMBIT_KEEP		0x40	    /* A file the reader should keep a
+					       copy of; see channel_set_dedup */
+#define XAMBIT_REF		0x80	    /* The data names a file kept
+					       before, by its SHA-256 digest */
+#define XAMBIT_DELTA		0x100	    /* The data rebuilds a file from
+					       one kept before */
+#define XAMBIT_EXTENT		0x200	    /* The data is one extent of a
+					       file; see channel_set_journal */
+#define XAMBIT_HOLES		0x400	    /* The data is the map of a sparse
+					       file and the runs of data in it */
 
 /* Channel Direction */
 #define XAMBIT_CHIN		0x00	    /* Reader */
@@ -57,6 +74,27 @@
 #define XAMBIT_CREATE_ON_OPEN	0x0001
 #define XAMBIT_DEL_ON_CLOSE	0x0002
 #endif
+#define XAMBIT_BUFFERED		0x0004	    /* Coalesce outgoing parcels into
+					       large writes; see channel_flush */
+#define XAMBIT_CHECKSUM		0x0008	    /* Checksum parcel data; readers
+					       drop parcels sent without one */
+#define XAMBIT_FDPASS		0x0010	    /* Send large files over a socket
+					       channel as sealed memfds */
+#define XAMBIT_THREADED		0x0020	    /* Writer shared by threads */
+#define XAMBIT_SHARED		0x0040	    /* FIFO written by several
+					       processes, or threads */
+#define XAMBIT_NONBLOCK		0x0080	    /* Return EAGAIN rather than wait;
+					       see channel_get_fd */
+#define XAMBIT_URING		0x0100	    /* Move FIFO data through an
+					       io_uring where available */
+#define XAMBIT_COMPRESS		0x0200	    /* Deflate parcels worth it;
+					       readers inflate them */
+#define XAMBIT_DIFF		0x0400	    /* Send changed files as deltas;
+					       see channel_set_dedup */
+#define XAMBIT_SPARSE		0x0800	    /* Send the holes in files as a
+					       map rather than as zeros */
+#define XAMBIT_RESYNC		0x1000	    /* Skip to the next good header
+					       after a bad one */
 
 /* XAmbit Error Conditions */
 #define XAMBIT_ERR_STD		-1	    /* Standard system error, use errno */
@@ -67,15 +105,63 @@
 #define XAMBIT_ERR_BAD_TYPE	-4	    /* Invalid data type */
 #define XAMBIT_ERR_HDR_VER	-5	    /* Received an incompatible parcel
 					       header */
+#define XAMBIT_ERR_DATA_CHKSUM	-6	    /* Parcel data checksum error */
+#define XAMBIT_ERR_INFLATE	-7	    /* Deflated parcel data was bad, or
+					       the channel does not take it */
+#define XAMBIT_ERR_DEDUP	-8	    /* The file a parcel refers to is
+					       not in the reader's store */
+#define XAMBIT_ERR_JOURNAL	-9	    /* An extent of a file came to a
+					       reader with no journal */
+#define XAMBIT_ERR_SPARSE	-10	    /* A sparse file came to a reader
+					       not receiving to a file */
 
 /* Constants */
-#define XAMBIT_VT_LEN		64	    /* Size of validator table map */
 #define MAX_STREAM_SIZE		(0x1 << 14) /* 16K */
+#define XAMBIT_SEND_BUF_LEN	(0x1 << 16) /* Default coalescing buffer size */
+#define XAMBIT_FLUSH_USEC	10000	    /* Default buffered flush interval */
+#define XAMBIT_BATCH_MAX	64	    /* Parcels per writev in a batch */
+#define XAMBIT_RECV_BUF_LEN	(0x1 << 16) /* Default read-ahead buffer size */
+#define XAMBIT_RECV_HOLD_MAX	(0x1 << 28) /* Largest parcel a non-blocking
+					       reader gathers in memory */
+#define XAMBIT_POOL_MIN_SHIFT	6	    /* Smallest pool block is 64 bytes */
+#define XAMBIT_POOL_CLASSES	17	    /* ... and the largest is 4M */
+#define XAMBIT_POOL_MAGIC	0x706f6f6c  /* Marks a pool block handed out */
+#define XAMBIT_SPLICE_MAX	(0x1 << 30) /* Largest single splice() request */
+#define XAMBIT_CHUNK_LEN	(0x1 << 20) /* Default receive-to-file chunk */
+#define XAMBIT_URING_DEPTH	8	    /* io_uring reads kept in flight */
+#define XAMBIT_URING_BUF_LEN	(0x1 << 16) /* ... each of up to this many
+					       bytes */
+#define XAMBIT_PAR_CHUNK	(0x1 << 22) /* Default parallel validation chunk */
+#define XAMBIT_ZLIB_LEVEL	1	    /* Default deflate level */
+#define XAMBIT_ZLIB_MIN		512	    /* Default smallest parcel deflated */
+#define XAMBIT_ZLIB_CHUNK	(0x1 << 18) /* Parcels are deflated in pieces
+					       of this many bytes */
+#define XAMBIT_DEDUP_MIN	(0x1 << 12) /* Smallest file sent by reference */
+#define XAMBIT_DEDUP_AGE	86400	    /* Default seconds a writer trusts
+					       the reader to keep a file */
+#define XAMBIT_EXTENT_LEN	(0x1 << 24) /* Default extent; larger files
+					       are sent as extents */
+#define XAMBIT_JOURNAL_AGE	(7 * 86400) /* Seconds a reader keeps a file
+					       it has had no extent of */
+#define XAMBIT_SPARSE_MIN	(0x1 << 20) /* Fewest bytes of holes for a
+					       file to be sent as sparse */
+#define XAMBIT_SPARSE_RUNS	(0x1 << 16) /* Most runs of data in the map
+					       of a sparse file */
+#define XAMBIT_SHM_RING_LEN	(0x1 << 22) /* Shared memory ring data size */
+#define XAMBIT_SOCK_MSG_LEN	(0x1 << 17) /* Largest socket channel message */
+#define XAMBIT_FDPASS_MIN	(0x1 << 20) /* Smallest file sent as a memfd */
+#define XAMBIT_UDP_MTU		1472	    /* Default datagram size */
+#define XAMBIT_UDP_RATE		125000000   /* Default pacing, bytes/second */
+#define XAMBIT_UDP_BATCH	32	    /* Datagrams per sendmmsg/recvmmsg */
+#define XAMBIT_UDP_PARCEL_MAX	(0x1 << 28) /* Largest parcel reassembled */
 
-#define XAMBIT_HDR_VERSION	1
+#define XAMBIT_HDR_VERSION	3
+#define XAMBIT_HDR_SYNC		0x5a1c3be7  /* Starts every parcel header */
 
 /* ******************  Parcel structure ******************* */
-typedef struct xambit_parcel_hdr_s {/* Version 1 */
+typedef struct xambit_parcel_hdr_s {/* Version 3 */
+    uint32_t	sync;		    /* XAMBIT_HDR_SYNC, for a reader to find
+				       the header again after damage */
     uint32_t	version;
     uint32_t	type;		    /* User-defined type; determines which
 				       validate callback routine will be used */
@@ -84,38 +170,268 @@ typedef struct xambit_parcel_hdr_s {/* Version 1 */
 				       want a size_t here because sender and
 				       receiver can be different systems with
 				       different deffinitions of a size_t*/
+    uint32_t	data_checksum;	    /* CRC32C of the data if flags has
+				       XAMBIT_DATA_CSUM, otherwise 0 */
     uint32_t	hdr_checksum;	    /* Header only - must be last item in header */
 } PACKED xambit_parcel_hdr_t;
 
 
 /* ***************** Type Validator Table ***************** */
+/* Validators are either a single validate callback that sees a whole parcel,
+ * or an incremental init/update/final set that sees stream parcels a segment
+ * at a time. final is called with a NULL header when a stream is abandoned,
+ * so that it can release ctx; its return value is then ignored. A chunk
+ * callback may be added to check pieces of a large parcel independently and
+ * concurrently (see channel_set_workers); it must be thread safe. Compiled
+ * rules (see xambit_rules_compile) are checked against whole parcels before
+ * any callback, and may stand in for them. */
+typedef struct xambit_rules_s xambit_rules_t;
+
+typedef struct xambit_validator_ops_s {
+    int		(*validate)(xambit_parcel_hdr_t *hdr, void *data);
+    int		(*init)(xambit_parcel_hdr_t *hdr, void **ctx);
+    int		(*update)(void *ctx, xambit_parcel_hdr_t *seg, void *data);
+    int		(*final)(void *ctx, xambit_parcel_hdr_t *hdr);
+    int		(*chunk)(xambit_parcel_hdr_t *hdr, void *data, uint64_t off,
+			 uint64_t len);
+    xambit_rules_t *rules;
+} xambit_validator_ops_t;
+
 typedef struct xambit_type_validator_s {
     uint32_t	type_id;
     int		(*validate)(xambit_parcel_hdr_t *hdr, void *data);
-    /* TODO: Locking */
-    struct xambit_type_validator_s *prev;
-    struct xambit_type_validator_s *next;
+    int		(*init)(xambit_parcel_hdr_t *hdr, void **ctx);
+    int		(*update)(void *ctx, xambit_parcel_hdr_t *seg, void *data);
+    int		(*final)(void *ctx, xambit_parcel_hdr_t *hdr);
+    int		(*chunk)(xambit_parcel_hdr_t *hdr, void *data, uint64_t off,
+			 uint64_t len);
+    xambit_rules_t *rules;
+    /* References to this entry: one held by the table it is registered
+     * in, and one by each parcel or stream validating with it, which may be
+     * on concurrent senders of an XAMBIT_THREADED channel. It is freed with
+     * the last, once unregistered or replaced. */
+    uint32_t	refs;
 } xambit_type_validator_t;
 
-typedef struct xambit_tv_map_s {
-    xambit_type_validator_t * map[XAMBIT_VT_LEN];
-} xambit_tv_map_t;
+/* Lock-free map of type IDs to validators; private to the library */
+typedef struct xambit_registry_s xambit_registry_t;
 
 /* ******************* Channel Structures ******************* */
+typedef struct xambit_stats_s {
+    uint64_t	parcels_sent;
+    uint64_t	bytes_sent;	    /* Payload bytes only, before any
+				       compression */
+    uint64_t	write_calls;	    /* write()/writev() system calls, or
+				       io_uring submissions */
+    uint64_t	flushes;	    /* Buffered mode flushes */
+    uint64_t	parcels_received;
+    uint64_t	bytes_received;	    /* Payload bytes only, once
+				       inflated */
+    uint64_t	read_calls;	    /* read() system calls, or io_uring
+				       submissions */
+    uint64_t	parcels_dropped;    /* Received parcels failing validation */
+    uint64_t	allocs;		    /* malloc() calls for received parcels */
+    uint64_t	csum_errors;	    /* Received parcels with bad data */
+    uint64_t	dgrams_lost;	    /* UDP datagrams missing on arrival */
+    uint64_t	dgrams_recovered;   /* ... of which rebuilt by FEC */
+    uint64_t	zlib_parcels;	    /* Parcels deflated, or inflated */
+    uint64_t	zlib_skipped;	    /* Parcels the writer sent as they
+				       were, not worth deflating */
+    uint64_t	zlib_saved;	    /* Payload bytes compression kept off
+				       the channel */
+    uint64_t	zlib_usec;	    /* CPU time spent on compression */
+    uint64_t	dedup_refs;	    /* Files sent, or received, by
+				       reference */
+    uint64_t	dedup_saved;	    /* Payload bytes references kept off
+				       the channel */
+    uint64_t	dedup_misses;	    /* References the reader could not
+				       resolve */
+    uint64_t	dedup_deltas;	    /* Files sent, or received, as
+				       deltas */
+    uint64_t	extents;	    /* Extents sent, or received and
+				       journaled */
+    uint64_t	extents_skipped;    /* Extents not sent again on resuming,
+				       or received twice */
+    uint64_t	sparse_files;	    /* Files sent, or received, as
+				       sparse */
+    uint64_t	sparse_saved;	    /* Bytes of holes kept off the
+				       channel */
+    uint64_t	hdr_errors;	    /* Bad parcel headers received */
+    uint64_t	resyncs;	    /* Good headers found again after
+				       bad ones */
+    uint64_t	resync_bytes;	    /* Bytes passed over finding them */
+    uint64_t	fds_refused;	    /* Descriptors passed over a socket
+				       that no header claimed, or past
+				       the number held at once */
+} xambit_stats_t;
+
+typedef struct xambit_send_vec_s {
+    void	*buf;
+    size_t	size;
+    uint32_t	tid;
+    int		err;		    /* Out: 0 if sent, or XAMBIT_ERR_* */
+} xambit_send_vec_t;
+
+typedef struct xambit_parcel_s {
+    xambit_parcel_hdr_t	hdr;
+    void		*data;	    /* Owned by the channel */
+} xambit_parcel_t;
+
+/* Received parcel buffer pool; the payload follows the header directly */
+typedef struct xambit_pool_blk_s {
+    struct xambit_pool_blk_s *next;
+    int32_t	cls;		    /* Size class, or -1 if not poolable */
+    uint32_t	magic;		    /* XAMBIT_POOL_MAGIC while handed out;
+				       also keeps the payload 16 byte
+				       aligned */
+    xambit_parcel_hdr_t hdr;
+} xambit_pool_blk_t;
+
+typedef struct xambit_pool_s {
+    xambit_pool_blk_t *free[XAMBIT_POOL_CLASSES];
+    size_t	cached;		    /* Bytes held in the free lists */
+    size_t	limit;
+} xambit_pool_t;
+
+struct xambit_channel_s;
+
+/* Outgoing stream parcel */
+typedef struct xambit_stream_s {
+    struct xambit_channel_s *ch;
+    xambit_type_validator_t *tv;
+    void	*ctx;		    /* Validator context */
+    uint32_t	type;
+    int		err;		    /* Sticky; the stream has been aborted */
+    uint8_t	aborted;
+    uint8_t	final_done;
+    uint64_t	total;		    /* Bytes sent in earlier segments */
+    size_t	len;		    /* Bytes waiting in seg */
+    uint8_t	seg[MAX_STREAM_SIZE];
+} xambit_stream_t;
+
+/* Incoming stream parcel being assembled */
+typedef struct xambit_rx_stream_s {
+    xambit_type_validator_t *tv;
+    void	*ctx;
+    uint32_t	type;
+    int		err;		    /* Sticky; the rest is discarded */
+    uint8_t	final_done;
+    uint64_t	total;
+    uint8_t	*buf;		    /* Assembled data when not to a file */
+    size_t	used;
+    size_t	cap;
+} xambit_rx_stream_t;
+
+/* Worker threads shared by the parallel paths; private to the library */
+typedef struct xambit_workers_s xambit_workers_t;
+
+/* Reader thread of a pipelined channel; private to the library */
+typedef struct xambit_pipeline_s xambit_pipeline_t;
+
+/* This end of a shared memory ring; private to the library */
+typedef struct xambit_shm_s xambit_shm_t;
+
+/* Socket channel state; private to the library */
+typedef struct xambit_sock_s xambit_sock_t;
+
+/* UDP channel state; private to the library */
+typedef struct xambit_udp_s xambit_udp_t;
+
+/* io_uring of a XAMBIT_URING channel; private to the library */
+typedef struct xambit_uring_s xambit_uring_t;
+
+/* Compression policy of a XAMBIT_COMPRESS channel; private to the
+ * library */
+typedef struct xambit_zlib_s xambit_zlib_t;
+
+/* File index or store of channel_set_dedup; private to the library */
+typedef struct xambit_dedup_s xambit_dedup_t;
+
+/* Extent journal of channel_set_journal; private to the library */
+typedef struct xambit_journal_s xambit_journal_t;
+
+/* Rest of a file a non-blocking channel has still to write; private to the
+ * library */
+typedef struct xambit_tx_file_s xambit_tx_file_t;
+
+/* Parcel a non-blocking reader is part way through writing to a file;
+ * private to the library */
+typedef struct xambit_rx_file_s xambit_rx_file_t;
+
+/* Send lock of a shared writer; private to the library */
+typedef struct xambit_lock_s xambit_lock_t;
+
+/* Channels waited on together; see xambit_set_new */
+typedef struct xambit_set_s xambit_set_t;
+
+/* A channel's place in a set; private to the library */
+typedef struct xambit_set_ent_s xambit_set_ent_t;
+
 typedef struct xambit_channel_s {
-    uint32_t	fd;
+    int32_t	fd;
     uint32_t	flags;
     uint32_t	num_types;	    /* Number of registered type validators */
-    xambit_tv_map_t *tvm;
-    uint8_t	type;		    /* FIFO or Socket */
-    uint8_t	direction;	    /* Reader or Writer */
-    union {
-	/* FIFO channel data */
-	char	    path[PATH_MAX];
+    xambit_registry_t *types;	    /* The channel's own validators */
+    xambit_registry_t *base;	    /* Shared ones, looked at after */
+    xambit_stats_t stats;
+
+    /* Buffered (XAMBIT_BUFFERED) send state */
+    uint8_t	*sbuf;
+    size_t	sbuf_len;	    /* Bytes queued in sbuf */
+    size_t	sbuf_size;
+    size_t	flush_bytes;	    /* Flush once this many bytes are queued */
+    uint32_t	flush_usec;	    /* Flush once the oldest byte is this old */
+    uint64_t	sbuf_stamp;	    /* Time (usec) the first byte was queued */
 
-	/* Socket channel data */
+    /* Non-blocking (XAMBIT_NONBLOCK) send state: bytes of parcels already
+     * accepted that the channel would not take, tx_pend[tx_pend_head,
+     * tx_pend_len) */
+    uint8_t	*tx_pend;
+    size_t	tx_pend_head;
+    size_t	tx_pend_len;
+    size_t	tx_pend_size;
+    xambit_tx_file_t *tx_file;	    /* ... and then of a file, written
+				       from the file itself */
 
-    };
+    /* Read-ahead state; unread bytes are rbuf[rbuf_head, rbuf_tail) */
+    uint8_t	*rbuf;
+    size_t	rbuf_head;
+    size_t	rbuf_tail;
+    size_t	rbuf_size;
+    size_t	rbuf_want;	    /* rbuf_size to go back to once a parcel
+				       grown past it is read, or 0 */
+    void	*rx_big;	    /* Batch payload too large for rbuf */
+    int		rx_resync;	    /* Looking for a good header after a
+				       bad one */
+    uint64_t	rx_discard;	    /* Bytes of a dropped parcel still to
+				       pass over as they arrive */
+    xambit_rx_file_t *rx_file;	    /* Non-blocking receive-to-file in
+				       progress */
+    xambit_pool_t *pool;
+    size_t	pool_out;	    /* Pool blocks handed out and not yet
+				       released */
+    size_t	chunk_size;	    /* Receive-to-file copy/splice unit */
+    xambit_stream_t *tx_stream;	    /* Open outgoing stream */
+    xambit_rx_stream_t *rx_stream;  /* Incoming stream in progress */
+    xambit_workers_t *workers;	    /* Parallel checksum/validation */
+    size_t	par_chunk;	    /* ... in pieces of this many bytes */
+    xambit_pipeline_t *pipeline;    /* Parcels read and checked ahead */
+    xambit_shm_t *shm;		    /* XAMBIT_CH_SHM transport */
+    xambit_sock_t *sock;	    /* XAMBIT_CH_SOCK transport */
+    xambit_udp_t *udp;		    /* XAMBIT_CH_UDP transport */
+    xambit_uring_t *uring;	    /* XAMBIT_URING ring, if the kernel
+				       provided one */
+    xambit_zlib_t *zlib;	    /* XAMBIT_COMPRESS policy */
+    xambit_dedup_t *dedup;	    /* Files sent or kept by digest */
+    xambit_journal_t *journal;	    /* Large files sent as extents */
+    xambit_lock_t *lock;	    /* XAMBIT_THREADED/SHARED send lock */
+    int		lock_pshared;	    /* ... in memory shared by processes */
+    xambit_set_ent_t *set_ent;	    /* Membership of a xambit_set_t */
+
+    uint8_t	type;		    /* FIFO, Socket or shared memory */
+    uint8_t	direction;	    /* Reader or Writer */
+    char	*path;		    /* FIFO path, shared memory name,
+				       socket path or UDP address */
 } xambit_channel_t;
 
 typedef struct channel_type_ops_s {
@@ -127,19 +443,83 @@ typedef struct channel_type_ops_s {
 
 /* ****************** Methods ******************** */
 xambit_channel_t * channel_fifo_open(const char *path, int flags, int write);
+xambit_channel_t * channel_shm_open(const char *name, int flags, int write);
+xambit_channel_t * channel_sock_open(const char *path, int flags, int write);
+xambit_channel_t * channel_udp_open(const char *addr, int flags, int write);
+int channel_set_pacing(xambit_channel_t *ch, uint64_t rate, size_t burst);
+int channel_set_mtu(xambit_channel_t *ch, size_t mtu);
+int channel_set_fec(xambit_channel_t *ch, int data, int repair);
+int channel_set_loss(xambit_channel_t *ch, uint32_t ppm);
 int channel_close(xambit_channel_t *ch);
 
 int channel_send_file(xambit_channel_t *ch, const char *path, uint32_t tid);
 int channel_send(xambit_channel_t *ch, void *buf, size_t size, uint32_t tid);
+int channel_send_gift(xambit_channel_t *ch, void *buf, size_t size,
+	uint32_t tid);
+int channel_send_batch(xambit_channel_t *ch, xambit_send_vec_t *vec, int count);
+int channel_set_flush_policy(xambit_channel_t *ch, size_t bytes, uint32_t usec);
+int channel_flush(xambit_channel_t *ch);
+int channel_get_stats(xambit_channel_t *ch, xambit_stats_t *stats);
+int channel_get_fd(xambit_channel_t *ch);
 
 int channel_receive_to_file(xambit_channel_t *ch, const char *path,
 	int oflags, mode_t omode);
 int channel_receive(xambit_channel_t *ch, void **buf,
 	xambit_parcel_hdr_t **header);
+int channel_set_chunk_size(xambit_channel_t *ch, size_t size);
+int channel_receive_batch(xambit_channel_t *ch, xambit_parcel_t *parcels,
+	int max);
+int channel_set_readahead(xambit_channel_t *ch, size_t size);
+int channel_receive_into(xambit_channel_t *ch, xambit_parcel_hdr_t *header,
+	void *buf, size_t size);
+int channel_set_pool(xambit_channel_t *ch, size_t limit);
+void channel_release(xambit_channel_t *ch, void *buf,
+	xambit_parcel_hdr_t *header);
+int channel_set_workers(xambit_channel_t *ch, int nthreads, size_t chunk);
+int channel_set_pipeline(xambit_channel_t *ch, size_t max_bytes);
+int channel_set_compression(xambit_channel_t *ch, int level, size_t min);
+int channel_set_dedup(xambit_channel_t *ch, const char *dir,
+	uint32_t max_age);
+int channel_set_journal(xambit_channel_t *ch, const char *dir,
+	uint64_t extent, uint32_t rewind);
 
 int channel_register_type(xambit_channel_t *,
 	uint32_t type_id,
 	int (*validate)(xambit_parcel_hdr_t *hdr, void *data));
+int channel_register_type_ops(xambit_channel_t *ch, uint32_t type_id,
+	const xambit_validator_ops_t *ops);
+int channel_replace_type_ops(xambit_channel_t *ch, uint32_t type_id,
+	const xambit_validator_ops_t *ops);
+int channel_unregister_type(xambit_channel_t *ch, uint32_t type_id);
+int channel_set_registry(xambit_channel_t *ch, xambit_registry_t *reg);
+int channel_register_rules(xambit_channel_t *ch, uint32_t type_id,
+	const char *rules);
+
+xambit_rules_t *xambit_rules_compile(const char *text, char *err,
+	size_t errlen);
+void xambit_rules_free(xambit_rules_t *rules);
+int xambit_rules_check(const xambit_rules_t *rules, const void *data,
+	size_t len);
+
+xambit_registry_t *xambit_registry_new(void);
+void xambit_registry_free(xambit_registry_t *reg);
+int xambit_registry_register_ops(xambit_registry_t *reg, uint32_t type_id,
+	const xambit_validator_ops_t *ops);
+int xambit_registry_replace_ops(xambit_registry_t *reg, uint32_t type_id,
+	const xambit_validator_ops_t *ops);
+int xambit_registry_unregister(xambit_registry_t *reg, uint32_t type_id);
+
+xambit_set_t *xambit_set_new(void);
+void xambit_set_free(xambit_set_t *set);
+int xambit_set_add(xambit_set_t *set, xambit_channel_t *ch, void *arg);
+int xambit_set_remove(xambit_set_t *set, xambit_channel_t *ch);
+int xambit_set_wait(xambit_set_t *set, int timeout);
+xambit_channel_t *xambit_set_next(xambit_set_t *set, void **arg);
+
+xambit_stream_t *channel_stream_open(xambit_channel_t *ch, uint32_t tid);
+int channel_stream_write(xambit_stream_t *st, const void *buf, size_t len);
+int channel_stream_close(xambit_stream_t *st);
+void channel_stream_abort(xambit_stream_t *st);
 
 int null_validator(xambit_parcel_hdr_t *p, void *data);
 int default_validator(xambit_parcel_hdr_t *p, void *data);
@@ -18,19 +18,33 @@
  * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <xambit.h>
 #include <zlib.h>
 
+#include "xambit_int.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define CSUM_8_ADD(x, total)						    \
     do {								    \
 	uint8_t _s;							    \
@@ -40,21 +54,84 @@
     } while (0);
 
 /* TODO: libFFI support */
-static xambit_type_validator_t *lookup_type_validator(xambit_channel_t *ch,
-				uint32_t tid);
-static void add_type_validator(xambit_channel_t *ch,
-				xambit_type_validator_t *tv);
 static void set_hdr_csum(xambit_parcel_hdr_t *phdr);
 static int validate_hdr_csum(xambit_parcel_hdr_t *phdr);
+static int rx_hdr_ok(xambit_parcel_hdr_t *h);
+static int rx_resync(xambit_channel_t *ch);
 static int verify_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *p);
-static int prepare_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *p);
 static int channel_send_buf(xambit_channel_t *ch,
 			    xambit_parcel_hdr_t *hdr,
 			    void *buf);
 static int channel_receive_buf(xambit_channel_t *ch,
 			      xambit_parcel_hdr_t **phdr,
 			      void **buf);
-static void xambit_clear_type_map(xambit_channel_t *ch);
+static int check_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			void *buf);
+static void ch_csum_data(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			 const void *data);
+static int ch_writev_all(xambit_channel_t *ch, struct iovec *iov, int cnt);
+static int ch_pend_add(xambit_channel_t *ch, const struct iovec *iov, int cnt);
+static int ch_pend_drain(xambit_channel_t *ch);
+static int ch_file_hold(xambit_channel_t *ch, int fd, uint64_t off,
+			uint64_t len, const sp_run_t *run, uint64_t cnt);
+static int ch_file_drain(xambit_channel_t *ch);
+static void ch_file_free(xambit_channel_t *ch);
+static int ch_write_all(xambit_channel_t *ch, const void *buf, uint64_t len);
+static int ch_queue_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			   void *buf);
+static int ch_flush(xambit_channel_t *ch);
+static int ch_update_type(xambit_channel_t *ch, uint32_t type_id,
+			  const xambit_validator_ops_t *ops, int how);
+static int ch_splice_file(xambit_channel_t *ch, int fd, void *data,
+			  const sp_run_t *run, uint64_t cnt);
+static int rx_validate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		       void *data, const uint32_t *crc);
+static int rx_validate_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			    void *data);
+static int rx_to_fd(xambit_channel_t *ch, int fd, uint64_t len);
+static int rx_to_fd_some(xambit_channel_t *ch, int fd, uint64_t *left,
+			 int *werr);
+static int rx_file_more(xambit_channel_t *ch, const char *path, int oflags,
+			mode_t omode);
+static int rx_file_done(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			int fd, const char *tmp, const char *path, int oflags,
+			mode_t omode);
+static void rx_file_free(xambit_channel_t *ch);
+static void rx_skip(xambit_channel_t *ch, uint64_t len);
+static int rx_copy_out(xambit_channel_t *ch, int tfd, int fd);
+static mode_t rx_umask(void);
+static int rx_ready(xambit_channel_t *ch);
+static int rx_ready_hdr(xambit_channel_t *ch);
+static int rx_ready_data(xambit_channel_t *ch);
+static int rx_grow(xambit_channel_t *ch, size_t size);
+static int pool_class(uint64_t len);
+static int rx_alloc(xambit_channel_t *ch, uint64_t len,
+		    xambit_parcel_hdr_t **phdr, void **pdata);
+static void pool_destroy(xambit_channel_t *ch);
+static int rx_wire(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		   const void **src, void **copy, uint32_t *crc,
+		   uint32_t **pcrc);
+static int rx_inflate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		      const void *src, const uint32_t *crc, void *dst);
+static int rx_into_zlib(xambit_channel_t *ch, xambit_parcel_hdr_t *header,
+			void *buf, size_t size);
+static int rx_batch_inflate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			    void **data, const uint32_t *crc);
+static int rx_zlib_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			   const char *path, int oflags, mode_t omode);
+static int rx_ref_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			  const char *path, int oflags, mode_t omode);
+static int rx_delta_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			    const char *path, int oflags, mode_t omode);
+static int rx_extent_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			     const char *path, int oflags, mode_t omode);
+static int ch_send_extents(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			   const char *path, const struct stat *st, int fd,
+			   void *data);
+static int rx_sparse_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			     const char *path, int oflags, mode_t omode);
+static int ch_sparse_map(int fd, uint64_t size, sp_hdr_t *sh,
+			 sp_run_t **map, uint64_t *held);
 
 
 /*  Function Name:	channel_fifo_open
@@ -77,72 +154,160 @@ static void xambit_clear_type_map(xambit_channel_t *ch);
 xambit_channel_t *channel_fifo_open(const char *path, int flags, int write)
 {
     int			err;
-    size_t		len;
     xambit_channel_t	*ch;
     struct stat		st;
     int			o_flags;
 
     o_flags = write ? O_WRONLY : O_RDONLY;
 
-    ch = malloc(sizeof(xambit_channel_t));
+    ch = ch_alloc(path, flags, write, XAMBIT_CH_FIFO);
     if (ch == NULL)
-    {
-	errno = ENOMEM;
 	return NULL;
+
+    if (stat(ch->path, &st) < 0)
+	goto out;
+
+    if ((!S_ISFIFO(st.st_mode)) && (!S_ISCHR(st.st_mode)))
+    {
+	errno = EINVAL;
+	goto out;
     }
 
-    ch->tvm = malloc(sizeof(xambit_tv_map_t));
-    if (ch->tvm == NULL)
+    err = access(ch->path, write ? W_OK : R_OK);
+    if (err < 0)
+	    goto out;
+
+    ch->fd = open(ch->path, o_flags);
+    if (ch->fd < 0)
+	goto out;
+
+    if (write && (flags & XAMBIT_SHARED) && ch_lock_open(ch) < 0)
+	goto out;
+
+    if (ch_nonblock(ch) < 0)
+	goto out;
+
+    if (uring_open(ch) < 0)
+	goto out;
+
+    return ch;
+
+out:
+    err = errno;
+    if (ch->fd >= 0)
+	close(ch->fd);
+    ch_free(ch);
+    errno = err;
+    return NULL;
+}
+
+/* Allocate a channel of the given type and fill in everything but the
+ * transport. path is kept for the transport to use. */
+xambit_channel_t *ch_alloc(const char *path, int flags, int write, int type)
+{
+    size_t		len;
+    xambit_channel_t	*ch;
+
+    ch = malloc(sizeof(xambit_channel_t));
+    if (ch == NULL)
     {
 	errno = ENOMEM;
-	goto out2;
+	return NULL;
     }
+    memset(ch, 0, sizeof(xambit_channel_t));
+    ch->fd = -1;
+    ch->chunk_size = XAMBIT_CHUNK_LEN;
 
-    memset(ch->tvm, 0, sizeof(xambit_tv_map_t));
-
-    ch->type = XAMBIT_CH_FIFO;
+    ch->type = type;
     ch->flags = flags;
     ch->direction = write ? XAMBIT_CHOUT : XAMBIT_CHIN;
     ch->num_types = 0;
 
+    /* Held at its own length, so that many channels stay small */
     len = strlen(path);
-    if (len < PATH_MAX)
+    if (len >= PATH_MAX)
     {
-	strncpy(ch->path, path, PATH_MAX - 1);
-	ch->path[len] = '\0';
+	errno = ENAMETOOLONG;
+	goto out;
     }
-    else
+    ch->path = strdup(path);
+    if (ch->path == NULL)
     {
-	errno = ENAMETOOLONG;
+	errno = ENOMEM;
 	goto out;
     }
 
-    if (stat(ch->path, &st) < 0)
+    if ((flags & XAMBIT_BUFFERED) && write)
+    {
+	if (channel_set_flush_policy(ch, XAMBIT_SEND_BUF_LEN,
+				     XAMBIT_FLUSH_USEC) < 0)
+	    goto out;
+    }
+
+    /* Processes can only share a FIFO, whose lock is set up once open */
+    if ((flags & XAMBIT_SHARED) && type != XAMBIT_CH_FIFO)
+    {
+	errno = EINVAL;
 	goto out;
+    }
 
-    if ((!S_ISFIFO(st.st_mode)) && (!S_ISCHR(st.st_mode)))
+    /* A backlog cannot be shared between processes, a ring has no
+     * descriptor to wait on and datagrams are paced out by sleeping */
+    if ((flags & XAMBIT_NONBLOCK) &&
+	((flags & XAMBIT_SHARED) || type == XAMBIT_CH_SHM ||
+	 (type == XAMBIT_CH_UDP && write)))
     {
 	errno = EINVAL;
 	goto out;
     }
 
-    err = access(ch->path, write ? W_OK : R_OK);
-    if (err < 0)
-	    goto out;
+    /* Only a byte stream can be searched for the next header */
+    if ((flags & XAMBIT_RESYNC) && type != XAMBIT_CH_FIFO)
+    {
+	errno = EINVAL;
+	goto out;
+    }
 
-    ch->fd = open(ch->path, o_flags);
-    if (ch->fd < 0)
+    /* Data read ahead into a ring's buffers has already left the FIFO, so
+     * polling that tells a non-blocking reader nothing */
+    if ((flags & XAMBIT_URING) &&
+	(type != XAMBIT_CH_FIFO || (flags & XAMBIT_NONBLOCK)))
+    {
+	errno = EINVAL;
+	goto out;
+    }
+    if ((flags & XAMBIT_THREADED) && !(flags & XAMBIT_SHARED) && write &&
+	ch_lock_open(ch) < 0)
+	goto out;
+
+    if ((flags & XAMBIT_COMPRESS) &&
+	channel_set_compression(ch, XAMBIT_ZLIB_LEVEL, 0) < 0)
 	goto out;
 
     return ch;
 
 out:
-    free(ch->tvm);
-out2:
-    free(ch);
+    ch_free(ch);
     return NULL;
 }
 
+/* Free a channel from ch_alloc whose transport failed to open */
+void ch_free(xambit_channel_t *ch)
+{
+    uring_close(ch);
+    if (ch->lock != NULL)
+	ch_lock_close(ch);
+    free(ch->sbuf);
+    free(ch->tx_pend);
+    ch_file_free(ch);
+    xambit_registry_free(ch->types);
+    free(ch->zlib);
+    dd_free(ch->dedup);
+    jn_free(ch->journal);
+    free(ch->path);
+    free(ch);
+}
+
 /*  Function Name:	channel_close
  *
  *  Scope:		Module
@@ -151,7 +316,9 @@ out2:
  *
  *  Assumptions:	.
  *
- *  Notes:
+ *  Notes:		Parcels still queued on a buffered channel are flushed
+ *			first. If that flush fails they are discarded and the
+ *			flush error is returned once the channel is closed.
  *
  *  Return Value:	0 on success, -1 on error and errno is set
  *			appropriately. If there is an error, the channel
@@ -160,20 +327,72 @@ out2:
 int channel_close(xambit_channel_t *ch)
 {
     int err;
+    int ferr;
+
+    set_leave(ch);
+    pl_stop(ch);
+    if (ch->tx_stream != NULL)
+	channel_stream_abort(ch->tx_stream);
+    rx_stream_reset(ch);
 
+    /* A non-blocking channel's backlog is written out before it goes */
+    while ((ferr = channel_flush(ch)) < 0 && errno == EAGAIN)
+    {
+	struct pollfd pfd = { ch->fd, POLLOUT, 0 };
+
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+	    break;
+    }
+
+    if (ch->type == XAMBIT_CH_SHM)
+    {
+	shm_close(ch);
+	ch->rbuf = NULL;
+    }
+    if (ch->type == XAMBIT_CH_SOCK)
+	sock_close(ch);
+    if (ch->type == XAMBIT_CH_UDP)
+	udp_close(ch);
+    uring_close(ch);
     err = close(ch->fd);
     if (err < 0)
 	goto out;
 
-    xambit_clear_type_map(ch);
+    xambit_registry_free(ch->types);
+    xambit_registry_free(ch->base);
+    if (ch->lock != NULL)
+	ch_lock_close(ch);
+    free(ch->sbuf);
+    free(ch->tx_pend);
+    ch_file_free(ch);
+    free(ch->rbuf);
+    free(ch->rx_big);
+    rx_file_free(ch);
+    pool_destroy(ch);
+    xw_destroy(ch->workers);
+    free(ch->zlib);
+    dd_free(ch->dedup);
+    jn_free(ch->journal);
+    free(ch->path);
     free(ch);
+    if (ferr < 0)
+	err = ferr;
 out:
     return err;
 }
 
+uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void set_hdr_csum(xambit_parcel_hdr_t *phdr)
 {
     uint32_t crc = crc32(0, Z_NULL, 0);
+    phdr->sync = XAMBIT_HDR_SYNC;
     crc = crc32(crc, (void *)phdr, sizeof(*phdr) - sizeof(phdr->hdr_checksum));
     phdr->hdr_checksum = crc;
 }
@@ -198,7 +417,7 @@ static int verify_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *p)
     return err;
 }
 
-static int prepare_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *p)
+int prepare_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *p)
 {
     set_hdr_csum(p);
     return 0;
@@ -208,411 +427,4170 @@ static int prepare_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *p)
      * */
 }
 
-/*  Function Name:	channel_send_buf
- *
- *  Scope:		Local
- *
- *  Purpose:		To send a chunk of data
- *
- *  Assumptions:	.
- *
- *  Notes:		.
- *
- *  Return Value:	On error a negetive value will be returned and errno
- *			will be set appropriately. Negetive values other than -1
- *			represent XAmbit specific error conditions. On success a
- *			non-negetive value is returned.
- */
-static int channel_send_buf(xambit_channel_t *ch,
-			    xambit_parcel_hdr_t *hdr,
-			    void *buf)
+/* Checksum and validate an outgoing parcel. Nothing is written. */
+static int check_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			void *buf)
 {
     xambit_type_validator_t *tv;
-    ssize_t	(*ch_write)(int, const void *, size_t) = NULL;
-    int		count = 0;
-    int		rem = 0;
     int		err;
 
+    /* Nothing may come between the segments of an open stream. Other
+     * threads of a shared channel wait for the send lock instead. */
+    if (ch->lock == NULL ? ch->tx_stream != NULL : ch_lock_held(ch))
+    {
+	errno = EBUSY;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* The data checksum is filled in as the parcel is written out */
+    hdr->data_checksum = 0;
+    if (ch->flags & XAMBIT_CHECKSUM)
+	hdr->flags |= XAMBIT_DATA_CSUM;
+
     err = prepare_parcel(ch, hdr);
     if (err < 0)
-	goto out;
+	return err;
 
     tv = lookup_type_validator(ch, hdr->type);
     if (tv == NULL)
 	return XAMBIT_ERR_BAD_TYPE;
 
-    err = tv->validate(hdr, buf);
-    if (err < 0)
+    err = tv_validate(tv, hdr, buf);
+    tv_put(tv);
+    return err;
+}
+
+/* Checksum the data of a checked parcel about to be written without being
+ * copied, and reseal its header */
+static void ch_csum_data(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			 const void *data)
+{
+    if (!(hdr->flags & XAMBIT_DATA_CSUM))
+	return;
+
+    hdr->data_checksum = crc32c(0, data, hdr->length);
+    prepare_parcel(ch, hdr);
+}
+
+/* Run a validator over a whole parcel, feeding it to an incremental
+ * validator in one piece. Its rules, if any, are checked first. */
+int tv_validate(xambit_type_validator_t *tv, xambit_parcel_hdr_t *hdr,
+		void *data)
+{
+    void	*ctx = NULL;
+
+    if (tv_rules(tv, hdr, data) < 0)
+	return XAMBIT_ERR_VALIDATE;
+
+    if (tv->validate != NULL)
+	return tv->validate(hdr, data) < 0 ? XAMBIT_ERR_VALIDATE : 0;
+
+    if (tv->update == NULL || tv->final == NULL)
+	return tv->chunk != NULL && tv->chunk(hdr, data, 0, hdr->length) < 0 ?
+	       XAMBIT_ERR_VALIDATE : 0;
+
+    if (tv->init != NULL && tv->init(hdr, &ctx) < 0)
+	return XAMBIT_ERR_VALIDATE;
+
+    if (tv->update(ctx, hdr, data) < 0)
     {
-	err = XAMBIT_ERR_VALIDATE;
-	goto out;
+	tv->final(ctx, NULL);
+	return XAMBIT_ERR_VALIDATE;
     }
 
+    return tv->final(ctx, hdr) < 0 ? XAMBIT_ERR_VALIDATE : 0;
+}
+
+/* Hand bytes to the channel's transport, as writev() */
+static ssize_t ch_sys_writev(xambit_channel_t *ch, const struct iovec *iov,
+			     int cnt)
+{
     switch (ch->type)
     {
 	case XAMBIT_CH_FIFO:
-	    ch_write = write;
-	    break;
-#ifdef NOT_YET
+	    return writev(ch->fd, iov, cnt);
+	case XAMBIT_CH_SHM:
+	    return shm_writev(ch, iov, cnt);
 	case XAMBIT_CH_SOCK:
-	    break;
-#endif
+	    return sock_writev(ch, iov, cnt);
+	case XAMBIT_CH_UDP:
+	    return udp_writev(ch, iov, cnt);
 	default:
 	    break;
     }
 
-    if (ch_write == NULL)
-    {
-	err = XAMBIT_ERR_STD;
-	errno = EINVAL;
-	goto out;
-    }
-
-    /* Write header first, then data */
-    err = ch_write(ch->fd, hdr, sizeof(xambit_parcel_hdr_t));
-    if (err != sizeof(xambit_parcel_hdr_t))
-    {
-	err = XAMBIT_ERR_STD;
-	errno = EIO;
-	goto out;
-    }
-
-    rem = hdr->length;;
-    while (rem > 0)
-    {
-	err = ch_write(ch->fd, buf + count, rem);
-	if (err < 0)
-	    goto out;
-	rem -= err;
-	count += err;
-    }
-
-    err = 0;
-out:
-    return err;
+    errno = EINVAL;
+    return -1;
 }
 
-/* Caller must free allocated memory p */
-static int channel_receive_buf(xambit_channel_t *ch,
-			      xambit_parcel_hdr_t **phdr,
-			      void **buf)
+/* Take bytes from the channel's transport, as read(), and count the call */
+static ssize_t ch_sys_read(xambit_channel_t *ch, void *buf, size_t len)
 {
-    uint64_t		size = 0;
-    uint64_t		count = 0;
-    uint64_t		rem = 0;
-    xambit_type_validator_t *tv;
-    xambit_parcel_hdr_t	*hdr;
-    void		*data;
-    ssize_t		(*ch_read)(int, void *, size_t) = NULL;
-    int			err = 0;
-
-    if (phdr == NULL)
-    {
-	err = XAMBIT_ERR_STD;
-	errno = EINVAL;
-	goto out;
-    }
+    ssize_t	n;
 
     switch (ch->type)
     {
 	case XAMBIT_CH_FIFO:
-	    ch_read = read;
+	    /* A ring counts the system calls it makes itself */
+	    if (ch->uring != NULL)
+		return uring_read(ch, buf, len);
+	    n = read(ch->fd, buf, len);
+	    break;
+	case XAMBIT_CH_SHM:
+	    n = shm_read(ch, buf, len);
 	    break;
-#ifdef NOT_YET
 	case XAMBIT_CH_SOCK:
+	    n = sock_read(ch, buf, len);
 	    break;
-#endif
-	default:
+	case XAMBIT_CH_UDP:
+	    n = udp_read(ch, buf, len);
 	    break;
+	default:
+	    errno = EINVAL;
+	    return -1;
     }
 
-    if (ch_read == NULL)
+    if (n >= 0)
+	ch->stats.read_calls++;
+    return n;
+}
+
+/* Write every byte described by iov, resuming after short writes. The iovec
+ * array is consumed in the process. A non-blocking channel keeps whatever
+ * it cannot write now in its backlog, behind anything already there. */
+static int ch_writev_all(xambit_channel_t *ch, struct iovec *iov, int cnt)
+{
+    ssize_t	n;
+
+    if (ch->tx_pend_len > ch->tx_pend_head)
     {
-	err = XAMBIT_ERR_STD;
-	errno = EINVAL;
-	goto out;
+	if (ch_pend_add(ch, iov, cnt) < 0)
+	    return XAMBIT_ERR_STD;
+	return ch_pend_drain(ch) < 0 && errno != EAGAIN ? XAMBIT_ERR_STD : 0;
     }
 
-    hdr = malloc(sizeof(xambit_parcel_hdr_t));
-    if (hdr == NULL)
+    while (cnt > 0)
     {
-	err = XAMBIT_ERR_STD;
-	errno = ENOMEM;
-	goto error2;
+	n = ch_sys_writev(ch, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN && (ch->flags & XAMBIT_NONBLOCK))
+		return ch_pend_add(ch, iov, cnt);
+	    return XAMBIT_ERR_STD;
+	}
+	CH_STAT_ADD(ch, write_calls, 1);
+
+	while (cnt > 0 && (size_t)n >= iov->iov_len)
+	{
+	    n -= iov->iov_len;
+	    iov++;
+	    cnt--;
+	}
+	if (cnt > 0)
+	{
+	    iov->iov_base = (uint8_t *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
     }
 
-    err = ch_read(ch->fd, hdr, sizeof(*hdr));
-    if (err < 0) /* Warning: send/receive sync error possib */
-	goto error2;
+    return 0;
+}
 
-    /* For now, mandate that an entire parcel header must be read at once */
-    if (err < sizeof(*hdr))
-    { /* Warning: send/receive sync error possible */
-	err = XAMBIT_ERR_STD;
-	errno = EINVAL;
-	goto error2;
-    }
+static int ch_write_all(xambit_channel_t *ch, const void *buf, uint64_t len)
+{
+    struct iovec iov;
 
-    if (hdr->version != XAMBIT_HDR_VERSION)
-    { /* Warning: send/receive sync error possible */
-	err = XAMBIT_ERR_HDR_VER;
-	errno = EINVAL;
-	goto error2;
-    }
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return ch_writev_all(ch, &iov, 1);
+}
 
-    rem = hdr->length;
-    data = malloc(rem);
-    if (data == NULL)
-    { /* Warning: send/receive sync error possible */
-	err = XAMBIT_ERR_STD;
-	errno = ENOMEM;
-	goto error2;
-    }
+/* Append the bytes described by iov to the backlog */
+static int ch_pend_add(xambit_channel_t *ch, const struct iovec *iov, int cnt)
+{
+    uint8_t	*nbuf;
+    size_t	need = 0;
+    size_t	size;
+    int		i;
+
+    for (i = 0; i < cnt; i++)
+	need += iov[i].iov_len;
 
-    while (rem > 0)
+    if (ch->tx_pend_head > 0)
     {
-	size = ch_read(ch->fd, data + count, rem);
-	if (size < 0)
-	{ /* Warning: send/receive sync error possible */
-	    err = XAMBIT_ERR_STD;
-	    goto error1;
-	}
-	count += size;
-	rem -= size;
+	memmove(ch->tx_pend, ch->tx_pend + ch->tx_pend_head,
+		ch->tx_pend_len - ch->tx_pend_head);
+	ch->tx_pend_len -= ch->tx_pend_head;
+	ch->tx_pend_head = 0;
     }
 
-    err = verify_parcel(ch, hdr);
-    if (err < 0)
-	goto error1;
-
-    tv = lookup_type_validator(ch, hdr->type);
-    if (tv == NULL)
+    if (need > ch->tx_pend_size - ch->tx_pend_len)
     {
-	err = XAMBIT_ERR_BAD_TYPE;
-	goto error1;
+	size = ch->tx_pend_size ? ch->tx_pend_size : XAMBIT_SEND_BUF_LEN;
+	while (size < ch->tx_pend_len + need)
+	    size *= 2;
+	nbuf = realloc(ch->tx_pend, size);
+	if (nbuf == NULL)
+	{
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+	ch->tx_pend = nbuf;
+	ch->tx_pend_size = size;
     }
 
-    err = tv->validate(hdr, data);
-    if (err < 0)
+    for (i = 0; i < cnt; i++)
     {
-	err = XAMBIT_ERR_VALIDATE;
-	goto error1;
+	memcpy(ch->tx_pend + ch->tx_pend_len, iov[i].iov_base,
+	       iov[i].iov_len);
+	ch->tx_pend_len += iov[i].iov_len;
     }
 
-    *phdr = hdr;
-    *buf = data;
-out:
-    return err;
-
-error1:
-    free(data);
-error2:
-    free(hdr);
-    return err;
+    return 0;
 }
 
-int channel_send_file(xambit_channel_t *ch, const char *path, uint32_t tid)
+/* Write as much of the backlog as the channel will take. Returns 0 once it
+ * is empty, otherwise a negetive value with errno set to EAGAIN or the write
+ * error. */
+static int ch_pend_drain(xambit_channel_t *ch)
 {
-    int			err;
-    int			fd;
-    void		*data;
-    xambit_parcel_hdr_t	hdr;
-    struct stat		file;
-    size_t		size;
-    size_t		index;
-    ssize_t		count;
-
-    err = stat(path, &file);
-    if (err < 0)
-	return err;
-
-    size = file.st_size;
+    struct iovec iov;
+    ssize_t	n;
 
-    hdr.length = size;
-    hdr.type = tid;
-    hdr.flags = XAMBIT_BLOCK;
-    hdr.version = XAMBIT_HDR_VERSION;
+    while (ch->tx_pend_len > ch->tx_pend_head)
+    {
+	iov.iov_base = ch->tx_pend + ch->tx_pend_head;
+	iov.iov_len = ch->tx_pend_len - ch->tx_pend_head;
+	n = ch_sys_writev(ch, &iov, 1);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return XAMBIT_ERR_STD;
+	}
+	CH_STAT_ADD(ch, write_calls, 1);
+	ch->tx_pend_head += n;
+    }
 
-    err = open(path, O_RDONLY);
-    if (err < 0)
-	goto out;
+    ch->tx_pend_head = ch->tx_pend_len = 0;
+    return 0;
+}
 
-    fd = err;
+/* Keep len bytes of fd from off, and then the cnt runs at run, as the rest
+ * of the backlog, to be written from fd by later calls */
+static int ch_file_hold(xambit_channel_t *ch, int fd, uint64_t off,
+			uint64_t len, const sp_run_t *run, uint64_t cnt)
+{
+    xambit_tx_file_t *tf;
 
-    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (data == MAP_FAILED)
+    tf = malloc(sizeof(*tf) + cnt * sizeof(*run));
+    if (tf == NULL)
     {
-	err = -1;
-	goto error;
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
     }
 
-    err = channel_send_buf(ch, &hdr, data);
-
-    munmap(data, size);
-error:
+    tf->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (tf->fd < 0)
+    {
+	free(tf);
+	return XAMBIT_ERR_STD;
+    }
+    tf->off = off;
+    tf->left = len;
+    tf->next = 0;
+    tf->runs = cnt;
+    memcpy(tf->run, run, cnt * sizeof(*run));
+    ch->tx_file = tf;
+    return 0;
+}
+
+/* Write as much of the held file as the channel will take: spliced where the
+ * kernel allows, otherwise read a buffer at a time into the backlog. Returns
+ * as ch_pend_drain. */
+static int ch_file_drain(xambit_channel_t *ch)
+{
+    xambit_tx_file_t *tf = ch->tx_file;
+    uint8_t	*nbuf;
+    ssize_t	n;
+    int		err;
+
+    while (tf->left > 0 || tf->next < tf->runs)
+    {
+	if (tf->left == 0)
+	{
+	    tf->off = tf->run[tf->next].offset;
+	    tf->left = tf->run[tf->next].length;
+	    tf->next++;
+	    continue;
+	}
+
+#ifdef HAVE_SPLICE
+	if (ch->type == XAMBIT_CH_FIFO)
+	{
+	    loff_t foff = tf->off;
+
+	    n = splice(tf->fd, &foff, ch->fd, NULL,
+		       tf->left > XAMBIT_SPLICE_MAX ? XAMBIT_SPLICE_MAX :
+						      tf->left,
+		       SPLICE_F_MOVE | SPLICE_F_MORE);
+	    if (n > 0)
+	    {
+		CH_STAT_ADD(ch, write_calls, 1);
+		tf->off += n;
+		tf->left -= n;
+		continue;
+	    }
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0 && errno != EINVAL && errno != ENOSYS)
+		return XAMBIT_ERR_STD;
+	}
+#endif
+
+	if (ch->tx_pend_size < XAMBIT_SEND_BUF_LEN)
+	{
+	    nbuf = realloc(ch->tx_pend, XAMBIT_SEND_BUF_LEN);
+	    if (nbuf == NULL)
+	    {
+		errno = ENOMEM;
+		return XAMBIT_ERR_STD;
+	    }
+	    ch->tx_pend = nbuf;
+	    ch->tx_pend_size = XAMBIT_SEND_BUF_LEN;
+	}
+
+	n = pread(tf->fd, ch->tx_pend, tf->left > ch->tx_pend_size ?
+				       ch->tx_pend_size : tf->left, tf->off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	{
+	    /* The file has been cut short since it was checked */
+	    if (n == 0)
+		errno = EIO;
+	    return XAMBIT_ERR_STD;
+	}
+	tf->off += n;
+	tf->left -= n;
+	ch->tx_pend_head = 0;
+	ch->tx_pend_len = n;
+
+	err = ch_pend_drain(ch);
+	if (err < 0)
+	    return err;
+    }
+
+    ch_file_free(ch);
+    return 0;
+}
+
+static void ch_file_free(xambit_channel_t *ch)
+{
+    if (ch->tx_file == NULL)
+	return;
+    close(ch->tx_file->fd);
+    free(ch->tx_file);
+    ch->tx_file = NULL;
+}
+
+/* Whether a non-blocking channel can take another parcel: only once its
+ * backlog, and any file held behind it, has been written. Returns 0, or a
+ * negetive value with errno set to EAGAIN (nothing having been sent) or the
+ * write error. */
+int ch_tx_ready(xambit_channel_t *ch)
+{
+    if (ch->tx_pend_len > ch->tx_pend_head && ch_pend_drain(ch) < 0)
+	return XAMBIT_ERR_STD;
+    if (ch->tx_file != NULL)
+	return ch_file_drain(ch);
+    return 0;
+}
+
+/* Put a newly opened XAMBIT_NONBLOCK channel's descriptor in non-blocking
+ * mode. Opening itself waits as usual. */
+int ch_nonblock(xambit_channel_t *ch)
+{
+    int		fl;
+
+    if (!(ch->flags & XAMBIT_NONBLOCK))
+	return 0;
+
+    fl = fcntl(ch->fd, F_GETFL);
+    if (fl < 0 || fcntl(ch->fd, F_SETFL, fl | O_NONBLOCK) < 0)
+	return XAMBIT_ERR_STD;
+    return 0;
+}
+
+/* Append a checked parcel to the coalescing buffer of a buffered channel,
+ * flushing as the policy requires. Parcels that will not fit in the buffer
+ * go straight out behind whatever is already queued. */
+static int ch_queue_parcel(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			   void *buf)
+{
+    struct iovec iov[2];
+    size_t	need = sizeof(*hdr) + hdr->length;
+    int		err;
+
+    if (need > ch->sbuf_size - ch->sbuf_len)
+    {
+	err = ch_flush(ch);
+	if (err < 0)
+	    return err;
+    }
+
+    if (need > ch->sbuf_size)
+    {
+	ch_csum_data(ch, hdr, buf);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(*hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = hdr->length;
+	return ch_writev_all(ch, iov, 2);
+    }
+
+    if (ch->sbuf_len == 0)
+	ch->sbuf_stamp = now_usec();
+
+    /* The header goes in last, once the copy has produced the checksum */
+    if (hdr->flags & XAMBIT_DATA_CSUM)
+    {
+	hdr->data_checksum = crc32c_copy(ch->sbuf + ch->sbuf_len + sizeof(*hdr),
+					 buf, hdr->length, 0);
+	prepare_parcel(ch, hdr);
+    }
+    else
+    {
+	memcpy(ch->sbuf + ch->sbuf_len + sizeof(*hdr), buf, hdr->length);
+    }
+    memcpy(ch->sbuf + ch->sbuf_len, hdr, sizeof(*hdr));
+    ch->sbuf_len += need;
+
+    if (ch->sbuf_len >= ch->flush_bytes ||
+	(ch->flush_usec && now_usec() - ch->sbuf_stamp >= ch->flush_usec))
+	return ch_flush(ch);
+
+    return 0;
+}
+
+/* Write, or queue on a buffered channel, a parcel that has been prepared and
+ * checked. The header and data leave in a single writev(). A shared channel
+ * must be locked by the caller. */
+int ch_emit(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr, void *buf)
+{
+    struct iovec iov[2];
+    int		err;
+
+    if (!ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (ch->sbuf != NULL)
+    {
+	err = ch_queue_parcel(ch, hdr, buf);
+    }
+    else
+    {
+	/* Header first, then data */
+	ch_csum_data(ch, hdr, buf);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(xambit_parcel_hdr_t);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = hdr->length;
+	err = ch_writev_all(ch, iov, 2);
+    }
+    if (err < 0)
+	return err;
+
+    CH_STAT_ADD(ch, parcels_sent, 1);
+    CH_STAT_ADD(ch, bytes_sent, hdr->length);
+    return 0;
+}
+
+/*  Function Name:	channel_send_buf
+ *
+ *  Scope:		Local
+ *
+ *  Purpose:		To send a chunk of data
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		.
+ *
+ *  Return Value:	On error a negetive value will be returned and errno
+ *			will be set appropriately. Negetive values other than -1
+ *			represent XAmbit specific error conditions. On success a
+ *			non-negetive value is returned.
+ */
+static int channel_send_buf(xambit_channel_t *ch,
+			    xambit_parcel_hdr_t *hdr,
+			    void *buf)
+{
+    int		err;
+    uint64_t	len = hdr->length;
+    void	*zbuf;
+    int		atomic;
+
+    err = check_parcel(ch, hdr, buf);
+    if (err < 0)
+	return err;
+
+    /* Validated as given, sent deflated if that pays */
+    zbuf = zl_deflate(ch, hdr, buf);
+
+    atomic = ch_lock_send(ch, sizeof(*hdr) + hdr->length);
+    err = ch_tx_ready(ch);
+    if (err == 0)
+	err = ch_emit(ch, hdr, zbuf != NULL ? zbuf : buf);
+    ch_unlock_send(ch, atomic);
+
+    if (zbuf != NULL)
+    {
+	if (err == 0)
+	    CH_STAT_ADD(ch, bytes_sent, len - hdr->length);
+	free(zbuf);
+    }
+    return err;
+}
+
+/* Room kept past the end of the read-ahead buffer. A socket message has to
+ * be read whole, so there is always space for the largest. */
+static size_t rx_slack(xambit_channel_t *ch)
+{
+    return ch->type == XAMBIT_CH_SOCK ? XAMBIT_SOCK_MSG_LEN : 0;
+}
+
+/* Make at least need bytes available in the read-ahead buffer, pulling in
+ * as much as the channel has ready with each read(). */
+int rx_fill(xambit_channel_t *ch, size_t need)
+{
+    ssize_t	n;
+
+    /* The ring is the read-ahead buffer */
+    if (ch->type == XAMBIT_CH_SHM)
+	return shm_rx_fill(ch, need);
+
+    if (ch->rbuf == NULL)
+    {
+	if (ch->rbuf_size == 0)
+	    ch->rbuf_size = XAMBIT_RECV_BUF_LEN;
+	ch->rbuf = malloc(ch->rbuf_size + rx_slack(ch));
+	if (ch->rbuf == NULL)
+	{
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+    }
+
+    while (ch->rbuf_tail - ch->rbuf_head < need)
+    {
+	if (ch->rbuf_head + need > ch->rbuf_size)
+	{
+	    memmove(ch->rbuf, ch->rbuf + ch->rbuf_head,
+		    ch->rbuf_tail - ch->rbuf_head);
+	    ch->rbuf_tail -= ch->rbuf_head;
+	    ch->rbuf_head = 0;
+	}
+
+	n = ch_sys_read(ch, ch->rbuf + ch->rbuf_tail,
+			ch->rbuf_size + rx_slack(ch) - ch->rbuf_tail);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return XAMBIT_ERR_STD;
+	}
+
+	if (n == 0)
+	{ /* Warning: send/receive sync error possible */
+	    errno = EINVAL;
+	    return XAMBIT_ERR_STD;
+	}
+	ch->rbuf_tail += n;
+    }
+
+    return 0;
+}
+
+/* rx_fill() that waits on a non-blocking channel, for a caller that cannot
+ * stop part way */
+int rx_fill_wait(xambit_channel_t *ch, size_t need)
+{
+    struct pollfd pfd = { ch->fd, POLLIN, 0 };
+    int		err;
+
+    while ((err = rx_fill(ch, need)) < 0 && errno == EAGAIN &&
+	   (ch->flags & XAMBIT_NONBLOCK))
+    {
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+	    return XAMBIT_ERR_STD;
+    }
+
+    return err;
+}
+
+/* Whether a receive can start on a parcel without waiting for the channel:
+ * the whole of one, or a header to report as bad, is already buffered */
+int rx_buffered(xambit_channel_t *ch)
+{
+    xambit_parcel_hdr_t	h;
+    size_t		avail = ch->rbuf_tail - ch->rbuf_head;
+
+    if (ch->type == XAMBIT_CH_UDP && udp_rx_pending(ch))
+	return 1;
+    if (ch->rx_file != NULL || ch->rx_discard > 0)
+	return avail > 0;
+    if (avail < sizeof(h))
+	return 0;
+
+    memcpy(&h, ch->rbuf + ch->rbuf_head, sizeof(h));
+    return !rx_hdr_ok(&h) || (h.flags & XAMBIT_FD) ||
+	   h.length <= avail - sizeof(h);
+}
+
+/* Whether a header is one that can be read */
+static int rx_hdr_ok(xambit_parcel_hdr_t *h)
+{
+    return h->sync == XAMBIT_HDR_SYNC && h->version == XAMBIT_HDR_VERSION &&
+	   validate_hdr_csum(h) == 0;
+}
+
+/* On a reader opened with XAMBIT_RESYNC, make sure the header buffered at
+ * the head of the read-ahead buffer is a good one, passing over everything
+ * up to the next that is. What is passed over is gone for good, so that a
+ * non-blocking reader told EAGAIN part way carries on from there. */
+static int rx_resync(xambit_channel_t *ch)
+{
+    xambit_parcel_hdr_t	h;
+    size_t		off;
+    int			err;
+
+    while (1)
+    {
+	memcpy(&h, ch->rbuf + ch->rbuf_head, sizeof(h));
+	if (rx_hdr_ok(&h))
+	    break;
+	if (!ch->rx_resync)
+	{
+	    ch->stats.hdr_errors++;
+	    ch->rx_resync = 1;
+	}
+
+	/* On to the next marker after this one, or the last bytes that may
+	 * start one, and from there a whole header */
+	off = 1 + sync_find(ch->rbuf + ch->rbuf_head + 1,
+			    ch->rbuf_tail - ch->rbuf_head - 1);
+	ch->rbuf_head += off;
+	ch->stats.resync_bytes += off;
+	err = rx_fill(ch, sizeof(h));
+	if (err < 0)
+	    return err;
+    }
+
+    if (ch->rx_resync)
+    {
+	ch->rx_resync = 0;
+	ch->stats.resyncs++;
+    }
+    return 0;
+}
+
+/* Make the next parcel header available in the read-ahead buffer. On a
+ * non-blocking channel its payload must be there too, so that what has
+ * arrived of a parcel is kept for the next call until the rest has. */
+static int rx_ready(xambit_channel_t *ch)
+{
+    int		err;
+
+    err = rx_ready_hdr(ch);
+    if (err == 0)
+	err = rx_ready_data(ch);
+    return err;
+}
+
+/* rx_ready() for the header alone */
+static int rx_ready_hdr(xambit_channel_t *ch)
+{
+    int		err;
+
+    if (ch->flags & XAMBIT_NONBLOCK)
+    {
+	/* A parcel being written to a file is taken by
+	 * channel_receive_to_file alone */
+	if (ch->rx_file != NULL)
+	{
+	    errno = EBUSY;
+	    return XAMBIT_ERR_STD;
+	}
+
+	/* ... and the rest of one that was dropped is passed over first */
+	if (ch->rx_discard > 0)
+	{
+	    err = rx_to_fd_some(ch, -1, &ch->rx_discard, NULL);
+	    if (err < 0)
+		return err;
+	}
+
+	if (ch->rbuf_want != 0 &&
+	    ch->rbuf_tail - ch->rbuf_head <= ch->rbuf_want)
+	    rx_grow(ch, ch->rbuf_want);
+    }
+
+    err = rx_fill(ch, sizeof(xambit_parcel_hdr_t));
+    if (err == 0 && (ch->flags & XAMBIT_RESYNC))
+	err = rx_resync(ch);
+    return err;
+}
+
+/* rx_ready() for the payload of the header it has made available. The
+ * read-ahead buffer grows, up to XAMBIT_RECV_HOLD_MAX, as the payload
+ * arrives rather than to the length the header claims. A parcel over that
+ * is dropped, and the rest of it passed over by later calls. */
+static int rx_ready_data(xambit_channel_t *ch)
+{
+    xambit_parcel_hdr_t	h;
+    size_t		need;
+    size_t		size;
+    int			err;
+
+    if (!(ch->flags & XAMBIT_NONBLOCK))
+	return 0;
+
+    /* A bad header is for rx_parse_hdr to report. Data passed by descriptor
+     * comes with the header. */
+    memcpy(&h, ch->rbuf + ch->rbuf_head, sizeof(h));
+    if (!rx_hdr_ok(&h) || (h.flags & XAMBIT_FD))
+	return 0;
+
+    if (h.length > XAMBIT_RECV_HOLD_MAX)
+    {
+	err = rx_parse_hdr(ch, &h);
+	if (err < 0)
+	    return err;
+	ch->rx_discard = h.length;
+	ch->stats.parcels_dropped++;
+	errno = EMSGSIZE;
+	return XAMBIT_ERR_STD;
+    }
+
+    need = sizeof(h) + h.length;
+    while (ch->rbuf_tail - ch->rbuf_head < need)
+    {
+	if (need > ch->rbuf_size &&
+	    ch->rbuf_tail - ch->rbuf_head >= ch->rbuf_size)
+	{
+	    size = ch->rbuf_size * 2 < need ? ch->rbuf_size * 2 : need;
+	    err = rx_grow(ch, size);
+	    if (err < 0)
+		return err;
+	}
+	err = rx_fill(ch, need < ch->rbuf_size ? need : ch->rbuf_size);
+	if (err < 0)
+	    return err;
+    }
+    return 0;
+}
+
+/* Resize the read-ahead buffer to size bytes, which must hold those already
+ * buffered, remembering the size it was set to */
+static int rx_grow(xambit_channel_t *ch, size_t size)
+{
+    uint8_t	*nbuf;
+    size_t	used = ch->rbuf_tail - ch->rbuf_head;
+
+    memmove(ch->rbuf, ch->rbuf + ch->rbuf_head, used);
+    ch->rbuf_head = 0;
+    ch->rbuf_tail = used;
+
+    nbuf = realloc(ch->rbuf, size + rx_slack(ch));
+    if (nbuf == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    ch->rbuf = nbuf;
+
+    if (ch->rbuf_want == 0)
+	ch->rbuf_want = ch->rbuf_size;
+    else if (size == ch->rbuf_want)
+	ch->rbuf_want = 0;
+    ch->rbuf_size = size;
+    return 0;
+}
+
+/* Copy len bytes of the stream to dst. Whatever is already buffered is used
+ * first; large remainders are read straight into dst. If crc is given the
+ * CRC32C of the data is taken on the way and stored there. */
+int rx_copy(xambit_channel_t *ch, void *dst, uint64_t len, uint32_t *crc)
+{
+    uint64_t	take;
+    ssize_t	n;
+    void	*src;
+    int		err;
+
+    if (crc != NULL)
+	*crc = 0;
+
+    /* Data that came in a memfd is copied from its mapping */
+    src = ch->type == XAMBIT_CH_SOCK ? sock_att_take(ch, len) : NULL;
+    if (src != NULL)
+    {
+	if (crc != NULL)
+	    *crc = crc32c_copy(dst, src, len, 0);
+	else
+	    memcpy(dst, src, len);
+	return 0;
+    }
+
+    take = ch->rbuf_tail - ch->rbuf_head;
+    if (take > len)
+	take = len;
+    if (crc != NULL)
+	*crc = crc32c_copy(dst, ch->rbuf + ch->rbuf_head, take, *crc);
+    else
+	memcpy(dst, ch->rbuf + ch->rbuf_head, take);
+    ch->rbuf_head += take;
+    dst = (uint8_t *)dst + take;
+    len -= take;
+
+    /* A socket message may run on past this parcel, so it is only ever read
+     * into the read-ahead buffer */
+    while (len >= ch->rbuf_size / 2 && ch->type != XAMBIT_CH_SOCK)
+    {
+	n = ch_sys_read(ch, dst, len);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return XAMBIT_ERR_STD;
+	}
+
+	if (n == 0)
+	{ /* Warning: send/receive sync error possible */
+	    errno = EINVAL;
+	    return XAMBIT_ERR_STD;
+	}
+	/* Still in cache from the read */
+	if (crc != NULL)
+	    *crc = crc32c(*crc, dst, n);
+	dst = (uint8_t *)dst + n;
+	len -= n;
+    }
+
+    while (len > 0)
+    {
+	take = len > ch->rbuf_size ? ch->rbuf_size : len;
+	err = rx_fill(ch, take);
+	if (err < 0)
+	    return err;
+	if (crc != NULL)
+	    *crc = crc32c_copy(dst, ch->rbuf + ch->rbuf_head, take, *crc);
+	else
+	    memcpy(dst, ch->rbuf + ch->rbuf_head, take);
+	ch->rbuf_head += take;
+	dst = (uint8_t *)dst + take;
+	len -= take;
+    }
+
+    return 0;
+}
+
+/* Take the next parcel header out of the read-ahead buffer, which must
+ * already hold it, and check it. */
+int rx_parse_hdr(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr)
+{
+    int		err;
+
+    memcpy(hdr, ch->rbuf + ch->rbuf_head, sizeof(*hdr));
+
+    if (hdr->sync != XAMBIT_HDR_SYNC || hdr->version != XAMBIT_HDR_VERSION)
+    {
+	errno = EINVAL;
+	err = XAMBIT_ERR_HDR_VER;
+    }
+    else
+    {
+	err = verify_parcel(ch, hdr);
+    }
+    if (err < 0)
+    {
+	if (!ch->rx_resync)
+	    ch->stats.hdr_errors++;
+
+	/* A reader that resyncs looks for the next header from this one, the
+	 * next time it is ready */
+	if (ch->flags & XAMBIT_RESYNC)
+	    ch->rx_resync = 1;
+	else /* Warning: send/receive sync error possible */
+	    ch->rbuf_head += sizeof(*hdr);
+	return err;
+    }
+    ch->rbuf_head += sizeof(*hdr);
+
+    if (ch->type == XAMBIT_CH_SOCK)
+    {
+	err = sock_rx_attach(ch, hdr);
+	if (err < 0)
+	    return err;
+    }
+    else if (hdr->flags & XAMBIT_FD)
+    { /* Warning: send/receive sync error possible */
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* Only whole parcels sent inline are deflated */
+    if ((hdr->flags & XAMBIT_ZLIB) &&
+	(hdr->flags & (XAMBIT_STREAM | XAMBIT_FD)))
+    { /* Warning: send/receive sync error possible */
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* ... and a reference is its digest and length alone */
+    if ((hdr->flags & XAMBIT_REF) &&
+	((hdr->flags & (XAMBIT_STREAM | XAMBIT_FD | XAMBIT_ZLIB)) ||
+	 hdr->length != sizeof(dd_ref_t)))
+    { /* Warning: send/receive sync error possible */
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* ... and a delta starts with the two versions */
+    if ((hdr->flags & XAMBIT_DELTA) &&
+	((hdr->flags & (XAMBIT_STREAM | XAMBIT_FD | XAMBIT_ZLIB |
+			XAMBIT_REF)) ||
+	 hdr->length < sizeof(dl_hdr_t)))
+    { /* Warning: send/receive sync error possible */
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* ... and an extent with where it goes */
+    if ((hdr->flags & XAMBIT_EXTENT) &&
+	((hdr->flags & (XAMBIT_STREAM | XAMBIT_FD | XAMBIT_ZLIB |
+			XAMBIT_REF | XAMBIT_DELTA)) ||
+	 hdr->length < sizeof(ex_hdr_t)))
+    { /* Warning: send/receive sync error possible */
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* ... and a sparse file with its map */
+    if ((hdr->flags & XAMBIT_HOLES) &&
+	((hdr->flags & (XAMBIT_STREAM | XAMBIT_FD | XAMBIT_ZLIB | XAMBIT_REF |
+			XAMBIT_DELTA | XAMBIT_EXTENT)) ||
+	 hdr->length < sizeof(sp_hdr_t)))
+    { /* Warning: send/receive sync error possible */
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (hdr->flags & XAMBIT_STREAM)
+    {
+	if (hdr->length > MAX_STREAM_SIZE)
+	{ /* Warning: send/receive sync error possible */
+	    errno = EINVAL;
+	    return XAMBIT_ERR_STD;
+	}
+    }
+    else if (ch->rx_stream != NULL)
+    {
+	/* Segments of a stream are never interleaved with other parcels, so
+	 * the sender has given up on it without saying so */
+	rx_stream_reset(ch);
+	ch->stats.parcels_dropped++;
+    }
+
+    return 0;
+}
+
+/* Where rx_copy should leave the CRC32C of a parcel's data: nowhere if it
+ * has none, or if it is large enough to be checked in parallel afterwards */
+static uint32_t *rx_copy_crc(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			     uint32_t *crc)
+{
+    if (!(hdr->flags & XAMBIT_DATA_CSUM) || rx_parallel(ch, hdr->length))
+	return NULL;
+    return crc;
+}
+
+/* Check the data checksum of a received parcel. crc is the CRC32C already
+ * taken of the data while copying it, or NULL to have it computed here. */
+int rx_check_data(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		  const void *data, const uint32_t *crc)
+{
+    /* That of an inflated parcel was checked as it crossed */
+    if (hdr->flags & XAMBIT_ZLIB)
+	return 0;
+
+    if (!(hdr->flags & XAMBIT_DATA_CSUM))
+    {
+	if (!(ch->flags & XAMBIT_CHECKSUM))
+	    return 0;
+    }
+    else if ((crc != NULL ? *crc : crc32c(0, data, hdr->length)) ==
+	     hdr->data_checksum)
+    {
+	return 0;
+    }
+
+    ch->stats.csum_errors++;
+    return XAMBIT_ERR_DATA_CHKSUM;
+}
+
+/* Check and run the registered validator over a received parcel */
+static int rx_validate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		       void *data, const uint32_t *crc)
+{
+    xambit_type_validator_t *tv;
+    int		err;
+
+    /* A reference or a delta is only resolved into a file, by
+     * channel_receive_to_file */
+    if (hdr->flags & (XAMBIT_REF | XAMBIT_DELTA))
+    {
+	ch->stats.dedup_misses++;
+	return XAMBIT_ERR_DEDUP;
+    }
+
+    /* ... as is an extent, into the file it is part of */
+    if (hdr->flags & XAMBIT_EXTENT)
+	return XAMBIT_ERR_JOURNAL;
+
+    /* ... and a sparse file, where its holes can be made */
+    if (hdr->flags & XAMBIT_HOLES)
+	return XAMBIT_ERR_SPARSE;
+
+    tv = lookup_type_validator(ch, hdr->type);
+    if (tv == NULL)
+	return XAMBIT_ERR_BAD_TYPE;
+
+    /* Data copied without a checksum being taken may be split up */
+    if (crc == NULL && rx_parallel(ch, hdr->length))
+    {
+	err = rx_par_check(ch, tv, hdr, data, !(hdr->flags & XAMBIT_ZLIB));
+    }
+    else
+    {
+	err = rx_check_data(ch, hdr, data, crc);
+	if (err == 0)
+	    err = tv_validate(tv, hdr, data);
+    }
+    tv_put(tv);
+    if (err < 0)
+	return err;
+
+    ch->stats.parcels_received++;
+    ch->stats.bytes_received += hdr->length;
+    return 0;
+}
+
+/* Run the registered validator over a file put together from parcels whose
+ * data was checked as it crossed, such as a delta or extents */
+static int rx_validate_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			    void *data)
+{
+    xambit_type_validator_t *tv;
+    int		err;
+
+    tv = lookup_type_validator(ch, hdr->type);
+    if (tv == NULL)
+	return XAMBIT_ERR_BAD_TYPE;
+
+    if (rx_parallel(ch, hdr->length))
+	err = rx_par_check(ch, tv, hdr, data, 0);
+    else
+	err = tv_validate(tv, hdr, data);
+    tv_put(tv);
+    if (err < 0)
+	return err;
+
+    ch->stats.parcels_received++;
+    ch->stats.bytes_received += hdr->length;
+    return 0;
+}
+
+/* Take the data of a parcel off the channel, in place where it is all in
+ * the read-ahead buffer. Otherwise it is copied to memory returned in *copy,
+ * for the caller to free, with its CRC32C taken on the way into *crc and
+ * *pcrc pointed at that if it has one. */
+static int rx_wire(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		   const void **src, void **copy, uint32_t *crc,
+		   uint32_t **pcrc)
+{
+    int		err;
+
+    *copy = NULL;
+    *pcrc = NULL;
+    if (hdr->length <= ch->rbuf_tail - ch->rbuf_head)
+    {
+	*src = ch->rbuf + ch->rbuf_head;
+	ch->rbuf_head += hdr->length;
+	return 0;
+    }
+
+    *copy = malloc(hdr->length);
+    ch->stats.allocs++;
+    if (*copy == NULL)
+    {
+	errno = ENOMEM;
+	rx_skip(ch, hdr->length);
+	return XAMBIT_ERR_STD;
+    }
+
+    if (hdr->flags & XAMBIT_DATA_CSUM)
+	*pcrc = crc;
+    err = rx_copy(ch, *copy, hdr->length, *pcrc);
+    if (err < 0)
+    {
+	free(*copy);
+	*copy = NULL;
+	return err;
+    }
+    *src = *copy;
+    return 0;
+}
+
+/* Check the data of a deflated parcel, as it crossed, and inflate it into
+ * dst, which must hold the length zl_length gave. crc is as for
+ * rx_check_data. hdr is left describing the inflated parcel. */
+static int rx_inflate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		      const void *src, const uint32_t *crc, void *dst)
+{
+    xambit_parcel_hdr_t	h = *hdr;
+    int			err;
+
+    h.flags &= ~XAMBIT_ZLIB;
+    err = rx_check_data(ch, &h, src, crc);
+    if (err < 0)
+	return err;
+
+    return zl_inflate(ch, hdr, src, dst, &ch->stats);
+}
+
+/* Size class of a pool block able to hold len payload bytes, or -1 if the
+ * payload is too large to be pooled */
+static int pool_class(uint64_t len)
+{
+    int cls = 0;
+
+    while (cls < XAMBIT_POOL_CLASSES &&
+	   len > ((uint64_t)1 << (XAMBIT_POOL_MIN_SHIFT + cls)))
+	cls++;
+
+    return cls < XAMBIT_POOL_CLASSES ? cls : -1;
+}
+
+/* channel_release finds a pooled payload right behind its header */
+_Static_assert(offsetof(xambit_pool_blk_t, hdr) + sizeof(xambit_parcel_hdr_t)
+	       == sizeof(xambit_pool_blk_t),
+	       "pool block payload must follow the parcel header");
+_Static_assert(sizeof(xambit_pool_blk_t) % 16 == 0,
+	       "pool block payload must be 16 byte aligned");
+
+/* Allocate the header and payload buffers for a received parcel. Pooled
+ * channels hand out a single block with the payload right behind the
+ * header; see channel_release. */
+static int rx_alloc(xambit_channel_t *ch, uint64_t len,
+		    xambit_parcel_hdr_t **phdr, void **pdata)
+{
+    xambit_pool_blk_t	*blk;
+    int			cls;
+
+    if (len > SIZE_MAX - sizeof(*blk))
+	goto nomem;
+
+    if (ch->pool != NULL)
+    {
+	cls = pool_class(len);
+	if (cls >= 0 && ch->pool->free[cls] != NULL)
+	{
+	    blk = ch->pool->free[cls];
+	    ch->pool->free[cls] = blk->next;
+	    ch->pool->cached -= (size_t)1 << (XAMBIT_POOL_MIN_SHIFT + cls);
+	}
+	else
+	{
+	    blk = malloc(sizeof(*blk) + (cls >= 0 ?
+			 (size_t)1 << (XAMBIT_POOL_MIN_SHIFT + cls) : len));
+	    if (blk == NULL)
+		goto nomem;
+	    ch->stats.allocs++;
+	}
+	blk->cls = cls;
+	blk->magic = XAMBIT_POOL_MAGIC;
+	ch->pool_out++;
+	*phdr = &blk->hdr;
+	*pdata = blk + 1;
+	return 0;
+    }
+
+    *phdr = malloc(sizeof(xambit_parcel_hdr_t));
+    *pdata = malloc(len ? len : 1);
+    ch->stats.allocs += 2;
+    if (*phdr != NULL && *pdata != NULL)
+	return 0;
+
+    free(*phdr);
+    free(*pdata);
+nomem:
+    errno = ENOMEM;
+    return XAMBIT_ERR_STD;
+}
+
+/* Read parcel headers until a block parcel is next on the channel, or a
+ * stream has been completed from the segments read. Returns 0 with the block
+ * header in h, 1 with h describing the stream and *sdata holding its data
+ * (which the caller must free()), or a negetive value on error. */
+int rx_next(xambit_channel_t *ch, xambit_parcel_hdr_t *h, void **sdata)
+{
+    xambit_parcel_hdr_t	seg;
+    void		*data;
+    int			err;
+
+    while (1)
+    {
+	err = rx_ready(ch);
+	if (err < 0)
+	    return err;
+
+	err = rx_parse_hdr(ch, &seg);
+	if (err < 0)
+	    return err;
+
+	if (!(seg.flags & XAMBIT_STREAM))
+	{
+	    *h = seg;
+	    return 0;
+	}
+
+	err = rx_fill(ch, seg.length);
+	if (err < 0)
+	    return err;
+	data = ch->rbuf + ch->rbuf_head;
+	ch->rbuf_head += seg.length;
+
+	err = rx_stream_segment(ch, &seg, data, -1, h);
+	if (err < 0)
+	    return err;
+	if (err == 1)
+	{
+	    *sdata = rx_stream_take(ch);
+	    return *sdata ? 1 : XAMBIT_ERR_STD;
+	}
+    }
+}
+
+/* Caller must release allocated memory with channel_release */
+static int channel_receive_buf(xambit_channel_t *ch,
+			      xambit_parcel_hdr_t **phdr,
+			      void **buf)
+{
+    xambit_parcel_hdr_t	h;
+    xambit_parcel_hdr_t	*hdr;
+    void		*data;
+    const void		*src;
+    void		*copy;
+    uint64_t		len;
+    uint32_t		crc;
+    uint32_t		*pcrc;
+    int			err = 0;
+
+    if (phdr == NULL || !ch_type_ok(ch))
+    {
+	err = XAMBIT_ERR_STD;
+	errno = EINVAL;
+	goto out;
+    }
+
+    if (ch->pipeline != NULL)
+	return pl_receive(ch, phdr, buf);
+
+    err = rx_next(ch, &h, &data);
+    if (err < 0)
+	goto out;
+
+    if (err == 1)
+    {
+	/* A stream, already validated segment by segment */
+	hdr = malloc(sizeof(*hdr));
+	ch->stats.allocs++;
+	if (hdr == NULL)
+	{
+	    free(data);
+	    errno = ENOMEM;
+	    err = XAMBIT_ERR_STD;
+	    goto out;
+	}
+	*hdr = h;
+	err = 0;
+	goto done;
+    }
+
+    if (h.flags & XAMBIT_ZLIB)
+    {
+	/* Inflated into a buffer of its own, then checked as any other */
+	err = rx_wire(ch, &h, &src, &copy, &crc, &pcrc);
+	if (err < 0) /* Warning: send/receive sync error possible */
+	    goto out;
+	err = zl_length(ch, &h, src, &len);
+	if (err == 0)
+	    err = rx_alloc(ch, len, &hdr, &data);
+	if (err < 0)
+	{
+	    free(copy);
+	    ch->stats.parcels_dropped++;
+	    goto out;
+	}
+	*hdr = h;
+	err = rx_inflate(ch, hdr, src, pcrc, data);
+	free(copy);
+	if (err == 0)
+	    err = rx_validate(ch, hdr, data, NULL);
+	if (err < 0)
+	{
+	    ch->stats.parcels_dropped++;
+	    goto error;
+	}
+	goto done;
+    }
+
+    err = rx_alloc(ch, h.length, &hdr, &data);
+    if (err < 0)
+    {
+	rx_skip(ch, h.length);
+	goto out;
+    }
+    *hdr = h;
+
+    pcrc = rx_copy_crc(ch, hdr, &crc);
+    err = rx_copy(ch, data, hdr->length, pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	goto error;
+
+    err = rx_validate(ch, hdr, data, pcrc);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	goto error;
+    }
+
+done:
+    *phdr = hdr;
+    *buf = data;
+out:
+    return err;
+
+error:
+    channel_release(ch, data, hdr);
+    return err;
+}
+
+/* Move the cnt runs of fd at run into the channel. Pages go from the page
+ * cache straight into the pipe with splice() where the kernel allows it;
+ * anything splice() will not take is written from the mapping at data. A
+ * non-blocking channel keeps whatever it will not take now as a held file,
+ * rather than copying it to the backlog. */
+static int ch_splice_file(xambit_channel_t *ch, int fd, void *data,
+			  const sp_run_t *run, uint64_t cnt)
+{
+    struct iovec iov;
+    uint64_t	off;
+    uint64_t	len;
+    uint64_t	i;
+    ssize_t	n;
+    int		err;
+#ifdef HAVE_SPLICE
+    loff_t	foff;
+#endif
+
+    for (i = 0; i < cnt; i++)
+    {
+	off = run[i].offset;
+	len = run[i].length;
+#ifdef HAVE_SPLICE
+	foff = off;
+
+	/* Nothing may overtake a backlog, which then takes the rest */
+	while (len > 0 && ch->type == XAMBIT_CH_FIFO &&
+	       ch->tx_pend_len == ch->tx_pend_head)
+	{
+	    n = splice(fd, &foff, ch->fd, NULL,
+		       len > XAMBIT_SPLICE_MAX ? XAMBIT_SPLICE_MAX : len,
+		       SPLICE_F_MOVE | SPLICE_F_MORE);
+	    if (n < 0)
+	    {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EINVAL || errno == ENOSYS || errno == EAGAIN)
+		    break;
+		return XAMBIT_ERR_STD;
+	    }
+	    if (n == 0)
+		break;
+	    CH_STAT_ADD(ch, write_calls, 1);
+	    len -= n;
+	}
+	off = foff;
+#endif
+
+	/* The rest goes straight from the mapping while the channel takes
+	 * it, then is held */
+	while (len > 0 && (ch->flags & XAMBIT_NONBLOCK) &&
+	       ch->tx_pend_len == ch->tx_pend_head)
+	{
+	    iov.iov_base = (uint8_t *)data + off;
+	    iov.iov_len = len;
+	    n = ch_sys_writev(ch, &iov, 1);
+	    if (n < 0)
+	    {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EAGAIN)
+		    break;
+		return XAMBIT_ERR_STD;
+	    }
+	    CH_STAT_ADD(ch, write_calls, 1);
+	    off += n;
+	    len -= n;
+	}
+	if (len > 0 && (ch->flags & XAMBIT_NONBLOCK))
+	    return ch_file_hold(ch, fd, off, len, run + i + 1, cnt - i - 1);
+
+	if (len == 0)
+	    continue;
+
+	iov.iov_base = (uint8_t *)data + off;
+	iov.iov_len = len;
+	err = ch_writev_all(ch, &iov, 1);
+	if (err < 0)
+	    return err;
+    }
+
+    return 0;
+}
+
+/* Find the runs of data in the file open on fd, of size bytes, and return
+ * them in *map, for the caller to free, with sh filled in. Returns 1, or 0 if
+ * the file has too little in holes or too many runs to be worth sending as
+ * sparse, or the file system cannot say where its holes are. */
+static int ch_sparse_map(int fd, uint64_t size, sp_hdr_t *sh,
+			 sp_run_t **map, uint64_t *held)
+{
+    sp_run_t	*run = NULL;
+    sp_run_t	*grow;
+    uint64_t	runs = 0;
+    uint64_t	alloc = 0;
+    off_t	data;
+    off_t	hole = 0;
+
+    *map = NULL;
+    *held = 0;
+#ifdef SEEK_DATA
+    while ((uint64_t)hole < size)
+    {
+	data = lseek(fd, hole, SEEK_DATA);
+	if (data < 0 && errno == ENXIO) /* Only a hole is left */
+	    break;
+	if (data < 0 || (uint64_t)data >= size)
+	    goto none;
+	hole = lseek(fd, data, SEEK_HOLE);
+	if (hole < 0 || runs == XAMBIT_SPARSE_RUNS)
+	    goto none;
+	if ((uint64_t)hole > size)
+	    hole = size;
+
+	if (runs == alloc)
+	{
+	    alloc = alloc ? alloc * 2 : 64;
+	    grow = realloc(run, alloc * sizeof(*run));
+	    if (grow == NULL)
+	    {
+		free(run);
+		errno = ENOMEM;
+		return XAMBIT_ERR_STD;
+	    }
+	    run = grow;
+	}
+	run[runs].offset = data;
+	run[runs].length = hole - data;
+	*held += hole - data;
+	runs++;
+    }
+
+    if (size - *held >= XAMBIT_SPARSE_MIN)
+    {
+	sh->size = size;
+	sh->runs = runs;
+	*map = run;
+	return 1;
+    }
+none:
+#endif
+    free(run);
+    return 0;
+}
+
+/* Send the checked file open on fd, mapped at data, as extents, from the
+ * first the journal says may not have arrived. Each extent carries its own
+ * data checksum. Called with the send lock held. */
+static int ch_send_extents(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			   const char *path, const struct stat *st, int fd,
+			   void *data)
+{
+    xambit_parcel_hdr_t	h;
+    struct iovec	iov[2];
+    ex_hdr_t		eh;
+    sp_run_t		run;
+    uint64_t		first;
+    uint64_t		count;
+    uint64_t		off;
+    uint64_t		n;
+    uint64_t		i;
+    int			jfd;
+    int			err = 0;
+
+    jfd = jn_send_open(ch, path, st, eh.id, &first);
+    if (jfd < 0)
+	return jfd;
+
+    /* Carrying on where this channel stopped, nothing need go again */
+    if (ch->journal->held_next > 0 &&
+	memcmp(ch->journal->held_id, eh.id, sizeof(eh.id)) == 0)
+	first = ch->journal->held_next;
+    else
+	CH_STAT_ADD(ch, extents_skipped, first);
+    ch->journal->held_next = 0;
+
+    eh.size = st->st_size;
+    eh.extent = ch->journal->extent;
+    count = (eh.size - 1) / eh.extent + 1;
+    for (i = first; i < count; i++)
+    {
+	off = i * eh.extent;
+	n = eh.size - off < eh.extent ? eh.size - off : eh.extent;
+	eh.index = i;
+
+	h = *hdr;
+	h.flags |= XAMBIT_EXTENT | XAMBIT_DATA_CSUM;
+	h.length = sizeof(eh) + n;
+	h.data_checksum = crc32c(crc32c(0, &eh, sizeof(eh)),
+				 (uint8_t *)data + off, n);
+	prepare_parcel(ch, &h);
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = &eh;
+	iov[1].iov_len = sizeof(eh);
+	err = ch_writev_all(ch, iov, 2);
+	run.offset = off;
+	run.length = n;
+	if (err == 0)
+	    err = ch_splice_file(ch, fd, data, &run, 1);
+	if (err < 0)
+	{
+	    /* The note is kept, for the file to be resumed */
+	    close(jfd);
+	    return err;
+	}
+	jn_send_mark(jfd, i + 1);
+	CH_STAT_ADD(ch, extents, 1);
+
+	/* A non-blocking channel takes no more than this extent behind a
+	 * backlog; calling again resumes from the next one */
+	if (i + 1 < count && (ch->tx_file != NULL ||
+			      ch->tx_pend_len > ch->tx_pend_head))
+	{
+	    memcpy(ch->journal->held_id, eh.id, sizeof(eh.id));
+	    ch->journal->held_next = i + 1;
+	    close(jfd);
+	    errno = EAGAIN;
+	    return XAMBIT_ERR_STD;
+	}
+    }
+
+    jn_send_done(ch, eh.id, jfd);
+    return 0;
+}
+
+int channel_send_file(xambit_channel_t *ch, const char *path, uint32_t tid)
+{
+    int			err;
+    int			fd;
+    void		*data;
+    xambit_parcel_hdr_t	hdr;
+    struct stat		file;
+    struct iovec	iov[3];
+    dd_ref_t		ref;
+    dl_state_t		dl;
+    sp_hdr_t		sh;
+    sp_run_t		*map = NULL;
+    sp_run_t		run;
+    uint64_t		size;
+    uint64_t		sent;
+    uint64_t		held = 0;
+    uint64_t		i;
+    uint32_t		crc;
+    int			hit = 0;
+    int			delta = 0;
+    int			sparse = 0;
+    int			extents;
+
+    if (ch == NULL || !ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    memset(&dl, 0, sizeof(dl));
+    err = open(path, O_RDONLY);
+    if (err < 0)
+	goto out;
+
+    fd = err;
+
+    err = fstat(fd, &file);
+    if (err < 0)
+	goto error;
+
+    size = file.st_size;
+    if (size > SIZE_MAX)
+    {
+	err = XAMBIT_ERR_STD;
+	errno = EFBIG;
+	goto error;
+    }
+
+    hdr.length = size;
+    hdr.type = tid;
+    hdr.flags = XAMBIT_BLOCK;
+    hdr.version = XAMBIT_HDR_VERSION;
+
+    /* A file the reader has been sent before crosses as its digest, and any
+     * other is marked for the reader to keep */
+    if (ch->dedup != NULL && size >= XAMBIT_DEDUP_MIN)
+    {
+	hit = dd_lookup(ch, fd, size, &ref);
+	if (hit < 0)
+	{
+	    err = hit;
+	    goto error;
+	}
+	if (!hit)
+	    hdr.flags |= XAMBIT_KEEP;
+
+	/* ... and one changed since it was last sent from path as what
+	 * changed */
+	if (ch->flags & XAMBIT_DIFF)
+	{
+	    delta = dl_encode(ch, path, fd, &ref, hit, &dl);
+	    if (delta < 0)
+	    {
+		err = delta;
+		goto error;
+	    }
+	}
+    }
+
+    /* A file with holes enough in it crosses as its runs of data, after a
+     * map of them. The blocks it has allocated are only a hint. */
+    if ((ch->flags & XAMBIT_SPARSE) && !hit && !delta &&
+	(uint64_t)file.st_blocks * 512 + XAMBIT_SPARSE_MIN <= size)
+    {
+	sparse = ch_sparse_map(fd, size, &sh, &map, &held);
+	if (sparse < 0)
+	{
+	    err = sparse;
+	    goto error;
+	}
+    }
+
+    /* A file too large to want to send again from the start goes as
+     * extents, which a later send resumes */
+    extents = ch->journal != NULL && !hit && !delta && !sparse &&
+	      size > ch->journal->extent;
+
+    /* A large file crosses a socket as a sealed copy passed by descriptor,
+     * and is validated as that copy. Without memfds it is sent inline. */
+    if (ch->type == XAMBIT_CH_SOCK && (ch->flags & XAMBIT_FDPASS) &&
+	size >= XAMBIT_FDPASS_MIN && !hit && !delta && !sparse && !extents)
+    {
+	err = sock_memfd(fd, size);
+	if (err >= 0)
+	{
+	    close(fd);
+	    fd = err;
+	    hdr.flags |= XAMBIT_FD;
+	}
+    }
+
+    /* The validator still needs to see the data, but only through the page
+     * cache; nothing is copied into this process */
+    data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    if (data == MAP_FAILED)
+    {
+	err = XAMBIT_ERR_STD;
+	goto error;
+    }
+
+    err = check_parcel(ch, &hdr, data);
+    if (err < 0)
+	goto unmap;
+
+    /* The writer's validator has still seen the whole file */
+    if (hit)
+    {
+	hdr.flags |= XAMBIT_REF;
+	hdr.length = sizeof(ref);
+	if (hdr.flags & XAMBIT_DATA_CSUM)
+	    hdr.data_checksum = crc32c(0, &ref, sizeof(ref));
+	prepare_parcel(ch, &hdr);
+    }
+    else if (delta)
+    {
+	hdr.flags |= XAMBIT_DELTA;
+	hdr.length = dl.delta_len;
+	if (hdr.flags & XAMBIT_DATA_CSUM)
+	    hdr.data_checksum = crc32c(0, dl.delta, dl.delta_len);
+	prepare_parcel(ch, &hdr);
+    }
+    else if (sparse)
+    {
+	hdr.flags |= XAMBIT_HOLES;
+	hdr.length = sizeof(sh) + sh.runs * sizeof(*map) + held;
+	if (hdr.flags & XAMBIT_DATA_CSUM)
+	{
+	    crc = crc32c(0, &sh, sizeof(sh));
+	    crc = crc32c(crc, map, sh.runs * sizeof(*map));
+	    for (i = 0; i < sh.runs; i++)
+		crc = crc32c(crc, (uint8_t *)data + map[i].offset,
+			     map[i].length);
+	    hdr.data_checksum = crc;
+	}
+	prepare_parcel(ch, &hdr);
+    }
+    else
+    {
+	ch_csum_data(ch, &hdr, data);
+    }
+
+    /* Anything queued on a buffered channel goes first */
+    ch_lock(ch);
+    err = ch_flush(ch);
+    if (err == 0)
+	err = ch_tx_ready(ch);
+    if (err < 0)
+	goto unlock;
+
+    if (hit)
+    {
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = &ref;
+	iov[1].iov_len = sizeof(ref);
+	err = ch_writev_all(ch, iov, 2);
+	if (err < 0)
+	    goto unlock;
+	CH_STAT_ADD(ch, dedup_refs, 1);
+	CH_STAT_ADD(ch, dedup_saved, size - sizeof(ref));
+    }
+    else if (delta)
+    {
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = dl.delta;
+	iov[1].iov_len = dl.delta_len;
+	err = ch_writev_all(ch, iov, 2);
+	if (err < 0)
+	    goto unlock;
+	CH_STAT_ADD(ch, dedup_deltas, 1);
+	CH_STAT_ADD(ch, dedup_saved, size - dl.delta_len);
+    }
+    else if (sparse)
+    {
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = &sh;
+	iov[1].iov_len = sizeof(sh);
+	iov[2].iov_base = map;
+	iov[2].iov_len = sh.runs * sizeof(*map);
+	err = ch_writev_all(ch, iov, sh.runs ? 3 : 2);
+	if (err == 0)
+	    err = ch_splice_file(ch, fd, data, map, sh.runs);
+	if (err < 0)
+	    goto unlock;
+	CH_STAT_ADD(ch, sparse_files, 1);
+	CH_STAT_ADD(ch, sparse_saved, size - held);
+    }
+    else if (extents)
+    {
+	err = ch_send_extents(ch, &hdr, path, &file, fd, data);
+	if (err < 0)
+	    goto unlock;
+    }
+    else if (hdr.flags & XAMBIT_FD)
+    {
+	err = sock_send_fd(ch, &hdr, fd);
+	if (err < 0)
+	    goto unlock;
+    }
+    else
+    {
+	/* A ring takes the header and as much of the file as the FIFO will,
+	 * in one submission */
+	sent = 0;
+	if (ch->uring != NULL)
+	    err = uring_send_file(ch, &hdr, fd, size, &sent);
+	else
+	    err = ch_write_all(ch, &hdr, sizeof(hdr));
+	if (err < 0)
+	    goto unlock;
+
+	run.offset = sent;
+	run.length = size - sent;
+	err = ch_splice_file(ch, fd, data, &run, 1);
+	if (err < 0)
+	    goto unlock;
+    }
+
+    CH_STAT_ADD(ch, parcels_sent, 1);
+    CH_STAT_ADD(ch, bytes_sent, size);
+    if (hdr.flags & XAMBIT_KEEP)
+	dd_insert(ch, &ref);
+    dl_save(ch, &dl, &ref);
+
+unlock:
+    ch_unlock(ch);
+unmap:
+    if (size)
+	munmap(data, size);
+error:
+    dl_free(&dl);
+    free(map);
+    close(fd);
+out:
+    return err;
+}
+
+/*  Function Name:	channel_send_gift
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To send a buffer whose pages are handed to the kernel
+ *			rather than copied.
+ *
+ *  Assumptions:	buf is page aligned memory from mmap(). The caller gives
+ *			up the pages: after this returns they must not be
+ *			written again, only unmapped.
+ *
+ *  Notes:		Uses vmsplice() with SPLICE_F_GIFT. Where that is not
+ *			available the buffer is written as by channel_send.
+ *
+ *  Return Value:	As channel_send.
+ */
+int channel_send_gift(xambit_channel_t *ch, void *buf, size_t size,
+		      uint32_t tid)
+{
+    xambit_parcel_hdr_t	hdr;
+    struct iovec	iov;
+    int			err;
+
+    if (ch == NULL || !ch_type_ok(ch) ||
+	((uintptr_t)buf & (sysconf(_SC_PAGESIZE) - 1)))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    hdr.length = size;
+    hdr.type = tid;
+    hdr.flags = XAMBIT_BLOCK;
+    hdr.version = XAMBIT_HDR_VERSION;
+
+    err = check_parcel(ch, &hdr, buf);
+    if (err < 0)
+	return err;
+    ch_csum_data(ch, &hdr, buf);
+
+    ch_lock(ch);
+    err = ch_flush(ch);
+    if (err == 0)
+	err = ch_tx_ready(ch);
+    if (err < 0)
+	goto out;
+
+    err = ch_write_all(ch, &hdr, sizeof(hdr));
+    if (err < 0)
+	goto out;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+#ifdef HAVE_VMSPLICE
+    while (iov.iov_len > 0 && ch->type == XAMBIT_CH_FIFO &&
+	   ch->tx_pend_len == ch->tx_pend_head)
+    {
+	ssize_t n = vmsplice(ch->fd, &iov, 1, SPLICE_F_GIFT);
+
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EINVAL || errno == ENOSYS || errno == EAGAIN)
+		break;
+	    err = XAMBIT_ERR_STD;
+	    goto out;
+	}
+	CH_STAT_ADD(ch, write_calls, 1);
+	iov.iov_base = (uint8_t *)iov.iov_base + n;
+	iov.iov_len -= n;
+    }
+#endif
+    if (iov.iov_len > 0)
+    {
+	err = ch_writev_all(ch, &iov, 1);
+	if (err < 0)
+	    goto out;
+    }
+
+    CH_STAT_ADD(ch, parcels_sent, 1);
+    CH_STAT_ADD(ch, bytes_sent, size);
+
+out:
+    ch_unlock(ch);
+    return err;
+}
+
+int channel_send(xambit_channel_t *ch, void *buf, size_t size, uint32_t tid)
+{
+    xambit_parcel_hdr_t	hdr;
+    int			err;
+
+    hdr.length = size;
+    hdr.type = tid;
+    hdr.flags = XAMBIT_BLOCK;
+    hdr.version = XAMBIT_HDR_VERSION;
+
+    err = channel_send_buf(ch, &hdr, buf);
+
+    return err;
+}
+
+/*  Function Name:	channel_send_batch
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To send an array of buffers, each as its own parcel.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Every parcel is checksummed and validated before any of
+ *			its group is written. Parcels that fail are skipped and
+ *			their err field says why; the rest are coalesced into
+ *			writev() calls of up to XAMBIT_BATCH_MAX parcels, or
+ *			queued when the channel is buffered.
+ *
+ *  Return Value:	The number of parcels sent, or a negetive value if
+ *			writing failed. After a write failure, parcels from the
+ *			failing group onwards are marked with the error and may
+ *			or may not have been sent.
+ */
+int channel_send_batch(xambit_channel_t *ch, xambit_send_vec_t *vec, int count)
+{
+    xambit_parcel_hdr_t	hdr[XAMBIT_BATCH_MAX];
+    struct iovec	iov[2 * XAMBIT_BATCH_MAX];
+    int			idx[XAMBIT_BATCH_MAX];
+    void		*zbuf[XAMBIT_BATCH_MAX];
+    void		*data[XAMBIT_BATCH_MAX];
+    uint64_t		len;
+    uint64_t		bytes;
+    int			sent = 0;
+    int			base;
+    int			atomic;
+    int			n;
+    int			i;
+    int			err;
+
+    if (ch == NULL || vec == NULL || count < 0 || !ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    for (base = 0; base < count; base += XAMBIT_BATCH_MAX)
+    {
+	n = 0;
+	for (i = base; i < count && i < base + XAMBIT_BATCH_MAX; i++)
+	{
+	    xambit_parcel_hdr_t *h = &hdr[n];
+
+	    h->length = vec[i].size;
+	    h->type = vec[i].tid;
+	    h->flags = XAMBIT_BLOCK;
+	    h->version = XAMBIT_HDR_VERSION;
+
+	    vec[i].err = check_parcel(ch, h, vec[i].buf);
+	    if (vec[i].err == 0)
+	    {
+		zbuf[n] = zl_deflate(ch, h, vec[i].buf);
+		data[n] = zbuf[n] != NULL ? zbuf[n] : vec[i].buf;
+		idx[n++] = i;
+	    }
+	}
+
+	/* A group small enough for one atomic write need not queue */
+	len = 0;
+	for (i = 0; i < n; i++)
+	    len += sizeof(xambit_parcel_hdr_t) + hdr[i].length;
+	atomic = ch_lock_send(ch, len);
+
+	err = ch_tx_ready(ch);
+	if (err < 0)
+	{
+	    /* Nothing of this group has gone */
+	    ch_unlock_send(ch, atomic);
+	    for (i = 0; i < n; i++)
+		free(zbuf[i]);
+	    for (i = base; i < count; i++)
+		vec[i].err = err;
+	    return sent > 0 && errno == EAGAIN ? sent : err;
+	}
+
+	if (ch->sbuf != NULL)
+	{
+	    for (i = 0; i < n && err == 0; i++)
+		err = ch_queue_parcel(ch, &hdr[i], data[i]);
+	}
+	else
+	{
+	    for (i = 0; i < n; i++)
+	    {
+		ch_csum_data(ch, &hdr[i], data[i]);
+		iov[2 * i].iov_base = &hdr[i];
+		iov[2 * i].iov_len = sizeof(xambit_parcel_hdr_t);
+		iov[2 * i + 1].iov_base = data[i];
+		iov[2 * i + 1].iov_len = hdr[i].length;
+	    }
+	    err = ch_writev_all(ch, iov, 2 * n);
+	}
+	ch_unlock_send(ch, atomic);
+	for (i = 0; i < n; i++)
+	    free(zbuf[i]);
+	if (err < 0)
+	{
+	    for (i = base; i < count; i++)
+		vec[i].err = err;
+	    return err;
+	}
+
+	/* As given, not as deflated */
+	bytes = 0;
+	for (i = 0; i < n; i++)
+	    bytes += vec[idx[i]].size;
+	CH_STAT_ADD(ch, bytes_sent, bytes);
+	CH_STAT_ADD(ch, parcels_sent, n);
+	sent += n;
+    }
+
+    return sent;
+}
+
+/*  Function Name:	channel_set_flush_policy
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To make a writer channel buffered, or to change when an
+ *			already buffered channel flushes.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Queued parcels are flushed once bytes are waiting, or
+ *			once the oldest has waited usec microseconds (0 for no
+ *			time limit). The age is only checked when a parcel is
+ *			sent; an idle writer must call channel_flush. Passing 0
+ *			bytes flushes and returns the channel to unbuffered.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_flush_policy(xambit_channel_t *ch, size_t bytes, uint32_t usec)
+{
+    uint8_t	*nbuf;
+    size_t	size;
+    int		err;
+
+    if (ch == NULL || ch->direction != XAMBIT_CHOUT)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    ch_lock(ch);
+    err = ch_flush(ch);
+    if (err < 0)
+	goto out;
+
+    if (bytes == 0)
+    {
+	free(ch->sbuf);
+	ch->sbuf = NULL;
+	ch->sbuf_size = 0;
+	ch->flags &= ~XAMBIT_BUFFERED;
+	goto out;
+    }
+
+    size = bytes > XAMBIT_SEND_BUF_LEN ? bytes : XAMBIT_SEND_BUF_LEN;
+    if (size != ch->sbuf_size)
+    {
+	nbuf = realloc(ch->sbuf, size);
+	if (nbuf == NULL)
+	{
+	    errno = ENOMEM;
+	    err = XAMBIT_ERR_STD;
+	    goto out;
+	}
+	ch->sbuf = nbuf;
+	ch->sbuf_size = size;
+    }
+
+    ch->flush_bytes = bytes;
+    ch->flush_usec = usec;
+    ch->flags |= XAMBIT_BUFFERED;
+
+out:
+    ch_unlock(ch);
+    return err;
+}
+
+/*  Function Name:	channel_flush
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To write out every parcel queued on a buffered channel.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		A no-op on unbuffered channels. Queued data is dropped
+ *			if the write fails, since the stream position of a
+ *			partial write is unknown to the receiver anyway. On a
+ *			non-blocking channel EAGAIN means part of the backlog
+ *			is still to be written.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_flush(xambit_channel_t *ch)
+{
+    int		err;
+
+    if (ch == NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    ch_lock(ch);
+    err = ch_flush(ch);
+    if (err == 0)
+	err = ch_tx_ready(ch);
+    ch_unlock(ch);
+    return err;
+}
+
+/* channel_flush for a caller that already has the channel to itself */
+static int ch_flush(xambit_channel_t *ch)
+{
+    struct iovec iov;
+    int		err;
+
+    if (ch->sbuf_len == 0)
+	return 0;
+
+    iov.iov_base = ch->sbuf;
+    iov.iov_len = ch->sbuf_len;
+    err = ch_writev_all(ch, &iov, 1);
+    ch->sbuf_len = 0;
+    CH_STAT_ADD(ch, flushes, 1);
+
+    return err;
+}
+
+int channel_get_stats(xambit_channel_t *ch, xambit_stats_t *stats)
+{
+    if (ch == NULL || stats == NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    *stats = ch->stats;
+    if (ch->pipeline != NULL)
+	pl_get_stats(ch, stats);
+    return 0;
+}
+
+/*  Function Name:	channel_get_fd
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To get the descriptor of a channel, for poll() or epoll.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Readable means a receive may make progress, writable
+ *			that a send or flush may. The descriptor still belongs
+ *			to the channel and must not be read, written or closed.
+ *
+ *  Return Value:	The descriptor, or -1 with errno set if the channel has
+ *			none.
+ */
+int channel_get_fd(xambit_channel_t *ch)
+{
+    if (ch == NULL || ch->type == XAMBIT_CH_SHM)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    return ch->fd;
+}
+
+int fd_write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t	n;
+
+    while (len > 0)
+    {
+	n = write(fd, buf, len);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return XAMBIT_ERR_STD;
+	}
+	buf = (const uint8_t *)buf + n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* Move len payload bytes from the channel to fd, or discard them when fd is
+ * negetive. Buffered bytes go first, then the rest is spliced from the FIFO
+ * into the file, or copied through a buffer of at most ch->chunk_size bytes.
+ * Whatever happens to fd, all len bytes are consumed so the stream stays in
+ * step; the first error seen is returned. */
+static int rx_to_fd(xambit_channel_t *ch, int fd, uint64_t len)
+{
+    uint8_t	*chunk = NULL;
+    size_t	csize;
+    uint64_t	take;
+    ssize_t	n;
+    void	*src;
+    int		err = 0;
+
+    src = ch->type == XAMBIT_CH_SOCK ? sock_att_take(ch, len) : NULL;
+    if (src != NULL)
+	return fd >= 0 ? fd_write_all(fd, src, len) : 0;
+
+    take = ch->rbuf_tail - ch->rbuf_head;
+    if (take > len)
+	take = len;
+    if (fd >= 0)
+	err = fd_write_all(fd, ch->rbuf + ch->rbuf_head, take);
+    ch->rbuf_head += take;
+    len -= take;
+
+#ifdef HAVE_SPLICE
+    /* Not past data a ring has already read ahead */
+    while (len > 0 && fd >= 0 && err == 0 && ch->type == XAMBIT_CH_FIFO &&
+	   ch->uring == NULL)
+    {
+	n = splice(ch->fd, NULL, fd, NULL,
+		   len > ch->chunk_size ? ch->chunk_size : len,
+		   SPLICE_F_MOVE);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EINVAL && errno != ENOSYS)
+		return XAMBIT_ERR_STD; /* Warning: send/receive sync error possible */
+	    break;
+	}
+	if (n == 0)
+	{ /* Warning: send/receive sync error possible */
+	    errno = EINVAL;
+	    return XAMBIT_ERR_STD;
+	}
+	ch->stats.read_calls++;
+	len -= n;
+    }
+#endif
+
+    if (len == 0)
+	return err;
+
+    /* A ring is written out from where the data lies, and a socket through
+     * the read-ahead buffer, which can always take a whole message */
+    while (len > 0 && ch->type != XAMBIT_CH_FIFO)
+    {
+	take = len > ch->chunk_size ? ch->chunk_size : len;
+	if (take > ch->rbuf_size)
+	    take = ch->rbuf_size;
+	n = rx_fill(ch, take);
+	if (n < 0)
+	    return n; /* Warning: send/receive sync error possible */
+	if (fd >= 0 && err == 0)
+	    err = fd_write_all(fd, ch->rbuf + ch->rbuf_head, take);
+	ch->rbuf_head += take;
+	len -= take;
+    }
+
+    if (len == 0)
+	return err;
+
+    csize = len > ch->chunk_size ? ch->chunk_size : len;
+    chunk = malloc(csize);
+    if (chunk == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    ch->stats.allocs++;
+
+    while (len > 0)
+    {
+	n = ch_sys_read(ch, chunk, len > csize ? csize : len);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    err = XAMBIT_ERR_STD;
+	    break;
+	}
+	if (n == 0)
+	{ /* Warning: send/receive sync error possible */
+	    errno = EINVAL;
+	    err = XAMBIT_ERR_STD;
+	    break;
+	}
+	if (fd >= 0 && err == 0)
+	    err = fd_write_all(fd, chunk, n);
+	len -= n;
+    }
+
+    free(chunk);
+    return err;
+}
+
+/* rx_to_fd() for a non-blocking channel, which stops when nothing more has
+ * arrived. *left is the number of bytes still to come, and is brought down
+ * by those moved. Returns 0 once it reaches 0, otherwise a negetive value
+ * with errno set to EAGAIN or the read error. If a write to fd fails, its
+ * errno goes in *werr, where that is not NULL, and the rest of the bytes are
+ * passed over. */
+static int rx_to_fd_some(xambit_channel_t *ch, int fd, uint64_t *left,
+			 int *werr)
+{
+    uint64_t	take;
+    ssize_t	n;
+
+    if (werr != NULL && *werr != 0)
+	fd = -1;
+
+    while (*left > 0)
+    {
+	take = ch->rbuf_tail - ch->rbuf_head;
+	if (take > 0)
+	{
+	    if (take > *left)
+		take = *left;
+	    if (fd >= 0 && fd_write_all(fd, ch->rbuf + ch->rbuf_head, take) < 0)
+	    {
+		if (werr != NULL)
+		    *werr = errno;
+		fd = -1;
+	    }
+	    ch->rbuf_head += take;
+	    *left -= take;
+	    continue;
+	}
+
+#ifdef HAVE_SPLICE
+	if (fd >= 0 && ch->type == XAMBIT_CH_FIFO)
+	{
+	    n = splice(ch->fd, NULL, fd, NULL,
+		       *left > ch->chunk_size ? ch->chunk_size : *left,
+		       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    if (n > 0)
+	    {
+		ch->stats.read_calls++;
+		*left -= n;
+		continue;
+	    }
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0 && errno != EINVAL && errno != ENOSYS)
+		return XAMBIT_ERR_STD;
+	    if (n == 0)
+	    { /* Warning: send/receive sync error possible */
+		errno = EINVAL;
+		return XAMBIT_ERR_STD;
+	    }
+	}
+#endif
+
+	/* Otherwise through the read-ahead buffer */
+	n = rx_fill(ch, 1);
+	if (n < 0)
+	    return n;
+    }
+
+    return 0;
+}
+
+/* Pass over the len payload bytes of a parcel that cannot be taken, so that
+ * the next parcel can be; errno is left as the failure set it */
+static void rx_skip(xambit_channel_t *ch, uint64_t len)
+{
+    int		err = errno;
+
+    rx_to_fd(ch, -1, len);
+    ch->stats.parcels_dropped++;
+    errno = err;
+}
+
+/* Make a name in tmp, of PATH_MAX bytes, for a temporary file next to path */
+int rx_temp_name(const char *path, char *tmp)
+{
+    static unsigned int seq;
+
+    if (snprintf(tmp, PATH_MAX, "%s.xambit-%d-%u", path, (int)getpid(),
+		 __sync_fetch_and_add(&seq, 1)) >= PATH_MAX)
+    {
+	errno = ENAMETOOLONG;
+	return XAMBIT_ERR_STD;
+    }
+    return 0;
+}
+
+/* Open a temporary file next to path to receive into */
+int rx_open_temp(const char *path, mode_t omode, char *tmp)
+{
+    int		fd;
+    int		i;
+
+    for (i = 0; i < 100; i++)
+    {
+	if (rx_temp_name(path, tmp) < 0)
+	    return XAMBIT_ERR_STD;
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, omode);
+	if (fd >= 0 || errno != EEXIST)
+	    return fd;
+    }
+
+    return XAMBIT_ERR_STD;
+}
+
+/* The process's umask, read without changing it where the kernel shows it,
+ * since umask() can only be read by setting it */
+static mode_t rx_umask(void)
+{
+    char	line[64];
+    FILE	*f;
+    mode_t	mask = (mode_t)-1;
+
+    f = fopen("/proc/self/status", "re");
+    if (f != NULL)
+    {
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+	    if (strncmp(line, "Umask:", 6) == 0)
+	    {
+		mask = (mode_t)strtoul(line + 6, NULL, 8);
+		break;
+	    }
+	}
+	fclose(f);
+    }
+
+    if (mask == (mode_t)-1)
+    {
+	mask = umask(022);
+	umask(mask);
+    }
+    return mask & 0777;
+}
+
+/* Copy the whole of tfd to fd through a chunk sized buffer, since the kernel
+ * copy helpers refuse O_APPEND targets */
+static int rx_copy_out(xambit_channel_t *ch, int tfd, int fd)
+{
+    uint8_t	*chunk;
+    off_t	off = 0;
+    ssize_t	n;
+    int		err = 0;
+
+    chunk = malloc(ch->chunk_size);
+    if (chunk == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+
+    while (1)
+    {
+	n = pread(tfd, chunk, ch->chunk_size, off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	{
+	    err = n < 0 ? XAMBIT_ERR_STD : 0;
+	    break;
+	}
+	err = fd_write_all(fd, chunk, n);
+	if (err < 0)
+	    break;
+	off += n;
+    }
+
+    free(chunk);
+    return err;
+}
+
+/* Put a validated temporary file in place as path, honouring the open flags
+ * the caller asked for. A file appended to, or reached through a symbolic link
+ * or another hard link, is written in place so that it stays the same file;
+ * otherwise the temporary file takes the mode and owner of any file it
+ * replaces and is renamed over it. */
+int rx_install(xambit_channel_t *ch, const char *tmp, int tfd,
+		      const char *path, int oflags, mode_t omode)
+{
+    struct stat	st;
+    int		fd;
+    int		err = 0;
+    int		exists;
+
+    exists = lstat(path, &st) == 0;
+    if ((oflags & O_APPEND) ||
+	(exists && !(oflags & O_EXCL) &&
+	 (S_ISLNK(st.st_mode) || st.st_nlink > 1)))
+    {
+	fd = open(path, oflags, omode);
+	if (fd < 0)
+	{
+	    unlink(tmp);
+	    return XAMBIT_ERR_STD;
+	}
+
+	err = rx_copy_out(ch, tfd, fd);
+	close(fd);
+	unlink(tmp);
+	return err;
+    }
+
+    if (oflags & O_EXCL)
+    {
+	if (link(tmp, path) < 0)
+	    err = XAMBIT_ERR_STD;
+	unlink(tmp);
+	return err;
+    }
+
+    if (!exists && !(oflags & O_CREAT))
+    {
+	unlink(tmp);
+	return XAMBIT_ERR_STD;
+    }
+
+    /* An owner the caller may not give away is left as it is */
+    if (exists)
+    {
+	if (fchown(tfd, st.st_uid, st.st_gid) < 0 && errno != EPERM)
+	{
+	    unlink(tmp);
+	    return XAMBIT_ERR_STD;
+	}
+	if (fchmod(tfd, st.st_mode & 07777) < 0)
+	{
+	    unlink(tmp);
+	    return XAMBIT_ERR_STD;
+	}
+    }
+
+    if (rename(tmp, path) < 0)
+    {
+	unlink(tmp);
+	return XAMBIT_ERR_STD;
+    }
+
+    return 0;
+}
+
+/*  Function Name:	channel_receive_to_file
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To receive a parcel straight into a file.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		The payload is streamed into a temporary file beside
+ *			path, spliced from the FIFO where possible and otherwise
+ *			copied in chunks of at most ch->chunk_size bytes. Only
+ *			once it passes validation is it put in place (see
+ *			rx_install), so path never holds unvalidated data. The
+ *			validator reads the file through a shared mapping, so
+ *			the parcel is never copied into anonymous memory, but
+ *			its pages are resident while they are checked. A
+ *			non-blocking channel writes a plain parcel to the file
+ *			as it arrives, over as many calls as that takes (see
+ *			rx_file_more).
+ *
+ *  Return Value:	0 on success, or a negetive value on failure.
+ */
+int channel_receive_to_file(xambit_channel_t *ch, const char *path,
+			      int oflags, mode_t omode)
+{
+    char		tmp[PATH_MAX];
+    xambit_parcel_hdr_t	hdr;
+    xambit_rx_file_t	*rf;
+    int			fd;
+    int			err;
+
+    if (ch == NULL || path == NULL || !ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* The reader thread owns the channel */
+    if (ch->pipeline != NULL)
+    {
+	errno = EBUSY;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* A non-blocking reader carries on with the file it has started */
+    if (ch->rx_file != NULL)
+	return rx_file_more(ch, path, oflags, omode);
+
+again:
+    err = rx_ready_hdr(ch);
+    if (err < 0)
+	return err;
+
+    /* ... and does not gather a plain parcel in memory first */
+    memcpy(&hdr, ch->rbuf + ch->rbuf_head, sizeof(hdr));
+    if (!(ch->flags & XAMBIT_NONBLOCK) || !rx_hdr_ok(&hdr) ||
+	(hdr.flags & (XAMBIT_FD | XAMBIT_EXTENT | XAMBIT_HOLES |
+		      XAMBIT_STREAM | XAMBIT_ZLIB | XAMBIT_REF |
+		      XAMBIT_DELTA)))
+    {
+	err = rx_ready_data(ch);
+	if (err < 0)
+	    return err;
+    }
+
+    err = rx_parse_hdr(ch, &hdr);
+    if (err < 0)
+	return err;
+
+    /* An extent that leaves its file unfinished is journaled, and the next
+     * parcel read in its place */
+    if (hdr.flags & XAMBIT_EXTENT)
+    {
+	err = rx_extent_to_file(ch, &hdr, path, oflags, omode);
+	if (err == 1)
+	    goto again;
+	return err;
+    }
+    if (hdr.flags & XAMBIT_HOLES)
+	return rx_sparse_to_file(ch, &hdr, path, oflags, omode);
+    if (hdr.flags & XAMBIT_STREAM)
+	return rx_stream_to_file(ch, &hdr, path, oflags, omode);
+    if (hdr.flags & XAMBIT_ZLIB)
+	return rx_zlib_to_file(ch, &hdr, path, oflags, omode);
+    if (hdr.flags & XAMBIT_REF)
+	return rx_ref_to_file(ch, &hdr, path, oflags, omode);
+    if (hdr.flags & XAMBIT_DELTA)
+	return rx_delta_to_file(ch, &hdr, path, oflags, omode);
+
+    if (ch->flags & XAMBIT_NONBLOCK)
+    {
+	rf = malloc(sizeof(*rf));
+	if (rf == NULL)
+	{
+	    errno = ENOMEM;
+	    fd = XAMBIT_ERR_STD;
+	}
+	else
+	{
+	    fd = rx_open_temp(path, omode, rf->tmp);
+	}
+	if (fd < 0)
+	{
+	    free(rf);
+	    ch->rx_discard = hdr.length;
+	    ch->stats.parcels_dropped++;
+	    return XAMBIT_ERR_STD;
+	}
+	rf->fd = fd;
+	rf->hdr = hdr;
+	rf->err = 0;
+	rf->left = hdr.length;
+	ch->rx_file = rf;
+	return rx_file_more(ch, path, oflags, omode);
+    }
+
+    fd = rx_open_temp(path, omode, tmp);
+    if (fd < 0)
+    {
+	rx_skip(ch, hdr.length);
+	return XAMBIT_ERR_STD;
+    }
+
+    err = rx_to_fd(ch, fd, hdr.length);
+    if (err < 0)
+    {
+	close(fd);
+	unlink(tmp);
+	return err;
+    }
+
+    return rx_file_done(ch, &hdr, fd, tmp, path, oflags, omode);
+}
+
+/* channel_receive_to_file() on a non-blocking channel for the rest of the
+ * plain parcel it has started to write to a file. Returns as that, or
+ * EAGAIN until the whole payload has arrived. */
+static int rx_file_more(xambit_channel_t *ch, const char *path, int oflags,
+			mode_t omode)
+{
+    xambit_rx_file_t	*rf = ch->rx_file;
+    int			fd;
+    int			err;
+
+    err = rx_to_fd_some(ch, rf->fd, &rf->left, &rf->err);
+    if (err < 0 && errno == EAGAIN)
+	return err;
+
+    /* Whatever went wrong, the rest of the parcel is passed over so that
+     * the next can be read */
+    ch->rx_file = NULL;
+    if (err == 0 && rf->err != 0)
+    {
+	errno = rf->err;
+	err = XAMBIT_ERR_STD;
+    }
+    if (err < 0)
+    {
+	ch->rx_discard = rf->left;
+	close(rf->fd);
+	unlink(rf->tmp);
+	free(rf);
+	return err;
+    }
+
+    fd = rf->fd;
+    err = rx_file_done(ch, &rf->hdr, fd, rf->tmp, path, oflags, omode);
+    free(rf);
+    return err;
+}
+
+/* Validate the payload of hdr, received into the temporary file tmp open on
+ * fd, and put it in place at path. fd is closed. */
+static int rx_file_done(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			int fd, const char *tmp, const char *path, int oflags,
+			mode_t omode)
+{
+    void	*data;
+    int		err;
+
+    /* The validator reads the file through the page cache */
+    data = hdr->length ? mmap(NULL, hdr->length, PROT_READ, MAP_SHARED, fd, 0)
+		       : "";
+    if (data == MAP_FAILED)
+    {
+	err = XAMBIT_ERR_STD;
+	goto error;
+    }
+    err = rx_validate(ch, hdr, data, NULL);
+
+    /* A copy that cannot be kept only costs the saving it would bring */
+    if (err == 0 && (hdr->flags & XAMBIT_KEEP) && ch->dedup != NULL)
+	dd_keep(ch, fd, data, hdr->length, NULL);
+    if (hdr->length)
+	munmap(data, hdr->length);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	goto error;
+    }
+
+    err = rx_install(ch, tmp, fd, path, oflags, omode);
+    close(fd);
+    return err;
+
+error:
+    close(fd);
+    unlink(tmp);
+    return err;
+}
+
+/* Drop a non-blocking channel's receive-to-file in progress */
+static void rx_file_free(xambit_channel_t *ch)
+{
+    if (ch->rx_file == NULL)
+	return;
+    close(ch->rx_file->fd);
+    unlink(ch->rx_file->tmp);
+    free(ch->rx_file);
+    ch->rx_file = NULL;
+}
+
+/* channel_receive_to_file() for a reference to a file kept before. The kept
+ * copy, once checked against the digest, is validated as the parcel and
+ * then copied into place. */
+static int rx_ref_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			  const char *path, int oflags, mode_t omode)
+{
+    char		tmp[PATH_MAX];
+    xambit_parcel_hdr_t	h;
+    xambit_type_validator_t *tv;
+    dd_ref_t		ref;
+    void		*data;
+    uint32_t		crc;
+    uint32_t		*pcrc;
+    int			sfd;
+    int			fd;
+    int			err;
+
+    pcrc = rx_copy_crc(ch, hdr, &crc);
+    err = rx_copy(ch, &ref, sizeof(ref), pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	return err;
+
+    err = rx_check_data(ch, hdr, &ref, pcrc);
+    if (err == 0)
+	err = dd_open(ch, &ref, &data);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	return err;
+    }
+    sfd = err;
+
+    /* The validator sees the header of the file as it was first sent */
+    h = *hdr;
+    h.flags &= ~(XAMBIT_REF | XAMBIT_DATA_CSUM);
+    h.length = ref.length;
+    tv = lookup_type_validator(ch, h.type);
+    if (tv == NULL)
+	err = XAMBIT_ERR_BAD_TYPE;
+    else if (rx_parallel(ch, h.length))
+	err = rx_par_check(ch, tv, &h, data, 0);
+    else
+	err = tv_validate(tv, &h, data);
+    tv_put(tv);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	goto out;
+    }
+
+    fd = rx_open_temp(path, omode, tmp);
+    if (fd < 0)
+    {
+	err = XAMBIT_ERR_STD;
+	goto out;
+    }
+    err = dd_copy(sfd, data, h.length, fd);
+    if (err == 0)
+	err = rx_install(ch, tmp, fd, path, oflags, omode);
+    else
+	unlink(tmp);
+    close(fd);
+    if (err < 0)
+	goto out;
+
+    ch->stats.parcels_received++;
+    ch->stats.bytes_received += h.length;
+    ch->stats.dedup_refs++;
+    ch->stats.dedup_saved += h.length - sizeof(ref);
+
+out:
+    if (h.length)
+	munmap(data, h.length);
+    close(sfd);
+    return err;
+}
+
+/* channel_receive_to_file() for a delta, applied to the kept copy of the
+ * old version straight into the mapped temporary file. The file rebuilt is
+ * checked against its digest, validated there and then kept in turn. */
+static int rx_delta_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			    const char *path, int oflags, mode_t omode)
+{
+    char		tmp[PATH_MAX];
+    xambit_parcel_hdr_t	h;
+    dl_hdr_t		dh;
+    const void		*src;
+    void		*copy;
+    void		*base;
+    void		*data = "";
+    int			mapped = 0;
+    uint8_t		digest[32];
+    uint32_t		crc;
+    uint32_t		*pcrc;
+    int			sfd;
+    int			fd;
+    int			err;
+
+    err = rx_wire(ch, hdr, &src, &copy, &crc, &pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	return err;
+
+    err = rx_check_data(ch, hdr, src, pcrc);
+    if (err < 0)
+	goto drop;
+    memcpy(&dh, src, sizeof(dh));
+    if (dh.file.length > SIZE_MAX)
+    {
+	errno = EFBIG;
+	err = XAMBIT_ERR_STD;
+	goto drop;
+    }
+    err = dd_open(ch, &dh.base, &base);
+    if (err < 0)
+	goto drop;
+    sfd = err;
+
+    /* The validator sees the header of the file as if sent whole */
+    h = *hdr;
+    h.flags &= ~(XAMBIT_DELTA | XAMBIT_DATA_CSUM);
+    h.length = dh.file.length;
+
+    fd = rx_open_temp(path, omode, tmp);
+    if (fd < 0)
+    {
+	err = XAMBIT_ERR_STD;
+	goto close_base;
+    }
+
+    /* As for an inflated parcel, blocks are allocated before the mapping */
+    if (h.length > 0)
+    {
+	err = posix_fallocate(fd, 0, h.length);
+	if (err != 0)
+	{
+	    errno = err;
+	    err = XAMBIT_ERR_STD;
+	    goto error;
+	}
+	data = mmap(NULL, h.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+	{
+	    err = XAMBIT_ERR_STD;
+	    goto error;
+	}
+	mapped = 1;
+    }
+
+    err = dl_apply(src, hdr->length, base, data);
+    if (err == 0)
+    {
+	sha256(data, h.length, digest);
+	if (memcmp(digest, dh.file.digest, sizeof(digest)) != 0)
+	{
+	    errno = EBADMSG;
+	    err = XAMBIT_ERR_STD;
+	}
+    }
+    if (err == 0)
+	err = rx_validate_file(ch, &h, data);
+    if (err == 0 && (h.flags & XAMBIT_KEEP))
+	dd_keep(ch, fd, data, h.length, digest);
+    if (err < 0)
+	goto error;
+
+    err = rx_install(ch, tmp, fd, path, oflags, omode);
+    close(fd);
+    if (err == 0)
+    {
+	ch->stats.dedup_deltas++;
+	ch->stats.dedup_saved += h.length - hdr->length;
+    }
+    goto out;
+
+error:
+    ch->stats.parcels_dropped++;
+    close(fd);
+    unlink(tmp);
+out:
+    if (mapped)
+	munmap(data, h.length);
+close_base:
+    if (dh.base.length)
+	munmap(base, dh.base.length);
+    close(sfd);
+    free(copy);
+    return err;
+
+drop:
+    ch->stats.parcels_dropped++;
+    free(copy);
+    return err;
+}
+
+/* channel_receive_to_file() for a sparse file. The runs of data are written
+ * where they go in a file already made as large as the whole, which leaves
+ * holes between them; the validator sees the whole file. */
+static int rx_sparse_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			     const char *path, int oflags, mode_t omode)
+{
+    char		tmp[PATH_MAX];
+    xambit_parcel_hdr_t	h;
+    sp_hdr_t		sh;
+    sp_run_t		*map = NULL;
+    uint64_t		left = hdr->length - sizeof(sh);
+    uint64_t		want;
+    uint64_t		end = 0;
+    uint64_t		i;
+    uint32_t		crc;
+    uint32_t		*pcrc;
+    void		*data = NULL;
+    int			fd;
+    int			err;
+
+    pcrc = hdr->flags & XAMBIT_DATA_CSUM ? &crc : NULL;
+    err = rx_copy(ch, &sh, sizeof(sh), pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	return err;
+
+    if (sh.runs > XAMBIT_SPARSE_RUNS || sh.runs * sizeof(*map) > left)
+	goto bad;
+    map = calloc(sh.runs + 1, sizeof(*map));
+    if (map == NULL)
+    {
+	errno = ENOMEM;
+	rx_skip(ch, left);
+	return XAMBIT_ERR_STD;
+    }
+    err = rx_copy(ch, map, sh.runs * sizeof(*map), NULL);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	goto out;
+    left -= sh.runs * sizeof(*map);
+    if (pcrc != NULL)
+	crc = crc32c(crc, map, sh.runs * sizeof(*map));
+
+    /* The runs must be in order, inside the file, and fill the parcel */
+    want = left;
+    for (i = 0; i < sh.runs; i++)
+    {
+	if (map[i].offset < end || map[i].offset > sh.size ||
+	    map[i].length > sh.size - map[i].offset || map[i].length > want)
+	    goto bad;
+	end = map[i].offset + map[i].length;
+	want -= map[i].length;
+    }
+    if (want != 0)
+	goto bad;
+
+    fd = rx_open_temp(path, omode, tmp);
+    if (fd < 0 || ftruncate(fd, sh.size) < 0)
+    {
+	err = XAMBIT_ERR_STD;
+	if (fd >= 0)
+	{
+	    close(fd);
+	    unlink(tmp);
+	}
+	rx_skip(ch, left);
+	goto out;
+    }
+
+    /* Every run is taken off the channel, whatever becomes of the file */
+    for (i = 0; i < sh.runs; i++)
+    {
+	if (err == 0 && lseek(fd, map[i].offset, SEEK_SET) < 0)
+	    err = XAMBIT_ERR_STD;
+	if (rx_to_fd(ch, err == 0 ? fd : -1, map[i].length) < 0 && err == 0)
+	    err = XAMBIT_ERR_STD;
+    }
+
+    if (err == 0)
+    {
+	data = sh.size ? mmap(NULL, sh.size, PROT_READ, MAP_SHARED, fd, 0)
+		       : "";
+	if (data == MAP_FAILED)
+	    err = XAMBIT_ERR_STD;
+    }
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	goto error;
+    }
+
+    /* The checksum is taken of the runs where they landed */
+    if (pcrc != NULL)
+	for (i = 0; i < sh.runs; i++)
+	    crc = crc32c(crc, (uint8_t *)data + map[i].offset, map[i].length);
+    err = rx_check_data(ch, hdr, NULL, pcrc);
+
+    h = *hdr;
+    h.flags &= ~(XAMBIT_HOLES | XAMBIT_DATA_CSUM);
+    h.length = sh.size;
+    if (err == 0)
+	err = rx_validate_file(ch, &h, data);
+    if (err == 0 && (h.flags & XAMBIT_KEEP) && ch->dedup != NULL)
+	dd_keep(ch, fd, data, h.length, NULL);
+    if (h.length)
+	munmap(data, h.length);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	goto error;
+    }
+
+    err = rx_install(ch, tmp, fd, path, oflags, omode);
+    close(fd);
+    if (err == 0)
+    {
+	ch->stats.sparse_files++;
+	ch->stats.sparse_saved += sh.size - left;
+    }
+    goto out;
+
+bad:
+    errno = EBADMSG;
+    err = XAMBIT_ERR_STD;
+    rx_skip(ch, left);
+    goto out;
+
+error:
+    close(fd);
+    unlink(tmp);
+out:
+    free(map);
+    return err;
+}
+
+/* channel_receive_to_file() for an extent of a file, written into the file
+ * in the reader's journal. Returns 1 if the file is not yet whole, or once it
+ * is, and has been validated, what putting it in place as path returned. */
+static int rx_extent_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			     const char *path, int oflags, mode_t omode)
+{
+    char		tmp[PATH_MAX];
+    xambit_parcel_hdr_t	h;
+    jn_part_t		jp;
+    ex_hdr_t		eh;
+    uint64_t		len = hdr->length - sizeof(eh);
+    uint64_t		off;
+    uint32_t		crc;
+    uint32_t		*pcrc;
+    size_t		page = sysconf(_SC_PAGESIZE);
+    void		*data;
+    int			fd;
+    int			err;
+
+    pcrc = hdr->flags & XAMBIT_DATA_CSUM ? &crc : NULL;
+    err = rx_copy(ch, &eh, sizeof(eh), pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	return err;
+
+    if (ch->journal == NULL)
+    {
+	rx_skip(ch, len);
+	return XAMBIT_ERR_JOURNAL;
+    }
+    err = jn_recv_open(ch, &eh, &jp);
+    if (err < 0)
+    {
+	rx_skip(ch, len);
+	return err;
+    }
+
+    off = eh.index * eh.extent;
+    if (len != (eh.size - off < eh.extent ? eh.size - off : eh.extent))
+    {
+	errno = EBADMSG;
+	err = XAMBIT_ERR_STD;
+	goto skip;
+    }
+
+    /* One the writer sent again, on resuming, that arrived the first time.
+     * A whole file kept after it could not be installed is tried again once
+     * the last extent is sent again. */
+    if (jn_recv_has(&jp, eh.index))
+    {
+	err = rx_to_fd(ch, -1, len);
+	ch->stats.extents_skipped++;
+	if (err == 0 && jp.have == jp.count && eh.index == jp.count - 1)
+	    goto whole;
+	jn_recv_close(ch, &jp, 0);
+	return err < 0 ? err : 1;
+    }
+
+    if (lseek(jp.fd, off, SEEK_SET) < 0)
+    {
+	err = XAMBIT_ERR_STD;
+	goto skip;
+    }
+    err = rx_to_fd(ch, jp.fd, len);
+    if (err < 0)
+	goto drop;
+
+    /* The checksum is taken of the extent where it landed, from the page
+     * cache */
+    if (pcrc != NULL)
+    {
+	data = mmap(NULL, len + off % page, PROT_READ, MAP_SHARED,
+		    jp.fd, off - off % page);
+	if (data == MAP_FAILED)
+	{
+	    err = XAMBIT_ERR_STD;
+	    goto drop;
+	}
+	crc = crc32c(crc, (uint8_t *)data + off % page, len);
+	munmap(data, len + off % page);
+    }
+    err = rx_check_data(ch, hdr, NULL, pcrc);
+    if (err == 0)
+	err = jn_recv_mark(&jp, eh.index);
+    if (err < 0)
+	goto drop;
+    ch->stats.extents++;
+    if (jp.have < jp.count)
+    {
+	jn_recv_close(ch, &jp, 0);
+	return 1;
+    }
+
+whole:
+    /* The file is validated whole, as if it had been sent so */
+    h = *hdr;
+    h.flags &= ~(XAMBIT_EXTENT | XAMBIT_DATA_CSUM);
+    h.length = eh.size;
+    data = mmap(NULL, h.length, PROT_READ, MAP_SHARED, jp.fd, 0);
+    if (data == MAP_FAILED)
+    {
+	err = XAMBIT_ERR_STD;
+	jn_recv_close(ch, &jp, 0);
+	return err;
+    }
+    err = rx_validate_file(ch, &h, data);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	goto out;
+    }
+    if ((h.flags & XAMBIT_KEEP) && ch->dedup != NULL)
+	dd_keep(ch, jp.fd, data, h.length, NULL);
+
+    /* It is linked out of the journal if it can be, or else copied. The
+     * journal keeps it until it is in place, so that a file that cannot be
+     * installed is not received again. */
+    if (jn_recv_take(ch, &jp, path, tmp) == 0)
+    {
+	fd = jp.fd;
+	jp.fd = -1;
+
+	/* The journal's file is private, and rx_install() only gives it the
+	 * mode of a file it replaces */
+	if (access(path, F_OK) < 0 && fchmod(fd, omode & ~rx_umask()) < 0)
+	    err = XAMBIT_ERR_STD;
+    }
+    else
+    {
+	fd = rx_open_temp(path, omode, tmp);
+	if (fd < 0)
+	{
+	    err = XAMBIT_ERR_STD;
+	    goto out;
+	}
+	err = dd_copy(jp.fd, data, h.length, fd);
+    }
+    if (err == 0)
+	err = rx_install(ch, tmp, fd, path, oflags, omode);
+    else
+	unlink(tmp);
     close(fd);
+
 out:
+    munmap(data, h.length);
+    jn_recv_close(ch, &jp, err == 0);
+    return err;
+
+skip:
+    rx_skip(ch, len);
+    jn_recv_close(ch, &jp, 0);
+    return err;
+
+drop:
+    ch->stats.parcels_dropped++;
+    jn_recv_close(ch, &jp, 0);
+    return err;
+}
+
+/* channel_receive_to_file() for a deflated parcel, inflated straight into
+ * the mapped temporary file and validated there */
+static int rx_zlib_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			   const char *path, int oflags, mode_t omode)
+{
+    char	tmp[PATH_MAX];
+    const void	*src;
+    void	*copy;
+    void	*data = "";
+    uint64_t	len;
+    uint32_t	crc;
+    uint32_t	*pcrc;
+    int		fd;
+    int		err;
+
+    err = rx_wire(ch, hdr, &src, &copy, &crc, &pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	return err;
+
+    err = zl_length(ch, hdr, src, &len);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	free(copy);
+	return err;
+    }
+
+    fd = rx_open_temp(path, omode, tmp);
+    if (fd < 0)
+    {
+	free(copy);
+	return XAMBIT_ERR_STD;
+    }
+
+    /* Blocks are allocated first so that a full disk is an error here
+     * rather than a fault in the mapping */
+    if (len > 0)
+    {
+	err = posix_fallocate(fd, 0, len);
+	if (err != 0)
+	{
+	    errno = err;
+	    err = XAMBIT_ERR_STD;
+	    goto error;
+	}
+	data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+	{
+	    err = XAMBIT_ERR_STD;
+	    goto error;
+	}
+    }
+
+    err = rx_inflate(ch, hdr, src, pcrc, data);
+    if (err == 0)
+	err = rx_validate(ch, hdr, data, NULL);
+    if (len > 0)
+	munmap(data, len);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	goto error;
+    }
+
+    free(copy);
+    err = rx_install(ch, tmp, fd, path, oflags, omode);
+    close(fd);
+    return err;
+
+error:
+    free(copy);
+    close(fd);
+    unlink(tmp);
+    return err;
+}
+
+/*  Function Name:	channel_set_chunk_size
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To bound the memory channel_receive_to_file uses to move
+ *			a payload into a file.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Also the most handed to a single splice() call.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_chunk_size(xambit_channel_t *ch, size_t size)
+{
+    if (ch == NULL || size == 0)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    ch->chunk_size = size;
+    return 0;
+}
+
+int channel_receive(xambit_channel_t *ch, void **buffer,
+		    xambit_parcel_hdr_t **header)
+{
+    int			err;
+    xambit_parcel_hdr_t	*hdr = NULL;
+    void		*buf = NULL;
+
+    err = channel_receive_buf(ch, &hdr, &buf);
+    if (err < 0)
+	return err;
+
+    *buffer = buf;
+    *header = hdr;
+    return err;
+}
+
+/*  Function Name:	channel_receive_into
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To receive a parcel into caller supplied memory.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		If the payload is larger than size, header is filled in
+ *			and the parcel is left on the channel so the call can
+ *			be repeated with a buffer of at least header->length
+ *			bytes. Stream parcels are assembled before their size
+ *			is known, so one that does not fit is dropped.
+ *
+ *  Return Value:	0 on success, or a negetive value on failure. When the
+ *			buffer is too small, XAMBIT_ERR_STD is returned with
+ *			errno set to EMSGSIZE.
+ */
+int channel_receive_into(xambit_channel_t *ch, xambit_parcel_hdr_t *header,
+			 void *buf, size_t size)
+{
+    void	*sdata;
+    uint32_t	crc;
+    uint32_t	*pcrc;
+    int		err;
+
+    if (ch == NULL || header == NULL || !ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (ch->pipeline != NULL)
+	return pl_receive_into(ch, header, buf, size);
+
+    err = rx_next(ch, header, &sdata);
+    if (err < 0)
+	return err;
+
+    if (err == 1)
+    {
+	/* A stream cannot be put back once assembled */
+	err = 0;
+	if (header->length > size)
+	{
+	    ch->stats.parcels_dropped++;
+	    errno = EMSGSIZE;
+	    err = XAMBIT_ERR_STD;
+	}
+	else
+	{
+	    memcpy(buf, sdata, header->length);
+	}
+	free(sdata);
+	return err;
+    }
+
+    if (header->flags & XAMBIT_ZLIB)
+	return rx_into_zlib(ch, header, buf, size);
+
+    if (header->length > size)
+    {
+	/* Nothing has been read past the header, so it can be put back */
+	ch->rbuf_head -= sizeof(*header);
+	errno = EMSGSIZE;
+	return XAMBIT_ERR_STD;
+    }
+
+    pcrc = rx_copy_crc(ch, header, &crc);
+    err = rx_copy(ch, buf, header->length, pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	return err;
+
+    err = rx_validate(ch, header, buf, pcrc);
+    if (err < 0)
+	ch->stats.parcels_dropped++;
+
     return err;
 }
 
-int channel_send(xambit_channel_t *ch, void *buf, size_t size, uint32_t tid)
+/* channel_receive_into() for a deflated parcel whose header has just been
+ * taken. Its inflated length is read from the start of its data, which is
+ * left on the channel with the header if it will not fit. */
+static int rx_into_zlib(xambit_channel_t *ch, xambit_parcel_hdr_t *header,
+			void *buf, size_t size)
 {
-    xambit_parcel_hdr_t	hdr;
-    int			err;
+    const void	*src;
+    void	*copy;
+    uint64_t	len;
+    uint32_t	crc;
+    uint32_t	*pcrc;
+    int		err;
 
-    hdr.length = size;
-    hdr.type = tid;
-    hdr.flags = XAMBIT_BLOCK;
-    hdr.version = XAMBIT_HDR_VERSION;
+    if (header->length >= sizeof(zl_hdr_t) &&
+	ch->rbuf_tail - ch->rbuf_head < sizeof(zl_hdr_t))
+    {
+	/* Filled with the header counted in, so that it stays put */
+	ch->rbuf_head -= sizeof(*header);
+	err = rx_fill(ch, sizeof(*header) + sizeof(zl_hdr_t));
+	ch->rbuf_head += sizeof(*header);
+	if (err < 0) /* Warning: send/receive sync error possible */
+	    return err;
+    }
 
-    err = channel_send_buf(ch, &hdr, buf);
+    err = zl_length(ch, header, ch->rbuf + ch->rbuf_head, &len);
+    if (err < 0)
+    {
+	ch->stats.parcels_dropped++;
+	return rx_to_fd(ch, -1, header->length) < 0 ? XAMBIT_ERR_STD : err;
+    }
+
+    if (len > size)
+    {
+	ch->rbuf_head -= sizeof(*header);
+	header->length = len;
+	errno = EMSGSIZE;
+	return XAMBIT_ERR_STD;
+    }
+
+    err = rx_wire(ch, header, &src, &copy, &crc, &pcrc);
+    if (err < 0) /* Warning: send/receive sync error possible */
+	return err;
+
+    err = rx_inflate(ch, header, src, pcrc, buf);
+    free(copy);
+    if (err == 0)
+	err = rx_validate(ch, header, buf, NULL);
+    if (err < 0)
+	ch->stats.parcels_dropped++;
 
     return err;
 }
 
-int channel_receive_to_file(xambit_channel_t *ch, const char *path,
-			      int oflags, mode_t omode)
+/*  Function Name:	channel_set_pool
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To have channel_receive allocate from a per-channel pool
+ *			of size-classed blocks.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Up to limit bytes of released blocks are kept for
+ *			reuse; a limit of 0 turns the pool off. Buffers received
+ *			from a pooled channel must be given back with
+ *			channel_release rather than free.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_pool(xambit_channel_t *ch, size_t limit)
 {
-    int			    err;
-    int			    fd;
-    xambit_parcel_hdr_t	    *hdr = NULL;
-    void		    *buf = NULL;
+    if (ch == NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
 
-    err = channel_receive_buf(ch, &hdr, &buf);
-    if (err < 0)
-	goto out;
+    if (limit == 0)
+    {
+	pool_destroy(ch);
+	return 0;
+    }
 
-    fd = open(path, oflags, omode);
-    if (fd < 0)
+    if (ch->pool == NULL)
     {
-	err = fd;
-	goto out;
+	ch->pool = calloc(1, sizeof(xambit_pool_t));
+	if (ch->pool == NULL)
+	{
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
     }
 
-    /* TODO: worry about not writing all the data? */
-    err = write(fd, buf, hdr->length);
+    ch->pool->limit = limit;
+    return 0;
+}
 
-    close(fd);
+/*  Function Name:	channel_release
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To give back a buffer and header returned by
+ *			channel_receive.
+ *
+ *  Assumptions:	buf and header came from the same channel_receive call.
+ *
+ *  Notes:		Pooled blocks are cached for the next receive while the
+ *			pool is under its limit. Anything else is freed, so this
+ *			may be used whether or not the channel is pooled. The
+ *			memory ahead of header is only looked at while the
+ *			channel has pool blocks out, and a block is only taken
+ *			for one if it carries XAMBIT_POOL_MAGIC.
+ */
+void channel_release(xambit_channel_t *ch, void *buf,
+		     xambit_parcel_hdr_t *header)
+{
+    xambit_pool_blk_t	*blk;
+    size_t		size;
 
-out:
-    if (hdr != NULL) free(hdr);
-    if (buf != NULL) free(buf);
-    return err;
+    if (buf == NULL || header == NULL)
+    {
+	free(buf);
+	free(header);
+	return;
+    }
+
+    if (buf != (void *)(header + 1) || (ch != NULL && ch->pool_out == 0))
+    {
+	free(buf);
+	free(header);
+	return;
+    }
+
+    blk = (xambit_pool_blk_t *)((uint8_t *)header -
+				offsetof(xambit_pool_blk_t, hdr));
+    if (blk->magic != XAMBIT_POOL_MAGIC)
+    {
+	free(buf);
+	free(header);
+	return;
+    }
+
+    blk->magic = 0;
+    if (ch != NULL)
+	ch->pool_out--;
+    if (blk->cls >= 0 && ch != NULL && ch->pool != NULL)
+    {
+	size = (size_t)1 << (XAMBIT_POOL_MIN_SHIFT + blk->cls);
+	if (ch->pool->cached + size <= ch->pool->limit)
+	{
+	    blk->next = ch->pool->free[blk->cls];
+	    ch->pool->free[blk->cls] = blk;
+	    ch->pool->cached += size;
+	    return;
+	}
+    }
+
+    free(blk);
 }
 
-int channel_receive(xambit_channel_t *ch, void **buffer,
-		    xambit_parcel_hdr_t **header)
+static void pool_destroy(xambit_channel_t *ch)
 {
-    int			err;
-    xambit_parcel_hdr_t	*hdr = NULL;
-    void		*buf = NULL;
+    xambit_pool_blk_t	*blk;
+    int			i;
 
-    err = channel_receive_buf(ch, &hdr, &buf);
-    if (err < 0)
-	goto error;
+    if (ch->pool == NULL)
+	return;
 
-    *buffer = buf;
-    *header = hdr;
-    return err;
+    for (i = 0; i < XAMBIT_POOL_CLASSES; i++)
+    {
+	while ((blk = ch->pool->free[i]) != NULL)
+	{
+	    ch->pool->free[i] = blk->next;
+	    free(blk);
+	}
+    }
 
-error:
-    if (hdr != NULL) free(hdr);
-    if (buf != NULL) free(buf);
-    return err;
+    free(ch->pool);
+    ch->pool = NULL;
 }
 
-static void xambit_clear_type_map(xambit_channel_t *ch)
+/*  Function Name:	channel_receive_batch
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To receive up to max parcels with as few reads as the
+ *			channel allows.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Blocks until one parcel is available, then also returns
+ *			every further parcel already held in the read-ahead
+ *			buffer. The returned data points into memory owned by
+ *			the channel and is only valid until the next receive
+ *			call on it. Parcels failing validation are dropped and
+ *			counted in the channel statistics. A completed stream
+ *			parcel is always the last one returned by a call.
+ *
+ *  Return Value:	The number of parcels stored in parcels, or a negetive
+ *			value if none could be returned.
+ */
+int channel_receive_batch(xambit_channel_t *ch, xambit_parcel_t *parcels,
+			  int max)
 {
-    int i;
+    xambit_parcel_hdr_t	*hdr;
+    xambit_parcel_hdr_t	seg;
+    size_t		saved;
+    void		*data;
+    uint32_t		crc;
+    uint32_t		*pcrc = NULL;
+    int			big;
+    int			n = 0;
+    int			err = 0;
+
+    if (ch == NULL || parcels == NULL || max <= 0 ||
+	!ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
 
-    for (i=0; i < XAMBIT_VT_LEN; i++)
+    if (ch->pipeline != NULL)
+	return pl_receive_batch(ch, parcels, max);
+
+    /* Data handed out by the previous call is released here */
+    free(ch->rx_big);
+    ch->rx_big = NULL;
+
+    err = rx_ready(ch);
+    if (err < 0)
+	return err;
+
+    while (n < max)
     {
-	xambit_type_validator_t *t = ch->tvm->map[i];
-	while (t != NULL)
+	if (ch->rbuf_tail - ch->rbuf_head < sizeof(xambit_parcel_hdr_t))
+	{
+	    /* Keep reading while a stream is part way through */
+	    if (n > 0 || err < 0 || ch->rx_stream == NULL)
+		break;
+	    err = rx_ready(ch);
+	    if (err < 0)
+		break;
+	}
+	else if (n == 0 && (ch->flags & XAMBIT_NONBLOCK))
+	{
+	    /* After a dropped parcel, the next must be whole too */
+	    err = rx_ready(ch);
+	    if (err < 0)
+		break;
+	}
+
+	hdr = &parcels[n].hdr;
+	saved = ch->rbuf_head;
+	err = rx_parse_hdr(ch, hdr);
+	if (err < 0)
+	{
+	    /* Report the bad header on the next call */
+	    if (n > 0)
+		ch->rbuf_head = saved;
+	    break;
+	}
+
+	if (hdr->flags & XAMBIT_STREAM)
+	{
+	    seg = *hdr;
+	    if (seg.length > ch->rbuf_tail - ch->rbuf_head)
+	    {
+		/* Refilling would move parcels already handed out */
+		if (n > 0)
+		{
+		    ch->rbuf_head = saved;
+		    break;
+		}
+		err = rx_fill(ch, seg.length);
+		if (err < 0)
+		    break;
+	    }
+	    data = ch->rbuf + ch->rbuf_head;
+	    ch->rbuf_head += seg.length;
+
+	    err = rx_stream_segment(ch, &seg, data, -1, hdr);
+	    if (err <= 0)
+		continue;
+
+	    ch->rx_big = rx_stream_take(ch);
+	    if (ch->rx_big == NULL)
+	    {
+		errno = ENOMEM;
+		err = XAMBIT_ERR_STD;
+		break;
+	    }
+	    parcels[n++].data = ch->rx_big;
+	    break;
+	}
+
+	/* Data passed in a memfd is handed out from its mapping, which the
+	 * next header parsed releases, so the call ends here */
+	data = ch->type == XAMBIT_CH_SOCK ?
+	       sock_att_take(ch, hdr->length) : NULL;
+	if (data != NULL)
+	{
+	    err = rx_validate(ch, hdr, data, NULL);
+	    if (err < 0)
+	    {
+		ch->stats.parcels_dropped++;
+		continue;
+	    }
+	    parcels[n++].data = data;
+	    break;
+	}
+
+	if (hdr->length > ch->rbuf_tail - ch->rbuf_head)
+	{
+	    if (n > 0)
+	    {
+		ch->rbuf_head = saved;
+		break;
+	    }
+
+	    if (hdr->length <= ch->rbuf_size)
+	    {
+		err = rx_fill(ch, hdr->length);
+		if (err < 0)
+		    break;
+	    }
+	    else
+	    {
+		ch->rx_big = malloc(hdr->length);
+		ch->stats.allocs++;
+		if (ch->rx_big == NULL)
+		{
+		    errno = ENOMEM;
+		    err = XAMBIT_ERR_STD;
+		    break;
+		}
+		pcrc = rx_copy_crc(ch, hdr, &crc);
+		err = rx_copy(ch, ch->rx_big, hdr->length, pcrc);
+		if (err < 0)
+		    break;
+	    }
+	}
+
+	if (ch->rx_big != NULL)
+	{
+	    data = ch->rx_big;
+	}
+	else
+	{
+	    data = ch->rbuf + ch->rbuf_head;
+	    ch->rbuf_head += hdr->length;
+	}
+
+	if (hdr->flags & XAMBIT_ZLIB)
+	{
+	    big = ch->rx_big != NULL;
+	    err = rx_batch_inflate(ch, hdr, &data, big ? pcrc : NULL);
+	    if (err == 0)
+		err = rx_validate(ch, hdr, data, NULL);
+	}
+	else
 	{
-	    xambit_type_validator_t *d = t;
-	    t = t->next;
-	    free(d);
+	    big = 0;
+	    err = rx_validate(ch, hdr, data, ch->rx_big != NULL ? pcrc : NULL);
 	}
+	if (err < 0)
+	{
+	    ch->stats.parcels_dropped++;
+	    if (ch->rx_big != NULL || big)
+		break;
+	    continue;
+	}
+
+	parcels[n++].data = data;
+	if (ch->rx_big != NULL)
+	    break;
     }
+
+    return n > 0 ? n : err;
 }
 
-static xambit_type_validator_t *lookup_type_validator(xambit_channel_t *ch,
-				uint32_t tid)
+/* Inflate a deflated parcel for channel_receive_batch into memory held in
+ * rx_big, as a payload too large for the read-ahead buffer is, in place of
+ * any copy of its data there */
+static int rx_batch_inflate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+			    void **data, const uint32_t *crc)
 {
-    int index;
-    xambit_type_validator_t *tv;
+    void	*out = NULL;
+    uint64_t	len;
+    int		err;
 
-    index = tid % XAMBIT_VT_LEN;
-    tv = ch->tvm->map[index];
+    err = zl_length(ch, hdr, *data, &len);
+    if (err == 0)
+    {
+	out = malloc(len ? len : 1);
+	ch->stats.allocs++;
+	if (out == NULL)
+	{
+	    errno = ENOMEM;
+	    err = XAMBIT_ERR_STD;
+	}
+    }
+    if (err == 0)
+	err = rx_inflate(ch, hdr, *data, crc, out);
 
-    while ((tv != NULL) && (tv->type_id != tid))
-	tv = tv->next;
+    free(ch->rx_big);
+    ch->rx_big = NULL;
+    if (err < 0)
+    {
+	free(out);
+	return err;
+    }
 
-    return tv;
+    ch->rx_big = out;
+    *data = out;
+    return 0;
 }
 
-static void add_type_validator(xambit_channel_t *ch, xambit_type_validator_t *tv)
+/*  Function Name:	channel_set_readahead
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To set the size of the read-ahead buffer of a reader
+ *			channel.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Payloads up to this size are returned in place by
+ *			channel_receive_batch. Bytes already buffered are kept.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_readahead(xambit_channel_t *ch, size_t size)
 {
-    int index;
-    xambit_type_validator_t *last = NULL;
+    uint8_t	*nbuf;
+    size_t	used;
 
-    index = tv->type_id % XAMBIT_VT_LEN;
+    /* A whole stream segment must fit. A ring has a fixed size. */
+    if (ch == NULL || ch->direction != XAMBIT_CHIN ||
+	ch->type == XAMBIT_CH_SHM ||
+	size < sizeof(xambit_parcel_hdr_t) + MAX_STREAM_SIZE)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
 
-    if (ch->tvm->map[index] == NULL)
+    used = ch->rbuf_tail - ch->rbuf_head;
+    if (used > size || ch->pipeline != NULL)
     {
-	ch->tvm->map[index] = tv;
+	errno = EBUSY;
+	return XAMBIT_ERR_STD;
     }
-    else
+
+    if (ch->rbuf != NULL)
     {
-	last = ch->tvm->map[index];
-	while (last->next != NULL)
+	memmove(ch->rbuf, ch->rbuf + ch->rbuf_head, used);
+	nbuf = realloc(ch->rbuf, size + rx_slack(ch));
+	if (nbuf == NULL)
 	{
-	    last = last->next;
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
 	}
-	last->next = tv;
+	ch->rbuf = nbuf;
     }
+
+    ch->rbuf_head = 0;
+    ch->rbuf_tail = used;
+    ch->rbuf_size = size;
+    ch->rbuf_want = 0;
+    return 0;
+}
+
+/* The validator for tid on ch, or failing that in the registry it shares.
+ * The caller must tv_put() it. */
+xambit_type_validator_t *lookup_type_validator(xambit_channel_t *ch,
+				uint32_t tid)
+{
+    xambit_type_validator_t *tv;
+    xambit_registry_t	*types;
+
+    types = __atomic_load_n(&ch->types, __ATOMIC_ACQUIRE);
+    tv = types != NULL ? registry_get(types, tid) : NULL;
+    if (tv == NULL && ch->base != NULL)
+	tv = registry_get(ch->base, tid);
+
+    return tv;
 }
 
 int channel_register_type(xambit_channel_t *ch,
 			  uint32_t type_id,
 			  int (*validate)(xambit_parcel_hdr_t *hdr, void *data))
 {
+    xambit_validator_ops_t	ops;
+
+    memset(&ops, 0, sizeof(ops));
+    ops.validate = validate;
+    return channel_register_type_ops(ch, type_id, &ops);
+}
+
+/*  Function Name:	channel_register_rules
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To register a parcel type checked by a set of
+ *			declarative rules rather than a callback.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		See xambit_rules_compile for the rule syntax. To see
+ *			why rules do not compile, or to combine them with
+ *			callbacks, compile them separately and set the rules
+ *			member of the ops given to channel_register_type_ops.
+ *
+ *  Return Value:	0 on success, -1 on failure with errno set.
+ */
+int channel_register_rules(xambit_channel_t *ch, uint32_t type_id,
+			   const char *rules)
+{
+    xambit_validator_ops_t	ops;
     int				err;
-    xambit_type_validator_t	*tv;
+    int				e;
+
+    memset(&ops, 0, sizeof(ops));
+    ops.rules = xambit_rules_compile(rules, NULL, 0);
+    if (ops.rules == NULL)
+	return -1;
+
+    err = channel_register_type_ops(ch, type_id, &ops);
+    e = errno;
+    xambit_rules_free(ops.rules);
+    errno = e;
+    return err;
+}
+
+/*  Function Name:	channel_register_type_ops
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To register a parcel type with a set of validation
+ *			callbacks.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		At least validate, update and final, or chunk must be
+ *			given.
+ *			The incremental callbacks let stream parcels be checked
+ *			as each segment arrives; without them a stream is
+ *			assembled and handed to validate whole.
+ *
+ *  Return Value:	0 on success, -1 on failure with errno set.
+ */
+int channel_register_type_ops(xambit_channel_t *ch, uint32_t type_id,
+			      const xambit_validator_ops_t *ops)
+{
+    return ch_update_type(ch, type_id, ops, REG_ADD);
+}
+
+/*  Function Name:	channel_replace_type_ops
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To register a parcel type, or change the callbacks of
+ *			one already registered.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Safe while other threads send or receive on the
+ *			channel. Parcels already being checked, and open
+ *			streams, finish with the old callbacks.
+ *
+ *  Return Value:	0 on success, -1 on failure with errno set.
+ */
+int channel_replace_type_ops(xambit_channel_t *ch, uint32_t type_id,
+			     const xambit_validator_ops_t *ops)
+{
+    return ch_update_type(ch, type_id, ops, REG_REPLACE);
+}
+
+/*  Function Name:	channel_unregister_type
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To stop a channel passing parcels of a type.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		As channel_replace_type_ops. A type the channel shares
+ *			through channel_set_registry is not affected.
+ *
+ *  Return Value:	0 on success, -1 on failure with errno set. ENOENT
+ *			means the type was not registered on the channel.
+ */
+int channel_unregister_type(xambit_channel_t *ch, uint32_t type_id)
+{
+    return ch_update_type(ch, type_id, NULL, REG_REMOVE);
+}
+
+static int ch_update_type(xambit_channel_t *ch, uint32_t type_id,
+			  const xambit_validator_ops_t *ops, int how)
+{
+    xambit_registry_t	*types;
+    xambit_registry_t	*none = NULL;
 
-    if (ch == NULL || validate == NULL)
+    if (ch == NULL)
     {
 	errno = EINVAL;
 	return -1;
     }
 
-    tv = lookup_type_validator(ch, type_id);
-    if (tv != NULL)
+    /* A channel gets a registry of its own with its first type; senders
+     * sharing it may be looking at the pointer meanwhile */
+    if (__atomic_load_n(&ch->types, __ATOMIC_ACQUIRE) == NULL)
     {
-	errno = EEXIST;
-	return -1;
+	types = xambit_registry_new();
+	if (types == NULL)
+	    return -1;
+	if (!__atomic_compare_exchange_n(&ch->types, &none, types, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	    xambit_registry_free(types);
     }
 
-    tv = malloc(sizeof(xambit_type_validator_t));
-    if (tv == NULL)
+    if (registry_update(ch->types, type_id, ops, how) < 0)
+	return -1;
+
+    ch->num_types = registry_count(ch->types);
+    return 0;
+}
+
+/*  Function Name:	channel_set_registry
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To have a channel look up types it has not registered
+ *			itself in a registry shared with other channels.
+ *
+ *  Assumptions:	Nothing is being sent or received on the channel.
+ *
+ *  Notes:		Types registered on the channel take precedence. The
+ *			channel keeps reg until it is closed or given another;
+ *			NULL detaches it.
+ *
+ *  Return Value:	0 on success, -1 on failure with errno set.
+ */
+int channel_set_registry(xambit_channel_t *ch, xambit_registry_t *reg)
+{
+    if (ch == NULL)
     {
-	errno = ENOMEM;
+	errno = EINVAL;
 	return -1;
     }
 
-    tv->type_id = type_id;
-    tv->validate = validate;
-    tv->prev = NULL;
-    tv->next = NULL;
-
-    add_type_validator(ch, tv);
-    ch->num_types++;
+    if (reg != NULL)
+	registry_hold(reg);
+    xambit_registry_free(ch->base);
+    ch->base = reg;
     return 0;
 }
 
-/* TODO: unregister_type? */
-
 int null_validator(xambit_parcel_hdr_t *p, void *data)
 {
     return 0;
@@ -0,0 +1,262 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* CRC32C (Castagnoli) payload checksums. On x86-64 CPUs with SSE4.2 the
+ * crc32 instruction is run over three interleaved lanes, which are joined
+ * with a carry-less multiply when PCLMUL is present. Elsewhere a slicing-by-8
+ * table is used. Each routine optionally copies the data as it goes, so a
+ * checksum costs no extra pass over memory where the data is copied anyway.
+ *
+ * Internally the CRC register is kept pre-inverted; only the crc32c*
+ * entry points apply the conventional initial and final inversion, so they
+ * can be chained like zlib's crc32(). */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define XAMBIT_CRC_X86
+#endif
+
+#include "xambit_int.h"
+
+#define CRC32C_POLY	0x82f63b78	/* Reflected Castagnoli polynomial */
+#define CRC32C_LANE	4096		/* Bytes per lane when interleaving */
+
+typedef uint32_t (*crc_fn_t)(uint32_t crc, const uint8_t *p, size_t len,
+			     uint8_t *dst);
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_x2n[32];	/* x^(2^n) modulo the polynomial */
+static uint32_t crc32c_lane1;	/* Shifts a lane's CRC over one lane ... */
+static uint32_t crc32c_lane2;	/* ... and over two */
+static crc_fn_t crc32c_run;
+
+/* Multiply a and b modulo the CRC polynomial; bit 31 holds x^0 */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t	m = (uint32_t)1 << 31;
+    uint32_t	p = 0;
+
+    while (1)
+    {
+	if (a & m)
+	{
+	    p ^= b;
+	    if ((a & (m - 1)) == 0)
+		break;
+	}
+	m >>= 1;
+	b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(8 * len) modulo the CRC polynomial */
+static uint32_t x8nmodp(uint64_t len)
+{
+    uint32_t	p = (uint32_t)1 << 31;
+    int		k = 3;
+
+    while (len)
+    {
+	if (len & 1)
+	    p = multmodp(crc32c_x2n[k & 31], p);
+	len >>= 1;
+	k++;
+    }
+    return p;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len,
+			  uint8_t *dst)
+{
+    uint64_t	w;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8)
+    {
+	memcpy(&w, p, 8);
+	if (dst != NULL)
+	{
+	    memcpy(dst, &w, 8);
+	    dst += 8;
+	}
+	w ^= crc;
+	crc = crc32c_table[7][w & 0xff] ^
+	      crc32c_table[6][(w >> 8) & 0xff] ^
+	      crc32c_table[5][(w >> 16) & 0xff] ^
+	      crc32c_table[4][(w >> 24) & 0xff] ^
+	      crc32c_table[3][(w >> 32) & 0xff] ^
+	      crc32c_table[2][(w >> 40) & 0xff] ^
+	      crc32c_table[1][(w >> 48) & 0xff] ^
+	      crc32c_table[0][w >> 56];
+	p += 8;
+	len -= 8;
+    }
+#endif
+    while (len--)
+    {
+	if (dst != NULL)
+	    *dst++ = *p;
+	crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef XAMBIT_CRC_X86
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw_run(uint32_t crc, const uint8_t *p,
+				     size_t len, uint8_t *dst)
+{
+    uint64_t	c = crc;
+    uint64_t	w;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+	memcpy(&w, p, 8);
+	if (dst != NULL)
+	{
+	    memcpy(dst, &w, 8);
+	    dst += 8;
+	}
+	c = _mm_crc32_u64(c, w);
+    }
+    for (; len > 0; len--, p++)
+    {
+	if (dst != NULL)
+	    *dst++ = *p;
+	c = _mm_crc32_u8((uint32_t)c, *p);
+    }
+    return (uint32_t)c;
+}
+
+/* The same product as multmodp(), in a few instructions */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t multmodp_hw(uint32_t a, uint32_t b)
+{
+    __m128i	r;
+
+    r = _mm_clmulepi64_si128(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b), 0);
+    r = _mm_slli_epi64(r, 1);
+    return _mm_crc32_u32(0, (uint32_t)_mm_cvtsi128_si64(r)) ^
+	   (uint32_t)_mm_extract_epi32(r, 1);
+}
+
+/* Three lanes keep the crc32 unit busy; one alone waits on its latency */
+#define CRC32C_HW_LANES(name, target_isa, join)				\
+__attribute__((target(target_isa)))					\
+static uint32_t name(uint32_t crc, const uint8_t *p, size_t len,	\
+		     uint8_t *dst)					\
+{									\
+    uint64_t	a, b, c;						\
+    uint64_t	wa, wb, wc;						\
+    size_t	i;							\
+									\
+    for (; len >= 3 * CRC32C_LANE; len -= 3 * CRC32C_LANE)		\
+    {									\
+	a = crc;							\
+	b = 0;								\
+	c = 0;								\
+	for (i = 0; i < CRC32C_LANE; i += 8)				\
+	{								\
+	    memcpy(&wa, p + i, 8);					\
+	    memcpy(&wb, p + CRC32C_LANE + i, 8);			\
+	    memcpy(&wc, p + 2 * CRC32C_LANE + i, 8);			\
+	    if (dst != NULL)						\
+	    {								\
+		memcpy(dst + i, &wa, 8);				\
+		memcpy(dst + CRC32C_LANE + i, &wb, 8);			\
+		memcpy(dst + 2 * CRC32C_LANE + i, &wc, 8);		\
+	    }								\
+	    a = _mm_crc32_u64(a, wa);					\
+	    b = _mm_crc32_u64(b, wb);					\
+	    c = _mm_crc32_u64(c, wc);					\
+	}								\
+	crc = join(crc32c_lane2, (uint32_t)a) ^				\
+	      join(crc32c_lane1, (uint32_t)b) ^ (uint32_t)c;		\
+	p += 3 * CRC32C_LANE;						\
+	if (dst != NULL)						\
+	    dst += 3 * CRC32C_LANE;					\
+    }									\
+    return crc32c_hw_run(crc, p, len, dst);				\
+}
+
+CRC32C_HW_LANES(crc32c_sse42, "sse4.2", multmodp)
+CRC32C_HW_LANES(crc32c_pclmul, "sse4.2,pclmul", multmodp_hw)
+#endif
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    uint32_t	c;
+    int		n;
+    int		k;
+
+    for (n = 0; n < 256; n++)
+    {
+	c = n;
+	for (k = 0; k < 8; k++)
+	    c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+	crc32c_table[0][n] = c;
+    }
+    for (n = 0; n < 256; n++)
+	for (k = 1; k < 8; k++)
+	    crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^
+		crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+
+    crc32c_x2n[0] = (uint32_t)1 << 30;	/* x^1 */
+    for (n = 1; n < 32; n++)
+	crc32c_x2n[n] = multmodp(crc32c_x2n[n - 1], crc32c_x2n[n - 1]);
+    crc32c_lane1 = x8nmodp(CRC32C_LANE);
+    crc32c_lane2 = x8nmodp(2 * CRC32C_LANE);
+
+    crc32c_run = crc32c_sw;
+#ifdef XAMBIT_CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+	crc32c_run = __builtin_cpu_supports("pclmul") ? crc32c_pclmul
+						      : crc32c_sse42;
+#endif
+}
+
+/* CRC32C of len bytes at buf, continuing from crc (0 to start) */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~crc32c_run(~crc, buf, len, NULL);
+}
+
+/* As crc32c(), copying the data to dst on the way through */
+uint32_t crc32c_copy(void *dst, const void *src, size_t len, uint32_t crc)
+{
+    return ~crc32c_run(~crc, src, len, dst);
+}
+
+/* CRC32C of two blocks end to end, from the CRC of each and the length of
+ * the second */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    return multmodp(x8nmodp(len2), crc1) ^ crc2;
+}
@@ -0,0 +1,415 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Files sent by reference. A writer given a directory keeps an index there,
+ * mapped into memory and shared by every process using it, of the SHA-256
+ * digest of each file it has sent whole, marked XAMBIT_KEEP. A reader given
+ * a directory keeps there a copy of each such file it receives, named by the
+ * digest it works out for itself. A file the writer has sent before, within
+ * max_age seconds, then crosses as a XAMBIT_REF parcel of its digest and
+ * length alone.
+ *
+ * A channel only carries data one way, so the writer cannot learn that the
+ * reader lost a file, or never kept it; the reader refuses such a reference
+ * with XAMBIT_ERR_DEDUP, and max_age bounds how long the writer goes on
+ * trusting it. The reader checks a kept file against its digest each time
+ * it is used, and it is validated afresh as the parcel referring to it. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#define DD_MAGIC	"XAMBITDD"
+#define DD_VERSION	1
+#define DD_INDEX	"index"	    /* Name of a writer's index file */
+#define DD_HISTORY	"history"   /* ... and of its XAMBIT_DIFF notes */
+#define DD_SLOTS	(1 << 16)   /* Files a writer's index remembers */
+#define DD_PROBE	8	    /* Slots a digest may be found in */
+
+typedef struct dd_slot_s {
+    uint8_t	digest[32];
+    uint64_t	length;
+    int64_t	sent;		    /* Seconds since the epoch; 0 if empty */
+} dd_slot_t;
+
+typedef struct dd_index_s {
+    char	magic[8];
+    uint32_t	version;
+    uint32_t	slots;
+    uint8_t	pad[48];
+    dd_slot_t	slot[];
+} dd_index_t;
+
+static int dd_map_index(xambit_dedup_t *dd);
+static dd_slot_t *dd_probe(xambit_dedup_t *dd, const dd_ref_t *ref);
+
+/* Create the index, or check that an existing one is one */
+static int dd_map_index(xambit_dedup_t *dd)
+{
+    struct stat	st;
+    dd_index_t	head;
+    int		err = XAMBIT_ERR_STD;
+
+    dd->map_len = sizeof(dd_index_t) + DD_SLOTS * sizeof(dd_slot_t);
+
+    /* Two writers starting together must not both create it */
+    if (flock(dd->ifd, LOCK_EX) < 0)
+	return XAMBIT_ERR_STD;
+    if (fstat(dd->ifd, &st) < 0)
+	goto out;
+
+    if (st.st_size == 0)
+    {
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, DD_MAGIC, sizeof(head.magic));
+	head.version = DD_VERSION;
+	head.slots = DD_SLOTS;
+	if (ftruncate(dd->ifd, dd->map_len) < 0 ||
+	    pwrite(dd->ifd, &head, sizeof(head), 0) != sizeof(head))
+	    goto out;
+    }
+    else if ((size_t)st.st_size != dd->map_len ||
+	     pread(dd->ifd, &head, sizeof(head), 0) != sizeof(head) ||
+	     memcmp(head.magic, DD_MAGIC, sizeof(head.magic)) != 0 ||
+	     head.version != DD_VERSION || head.slots != DD_SLOTS)
+    {
+	/* Not something to be overwritten */
+	errno = EINVAL;
+	goto out;
+    }
+
+    dd->index = mmap(NULL, dd->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     dd->ifd, 0);
+    if (dd->index == MAP_FAILED)
+    {
+	dd->index = NULL;
+	goto out;
+    }
+    err = 0;
+
+out:
+    flock(dd->ifd, LOCK_UN);
+    return err;
+}
+
+/* The slot holding ref's digest, or failing that the one to put it in: the
+ * first empty slot it may go in, or the one sent longest ago. The index must
+ * be locked. */
+static dd_slot_t *dd_probe(xambit_dedup_t *dd, const dd_ref_t *ref)
+{
+    dd_slot_t	*s;
+    dd_slot_t	*use = NULL;
+    uint64_t	h;
+    int		i;
+
+    memcpy(&h, ref->digest, sizeof(h));
+    for (i = 0; i < DD_PROBE; i++)
+    {
+	s = &dd->index->slot[(h + i) % DD_SLOTS];
+	if (s->sent != 0 && memcmp(s->digest, ref->digest, 32) == 0)
+	    return s;
+	if (use == NULL || (use->sent != 0 && s->sent < use->sent))
+	    use = s;
+    }
+    return use;
+}
+
+/* The name a kept file has in the reader's store: its digest in hex */
+void dd_name(const uint8_t *digest, char *name)
+{
+    int		i;
+
+    for (i = 0; i < 32; i++)
+	sprintf(name + 2 * i, "%02x", digest[i]);
+}
+
+/* The temporary name, of DD_TMP_LEN bytes, a file to be named name is
+ * written under in a store. It is unique to the process and the call, since
+ * threads and channels may share a store. */
+void dd_tmp_name(const char *name, char *tmp)
+{
+    static unsigned int seq;
+
+    snprintf(tmp, DD_TMP_LEN, ".%s.%d.%u", name, (int)getpid(),
+	     __sync_fetch_and_add(&seq, 1));
+}
+
+/* Whether a writer's reader should still hold the len bytes of fd, sent
+ * before: 1 if so, 0 if not. ref is filled in either way, ready for
+ * dd_insert() once the file has been sent whole. */
+int dd_lookup(xambit_channel_t *ch, int fd, uint64_t len, dd_ref_t *ref)
+{
+    xambit_dedup_t *dd = ch->dedup;
+    dd_slot_t	*s;
+    void	*data;
+    int		hit;
+
+    data = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    if (data == MAP_FAILED)
+	return XAMBIT_ERR_STD;
+    madvise(data, len, MADV_SEQUENTIAL);
+    sha256(data, len, ref->digest);
+    ref->length = len;
+    if (len)
+	munmap(data, len);
+
+    if (flock(dd->ifd, LOCK_EX) < 0)
+	return XAMBIT_ERR_STD;
+    s = dd_probe(dd, ref);
+    hit = s->sent != 0 && memcmp(s->digest, ref->digest, 32) == 0 &&
+	  s->length == len && time(NULL) - s->sent < dd->max_age;
+    flock(dd->ifd, LOCK_UN);
+
+    return hit;
+}
+
+/* Note that the file ref describes has been sent whole. Nothing is lost but
+ * a later saving if this fails, so it cannot. */
+void dd_insert(xambit_channel_t *ch, const dd_ref_t *ref)
+{
+    xambit_dedup_t *dd = ch->dedup;
+    dd_slot_t	*s;
+
+    if (flock(dd->ifd, LOCK_EX) < 0)
+	return;
+    s = dd_probe(dd, ref);
+    memcpy(s->digest, ref->digest, 32);
+    s->length = ref->length;
+    s->sent = time(NULL);
+    flock(dd->ifd, LOCK_UN);
+}
+
+/* Copy the len bytes of sfd, mapped at data, to the start of fd: by the
+ * kernel, which may share the blocks, where it can */
+int dd_copy(int sfd, const void *data, uint64_t len, int fd)
+{
+    loff_t	in = 0;
+    loff_t	out = 0;
+    ssize_t	n;
+
+    while ((uint64_t)in < len)
+    {
+	n = copy_file_range(sfd, &in, fd, &out, len - in, 0);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+    }
+    if ((uint64_t)in == len)
+	return 0;
+
+    if (lseek(fd, in, SEEK_SET) < 0)
+	return XAMBIT_ERR_STD;
+    return fd_write_all(fd, (const uint8_t *)data + in, len - in);
+}
+
+/* Keep a copy in a reader's store of a validated XAMBIT_KEEP file, the len
+ * bytes of fd mapped at data, if it has none yet. digest is that of the data
+ * if already known, or NULL. */
+int dd_keep(xambit_channel_t *ch, int fd, const void *data, uint64_t len,
+	    const uint8_t *digest)
+{
+    xambit_dedup_t *dd = ch->dedup;
+    char	name[65];
+    char	tmp[DD_TMP_LEN];
+    uint8_t	own[32];
+    int		kfd;
+    int		err;
+
+    if (digest == NULL)
+    {
+	sha256(data, len, own);
+	digest = own;
+    }
+    dd_name(digest, name);
+    if (faccessat(dd->dirfd, name, F_OK, 0) == 0)
+	return 0;
+
+    dd_tmp_name(name, tmp);
+    kfd = openat(dd->dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		 0600);
+    if (kfd < 0)
+	return XAMBIT_ERR_STD;
+
+    err = dd_copy(fd, data, len, kfd);
+    if (close(kfd) < 0 && err == 0)
+	err = XAMBIT_ERR_STD;
+    if (err == 0 && renameat(dd->dirfd, tmp, dd->dirfd, name) < 0)
+	err = XAMBIT_ERR_STD;
+    if (err < 0)
+	unlinkat(dd->dirfd, tmp, 0);
+    return err;
+}
+
+/* Open and map the file a reference names in a reader's store, once it has
+ * been checked against the digest. Returns its descriptor, with the mapping
+ * of its ref->length bytes in *data, or XAMBIT_ERR_DEDUP if the store has no
+ * such file. One found to have changed is removed. */
+int dd_open(xambit_channel_t *ch, const dd_ref_t *ref, void **data)
+{
+    xambit_dedup_t *dd = ch->dedup;
+    struct stat	st;
+    char	name[65];
+    uint8_t	digest[32];
+    int		fd;
+
+    if (dd == NULL || ref->length > SIZE_MAX)
+	goto miss;
+
+    dd_name(ref->digest, name);
+    fd = openat(dd->dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	goto miss;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size != ref->length)
+	goto bad;
+
+    *data = ref->length ? mmap(NULL, ref->length, PROT_READ, MAP_SHARED, fd,
+			       0) : "";
+    if (*data == MAP_FAILED)
+	goto bad;
+    sha256(*data, ref->length, digest);
+    if (memcmp(digest, ref->digest, 32) == 0)
+	return fd;
+
+    if (ref->length)
+	munmap(*data, ref->length);
+bad:
+    close(fd);
+    unlinkat(dd->dirfd, name, 0);
+miss:
+    ch->stats.dedup_misses++;
+    return XAMBIT_ERR_DEDUP;
+}
+
+void dd_free(xambit_dedup_t *dd)
+{
+    if (dd == NULL)
+	return;
+
+    if (dd->index != NULL)
+	munmap(dd->index, dd->map_len);
+    if (dd->ifd >= 0)
+	close(dd->ifd);
+    if (dd->hfd >= 0)
+	close(dd->hfd);
+    close(dd->dirfd);
+    free(dd);
+}
+
+/*  Function Name:	channel_set_dedup
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To have a writer send again only a reference to files
+ *			it has sent before, and a reader resolve them.
+ *
+ *  Assumptions:	Called before the channel is used.
+ *
+ *  Notes:		dir is created if need be. A writer keeps its index of
+ *			the files it has sent there, which any number of
+ *			writers may share, and sends by reference only files
+ *			sent within max_age seconds; 0 selects
+ *			XAMBIT_DEDUP_AGE. A XAMBIT_DIFF writer also notes
+ *			there how it cut each file, to send its next version as
+ *			a delta. A reader keeps the files it is sent there,
+ *			rebuilds deltas from them, and ignores max_age. A NULL
+ *			dir turns it off.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_dedup(xambit_channel_t *ch, const char *dir, uint32_t max_age)
+{
+    xambit_dedup_t *dd;
+
+    if (ch == NULL || !ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (dir == NULL)
+    {
+	dd_free(ch->dedup);
+	ch->dedup = NULL;
+	return 0;
+    }
+
+    dd = calloc(1, sizeof(*dd));
+    if (dd == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    dd->ifd = -1;
+    dd->hfd = -1;
+    dd->max_age = max_age ? max_age : XAMBIT_DEDUP_AGE;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+	goto error;
+    dd->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dd->dirfd < 0)
+	goto error;
+
+    if (ch->direction == XAMBIT_CHOUT)
+    {
+	dd->ifd = openat(dd->dirfd, DD_INDEX, O_RDWR | O_CREAT | O_CLOEXEC,
+			 0600);
+	if (dd->ifd < 0 || dd_map_index(dd) < 0)
+	    goto error_close;
+    }
+
+    /* ... and one sending deltas, where each file was cut into chunks */
+    if (ch->direction == XAMBIT_CHOUT && (ch->flags & XAMBIT_DIFF))
+    {
+	if (mkdirat(dd->dirfd, DD_HISTORY, 0700) < 0 && errno != EEXIST)
+	    goto error_close;
+	dd->hfd = openat(dd->dirfd, DD_HISTORY,
+			 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dd->hfd < 0)
+	    goto error_close;
+    }
+
+    dd_free(ch->dedup);
+    ch->dedup = dd;
+    return 0;
+
+error_close:
+    dd_free(dd);
+    return XAMBIT_ERR_STD;
+
+error:
+    free(dd);
+    return XAMBIT_ERR_STD;
+}
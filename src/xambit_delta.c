@@ -0,0 +1,447 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Changed files sent as deltas. A XAMBIT_DIFF writer with a dedup directory
+ * notes, for each path it sends a file from, the digest of what it sent and
+ * how it cut it into chunks, each with the start of its SHA-256. When a file
+ * is sent again from that path with other contents it is cut the same way,
+ * and crosses as a XAMBIT_DELTA parcel: the chunks also in the old version
+ * are copied from the reader's kept copy of it, and only the others are
+ * sent. The cuts are where a gear hash rolled over the data meets a mask, so
+ * they follow the contents rather than their offsets, and an insertion or a
+ * deletion only changes the chunks about it.
+ *
+ * The writer has only its own notes to go on, so a delta is only ever taken
+ * against the version it last sent from the path, within max_age seconds.
+ * The reader rebuilds the file, checks it against the digest of the new
+ * version and validates it as any other, then keeps it for the next. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#define DL_MAGIC	"XAMBITDH"
+#define DL_VERSION	1
+#define DL_MIN		(1 << 11)   /* Smallest chunk, but the last */
+#define DL_BITS		13	    /* Chunks average 8K ... */
+#define DL_MAX		(1 << 16)   /* ... and are cut at 64K regardless */
+#define DL_HASH		16	    /* Bytes of a chunk's SHA-256 noted */
+
+/* Cuts are harder to make before the average size and easier after it, which
+ * keeps chunks nearer that size. The mask covers the high bits of the hash,
+ * those that depend on the last 64 bytes rather than the last few. */
+#define DL_MASK_S	(~0ULL << (64 - DL_BITS - 1))
+#define DL_MASK_L	(~0ULL << (64 - DL_BITS + 1))
+
+/* One chunk of a file, as noted */
+typedef struct dl_chunk_s {
+    uint8_t	hash[DL_HASH];
+    uint64_t	offset;
+    uint32_t	length;
+    uint32_t	pad;
+} dl_chunk_t;
+
+/* Start of a note, followed by its chunks */
+typedef struct dl_note_s {
+    char	magic[8];
+    uint32_t	version;
+    uint32_t	count;		    /* Chunks */
+    uint8_t	digest[32];	    /* The file as sent */
+    uint64_t	length;
+    int64_t	sent;		    /* Seconds since the epoch */
+} dl_note_t;
+
+static uint64_t dl_gear[256];
+
+static size_t dl_cut(const uint8_t *p, size_t n);
+static int dl_chunks(const uint8_t *data, uint64_t len, dl_state_t *dl);
+static dl_chunk_t *dl_read(xambit_channel_t *ch, const char *name,
+			   dl_note_t *note);
+static int dl_diff(const dl_note_t *note, dl_chunk_t *old,
+		   const uint8_t *data, const dd_ref_t *ref, dl_state_t *dl);
+
+/* The gear table: any fixed random values will do, but the writer's notes
+ * are only any use while they stay the same */
+__attribute__((constructor))
+static void dl_init(void)
+{
+    uint64_t	x = 0x58616d6269744463ULL;
+    uint64_t	z;
+    int		i;
+
+    for (i = 0; i < 256; i++)
+    {
+	z = (x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	dl_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Length of the chunk at the start of the n bytes at p */
+static size_t dl_cut(const uint8_t *p, size_t n)
+{
+    uint64_t	h = 0;
+    size_t	avg = 1 << DL_BITS;
+    size_t	i;
+
+    if (n <= DL_MIN)
+	return n;
+    if (n > DL_MAX)
+	n = DL_MAX;
+    if (avg > n)
+	avg = n;
+
+    for (i = DL_MIN; i < avg; i++)
+    {
+	h = (h << 1) + dl_gear[p[i]];
+	if (!(h & DL_MASK_S))
+	    return i + 1;
+    }
+    for (; i < n; i++)
+    {
+	h = (h << 1) + dl_gear[p[i]];
+	if (!(h & DL_MASK_L))
+	    return i + 1;
+    }
+    return n;
+}
+
+/* Cut the len bytes at data into chunks, into dl */
+static int dl_chunks(const uint8_t *data, uint64_t len, dl_state_t *dl)
+{
+    uint8_t	digest[32];
+    uint64_t	off;
+    size_t	n;
+
+    /* No chunk but the last is shorter than DL_MIN */
+    if (len / DL_MIN + 1 > UINT32_MAX)
+    {
+	errno = EFBIG;
+	return XAMBIT_ERR_STD;
+    }
+    dl->chunk = malloc((len / DL_MIN + 1) * sizeof(dl_chunk_t));
+    if (dl->chunk == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+
+    for (off = 0; off < len; off += n)
+    {
+	n = dl_cut(data + off, len - off);
+	sha256(data + off, n, digest);
+	memcpy(dl->chunk[dl->count].hash, digest, DL_HASH);
+	dl->chunk[dl->count].offset = off;
+	dl->chunk[dl->count].length = n;
+	dl->chunk[dl->count].pad = 0;
+	dl->count++;
+    }
+    return 0;
+}
+
+/* Read the note name, if there is one still to be trusted. Returns its
+ * chunks, or NULL. */
+static dl_chunk_t *dl_read(xambit_channel_t *ch, const char *name,
+			   dl_note_t *note)
+{
+    dl_chunk_t	*chunk = NULL;
+    size_t	size;
+    int		fd;
+
+    fd = openat(ch->dedup->hfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return NULL;
+
+    if (read(fd, note, sizeof(*note)) != sizeof(*note) ||
+	memcmp(note->magic, DL_MAGIC, sizeof(note->magic)) != 0 ||
+	note->version != DL_VERSION || note->count == 0 ||
+	note->count > note->length / DL_MIN + 1 ||
+	time(NULL) - note->sent >= ch->dedup->max_age)
+	goto out;
+
+    size = (size_t)note->count * sizeof(dl_chunk_t);
+    chunk = malloc(size);
+    if (chunk != NULL && read(fd, chunk, size) != (ssize_t)size)
+    {
+	free(chunk);
+	chunk = NULL;
+    }
+
+out:
+    close(fd);
+    return chunk;
+}
+
+/* Build in dl the delta that makes the file ref describes, at data, out of
+ * the old version, cut into old as note says. Returns 1 if it saves at least
+ * an eighth of the file, or 0 if it is not worth sending. */
+static int dl_diff(const dl_note_t *note, dl_chunk_t *old,
+		   const uint8_t *data, const dd_ref_t *ref, dl_state_t *dl)
+{
+    dl_chunk_t	*c;
+    dl_chunk_t	*m;
+    dl_hdr_t	*dh;
+    dl_op_t	*cp = NULL;
+    dl_op_t	*lit = NULL;
+    uint32_t	*table;
+    uint8_t	*out;
+    uint64_t	key;
+    size_t	limit = ref->length - ref->length / 8;
+    size_t	pos = sizeof(dl_hdr_t);
+    size_t	mask;
+    size_t	j;
+    uint32_t	i;
+
+    /* An open addressed table of the old chunks, at most half full */
+    for (mask = 1; mask < 2 * (size_t)note->count; mask <<= 1)
+	;
+    table = calloc(mask, sizeof(*table));
+    out = malloc(limit);
+    if (table == NULL || out == NULL)
+	goto no;
+    mask--;
+    for (i = 0; i < note->count; i++)
+    {
+	memcpy(&key, old[i].hash, sizeof(key));
+	for (j = key & mask; table[j] != 0; j = (j + 1) & mask)
+	    ;
+	table[j] = i + 1;
+    }
+
+    for (i = 0; i < dl->count; i++)
+    {
+	c = &dl->chunk[i];
+	memcpy(&key, c->hash, sizeof(key));
+	m = NULL;
+	for (j = key & mask; table[j] != 0; j = (j + 1) & mask)
+	{
+	    m = &old[table[j] - 1];
+	    if (m->length == c->length &&
+		memcmp(m->hash, c->hash, DL_HASH) == 0 &&
+		m->length <= note->length &&
+		m->offset <= note->length - m->length)
+		break;
+	    m = NULL;
+	}
+
+	/* Runs of chunks copied from one after another in the old version,
+	 * or not found in it, each take a single operation */
+	if (m != NULL && cp != NULL &&
+	    cp->offset + cp->length == m->offset &&
+	    cp->length <= UINT32_MAX - c->length)
+	{
+	    cp->length += c->length;
+	    continue;
+	}
+	if (m == NULL && lit != NULL && lit->length <= UINT32_MAX - c->length)
+	{
+	    if (pos + c->length > limit)
+		goto no;
+	    memcpy(out + pos, data + c->offset, c->length);
+	    pos += c->length;
+	    lit->length += c->length;
+	    continue;
+	}
+
+	if (pos + sizeof(dl_op_t) + (m == NULL ? c->length : 0) > limit)
+	    goto no;
+	if (m != NULL)
+	{
+	    cp = (dl_op_t *)(out + pos);
+	    cp->offset = m->offset;
+	    cp->length = c->length;
+	    lit = NULL;
+	    pos += sizeof(dl_op_t);
+	}
+	else
+	{
+	    lit = (dl_op_t *)(out + pos);
+	    lit->offset = DL_LITERAL;
+	    lit->length = c->length;
+	    cp = NULL;
+	    pos += sizeof(dl_op_t);
+	    memcpy(out + pos, data + c->offset, c->length);
+	    pos += c->length;
+	}
+    }
+
+    dh = (dl_hdr_t *)out;
+    memcpy(dh->base.digest, note->digest, sizeof(dh->base.digest));
+    dh->base.length = note->length;
+    dh->file = *ref;
+    dl->delta = out;
+    dl->delta_len = pos;
+    free(table);
+    return 1;
+
+no:
+    free(table);
+    free(out);
+    return 0;
+}
+
+/* Cut the file at fd, described by ref, as a XAMBIT_DIFF writer about to
+ * send it from path, and unless the reader already has it (hit) make the
+ * delta from the version last sent from there. Returns 1 if dl holds a delta
+ * worth sending, 0 if not, or negetive on failure. Either way dl is ready
+ * for dl_save() once the file has been sent, and dl_free(). */
+int dl_encode(xambit_channel_t *ch, const char *path, int fd,
+	      const dd_ref_t *ref, int hit, dl_state_t *dl)
+{
+    char	real[PATH_MAX];
+    uint8_t	digest[32];
+    dl_note_t	note;
+    dl_chunk_t	*old;
+    void	*data;
+    int		err;
+
+    if (ch->dedup->hfd < 0)
+	return 0;
+
+    /* Notes are filed by the digest of the file's path */
+    if (realpath(path, real) != NULL)
+	path = real;
+    sha256(path, strlen(path), digest);
+    dd_name(digest, dl->name);
+
+    data = mmap(NULL, ref->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+	return XAMBIT_ERR_STD;
+    madvise(data, ref->length, MADV_SEQUENTIAL);
+
+    err = dl_chunks(data, ref->length, dl);
+    if (err == 0 && !hit)
+    {
+	old = dl_read(ch, dl->name, &note);
+	if (old != NULL &&
+	    memcmp(note.digest, ref->digest, sizeof(note.digest)) != 0)
+	    err = dl_diff(&note, old, data, ref, dl);
+	free(old);
+    }
+
+    munmap(data, ref->length);
+    return err;
+}
+
+/* Note how the file ref describes, just sent, was cut. Nothing is lost but a
+ * later saving if this fails, so it cannot. */
+void dl_save(xambit_channel_t *ch, const dl_state_t *dl, const dd_ref_t *ref)
+{
+    char	tmp[DD_TMP_LEN];
+    dl_note_t	note;
+    size_t	size = (size_t)dl->count * sizeof(dl_chunk_t);
+    int		fd;
+    int		ok;
+
+    if (dl->chunk == NULL)
+	return;
+
+    memset(&note, 0, sizeof(note));
+    memcpy(note.magic, DL_MAGIC, sizeof(note.magic));
+    note.version = DL_VERSION;
+    note.count = dl->count;
+    memcpy(note.digest, ref->digest, sizeof(note.digest));
+    note.length = ref->length;
+    note.sent = time(NULL);
+
+    dd_tmp_name(dl->name, tmp);
+    fd = openat(ch->dedup->hfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		0600);
+    if (fd < 0)
+	return;
+    ok = fd_write_all(fd, &note, sizeof(note)) == 0 &&
+	 fd_write_all(fd, dl->chunk, size) == 0;
+    if (close(fd) < 0)
+	ok = 0;
+    if (!ok || renameat(ch->dedup->hfd, tmp, ch->dedup->hfd, dl->name) < 0)
+	unlinkat(ch->dedup->hfd, tmp, 0);
+}
+
+void dl_free(dl_state_t *dl)
+{
+    free(dl->chunk);
+    free(dl->delta);
+    dl->chunk = NULL;
+    dl->delta = NULL;
+}
+
+/* Rebuild into dst the file the len byte XAMBIT_DELTA parcel data at src
+ * describes, from the mapping of the old version at base. dst must hold the
+ * length the parcel gives. Returns 0, or XAMBIT_ERR_STD with errno set to
+ * EBADMSG if the operations do not make up exactly that length from within
+ * the old version and the parcel. */
+int dl_apply(const void *src, uint64_t len, const void *base, void *dst)
+{
+    const uint8_t *p = (const uint8_t *)src + sizeof(dl_hdr_t);
+    const uint8_t *end = (const uint8_t *)src + len;
+    dl_hdr_t	dh;
+    dl_op_t	op;
+    uint64_t	done = 0;
+
+    memcpy(&dh, src, sizeof(dh));
+    while (p < end)
+    {
+	if ((size_t)(end - p) < sizeof(op))
+	    goto bad;
+	memcpy(&op, p, sizeof(op));
+	p += sizeof(op);
+	if (op.length > dh.file.length - done)
+	    goto bad;
+
+	if (op.offset == DL_LITERAL)
+	{
+	    if (op.length > (size_t)(end - p))
+		goto bad;
+	    memcpy((uint8_t *)dst + done, p, op.length);
+	    p += op.length;
+	}
+	else
+	{
+	    if (op.offset > dh.base.length ||
+		op.length > dh.base.length - op.offset)
+		goto bad;
+	    memcpy((uint8_t *)dst + done, (const uint8_t *)base + op.offset,
+		   op.length);
+	}
+	done += op.length;
+    }
+
+    if (done == dh.file.length)
+	return 0;
+
+bad:
+    errno = EBADMSG;
+    return XAMBIT_ERR_STD;
+}
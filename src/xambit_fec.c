@@ -0,0 +1,274 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Reed-Solomon erasure coding over GF(2^8), for channels with no way to ask
+ * for a lost parcel again. A block of n data symbols gains r repair symbols,
+ * each a sum of the data symbols weighted by a row of a Cauchy matrix; any
+ * square piece of a Cauchy matrix is invertible, so any n of the n + r
+ * symbols give back the rest.
+ *
+ * The work is all in multiplying a symbol by a constant and adding it to
+ * another. On x86-64 CPUs with SSSE3 or AVX2 that is done 16 or 32 bytes at
+ * a time with pshufb, looking the product of each nibble up in a 16 entry
+ * table; elsewhere a full multiplication table is used. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define XAMBIT_GF_X86
+#endif
+
+#include "xambit_int.h"
+
+#define GF_POLY		0x11d	    /* x^8 + x^4 + x^3 + x^2 + 1 */
+
+typedef void (*gf_fn_t)(uint8_t *dst, const uint8_t *src, uint8_t c,
+			size_t len);
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+static gf_fn_t gf_mul_add_run;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return gf_mul_table[a][b];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void gf_mul_add_sw(uint8_t *dst, const uint8_t *src, uint8_t c,
+			  size_t len)
+{
+    const uint8_t   *t = gf_mul_table[c];
+    size_t	    i;
+
+    for (i = 0; i < len; i++)
+	dst[i] ^= t[src[i]];
+}
+
+#ifdef XAMBIT_GF_X86
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+			     size_t len)
+{
+    __m128i	lo = _mm_loadu_si128((const __m128i *)gf_mul_table[c]);
+    __m128i	hi;
+    __m128i	mask = _mm_set1_epi8(0x0f);
+    __m128i	s, p;
+    uint8_t	th[16];
+    int		i;
+
+    for (i = 0; i < 16; i++)
+	th[i] = gf_mul_table[c][i << 4];
+    hi = _mm_loadu_si128((const __m128i *)th);
+
+    for (; len >= 16; len -= 16, src += 16, dst += 16)
+    {
+	s = _mm_loadu_si128((const __m128i *)src);
+	p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+		_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+	_mm_storeu_si128((__m128i *)dst,
+			 _mm_xor_si128(_mm_loadu_si128((__m128i *)dst), p));
+    }
+    gf_mul_add_sw(dst, src, c, len);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+			    size_t len)
+{
+    __m256i	lo;
+    __m256i	hi;
+    __m256i	mask = _mm256_set1_epi8(0x0f);
+    __m256i	s, p;
+    uint8_t	th[16];
+    int		i;
+
+    for (i = 0; i < 16; i++)
+	th[i] = gf_mul_table[c][i << 4];
+    lo = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)gf_mul_table[c]));
+    hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)th));
+
+    for (; len >= 32; len -= 32, src += 32, dst += 32)
+    {
+	s = _mm256_loadu_si256((const __m256i *)src);
+	p = _mm256_xor_si256(
+		_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+		_mm256_shuffle_epi8(hi,
+			_mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+	_mm256_storeu_si256((__m256i *)dst,
+		_mm256_xor_si256(_mm256_loadu_si256((__m256i *)dst), p));
+    }
+    gf_mul_add_sw(dst, src, c, len);
+}
+#endif
+
+__attribute__((constructor))
+static void gf_init(void)
+{
+    int		x = 1;
+    int		a;
+    int		b;
+
+    for (a = 0; a < 255; a++)
+    {
+	gf_exp[a] = x;
+	gf_exp[a + 255] = x;
+	gf_log[x] = a;
+	x <<= 1;
+	if (x & 0x100)
+	    x ^= GF_POLY;
+    }
+
+    for (a = 1; a < 256; a++)
+	for (b = 1; b < 256; b++)
+	    gf_mul_table[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+
+    gf_mul_add_run = gf_mul_add_sw;
+#ifdef XAMBIT_GF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	gf_mul_add_run = gf_mul_add_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+	gf_mul_add_run = gf_mul_add_ssse3;
+#endif
+}
+
+/* Add c times len bytes at src to dst */
+void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+	return;
+    gf_mul_add_run(dst, src, c, len);
+}
+
+/* Weight of data symbol i in repair symbol j of a code with r repair
+ * symbols. The rows and columns take distinct points, 0..r-1 and r on, so
+ * the sum is never 0. */
+static uint8_t fec_coef(int r, int j, int i)
+{
+    return gf_inv(j ^ (r + i));
+}
+
+/* Compute the r repair symbols for n data symbols, each of len bytes */
+void fec_encode(int r, int n, uint8_t *const *data, uint8_t *const *repair,
+		size_t len)
+{
+    int		i;
+    int		j;
+
+    for (j = 0; j < r; j++)
+    {
+	memset(repair[j], 0, len);
+	for (i = 0; i < n; i++)
+	    gf_mul_add(repair[j], data[i], fec_coef(r, j, i), len);
+    }
+}
+
+/* Rebuild the data symbols not in have from the repair symbols in rhave.
+ * The repair symbols used are overwritten. Returns 0 if every data symbol
+ * is now present, negative if too few symbols arrived. */
+int fec_decode(int r, int n, uint8_t *const *data, const uint8_t *have,
+	       uint8_t *const *repair, const uint8_t *rhave, size_t len)
+{
+    uint8_t	m[XAMBIT_FEC_MAX][2 * XAMBIT_FEC_MAX];
+    int		lost[XAMBIT_FEC_MAX];
+    int		rows[XAMBIT_FEC_MAX];
+    uint8_t	c;
+    int		e = 0;
+    int		k = 0;
+    int		i;
+    int		j;
+    int		t;
+
+    for (i = 0; i < n; i++)
+	if (!have[i])
+	{
+	    if (e == r)
+		return XAMBIT_ERR_STD;
+	    lost[e++] = i;
+	}
+    if (e == 0)
+	return 0;
+
+    for (j = 0; j < r && k < e; j++)
+	if (rhave[j])
+	    rows[k++] = j;
+    if (k < e)
+	return XAMBIT_ERR_STD;
+
+    /* Take the data that did arrive out of the repair symbols, leaving
+     * each the sum of the lost symbols alone */
+    for (t = 0; t < e; t++)
+	for (i = 0; i < n; i++)
+	    if (have[i])
+		gf_mul_add(repair[rows[t]], data[i], fec_coef(r, rows[t], i),
+			   len);
+
+    /* Invert the e x e piece of the matrix for the lost symbols */
+    for (t = 0; t < e; t++)
+	for (i = 0; i < e; i++)
+	{
+	    m[t][i] = fec_coef(r, rows[t], lost[i]);
+	    m[t][e + i] = t == i;
+	}
+    for (i = 0; i < e; i++)
+    {
+	for (t = i; m[t][i] == 0; t++)
+	    ;
+	if (t != i)
+	    for (j = 0; j < 2 * e; j++)
+	    {
+		c = m[i][j];
+		m[i][j] = m[t][j];
+		m[t][j] = c;
+	    }
+	c = gf_inv(m[i][i]);
+	for (j = 0; j < 2 * e; j++)
+	    m[i][j] = gf_mul(m[i][j], c);
+	for (t = 0; t < e; t++)
+	    if (t != i && m[t][i] != 0)
+	    {
+		c = m[t][i];
+		for (j = 0; j < 2 * e; j++)
+		    m[t][j] ^= gf_mul(m[i][j], c);
+	    }
+    }
+
+    for (i = 0; i < e; i++)
+    {
+	memset(data[lost[i]], 0, len);
+	for (t = 0; t < e; t++)
+	    gf_mul_add(data[lost[i]], repair[rows[t]], m[i][e + t], len);
+    }
+    return 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Library internal interfaces shared between the XAmbit source files. None of
+ * these are exported from the shared library. */
+
+#ifndef XAMBIT_INT_H
+#define XAMBIT_INT_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <xambit.h>
+
+#define XAMBIT_INTERNAL __attribute__((visibility("hidden")))
+
+#define XAMBIT_FEC_MAX	XAMBIT_UDP_BATCH    /* Most symbols in a FEC block */
+
+/* A unit of work for the channel worker threads, counted against a group
+ * that can be waited on */
+typedef struct xw_group_s {
+    int		pending;
+} xw_group_t;
+
+typedef struct xw_job_s {
+    void	(*fn)(void *arg);
+    void	*arg;
+    xw_group_t	*group;
+    struct xw_job_s *next;
+} xw_job_t;
+
+/* Start of the data of a XAMBIT_ZLIB parcel, followed by the deflated length
+ * of each piece and then the pieces; see xambit_zlib.c */
+typedef struct zl_hdr_s {
+    uint64_t	length;		    /* Inflated */
+    uint32_t	chunk;		    /* Inflated bytes a piece, but the last */
+    uint32_t	count;		    /* Pieces */
+} PACKED zl_hdr_t;
+
+/* The data of a XAMBIT_REF parcel; see xambit_dedup.c */
+typedef struct dd_ref_s {
+    uint8_t	digest[32];	    /* SHA-256 of the file */
+    uint64_t	length;
+} PACKED dd_ref_t;
+
+#define DD_TMP_LEN	96	    /* Room for a temporary name in a store */
+
+/* Start of the data of a XAMBIT_DELTA parcel, followed by the operations
+ * that rebuild the file: each a dl_op_t copying from the old version, or one
+ * at DL_LITERAL followed by the bytes it adds; see xambit_delta.c */
+typedef struct dl_hdr_s {
+    dd_ref_t	base;		    /* The old version, kept by the reader */
+    dd_ref_t	file;		    /* The file rebuilt */
+} PACKED dl_hdr_t;
+
+typedef struct dl_op_s {
+    uint64_t	offset;		    /* In the old version, or DL_LITERAL */
+    uint32_t	length;
+} PACKED dl_op_t;
+
+#define DL_LITERAL	UINT64_MAX
+
+/* What a XAMBIT_DIFF writer made of a file it is about to send: how it cut
+ * it, and the delta to send if one is worth it */
+typedef struct dl_state_s {
+    char	name[65];	    /* Of the file's note in the history */
+    struct dl_chunk_s *chunk;
+    uint32_t	count;
+    void	*delta;
+    size_t	delta_len;
+} dl_state_t;
+
+/* Start of the data of a XAMBIT_EXTENT parcel, followed by the extent;
+ * see xambit_journal.c */
+typedef struct ex_hdr_s {
+    uint8_t	id[16];		    /* Names the file's transfer */
+    uint64_t	size;		    /* Of the whole file */
+    uint64_t	extent;		    /* Bytes an extent, but the last */
+    uint64_t	index;		    /* This extent's, from 0 */
+} PACKED ex_hdr_t;
+
+/* A channel's extent journal */
+struct xambit_journal_s {
+    int		dirfd;
+    uint64_t	extent;		    /* Writer's extent length */
+    uint32_t	rewind;		    /* Writer's extents sent again */
+    uint8_t	held_id[16];	    /* File a non-blocking writer stopped */
+    uint64_t	held_next;	    /* ... part way through, at this extent,
+				       or 0 */
+};
+
+/* A reader's file being put together from extents */
+typedef struct jn_part_s {
+    char	name[40];	    /* The transfer's id in hex, and room for
+				       a suffix */
+    int		fd;		    /* The file so far */
+    int		mfd;		    /* Its map of the extents in it */
+    uint64_t	count;		    /* Extents in all */
+    uint64_t	have;		    /* ... of which received */
+} jn_part_t;
+
+/* Start of the data of a XAMBIT_HOLES parcel, followed by a sp_run_t for
+ * each run of data in the file and then the bytes of each in turn. Anything
+ * else in the file is a hole. */
+typedef struct sp_hdr_s {
+    uint64_t	size;		    /* Of the whole file */
+    uint64_t	runs;
+} PACKED sp_hdr_t;
+
+typedef struct sp_run_s {
+    uint64_t	offset;
+    uint64_t	length;
+} PACKED sp_run_t;
+
+/* What a non-blocking channel has still to write of a file it has accepted:
+ * left bytes of fd from off, then each of run[next, runs) in turn. It is
+ * read from fd a buffer at a time rather than held in memory. */
+struct xambit_tx_file_s {
+    int		fd;		    /* A dup of the sender's descriptor */
+    uint64_t	off;
+    uint64_t	left;
+    uint64_t	next;
+    uint64_t	runs;
+    sp_run_t	run[];
+};
+
+/* A parcel a non-blocking channel_receive_to_file is writing to its
+ * temporary file as it arrives, over as many calls as that takes */
+struct xambit_rx_file_s {
+    xambit_parcel_hdr_t hdr;
+    int		fd;
+    int		err;		    /* First write error; the rest of the
+				       payload is then passed over */
+    uint64_t	left;		    /* Payload bytes still to come */
+    char	tmp[PATH_MAX];
+};
+
+/* A channel's dedup directory; see xambit_dedup.c */
+struct xambit_dedup_s {
+    int		dirfd;
+    int		ifd;		    /* Writer's index, or -1 */
+    int		hfd;		    /* XAMBIT_DIFF writer's history, or -1 */
+    struct dd_index_s *index;	    /* ... mapped */
+    size_t	map_len;
+    uint32_t	max_age;
+};
+
+/* Transports that carry parcels */
+static inline int ch_type_ok(xambit_channel_t *ch)
+{
+    return ch->type == XAMBIT_CH_FIFO || ch->type == XAMBIT_CH_SHM ||
+	   ch->type == XAMBIT_CH_SOCK || ch->type == XAMBIT_CH_UDP;
+}
+
+/* xambit.c */
+XAMBIT_INTERNAL xambit_channel_t *ch_alloc(const char *path, int flags,
+				int write, int type);
+XAMBIT_INTERNAL void ch_free(xambit_channel_t *ch);
+XAMBIT_INTERNAL xambit_type_validator_t *lookup_type_validator(
+				xambit_channel_t *ch, uint32_t tid);
+XAMBIT_INTERNAL int tv_validate(xambit_type_validator_t *tv,
+				xambit_parcel_hdr_t *hdr, void *data);
+XAMBIT_INTERNAL int prepare_parcel(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *p);
+XAMBIT_INTERNAL int ch_emit(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+				void *buf);
+XAMBIT_INTERNAL int ch_tx_ready(xambit_channel_t *ch);
+XAMBIT_INTERNAL int ch_nonblock(xambit_channel_t *ch);
+XAMBIT_INTERNAL int rx_fill(xambit_channel_t *ch, size_t need);
+XAMBIT_INTERNAL int rx_fill_wait(xambit_channel_t *ch, size_t need);
+XAMBIT_INTERNAL int rx_buffered(xambit_channel_t *ch);
+XAMBIT_INTERNAL int rx_parse_hdr(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *hdr);
+XAMBIT_INTERNAL int rx_next(xambit_channel_t *ch, xambit_parcel_hdr_t *h,
+				void **sdata);
+XAMBIT_INTERNAL int rx_copy(xambit_channel_t *ch, void *dst, uint64_t len,
+				uint32_t *crc);
+XAMBIT_INTERNAL int rx_check_data(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *hdr, const void *data,
+				const uint32_t *crc);
+XAMBIT_INTERNAL int fd_write_all(int fd, const void *buf, size_t len);
+XAMBIT_INTERNAL int rx_temp_name(const char *path, char *tmp);
+XAMBIT_INTERNAL int rx_open_temp(const char *path, mode_t omode, char *tmp);
+XAMBIT_INTERNAL int rx_install(xambit_channel_t *ch, const char *tmp, int tfd,
+				const char *path, int oflags, mode_t omode);
+XAMBIT_INTERNAL uint64_t now_usec(void);
+
+/* xambit_stream.c */
+XAMBIT_INTERNAL int rx_stream_segment(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *seg, void *data, int fd,
+				xambit_parcel_hdr_t *out);
+XAMBIT_INTERNAL void *rx_stream_take(xambit_channel_t *ch);
+XAMBIT_INTERNAL void rx_stream_reset(xambit_channel_t *ch);
+XAMBIT_INTERNAL int rx_stream_to_file(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *first, const char *path,
+				int oflags, mode_t omode);
+
+/* xambit_crc.c */
+XAMBIT_INTERNAL uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+XAMBIT_INTERNAL uint32_t crc32c_copy(void *dst, const void *src, size_t len,
+				uint32_t crc);
+XAMBIT_INTERNAL uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2,
+				uint64_t len2);
+
+/* xambit_sync.c */
+XAMBIT_INTERNAL size_t sync_find(const uint8_t *p, size_t len);
+
+/* xambit_sha.c */
+XAMBIT_INTERNAL void sha256(const void *buf, uint64_t len, uint8_t *digest);
+
+/* xambit_fec.c */
+XAMBIT_INTERNAL void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c,
+				size_t len);
+XAMBIT_INTERNAL void fec_encode(int r, int n, uint8_t *const *data,
+				uint8_t *const *repair, size_t len);
+XAMBIT_INTERNAL int fec_decode(int r, int n, uint8_t *const *data,
+				const uint8_t *have, uint8_t *const *repair,
+				const uint8_t *rhave, size_t len);
+
+/* xambit_lock.c */
+XAMBIT_INTERNAL int ch_lock_open(xambit_channel_t *ch);
+XAMBIT_INTERNAL void ch_lock_close(xambit_channel_t *ch);
+XAMBIT_INTERNAL void ch_lock(xambit_channel_t *ch);
+XAMBIT_INTERNAL void ch_unlock(xambit_channel_t *ch);
+XAMBIT_INTERNAL int ch_lock_held(xambit_channel_t *ch);
+XAMBIT_INTERNAL int ch_lock_send(xambit_channel_t *ch, uint64_t len);
+XAMBIT_INTERNAL void ch_unlock_send(xambit_channel_t *ch, int atomic);
+
+/* Add to a send statistic, which concurrent senders may share */
+#define CH_STAT_ADD(ch, field, n)					\
+    do {								\
+	if ((ch)->lock != NULL)						\
+	    __atomic_add_fetch(&(ch)->stats.field, (n), __ATOMIC_RELAXED); \
+	else								\
+	    (ch)->stats.field += (n);					\
+    } while (0)
+
+/* xambit_registry.c */
+#define REG_ADD		0	    /* How registry_update changes a type */
+#define REG_REPLACE	1
+#define REG_REMOVE	2
+
+XAMBIT_INTERNAL xambit_type_validator_t *registry_get(xambit_registry_t *reg,
+				uint32_t tid);
+XAMBIT_INTERNAL void tv_put(xambit_type_validator_t *tv);
+XAMBIT_INTERNAL int registry_update(xambit_registry_t *reg, uint32_t tid,
+				const xambit_validator_ops_t *ops, int how);
+XAMBIT_INTERNAL uint32_t registry_count(xambit_registry_t *reg);
+XAMBIT_INTERNAL void registry_hold(xambit_registry_t *reg);
+
+/* xambit_rules.c */
+XAMBIT_INTERNAL void rules_hold(xambit_rules_t *rules);
+
+/* Check a whole parcel against the rules of its type, if it has any */
+static inline int tv_rules(xambit_type_validator_t *tv,
+			   xambit_parcel_hdr_t *hdr, const void *data)
+{
+    if (tv->rules == NULL)
+	return 0;
+    return xambit_rules_check(tv->rules, data, hdr->length) < 0 ?
+	   XAMBIT_ERR_VALIDATE : 0;
+}
+
+/* xambit_pipeline.c */
+XAMBIT_INTERNAL int pl_receive(xambit_channel_t *ch,
+				xambit_parcel_hdr_t **phdr, void **buf);
+XAMBIT_INTERNAL int pl_receive_into(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *header, void *buf,
+				size_t size);
+XAMBIT_INTERNAL int pl_receive_batch(xambit_channel_t *ch,
+				xambit_parcel_t *parcels, int max);
+XAMBIT_INTERNAL void pl_get_stats(xambit_channel_t *ch,
+				xambit_stats_t *stats);
+XAMBIT_INTERNAL void pl_stop(xambit_channel_t *ch);
+
+/* xambit_uring.c */
+XAMBIT_INTERNAL int uring_open(xambit_channel_t *ch);
+XAMBIT_INTERNAL ssize_t uring_read(xambit_channel_t *ch, void *buf,
+				size_t len);
+XAMBIT_INTERNAL int uring_send_file(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *hdr, int fd, uint64_t len,
+				uint64_t *sent);
+XAMBIT_INTERNAL void uring_close(xambit_channel_t *ch);
+
+/* xambit_zlib.c */
+XAMBIT_INTERNAL void *zl_deflate(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *hdr, const void *buf);
+XAMBIT_INTERNAL int zl_length(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+				const void *src, uint64_t *len);
+XAMBIT_INTERNAL int zl_inflate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+				const void *src, void *dst,
+				xambit_stats_t *stats);
+
+/* xambit_dedup.c */
+XAMBIT_INTERNAL int dd_lookup(xambit_channel_t *ch, int fd, uint64_t len,
+				dd_ref_t *ref);
+XAMBIT_INTERNAL void dd_insert(xambit_channel_t *ch, const dd_ref_t *ref);
+XAMBIT_INTERNAL int dd_keep(xambit_channel_t *ch, int fd, const void *data,
+				uint64_t len, const uint8_t *digest);
+XAMBIT_INTERNAL int dd_open(xambit_channel_t *ch, const dd_ref_t *ref,
+				void **data);
+XAMBIT_INTERNAL int dd_copy(int sfd, const void *data, uint64_t len, int fd);
+XAMBIT_INTERNAL void dd_free(xambit_dedup_t *dd);
+XAMBIT_INTERNAL void dd_name(const uint8_t *digest, char *name);
+XAMBIT_INTERNAL void dd_tmp_name(const char *name, char *tmp);
+
+/* xambit_delta.c */
+XAMBIT_INTERNAL int dl_encode(xambit_channel_t *ch, const char *path, int fd,
+				const dd_ref_t *ref, int hit, dl_state_t *dl);
+XAMBIT_INTERNAL void dl_save(xambit_channel_t *ch, const dl_state_t *dl,
+				const dd_ref_t *ref);
+XAMBIT_INTERNAL void dl_free(dl_state_t *dl);
+XAMBIT_INTERNAL int dl_apply(const void *src, uint64_t len, const void *base,
+				void *dst);
+
+/* xambit_journal.c */
+XAMBIT_INTERNAL int jn_send_open(xambit_channel_t *ch, const char *path,
+				const struct stat *st, uint8_t *id,
+				uint64_t *first);
+XAMBIT_INTERNAL void jn_send_mark(int jfd, uint64_t sent);
+XAMBIT_INTERNAL void jn_send_done(xambit_channel_t *ch, const uint8_t *id,
+				int jfd);
+XAMBIT_INTERNAL int jn_recv_open(xambit_channel_t *ch, const ex_hdr_t *eh,
+				jn_part_t *jp);
+XAMBIT_INTERNAL int jn_recv_has(jn_part_t *jp, uint64_t index);
+XAMBIT_INTERNAL int jn_recv_mark(jn_part_t *jp, uint64_t index);
+XAMBIT_INTERNAL int jn_recv_take(xambit_channel_t *ch, jn_part_t *jp,
+				const char *path, char *tmp);
+XAMBIT_INTERNAL void jn_recv_close(xambit_channel_t *ch, jn_part_t *jp,
+				int remove);
+XAMBIT_INTERNAL void jn_free(xambit_journal_t *jn);
+
+/* xambit_set.c */
+XAMBIT_INTERNAL void set_leave(xambit_channel_t *ch);
+
+/* xambit_shm.c */
+XAMBIT_INTERNAL ssize_t shm_writev(xambit_channel_t *ch,
+				const struct iovec *iov, int cnt);
+XAMBIT_INTERNAL ssize_t shm_read(xambit_channel_t *ch, void *buf, size_t len);
+XAMBIT_INTERNAL int shm_rx_fill(xambit_channel_t *ch, size_t need);
+XAMBIT_INTERNAL void shm_close(xambit_channel_t *ch);
+
+/* xambit_sock.c */
+XAMBIT_INTERNAL ssize_t sock_writev(xambit_channel_t *ch,
+				const struct iovec *iov, int cnt);
+XAMBIT_INTERNAL ssize_t sock_read(xambit_channel_t *ch, void *buf, size_t len);
+XAMBIT_INTERNAL int sock_memfd(int fd, uint64_t size);
+XAMBIT_INTERNAL int sock_send_fd(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *hdr, int fd);
+XAMBIT_INTERNAL int sock_rx_attach(xambit_channel_t *ch,
+				xambit_parcel_hdr_t *hdr);
+XAMBIT_INTERNAL void *sock_att_take(xambit_channel_t *ch, uint64_t len);
+XAMBIT_INTERNAL void sock_close(xambit_channel_t *ch);
+
+/* xambit_udp.c */
+XAMBIT_INTERNAL ssize_t udp_writev(xambit_channel_t *ch,
+				const struct iovec *iov, int cnt);
+XAMBIT_INTERNAL ssize_t udp_read(xambit_channel_t *ch, void *buf, size_t len);
+XAMBIT_INTERNAL int udp_rx_pending(xambit_channel_t *ch);
+XAMBIT_INTERNAL void udp_close(xambit_channel_t *ch);
+
+/* xambit_work.c */
+XAMBIT_INTERNAL xambit_workers_t *xw_create(int nthreads);
+XAMBIT_INTERNAL void xw_destroy(xambit_workers_t *w);
+XAMBIT_INTERNAL int xw_nthreads(xambit_workers_t *w);
+XAMBIT_INTERNAL void xw_submit(xambit_workers_t *w, xw_group_t *group,
+				xw_job_t *job);
+XAMBIT_INTERNAL void xw_wait(xambit_workers_t *w, xw_group_t *group);
+XAMBIT_INTERNAL int rx_parallel(xambit_channel_t *ch, uint64_t len);
+XAMBIT_INTERNAL int rx_par_check(xambit_channel_t *ch,
+				xambit_type_validator_t *tv,
+				xambit_parcel_hdr_t *hdr, void *data, int csum);
+
+#endif
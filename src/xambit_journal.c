@@ -0,0 +1,394 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Large files sent as extents. A writer given a journal directory sends a
+ * file larger than its extent length as XAMBIT_EXTENT parcels, each carrying
+ * the transfer's id, the file's size and the extent's number, and notes in
+ * <id>.send how many it has sent. The id is a digest of the file's path,
+ * inode, size and modification time, so a file sent again unchanged, after
+ * the writer or the channel failed, resumes where the note says rather than
+ * from the start.
+ *
+ * Nothing comes back across a channel, so the writer cannot know which
+ * extents arrived. It takes those it sent as received once rewind more have
+ * followed them, and resumes that far back: extents in the pipe when the
+ * reader went away are sent again. A reader given a journal directory builds
+ * the file in <id>.part, noting in <id>.pmap which extents it holds, each made
+ * durable before it is noted, and skips any extent it is sent again. Once it
+ * holds them all the file is validated whole, and put in place. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#define JN_MAGIC	"XAMBITJN"
+#define JN_VERSION	1
+
+/* A writer's note of a transfer */
+typedef struct jn_send_s {
+    char	magic[8];
+    uint32_t	version;
+    uint32_t	pad;
+    uint8_t	id[16];
+    uint64_t	size;
+    uint64_t	extent;
+    uint64_t	sent;		    /* Extents wholly written */
+} jn_send_t;
+
+/* Start of a reader's map of a transfer, followed by a bit an extent */
+typedef struct jn_map_s {
+    char	magic[8];
+    uint32_t	version;
+    uint32_t	pad;
+    uint64_t	size;
+    uint64_t	extent;
+    uint64_t	have;		    /* Extents received */
+} jn_map_t;
+
+static void jn_name(const uint8_t *id, const char *suffix, char *name);
+static void jn_prune(xambit_journal_t *jn);
+
+/* The name of a transfer's file: its id in hex and suffix */
+static void jn_name(const uint8_t *id, const char *suffix, char *name)
+{
+    int		i;
+
+    for (i = 0; i < 16; i++)
+	sprintf(name + 2 * i, "%02x", id[i]);
+    strcpy(name + 32, suffix);
+}
+
+/* Remove a reader's files of transfers it has had no extent of for
+ * XAMBIT_JOURNAL_AGE seconds, whose writers must have given up on them */
+static void jn_prune(xambit_journal_t *jn)
+{
+    struct dirent *de;
+    struct stat	st;
+    time_t	old = time(NULL) - XAMBIT_JOURNAL_AGE;
+    DIR		*d;
+    int		fd;
+
+    fd = dup(jn->dirfd);
+    if (fd < 0)
+	return;
+    d = fdopendir(fd);
+    if (d == NULL)
+    {
+	close(fd);
+	return;
+    }
+
+    while ((de = readdir(d)) != NULL)
+    {
+	if (strlen(de->d_name) == 37 &&
+	    (strcmp(de->d_name + 32, ".part") == 0 ||
+	     strcmp(de->d_name + 32, ".pmap") == 0) &&
+	    fstatat(jn->dirfd, de->d_name, &st, 0) == 0 && st.st_mtime < old)
+	    unlinkat(jn->dirfd, de->d_name, 0);
+    }
+    closedir(d);
+}
+
+/* Start, or resume, sending the file at path, described by st, as extents.
+ * Fills in id and the first extent to send. Returns the descriptor of the
+ * writer's note, for jn_send_mark() and jn_send_done(), or negetive on
+ * failure. */
+int jn_send_open(xambit_channel_t *ch, const char *path, const struct stat *st,
+		 uint8_t *id, uint64_t *first)
+{
+    xambit_journal_t *jn = ch->journal;
+    char	real[PATH_MAX];
+    char	name[40];
+    uint8_t	digest[32];
+    uint8_t	key[PATH_MAX + 64];
+    size_t	len;
+    jn_send_t	note;
+    int		fd;
+
+    if (realpath(path, real) != NULL)
+	path = real;
+    len = strlen(path);
+    memcpy(key, path, len);
+    memcpy(key + len, &st->st_dev, sizeof(st->st_dev));
+    len += sizeof(st->st_dev);
+    memcpy(key + len, &st->st_ino, sizeof(st->st_ino));
+    len += sizeof(st->st_ino);
+    memcpy(key + len, &st->st_size, sizeof(st->st_size));
+    len += sizeof(st->st_size);
+    memcpy(key + len, &st->st_mtim, sizeof(st->st_mtim));
+    len += sizeof(st->st_mtim);
+    sha256(key, len, digest);
+    memcpy(id, digest, 16);
+
+    jn_name(id, ".send", name);
+    fd = openat(jn->dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+	return XAMBIT_ERR_STD;
+
+    *first = 0;
+    if (pread(fd, &note, sizeof(note), 0) == sizeof(note) &&
+	memcmp(note.magic, JN_MAGIC, sizeof(note.magic)) == 0 &&
+	note.version == JN_VERSION && memcmp(note.id, id, 16) == 0 &&
+	note.size == (uint64_t)st->st_size && note.extent == jn->extent)
+    {
+	*first = note.sent > jn->rewind ? note.sent - jn->rewind : 0;
+	return fd;
+    }
+
+    memset(&note, 0, sizeof(note));
+    memcpy(note.magic, JN_MAGIC, sizeof(note.magic));
+    note.version = JN_VERSION;
+    memcpy(note.id, id, 16);
+    note.size = st->st_size;
+    note.extent = jn->extent;
+    if (pwrite(fd, &note, sizeof(note), 0) != sizeof(note))
+    {
+	close(fd);
+	unlinkat(jn->dirfd, name, 0);
+	return XAMBIT_ERR_STD;
+    }
+    return fd;
+}
+
+/* Note that the first sent extents have been written to the channel. Only
+ * a later saving is lost if this fails, so it cannot. */
+void jn_send_mark(int jfd, uint64_t sent)
+{
+    if (pwrite(jfd, &sent, sizeof(sent), offsetof(jn_send_t, sent)) < 0)
+	return;
+}
+
+/* The whole file has been sent: forget it */
+void jn_send_done(xambit_channel_t *ch, const uint8_t *id, int jfd)
+{
+    char	name[40];
+
+    jn_name(id, ".send", name);
+    unlinkat(ch->journal->dirfd, name, 0);
+    close(jfd);
+}
+
+/* Open, or start, the file an extent belongs to in a reader's journal.
+ * Returns 0, or negetive with errno set to EBADMSG if the extent does not
+ * fit the file it claims to be part of. */
+int jn_recv_open(xambit_channel_t *ch, const ex_hdr_t *eh, jn_part_t *jp)
+{
+    xambit_journal_t *jn = ch->journal;
+    jn_map_t	map;
+    size_t	bits;
+
+    if (eh->extent == 0 || eh->size == 0 ||
+	eh->index > (eh->size - 1) / eh->extent)
+    {
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+    jp->count = (eh->size - 1) / eh->extent + 1;
+    bits = (jp->count + 7) / 8;
+
+    jp->fd = -1;
+    jn_name(eh->id, ".pmap", jp->name);
+    jp->mfd = openat(jn->dirfd, jp->name, O_RDWR | O_CREAT | O_CLOEXEC,
+		     0600);
+    if (jp->mfd < 0)
+	return XAMBIT_ERR_STD;
+    jn_name(eh->id, ".part", jp->name);
+    jp->fd = openat(jn->dirfd, jp->name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (jp->fd < 0)
+	goto error;
+
+    if (pread(jp->mfd, &map, sizeof(map), 0) == sizeof(map) &&
+	memcmp(map.magic, JN_MAGIC, sizeof(map.magic)) == 0 &&
+	map.version == JN_VERSION && map.size == eh->size &&
+	map.extent == eh->extent && map.have <= jp->count)
+    {
+	jp->have = map.have;
+	return 0;
+    }
+
+    /* A new transfer, or what is left of one that cannot be trusted */
+    memset(&map, 0, sizeof(map));
+    memcpy(map.magic, JN_MAGIC, sizeof(map.magic));
+    map.version = JN_VERSION;
+    map.size = eh->size;
+    map.extent = eh->extent;
+    jp->have = 0;
+    if (ftruncate(jp->mfd, 0) < 0 ||
+	ftruncate(jp->mfd, sizeof(map) + bits) < 0 ||
+	ftruncate(jp->fd, 0) < 0 || ftruncate(jp->fd, eh->size) < 0 ||
+	pwrite(jp->mfd, &map, sizeof(map), 0) != sizeof(map))
+	goto error;
+    return 0;
+
+error:
+    jn_recv_close(ch, jp, 1);
+    return XAMBIT_ERR_STD;
+}
+
+/* Whether the reader already holds extent index */
+int jn_recv_has(jn_part_t *jp, uint64_t index)
+{
+    uint8_t	b;
+
+    if (pread(jp->mfd, &b, 1, sizeof(jn_map_t) + index / 8) != 1)
+	return 0;
+    return (b >> (index % 8)) & 1;
+}
+
+/* Note that extent index is in the file, once it is on disk */
+int jn_recv_mark(jn_part_t *jp, uint64_t index)
+{
+    off_t	off = sizeof(jn_map_t) + index / 8;
+    uint8_t	b;
+
+    if (fdatasync(jp->fd) < 0 || pread(jp->mfd, &b, 1, off) != 1)
+	return XAMBIT_ERR_STD;
+    b |= 1 << (index % 8);
+    jp->have++;
+    if (pwrite(jp->mfd, &b, 1, off) != 1 ||
+	pwrite(jp->mfd, &jp->have, sizeof(jp->have),
+	       offsetof(jn_map_t, have)) != sizeof(jp->have))
+	return XAMBIT_ERR_STD;
+    return 0;
+}
+
+/* Link a finished file of the journal to a temporary name next to path,
+ * left in tmp. This fails with EXDEV if path is on another file system; the
+ * file must then be copied. */
+int jn_recv_take(xambit_channel_t *ch, jn_part_t *jp, const char *path,
+		 char *tmp)
+{
+    int		i;
+
+    for (i = 0; i < 100; i++)
+    {
+	if (rx_temp_name(path, tmp) < 0)
+	    return XAMBIT_ERR_STD;
+	if (linkat(ch->journal->dirfd, jp->name, AT_FDCWD, tmp, 0) == 0)
+	    return 0;
+	if (errno != EEXIST)
+	    return XAMBIT_ERR_STD;
+    }
+
+    return XAMBIT_ERR_STD;
+}
+
+/* Close a file of the journal, and remove it if it is finished with */
+void jn_recv_close(xambit_channel_t *ch, jn_part_t *jp, int remove)
+{
+    if (jp->fd >= 0)
+	close(jp->fd);
+    close(jp->mfd);
+    if (!remove)
+	return;
+
+    memcpy(jp->name + 32, ".part", 6);
+    unlinkat(ch->journal->dirfd, jp->name, 0);
+    memcpy(jp->name + 32, ".pmap", 6);
+    unlinkat(ch->journal->dirfd, jp->name, 0);
+}
+
+void jn_free(xambit_journal_t *jn)
+{
+    if (jn == NULL)
+	return;
+
+    close(jn->dirfd);
+    free(jn);
+}
+
+/*  Function Name:	channel_set_journal
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To have a writer send large files as extents it can
+ *			resume, and a reader put them together.
+ *
+ *  Assumptions:	Called before the channel is used.
+ *
+ *  Notes:		dir is created if need be. A writer sends files of over
+ *			extent bytes (0 selects XAMBIT_EXTENT_LEN) as extents,
+ *			and on sending one again resumes rewind extents before
+ *			the last it had sent. A reader puts files together in
+ *			dir, and ignores extent and rewind. A NULL dir turns it
+ *			off.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_journal(xambit_channel_t *ch, const char *dir,
+			uint64_t extent, uint32_t rewind)
+{
+    xambit_journal_t *jn;
+
+    if (ch == NULL || !ch_type_ok(ch))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (dir == NULL)
+    {
+	jn_free(ch->journal);
+	ch->journal = NULL;
+	return 0;
+    }
+
+    jn = calloc(1, sizeof(*jn));
+    if (jn == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    jn->extent = extent ? extent : XAMBIT_EXTENT_LEN;
+    jn->rewind = rewind;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+	goto error;
+    jn->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (jn->dirfd < 0)
+	goto error;
+
+    if (ch->direction == XAMBIT_CHIN)
+	jn_prune(jn);
+
+    jn_free(ch->journal);
+    ch->journal = jn;
+    return 0;
+
+error:
+    free(jn);
+    return XAMBIT_ERR_STD;
+}
@@ -0,0 +1,246 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Send locks for writer channels shared between threads (XAMBIT_THREADED)
+ * or processes (XAMBIT_SHARED). A parcel the kernel writes to a FIFO in one
+ * piece, at most PIPE_BUF bytes, cannot be torn by another writer, so any
+ * number of those may be under way at once; they only count themselves in.
+ * Everything else takes a lock, and once it has it waits for the atomic
+ * writes in flight to finish. An atomic writer that finds the lock taken or
+ * wanted waits for it too, so a stream of small parcels cannot starve a
+ * large one. The lock is not fair: a sender that has just let it go may take
+ * it straight back, which on a buffered channel saves a trip through the
+ * scheduler for every parcel.
+ *
+ * Waiters sleep on futexes. Between processes the lock lives in a shared
+ * memory object named after the FIFO's device and inode, so every writer
+ * of the FIFO finds the same one. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+struct xambit_lock_s {
+    uint32_t	state;		    /* 0 free, 1 held, 2 wanted; a futex */
+    uint32_t	shared;		    /* Atomic writes under way; a futex */
+    int32_t	holder;		    /* Thread holding the lock, or 0 */
+};
+
+static void lock_wait(xambit_channel_t *ch, uint32_t *addr, uint32_t val);
+static void lock_wake(xambit_channel_t *ch, uint32_t *addr, int n);
+static int lock_tid(void);
+
+static void lock_wait(xambit_channel_t *ch, uint32_t *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, ch->lock_pshared ? FUTEX_WAIT :
+	    FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void lock_wake(xambit_channel_t *ch, uint32_t *addr, int n)
+{
+    syscall(SYS_futex, addr, ch->lock_pshared ? FUTEX_WAKE :
+	    FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static int lock_tid(void)
+{
+    static __thread int	tid;
+
+    if (tid == 0)
+	tid = syscall(SYS_gettid);
+    return tid;
+}
+
+/* Give a channel opened with XAMBIT_THREADED or XAMBIT_SHARED its lock */
+int ch_lock_open(xambit_channel_t *ch)
+{
+    char	name[64];
+    struct stat	st;
+    void	*p;
+    int		fd;
+    int		err;
+
+    if (!(ch->flags & XAMBIT_SHARED))
+    {
+	ch->lock = calloc(1, sizeof(*ch->lock));
+	if (ch->lock == NULL)
+	{
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+	return 0;
+    }
+
+    if (ch->type != XAMBIT_CH_FIFO || fstat(ch->fd, &st) < 0)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* A fresh object reads as zeroes, which is an unheld lock */
+    snprintf(name, sizeof(name), "/xambit-lock-%llx-%llx",
+	     (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+    fd = shm_open(name, O_RDWR | O_CREAT, 0660);
+    if (fd < 0)
+	return XAMBIT_ERR_STD;
+    if (fstat(fd, &st) < 0 ||
+	(st.st_size < (off_t)sizeof(*ch->lock) &&
+	 ftruncate(fd, sizeof(*ch->lock)) < 0))
+	goto error;
+
+    p = mmap(NULL, sizeof(*ch->lock), PROT_READ | PROT_WRITE, MAP_SHARED,
+	     fd, 0);
+    if (p == MAP_FAILED)
+	goto error;
+    close(fd);
+
+    ch->lock = p;
+    ch->lock_pshared = 1;
+    return 0;
+
+error:
+    err = errno;
+    close(fd);
+    errno = err;
+    return XAMBIT_ERR_STD;
+}
+
+void ch_lock_close(xambit_channel_t *ch)
+{
+    if (ch->lock_pshared)
+	munmap(ch->lock, sizeof(*ch->lock));
+    else
+	free(ch->lock);
+    ch->lock = NULL;
+}
+
+/* Wait for a turn alone on the channel */
+void ch_lock(xambit_channel_t *ch)
+{
+    xambit_lock_t   *l = ch->lock;
+    uint32_t	    c = 0;
+    uint32_t	    v;
+
+    if (l == NULL)
+	return;
+
+    /* Once it has had to wait a sender marks the lock wanted, and so wakes
+     * someone else when it lets go */
+    if (!__atomic_compare_exchange_n(&l->state, &c, 1, 0, __ATOMIC_SEQ_CST,
+				     __ATOMIC_SEQ_CST))
+    {
+	if (c != 2)
+	    c = __atomic_exchange_n(&l->state, 2, __ATOMIC_SEQ_CST);
+	while (c != 0)
+	{
+	    lock_wait(ch, &l->state, 2);
+	    c = __atomic_exchange_n(&l->state, 2, __ATOMIC_SEQ_CST);
+	}
+    }
+
+    /* Atomic writes that started before the lock was taken finish */
+    while ((v = __atomic_load_n(&l->shared, __ATOMIC_SEQ_CST)) != 0)
+	lock_wait(ch, &l->shared, v);
+
+    __atomic_store_n(&l->holder, lock_tid(), __ATOMIC_RELAXED);
+}
+
+void ch_unlock(xambit_channel_t *ch)
+{
+    xambit_lock_t   *l = ch->lock;
+
+    if (l == NULL)
+	return;
+
+    __atomic_store_n(&l->holder, 0, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&l->state, 0, __ATOMIC_SEQ_CST) == 2)
+	lock_wake(ch, &l->state, 1);
+}
+
+/* Whether this thread holds the lock */
+int ch_lock_held(xambit_channel_t *ch)
+{
+    return ch->lock != NULL &&
+	   __atomic_load_n(&ch->lock->holder, __ATOMIC_RELAXED) == lock_tid();
+}
+
+/* Lock the channel to send len bytes in the writes of a single parcel.
+ * A XAMBIT_NONBLOCK channel always takes the lock, since what the FIFO will
+ * not take is queued in tx_pend, which is not safe to share. Returns what
+ * to pass to ch_unlock_send. */
+int ch_lock_send(xambit_channel_t *ch, uint64_t len)
+{
+    xambit_lock_t   *l = ch->lock;
+
+    if (l == NULL)
+	return 0;
+
+    if (ch->type != XAMBIT_CH_FIFO || ch->sbuf != NULL || len > PIPE_BUF ||
+	(ch->flags & XAMBIT_NONBLOCK))
+    {
+	ch_lock(ch);
+	return 0;
+    }
+
+    /* Count in, and go ahead unless someone holds or waits for the lock.
+     * A locker marks the lock before checking the count, so one of the two
+     * sees the other. */
+    __atomic_add_fetch(&l->shared, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&l->state, __ATOMIC_SEQ_CST) == 0)
+	return 1;
+    ch_unlock_send(ch, 1);
+
+    ch_lock(ch);
+    __atomic_add_fetch(&l->shared, 1, __ATOMIC_SEQ_CST);
+    ch_unlock(ch);
+    return 1;
+}
+
+void ch_unlock_send(xambit_channel_t *ch, int atomic)
+{
+    xambit_lock_t   *l = ch->lock;
+
+    if (l == NULL)
+	return;
+
+    if (!atomic)
+    {
+	ch_unlock(ch);
+	return;
+    }
+
+    if (__atomic_sub_fetch(&l->shared, 1, __ATOMIC_SEQ_CST) == 0 &&
+	__atomic_load_n(&l->state, __ATOMIC_SEQ_CST) != 0)
+	lock_wake(ch, &l->shared, INT_MAX);
+}
@@ -0,0 +1,601 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Pipelined receiving. A reader thread takes parcels off the channel as fast
+ * as they come, and hands each to the channel workers to be checksummed and
+ * validated, so that several parcels are checked at once. Parcels wait in a
+ * queue in the order they were read, and are delivered from its head once
+ * their verdict is in, which keeps them in order however the checks finish.
+ *
+ * The reader stops reading while the parcels queued hold more than the
+ * channel's limit of bytes; at least one is always let through. It runs with
+ * cancellation disabled except while reading, so that channel_close() can
+ * stop it however long the sender is silent. A transport error ends it,
+ * leaving the error at the head of the queue to be returned from then on. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+/* A parcel read and waiting for its verdict, or to be delivered */
+typedef struct pl_entry_s {
+    xw_job_t		job;
+    xambit_pipeline_t	*pl;
+    xambit_parcel_hdr_t	*hdr;
+    void		*data;
+    uint64_t		queued;	    /* Bytes counted against the limit */
+    int			err;
+    int			errnum;	    /* errno to go with a fatal err */
+    uint8_t		done;	    /* The verdict is in */
+    uint8_t		fatal;	    /* The reader stopped here */
+    uint8_t		counted;    /* Already in the channel statistics */
+    struct pl_entry_s	*next;
+} pl_entry_t;
+
+struct xambit_pipeline_s {
+    xambit_channel_t	*ch;
+    pthread_t		thread;
+    pthread_mutex_t	lock;
+    pthread_cond_t	ready;	    /* The head of the queue is done */
+    pthread_cond_t	space;	    /* Bytes queued fell, or stopping */
+    xw_group_t		group;	    /* Checks outstanding */
+    pl_entry_t		*head;
+    pl_entry_t		*tail;
+    pl_entry_t		*cur;	    /* Being read, not yet queued */
+    pl_entry_t		*out;	    /* Handed out by the last batch */
+    uint64_t		queued;	    /* Payload bytes in the queue */
+    uint64_t		max;
+    xambit_stats_t	stats;	    /* Verdicts delivered, see pl_account */
+    int			stop;
+};
+
+static void *pl_main(void *arg);
+static int pl_read(xambit_pipeline_t *pl, pl_entry_t *e);
+static void pl_queue(xambit_pipeline_t *pl, pl_entry_t *e);
+static void pl_check(void *arg);
+static int pl_inflate(pl_entry_t *e, xambit_stats_t *zst);
+static pl_entry_t *pl_wait(xambit_pipeline_t *pl);
+static void pl_unlink(xambit_pipeline_t *pl, pl_entry_t *e);
+static void pl_account(xambit_pipeline_t *pl, pl_entry_t *e);
+static void pl_free(pl_entry_t *e);
+static void pl_free_list(pl_entry_t *e);
+
+static void pl_free(pl_entry_t *e)
+{
+    if (e == NULL)
+	return;
+    free(e->hdr);
+    free(e->data);
+    free(e);
+}
+
+static void pl_free_list(pl_entry_t *e)
+{
+    pl_entry_t	*next;
+
+    for (; e != NULL; e = next)
+    {
+	next = e->next;
+	pl_free(e);
+    }
+}
+
+/* Inflate a deflated parcel, already checked as it crossed, in place of its
+ * data, counting what it took in zst */
+static int pl_inflate(pl_entry_t *e, xambit_stats_t *zst)
+{
+    xambit_channel_t	*ch = e->pl->ch;
+    void		*out;
+    uint64_t		len;
+    int			err;
+
+    err = zl_length(ch, e->hdr, e->data, &len);
+    if (err < 0)
+	return err;
+
+    out = malloc(len ? len : 1);
+    if (out == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+
+    err = zl_inflate(ch, e->hdr, e->data, out, zst);
+    if (err < 0)
+    {
+	free(out);
+	return err;
+    }
+
+    free(e->data);
+    e->data = out;
+    return 0;
+}
+
+/* Checksum, inflate and validate a parcel on a worker thread. The statistics
+ * are left to whoever delivers it, but for those of compression, which are
+ * of work done whatever the verdict. */
+static void pl_check(void *arg)
+{
+    pl_entry_t		    *e = arg;
+    xambit_pipeline_t	    *pl = e->pl;
+    xambit_channel_t	    *ch = pl->ch;
+    xambit_type_validator_t *tv;
+    xambit_stats_t	    zst;
+    int			    err = 0;
+
+    if (e->hdr->flags & XAMBIT_DATA_CSUM ?
+	crc32c(0, e->data, e->hdr->length) != e->hdr->data_checksum :
+	(ch->flags & XAMBIT_CHECKSUM) != 0)
+	err = XAMBIT_ERR_DATA_CHKSUM;
+
+    /* References and deltas are only resolved into files */
+    if (err == 0 && (e->hdr->flags & (XAMBIT_REF | XAMBIT_DELTA)))
+	err = XAMBIT_ERR_DEDUP;
+
+    /* ... as are extents */
+    if (err == 0 && (e->hdr->flags & XAMBIT_EXTENT))
+	err = XAMBIT_ERR_JOURNAL;
+
+    /* ... and sparse files */
+    if (err == 0 && (e->hdr->flags & XAMBIT_HOLES))
+	err = XAMBIT_ERR_SPARSE;
+
+    memset(&zst, 0, sizeof(zst));
+    if (err == 0 && (e->hdr->flags & XAMBIT_ZLIB))
+	err = pl_inflate(e, &zst);
+
+    if (err == 0)
+    {
+	tv = lookup_type_validator(ch, e->hdr->type);
+	if (tv == NULL)
+	    err = XAMBIT_ERR_BAD_TYPE;
+	else
+	    err = tv_validate(tv, e->hdr, e->data);
+	tv_put(tv);
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    pl->stats.zlib_parcels += zst.zlib_parcels;
+    pl->stats.zlib_saved += zst.zlib_saved;
+    pl->stats.zlib_usec += zst.zlib_usec;
+    e->err = err;
+    e->done = 1;
+    if (e == pl->head)
+	pthread_cond_signal(&pl->ready);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+/* Read the next parcel into e. Returns 0 if it is to be checked, 1 if it is
+ * a stream already checked segment by segment, or a negetive value. */
+static int pl_read(xambit_pipeline_t *pl, pl_entry_t *e)
+{
+    xambit_channel_t	*ch = pl->ch;
+    xambit_parcel_hdr_t	h;
+    void		*sdata = NULL;
+    int			err;
+
+    err = rx_next(ch, &h, &sdata);
+    e->data = sdata;
+    if (err < 0)
+	return err;
+
+    e->hdr = malloc(sizeof(*e->hdr));
+    ch->stats.allocs++;
+    if (e->hdr == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    *e->hdr = h;
+    if (err == 1)
+	return 1;
+
+    e->data = malloc(h.length ? h.length : 1);
+    ch->stats.allocs++;
+    if (e->data == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+
+    return rx_copy(ch, e->data, h.length, NULL);
+}
+
+/* Add a parcel to the tail of the queue */
+static void pl_queue(xambit_pipeline_t *pl, pl_entry_t *e)
+{
+    pthread_mutex_lock(&pl->lock);
+    if (pl->tail != NULL)
+	pl->tail->next = e;
+    else
+	pl->head = e;
+    pl->tail = e;
+    pl->cur = NULL;
+    if (e->hdr != NULL)
+	e->queued = e->hdr->length;
+    pl->queued += e->queued;
+    if (e->done && e == pl->head)
+	pthread_cond_signal(&pl->ready);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void *pl_main(void *arg)
+{
+    xambit_pipeline_t	*pl = arg;
+    pl_entry_t		*e;
+    int			stop;
+    int			err;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (1)
+    {
+	pthread_mutex_lock(&pl->lock);
+	while (!pl->stop && pl->head != NULL && pl->queued >= pl->max)
+	    pthread_cond_wait(&pl->space, &pl->lock);
+	stop = pl->stop;
+	pthread_mutex_unlock(&pl->lock);
+	if (stop)
+	    break;
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+	{
+	    /* Nothing can be queued to say so; wait for memory */
+	    sleep(1);
+	    continue;
+	}
+	e->pl = pl;
+	pl->cur = e;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	err = pl_read(pl, e);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	if (err == 0)
+	{
+	    pl_queue(pl, e);
+	    e->job.fn = pl_check;
+	    e->job.arg = e;
+	    xw_submit(pl->ch->workers, &pl->group, &e->job);
+	    continue;
+	}
+
+	/* A stream has been checked, or dropped and counted, already. Other
+	 * errors leave the channel out of step, so reading stops. */
+	e->done = 1;
+	e->counted = 1;
+	e->err = err < 0 ? err : 0;
+	if (err < 0 && err != XAMBIT_ERR_VALIDATE &&
+	    err != XAMBIT_ERR_BAD_TYPE && err != XAMBIT_ERR_DATA_CHKSUM)
+	{
+	    e->fatal = 1;
+	    e->errnum = errno;
+	    free(e->hdr);
+	    free(e->data);
+	    e->hdr = NULL;
+	    e->data = NULL;
+	}
+	else if (err < 0)
+	{
+	    free(e->hdr);
+	    free(e->data);
+	    e->hdr = NULL;
+	    e->data = NULL;
+	}
+	pl_queue(pl, e);
+	if (e->fatal)
+	    break;
+    }
+
+    return NULL;
+}
+
+/* The head of the queue, once its verdict is in */
+static pl_entry_t *pl_wait(xambit_pipeline_t *pl)
+{
+    pl_entry_t	*e;
+
+    pthread_mutex_lock(&pl->lock);
+    while (pl->head == NULL || !pl->head->done)
+	pthread_cond_wait(&pl->ready, &pl->lock);
+    e = pl->head;
+    pthread_mutex_unlock(&pl->lock);
+
+    return e;
+}
+
+/* Take the head of the queue off it; called with the lock held */
+static void pl_unlink(xambit_pipeline_t *pl, pl_entry_t *e)
+{
+    pl->head = e->next;
+    if (pl->head == NULL)
+	pl->tail = NULL;
+    e->next = NULL;
+    pl->queued -= e->queued;
+    pthread_cond_signal(&pl->space);
+}
+
+/* Count a delivered parcel, as rx_validate() would have. The channel
+ * statistics belong to the reader thread while it runs, so these are kept
+ * apart and added in by pl_get_stats(). Called with the lock held. */
+static void pl_account(xambit_pipeline_t *pl, pl_entry_t *e)
+{
+    if (e->counted)
+	return;
+
+    if (e->err < 0)
+    {
+	if (e->err == XAMBIT_ERR_DATA_CHKSUM)
+	    pl->stats.csum_errors++;
+	if (e->err == XAMBIT_ERR_DEDUP)
+	    pl->stats.dedup_misses++;
+	pl->stats.parcels_dropped++;
+	return;
+    }
+
+    pl->stats.parcels_received++;
+    pl->stats.bytes_received += e->hdr->length;
+}
+
+/* Add the verdicts delivered so far to stats */
+void pl_get_stats(xambit_channel_t *ch, xambit_stats_t *stats)
+{
+    xambit_pipeline_t	*pl = ch->pipeline;
+
+    pthread_mutex_lock(&pl->lock);
+    stats->parcels_received += pl->stats.parcels_received;
+    stats->bytes_received += pl->stats.bytes_received;
+    stats->parcels_dropped += pl->stats.parcels_dropped;
+    stats->csum_errors += pl->stats.csum_errors;
+    stats->zlib_parcels += pl->stats.zlib_parcels;
+    stats->zlib_saved += pl->stats.zlib_saved;
+    stats->zlib_usec += pl->stats.zlib_usec;
+    stats->dedup_misses += pl->stats.dedup_misses;
+    pthread_mutex_unlock(&pl->lock);
+}
+
+/* channel_receive() on a pipelined channel */
+int pl_receive(xambit_channel_t *ch, xambit_parcel_hdr_t **phdr, void **buf)
+{
+    xambit_pipeline_t	*pl = ch->pipeline;
+    pl_entry_t		*e;
+    int			err;
+
+    e = pl_wait(pl);
+    if (e->fatal)
+    {
+	errno = e->errnum;
+	return e->err;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    pl_unlink(pl, e);
+    pl_account(pl, e);
+    pthread_mutex_unlock(&pl->lock);
+
+    err = e->err;
+    if (err == 0)
+    {
+	*phdr = e->hdr;
+	*buf = e->data;
+	e->hdr = NULL;
+	e->data = NULL;
+    }
+    pl_free(e);
+    return err;
+}
+
+/* channel_receive_into() on a pipelined channel. A parcel too large for buf
+ * stays queued, streams included. */
+int pl_receive_into(xambit_channel_t *ch, xambit_parcel_hdr_t *header,
+		    void *buf, size_t size)
+{
+    xambit_pipeline_t	*pl = ch->pipeline;
+    pl_entry_t		*e;
+    int			err;
+
+    e = pl_wait(pl);
+    if (e->fatal)
+    {
+	errno = e->errnum;
+	return e->err;
+    }
+
+    if (e->err == 0)
+    {
+	*header = *e->hdr;
+	if (e->hdr->length > size)
+	{
+	    errno = EMSGSIZE;
+	    return XAMBIT_ERR_STD;
+	}
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    pl_unlink(pl, e);
+    pl_account(pl, e);
+    pthread_mutex_unlock(&pl->lock);
+
+    err = e->err;
+    if (err == 0)
+	memcpy(buf, e->data, e->hdr->length);
+    pl_free(e);
+    return err;
+}
+
+/* channel_receive_batch() on a pipelined channel: the first parcel waited
+ * for, and every one after it with a verdict already in */
+int pl_receive_batch(xambit_channel_t *ch, xambit_parcel_t *parcels, int max)
+{
+    xambit_pipeline_t	*pl = ch->pipeline;
+    pl_entry_t		*e;
+    pl_entry_t		*dropped = NULL;
+    pl_entry_t		**out = &pl->out;
+    int			err = 0;
+    int			n = 0;
+
+    /* Data handed out by the previous call is released here */
+    pl_free_list(pl->out);
+    pl->out = NULL;
+
+    e = pl_wait(pl);
+    if (e->fatal)
+    {
+	errno = e->errnum;
+	return e->err;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    while (n < max && (e = pl->head) != NULL && e->done && !e->fatal)
+    {
+	pl_unlink(pl, e);
+	pl_account(pl, e);
+	if (e->err < 0)
+	{
+	    err = e->err;
+	    e->next = dropped;
+	    dropped = e;
+	    continue;
+	}
+
+	parcels[n].hdr = *e->hdr;
+	parcels[n++].data = e->data;
+	*out = e;
+	out = &e->next;
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    pl_free_list(dropped);
+    return n > 0 ? n : err;
+}
+
+/* Stop the reader and free whatever it has queued */
+void pl_stop(xambit_channel_t *ch)
+{
+    xambit_pipeline_t	*pl = ch->pipeline;
+
+    if (pl == NULL)
+	return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = 1;
+    pthread_cond_broadcast(&pl->space);
+    pthread_mutex_unlock(&pl->lock);
+
+    pthread_cancel(pl->thread);
+    pthread_join(pl->thread, NULL);
+    xw_wait(ch->workers, &pl->group);
+    pl_get_stats(ch, &ch->stats);
+
+    pl_free(pl->cur);
+    pl_free_list(pl->head);
+    pl_free_list(pl->out);
+    pthread_cond_destroy(&pl->space);
+    pthread_cond_destroy(&pl->ready);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl);
+    ch->pipeline = NULL;
+}
+
+/*  Function Name:	channel_set_pipeline
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To read parcels on a thread of their own and validate
+ *			several at once on the channel's workers.
+ *
+ *  Assumptions:	channel_set_workers has been called on the channel.
+ *
+ *  Notes:		Parcels are still delivered in the order sent. Up to
+ *			max_bytes of payload are read ahead of the caller,
+ *			with at least one parcel always let through. Once
+ *			started the pipeline runs until the channel is closed;
+ *			calling again only changes max_bytes. Validators must
+ *			be thread safe.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_pipeline(xambit_channel_t *ch, size_t max_bytes)
+{
+    xambit_pipeline_t	*pl;
+
+    if (ch == NULL || ch->direction != XAMBIT_CHIN || ch->workers == NULL ||
+	(ch->flags & XAMBIT_NONBLOCK) || ch->set_ent != NULL ||
+	(ch->type != XAMBIT_CH_FIFO && ch->type != XAMBIT_CH_SOCK &&
+	 ch->type != XAMBIT_CH_UDP))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    pl = ch->pipeline;
+    if (pl != NULL)
+    {
+	if (max_bytes == 0)
+	{
+	    errno = EBUSY;
+	    return XAMBIT_ERR_STD;
+	}
+	pthread_mutex_lock(&pl->lock);
+	pl->max = max_bytes;
+	pthread_cond_signal(&pl->space);
+	pthread_mutex_unlock(&pl->lock);
+	return 0;
+    }
+
+    if (max_bytes == 0)
+	return 0;
+
+    pl = calloc(1, sizeof(*pl));
+    if (pl == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    pl->ch = ch;
+    pl->max = max_bytes;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->ready, NULL);
+    pthread_cond_init(&pl->space, NULL);
+
+    errno = pthread_create(&pl->thread, NULL, pl_main, pl);
+    if (errno != 0)
+    {
+	pthread_cond_destroy(&pl->space);
+	pthread_cond_destroy(&pl->ready);
+	pthread_mutex_destroy(&pl->lock);
+	free(pl);
+	return XAMBIT_ERR_STD;
+    }
+
+    ch->pipeline = pl;
+    return 0;
+}
@@ -0,0 +1,599 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Type validator registries. Every channel gets one of its own with its
+ * first type, and may look through it to a registry shared with other
+ * channels.
+ *
+ * Parcels are looked up far more often than types change, so a registry is
+ * an immutable table that writers copy, change and publish whole. Readers
+ * take no lock: they count themselves in to one of two reader counts, load
+ * the table and count themselves out. A writer publishes the new table,
+ * then moves the readers over to the other count and waits for the old one
+ * to empty, twice, after which no reader can still hold the old table.
+ *
+ * The table is a perfect hash, rebuilt on every change: the keys are spread
+ * over buckets, and each bucket is given the displacement that sends all its
+ * keys to free slots. A lookup is two hashes and one compare.
+ *
+ * A validator found is returned with a reference, as streams use theirs for
+ * as long as they run; one that has been unregistered or replaced is freed
+ * when the last user puts it back. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#define REG_DISP_TRIES	1024	    /* Displacements to try per bucket */
+#define REG_BUCKET_MAX	16	    /* Larger buckets are left to a rebuild */
+
+typedef struct reg_table_s {
+    uint32_t	nbuckets;
+    uint32_t	nslots;		    /* A power of two */
+    uint32_t	count;		    /* Validators in the table */
+    uint32_t	*disp;		    /* Displacement of each bucket */
+    xambit_type_validator_t *slot[];
+} reg_table_t;
+
+struct xambit_registry_s {
+    reg_table_t	*table;		    /* Published table, or NULL if empty */
+    uint32_t	epoch;		    /* Low bit picks the readers' count */
+    uint32_t	readers[2];
+    uint32_t	refs;
+    pthread_mutex_t lock;	    /* Serialises writers */
+};
+
+typedef struct reg_bucket_s {
+    uint32_t	index;
+    uint32_t	size;
+    uint32_t	first;		    /* Its keys start here in the key order */
+} reg_bucket_t;
+
+static uint32_t reg_mix(uint32_t x);
+static uint32_t reg_bucket(const reg_table_t *t, uint32_t tid);
+static uint32_t reg_slot(const reg_table_t *t, uint32_t tid, uint32_t d);
+static reg_table_t *reg_build(xambit_type_validator_t **tv, uint32_t size,
+			      uint32_t n);
+static int reg_place(reg_table_t *t, xambit_type_validator_t **tv,
+		     uint32_t n);
+static int reg_bucket_cmp(const void *a, const void *b);
+static uint32_t reg_pos(const reg_table_t *t, uint32_t tid);
+static int64_t reg_fit(const reg_table_t *t, xambit_type_validator_t **tv,
+		       uint32_t k, uint32_t *pos);
+static reg_table_t *reg_alloc(uint32_t nslots, uint32_t nbuckets);
+static reg_table_t *reg_copy(const reg_table_t *t);
+static int reg_insert(const reg_table_t *t, xambit_type_validator_t *tv,
+		      reg_table_t **nt);
+static void reg_synchronize(xambit_registry_t *reg);
+
+static uint32_t reg_mix(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t reg_bucket(const reg_table_t *t, uint32_t tid)
+{
+    return ((uint64_t)reg_mix(tid) * t->nbuckets) >> 32;
+}
+
+static uint32_t reg_slot(const reg_table_t *t, uint32_t tid, uint32_t d)
+{
+    return reg_mix(tid ^ (0x5bd1e995 + d * 0x9e3779b9)) & (t->nslots - 1);
+}
+
+/* Largest buckets first, while there is most room for them */
+static int reg_bucket_cmp(const void *a, const void *b)
+{
+    const reg_bucket_t	*x = a;
+    const reg_bucket_t	*y = b;
+
+    if (x->size != y->size)
+	return x->size < y->size ? 1 : -1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Slot of t that tid would be in */
+static uint32_t reg_pos(const reg_table_t *t, uint32_t tid)
+{
+    return reg_slot(t, tid, t->disp[reg_bucket(t, tid)]);
+}
+
+/* Find a displacement that puts the k validators in tv, all of one bucket,
+ * into free slots of t, whose numbers are left in pos. Returns the
+ * displacement, or -1 if there is none. */
+static int64_t reg_fit(const reg_table_t *t, xambit_type_validator_t **tv,
+		       uint32_t k, uint32_t *pos)
+{
+    uint32_t	d;
+    uint32_t	i;
+    uint32_t	j;
+
+    for (d = 0; d < REG_DISP_TRIES; d++)
+    {
+	for (i = 0; i < k; i++)
+	{
+	    pos[i] = reg_slot(t, tv[i]->type_id, d);
+	    if (t->slot[pos[i]] != NULL)
+		break;
+	    for (j = 0; j < i && pos[j] != pos[i]; j++)
+		;
+	    if (j < i)
+		break;
+	}
+	if (i == k)
+	    return d;
+    }
+    return -1;
+}
+
+/* Find a displacement for every bucket of t. Returns 0 on success, 1 if
+ * some bucket would not fit, negative on failure. */
+static int reg_place(reg_table_t *t, xambit_type_validator_t **tv,
+		     uint32_t n)
+{
+    xambit_type_validator_t **sorted;
+    reg_bucket_t	*b;
+    uint32_t		*pos;
+    uint32_t		i;
+    uint32_t		j;
+    uint32_t		k;
+    int64_t		d;
+    int			err = XAMBIT_ERR_STD;
+
+    b = calloc(t->nbuckets, sizeof(*b));
+    sorted = malloc(n * sizeof(*sorted));
+    pos = malloc(n * sizeof(*pos));
+    if (b == NULL || sorted == NULL || pos == NULL)
+    {
+	errno = ENOMEM;
+	goto out;
+    }
+
+    /* Group the keys by bucket */
+    for (i = 0; i < t->nbuckets; i++)
+	b[i].index = i;
+    for (i = 0; i < n; i++)
+	b[reg_bucket(t, tv[i]->type_id)].size++;
+    for (i = 0, k = 0; i < t->nbuckets; i++)
+    {
+	b[i].first = k;
+	k += b[i].size;
+    }
+    for (i = 0; i < n; i++)
+	sorted[b[reg_bucket(t, tv[i]->type_id)].first++] = tv[i];
+    for (i = 0; i < t->nbuckets; i++)
+	b[i].first -= b[i].size;
+    qsort(b, t->nbuckets, sizeof(*b), reg_bucket_cmp);
+
+    for (i = 0; i < t->nbuckets && b[i].size > 0; i++)
+    {
+	d = reg_fit(t, &sorted[b[i].first], b[i].size, pos);
+	if (d < 0)
+	{
+	    err = 1;
+	    goto out;
+	}
+
+	t->disp[b[i].index] = d;
+	for (j = 0; j < b[i].size; j++)
+	    t->slot[pos[j]] = sorted[b[i].first + j];
+    }
+    err = 0;
+
+out:
+    free(b);
+    free(sorted);
+    free(pos);
+    return err;
+}
+
+static reg_table_t *reg_alloc(uint32_t nslots, uint32_t nbuckets)
+{
+    reg_table_t	*t;
+
+    t = calloc(1, sizeof(*t) + nslots * sizeof(t->slot[0]) +
+	       nbuckets * sizeof(t->disp[0]));
+    if (t == NULL)
+    {
+	errno = ENOMEM;
+	return NULL;
+    }
+    t->nbuckets = nbuckets;
+    t->nslots = nslots;
+    t->disp = (uint32_t *)&t->slot[nslots];
+    return t;
+}
+
+static reg_table_t *reg_copy(const reg_table_t *t)
+{
+    reg_table_t	*nt;
+
+    nt = reg_alloc(t->nslots, t->nbuckets);
+    if (nt == NULL)
+	return NULL;
+    nt->count = t->count;
+    memcpy(nt->slot, t->slot, t->nslots * sizeof(t->slot[0]));
+    memcpy(nt->disp, t->disp, t->nbuckets * sizeof(t->disp[0]));
+    return nt;
+}
+
+/* Build a table of the n validators in tv, whose type IDs are distinct,
+ * with room for size */
+static reg_table_t *reg_build(xambit_type_validator_t **tv, uint32_t size,
+			      uint32_t n)
+{
+    reg_table_t	*t;
+    uint32_t	nslots = 1;
+    uint32_t	nbuckets = 1;
+    int		err;
+
+    while (nslots < size + size / 4)
+	nslots <<= 1;
+    while (nbuckets < size / 2)
+	nbuckets <<= 1;
+
+    for (;;)
+    {
+	t = reg_alloc(nslots, nbuckets);
+	if (t == NULL)
+	    return NULL;
+	t->count = n;
+
+	err = reg_place(t, tv, n);
+	if (err == 0)
+	    return t;
+	free(t);
+	if (err < 0)
+	    return NULL;
+	nslots <<= 1;
+    }
+}
+
+/* Copy t with tv added, moving only the bucket tv falls in. Returns 0 with
+ * the copy in *nt, 1 if the table is too full or the bucket will not fit,
+ * negative on failure. */
+static int reg_insert(const reg_table_t *t, xambit_type_validator_t *tv,
+		      reg_table_t **nt)
+{
+    xambit_type_validator_t *bk[REG_BUCKET_MAX + 1];
+    uint32_t	pos[REG_BUCKET_MAX + 1];
+    uint32_t	b;
+    uint32_t	k = 0;
+    uint32_t	i;
+    int64_t	d;
+
+    if (t == NULL || (t->count + 1) * 5 > t->nslots * 4)
+	return 1;
+
+    *nt = reg_copy(t);
+    if (*nt == NULL)
+	return XAMBIT_ERR_STD;
+    (*nt)->count++;
+
+    i = reg_pos(t, tv->type_id);
+    if (t->slot[i] == NULL)
+    {
+	(*nt)->slot[i] = tv;
+	return 0;
+    }
+
+    /* Take the bucket's keys out and find them all a new displacement */
+    b = reg_bucket(t, tv->type_id);
+    for (i = 0; i < t->nslots; i++)
+    {
+	if (t->slot[i] == NULL || reg_bucket(t, t->slot[i]->type_id) != b)
+	    continue;
+	if (k == REG_BUCKET_MAX)
+	    goto full;
+	bk[k++] = t->slot[i];
+	(*nt)->slot[i] = NULL;
+    }
+    bk[k++] = tv;
+
+    d = reg_fit(*nt, bk, k, pos);
+    if (d < 0)
+	goto full;
+    (*nt)->disp[b] = d;
+    for (i = 0; i < k; i++)
+	(*nt)->slot[pos[i]] = bk[i];
+    return 0;
+
+full:
+    free(*nt);
+    *nt = NULL;
+    return 1;
+}
+
+/* Wait until every reader that might have seen the table published before
+ * the call has finished with it. Called with the writer lock held. */
+static void reg_synchronize(xambit_registry_t *reg)
+{
+    uint32_t	e;
+    int		i;
+
+    for (i = 0; i < 2; i++)
+    {
+	e = __atomic_fetch_add(&reg->epoch, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&reg->readers[e & 1], __ATOMIC_SEQ_CST) != 0)
+	    sched_yield();
+    }
+}
+
+/* The validator for tid in reg, with a reference for the caller, or NULL */
+xambit_type_validator_t *registry_get(xambit_registry_t *reg, uint32_t tid)
+{
+    xambit_type_validator_t *tv = NULL;
+    reg_table_t	*t;
+    uint32_t	e;
+
+    e = __atomic_load_n(&reg->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&reg->readers[e], 1, __ATOMIC_SEQ_CST);
+
+    t = __atomic_load_n(&reg->table, __ATOMIC_SEQ_CST);
+    if (t != NULL)
+    {
+	tv = t->slot[reg_pos(t, tid)];
+	if (tv != NULL && tv->type_id == tid)
+	    __atomic_add_fetch(&tv->refs, 1, __ATOMIC_RELAXED);
+	else
+	    tv = NULL;
+    }
+
+    __atomic_sub_fetch(&reg->readers[e], 1, __ATOMIC_RELEASE);
+    return tv;
+}
+
+void tv_put(xambit_type_validator_t *tv)
+{
+    if (tv != NULL && __atomic_sub_fetch(&tv->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+	xambit_rules_free(tv->rules);
+	free(tv);
+    }
+}
+
+/* Add, replace or remove the validator for tid. Returns 0 on success,
+ * negative on failure. */
+int registry_update(xambit_registry_t *reg, uint32_t tid,
+		    const xambit_validator_ops_t *ops, int how)
+{
+    xambit_type_validator_t **tv = NULL;
+    xambit_type_validator_t *ntv = NULL;
+    xambit_type_validator_t *old = NULL;
+    reg_table_t	*t;
+    reg_table_t	*nt = NULL;
+    uint32_t	n = 0;
+    uint32_t	i;
+    int		err = XAMBIT_ERR_STD;
+
+    if (reg == NULL || (how != REG_REMOVE && (ops == NULL ||
+	(ops->validate == NULL && ops->chunk == NULL &&
+	 ops->rules == NULL && (ops->update == NULL || ops->final == NULL)))))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    pthread_mutex_lock(&reg->lock);
+    t = reg->table;
+
+    if (t != NULL && t->slot[reg_pos(t, tid)] != NULL &&
+	t->slot[reg_pos(t, tid)]->type_id == tid)
+	old = t->slot[reg_pos(t, tid)];
+    if ((old != NULL && how == REG_ADD) || (old == NULL && how == REG_REMOVE))
+    {
+	errno = old != NULL ? EEXIST : ENOENT;
+	goto out;
+    }
+
+    if (how != REG_REMOVE)
+    {
+	ntv = calloc(1, sizeof(*ntv));
+	if (ntv == NULL)
+	{
+	    errno = ENOMEM;
+	    goto out;
+	}
+	ntv->type_id = tid;
+	ntv->validate = ops->validate;
+	ntv->init = ops->init;
+	ntv->update = ops->update;
+	ntv->final = ops->final;
+	ntv->chunk = ops->chunk;
+	ntv->rules = ops->rules;
+	if (ntv->rules != NULL)
+	    rules_hold(ntv->rules);
+	ntv->refs = 1;
+    }
+
+    /* A change in place, or an addition that fits, only copies the table.
+     * Otherwise it is built again, with room to grow. */
+    if (old != NULL && (ntv != NULL || t->count > 1))
+    {
+	nt = reg_copy(t);
+	if (nt == NULL)
+	    goto error;
+	nt->slot[reg_pos(t, tid)] = ntv;
+	nt->count -= ntv == NULL;
+    }
+    else if (old == NULL)
+    {
+	err = reg_insert(t, ntv, &nt);
+	if (err < 0)
+	    goto error;
+	if (err > 0)
+	{
+	    tv = malloc(((t != NULL ? t->count : 0) + 1) * sizeof(*tv));
+	    if (tv == NULL)
+	    {
+		errno = ENOMEM;
+		goto error;
+	    }
+	    for (i = 0; t != NULL && i < t->nslots; i++)
+		if (t->slot[i] != NULL)
+		    tv[n++] = t->slot[i];
+	    tv[n++] = ntv;
+
+	    /* Twice the room, so that rebuilds get rarer as the table grows */
+	    nt = reg_build(tv, 2 * n, n);
+	    if (nt == NULL)
+		goto error;
+	}
+    }
+
+    __atomic_store_n(&reg->table, nt, __ATOMIC_SEQ_CST);
+    reg_synchronize(reg);
+    free(t);
+    tv_put(old);
+    err = 0;
+    goto out;
+
+error:
+    err = XAMBIT_ERR_STD;
+    tv_put(ntv);
+out:
+    pthread_mutex_unlock(&reg->lock);
+    free(tv);
+    return err;
+}
+
+/*  Function Name:	xambit_registry_new
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To create an empty type validator registry that
+ *			channels can share.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		See channel_set_registry.
+ *
+ *  Return Value:	The registry, or NULL with errno set.
+ */
+xambit_registry_t *xambit_registry_new(void)
+{
+    xambit_registry_t	*reg;
+
+    reg = calloc(1, sizeof(*reg));
+    if (reg == NULL)
+    {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    pthread_mutex_init(&reg->lock, NULL);
+    reg->refs = 1;
+    return reg;
+}
+
+/*  Function Name:	xambit_registry_free
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To give up a registry.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Channels still using the registry keep it until they
+ *			are closed or given another.
+ *
+ *  Return Value:	None.
+ */
+void xambit_registry_free(xambit_registry_t *reg)
+{
+    reg_table_t	*t;
+    uint32_t	i;
+
+    if (reg == NULL || __atomic_sub_fetch(&reg->refs, 1, __ATOMIC_ACQ_REL))
+	return;
+
+    t = reg->table;
+    for (i = 0; t != NULL && i < t->nslots; i++)
+	tv_put(t->slot[i]);
+    free(t);
+    pthread_mutex_destroy(&reg->lock);
+    free(reg);
+}
+
+/* Number of types in reg */
+uint32_t registry_count(xambit_registry_t *reg)
+{
+    reg_table_t	*t;
+    uint32_t	e;
+    uint32_t	n;
+
+    e = __atomic_load_n(&reg->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&reg->readers[e], 1, __ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&reg->table, __ATOMIC_SEQ_CST);
+    n = t != NULL ? t->count : 0;
+    __atomic_sub_fetch(&reg->readers[e], 1, __ATOMIC_RELEASE);
+    return n;
+}
+
+void registry_hold(xambit_registry_t *reg)
+{
+    __atomic_add_fetch(&reg->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*  Function Name:	xambit_registry_register_ops
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To add a type to a registry, or to change or remove
+ *			one, while channels may be using it.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		As channel_register_type_ops. Parcels being checked
+ *			when a type changes finish with the old validator,
+ *			as do open streams.
+ *
+ *  Return Value:	0 on success, -1 on failure with errno set.
+ */
+int xambit_registry_register_ops(xambit_registry_t *reg, uint32_t type_id,
+				 const xambit_validator_ops_t *ops)
+{
+    return registry_update(reg, type_id, ops, REG_ADD) < 0 ? -1 : 0;
+}
+
+int xambit_registry_replace_ops(xambit_registry_t *reg, uint32_t type_id,
+				const xambit_validator_ops_t *ops)
+{
+    return registry_update(reg, type_id, ops, REG_REPLACE) < 0 ? -1 : 0;
+}
+
+int xambit_registry_unregister(xambit_registry_t *reg, uint32_t type_id)
+{
+    return registry_update(reg, type_id, NULL, REG_REMOVE) < 0 ? -1 : 0;
+}
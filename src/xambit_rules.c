@@ -0,0 +1,1591 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Declarative validation rules. A rule set is text, one rule to a line:
+ *
+ *	length MIN [MAX]	the parcel is MIN to MAX bytes long
+ *	bytes [CLASS]		every byte is in CLASS
+ *	require PATTERN		PATTERN occurs somewhere in the parcel
+ *	forbid PATTERN		PATTERN occurs nowhere in the parcel
+ *	field N SEP PATTERN	the Nth SEP separated field is all PATTERN
+ *
+ * A PATTERN is a "string" or a /regular expression/. They are compiled when
+ * the rules are, so that checking a parcel is a single pass over it: all
+ * the require and forbid patterns become one DFA over byte classes, whose
+ * state records which patterns have been seen, and each field pattern a DFA
+ * of its own.
+ *
+ * Most of a parcel usually leaves the DFA where it is. A state that only a
+ * few bytes lead out of is skipped over 16 or 32 bytes at a time on x86-64
+ * CPUs with SSSE3 or AVX2, finding the next of those bytes with pshufb set
+ * membership tests; the bytes rule is checked in the same way. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define XAMBIT_RS_X86
+#endif
+
+#include "xambit_int.h"
+
+#define RS_MAX_PATTERNS	64	    /* require and forbid patterns in a set */
+#define RS_MAX_FIELDS	64
+#define RS_MAX_NSTATES	65536	    /* NFA states for the patterns of a DFA */
+#define RS_MAX_DSTATES	4096	    /* States of a DFA */
+#define RS_MAX_REPEAT	255	    /* Largest count in {m,n} */
+#define RS_ACCEL_MAX	16	    /* Most exits from a state skipped over */
+
+#define RS_STOP_ACCEL	1	    /* Why a DFA state leaves the fast loop */
+#define RS_STOP_DONE	2
+
+/* ********************* Byte sets ********************* */
+
+typedef struct rs_cset_s {
+    uint32_t	w[8];
+} rs_cset_t;
+
+/* A byte set laid out for pshufb: bit (b >> 4) & 7 of lo[b & 15] is set for
+ * members b below 0x80, and likewise hi for those above */
+typedef struct rs_set_s {
+    uint8_t	lo[16];
+    uint8_t	hi[16];
+    rs_cset_t	bits;
+} rs_set_t;
+
+typedef size_t (*rs_find_fn_t)(const rs_set_t *s, const uint8_t *p,
+			       size_t len);
+
+static rs_find_fn_t rs_find_run;
+
+/* ************* Regular expression syntax trees ************* */
+
+enum { RN_SET, RN_CAT, RN_ALT, RN_REP, RN_EMPTY };
+
+typedef struct rs_node_s {
+    int		type;
+    int		a;		    /* Children, as node indexes */
+    int		b;
+    int		min;		    /* RN_REP; max < 0 for no limit */
+    int		max;
+    rs_cset_t	set;
+} rs_node_t;
+
+/* A pattern to match: its tree, and whether it must start at the start of
+ * the data and end at the end */
+typedef struct rs_pat_s {
+    int		root;
+    int		anchored;
+    int		at_end;
+} rs_pat_t;
+
+/* **************** Thompson NFAs **************** */
+
+enum { NS_SET, NS_SPLIT, NS_MATCH };
+
+typedef struct rs_nstate_s {
+    uint8_t	type;
+    uint8_t	pat;		    /* Pattern the state belongs to */
+    int32_t	out;
+    int32_t	out1;		    /* NS_SPLIT */
+    int32_t	set;		    /* NS_SET: index into the NFA's sets */
+} rs_nstate_t;
+
+typedef struct rs_nfa_s {
+    rs_nstate_t	*st;
+    int		n;
+    int		cap;
+    rs_cset_t	*sets;
+    int		nsets;
+    int		setcap;
+    int		start[RS_MAX_PATTERNS];
+} rs_nfa_t;
+
+/* **************** DFAs **************** */
+
+typedef struct rs_dfa_s {
+    uint8_t	cls[256];	    /* Byte to class */
+    uint32_t	nclasses;
+    uint32_t	nstates;
+    uint16_t	*trans;		    /* nstates rows of nclasses */
+    uint8_t	*stop;		    /* RS_STOP_* for each state */
+    uint64_t	*mask;		    /* Patterns matched on the way there */
+    uint64_t	*endmask;	    /* ... and also matched if the data ends */
+    int16_t	*accel;		    /* Index into sets, for RS_STOP_ACCEL */
+    rs_set_t	*sets;
+} rs_dfa_t;
+
+typedef struct rs_field_s {
+    uint32_t	n;		    /* Counting from 1 */
+    uint8_t	sep;
+    rs_dfa_t	dfa;
+} rs_field_t;
+
+struct xambit_rules_s {
+    uint32_t	refs;
+    uint64_t	min_len;
+    uint64_t	max_len;
+    int		check_bytes;
+    rs_set_t	bad;		    /* Bytes outside the bytes rules */
+    uint64_t	require;	    /* Pattern masks */
+    uint64_t	forbid;
+    rs_dfa_t	*search;	    /* The require and forbid patterns */
+    rs_field_t	*fields;
+    int		nfields;
+};
+
+/* **************** Compiler state **************** */
+
+typedef struct rs_comp_s {
+    char	*err;
+    size_t	errlen;
+    int		line;
+    const char	*p;		    /* Parse position */
+    const char	*end;
+    rs_node_t	*node;
+    int		nnode;
+    int		capnode;
+    rs_pat_t	pat[RS_MAX_PATTERNS];
+    int		npat;
+    rs_pat_t	fpat[RS_MAX_FIELDS];
+} rs_comp_t;
+
+/* DFA construction state: the NFA state sets of each DFA state, end to end
+ * in pool, and a hash of them */
+typedef struct rs_build_s {
+    rs_nfa_t	*nfa;
+    rs_pat_t	*pats;
+    int		npats;
+    uint64_t	reject;		    /* Patterns that settle the verdict */
+    int32_t	*pool;
+    size_t	npool;
+    size_t	poolcap;
+    size_t	*off;		    /* Of each state's set in pool */
+    int		*len;
+    int32_t	*hash;
+    uint32_t	*stamp;		    /* Closure marks, one per NFA state */
+    uint32_t	gen;
+    int32_t	*stack;
+    int32_t	*work;
+} rs_build_t;
+
+static void cs_add(rs_cset_t *s, int b);
+static void cs_range(rs_cset_t *s, int lo, int hi);
+static void cs_invert(rs_cset_t *s);
+static int cs_has(const rs_cset_t *s, int b);
+static void rs_set_make(rs_set_t *s, const rs_cset_t *cs);
+static size_t rs_find_sw(const rs_set_t *s, const uint8_t *p, size_t len);
+static int rs_error(rs_comp_t *c, const char *fmt, ...);
+static int rs_node_new(rs_comp_t *c, int type);
+static int rs_node_pair(rs_comp_t *c, int type, int a, int b);
+static int rs_hexval(int ch);
+static int rs_parse_hex(rs_comp_t *c);
+static int rs_parse_escape(rs_comp_t *c, rs_cset_t *set);
+static int rs_parse_class(rs_comp_t *c, rs_cset_t *set);
+static int rs_parse_alt(rs_comp_t *c);
+static int rs_parse_cat(rs_comp_t *c);
+static int rs_parse_repeat(rs_comp_t *c);
+static int rs_parse_atom(rs_comp_t *c);
+static int rs_parse_count(rs_comp_t *c);
+static int rs_parse_pattern(rs_comp_t *c, rs_pat_t *pat);
+static int rs_parse_number(rs_comp_t *c, uint64_t *n);
+static void rs_skip_space(rs_comp_t *c);
+static int rs_keyword(rs_comp_t *c, const char *kw);
+static int rs_parse_rule(rs_comp_t *c, xambit_rules_t *r);
+static int rs_nstate_new(rs_nfa_t *nfa, int type, int pat);
+static int rs_emit(rs_comp_t *c, rs_nfa_t *nfa, int node, int next, int pat);
+static void rs_closure(rs_build_t *b, int32_t *set, int *n, int s);
+static int rs_cmp(const void *a, const void *b);
+static int rs_grow(void *pp, size_t size, uint32_t cap);
+static int rs_dstate(rs_build_t *b, rs_dfa_t *d, int32_t *set, int n,
+		     uint64_t mask);
+static int rs_build_dfa(rs_comp_t *c, rs_pat_t *pats, int npats,
+			uint64_t reject, rs_dfa_t *d);
+static void rs_dfa_free(rs_dfa_t *d);
+static uint64_t rs_run(const rs_dfa_t *d, const uint8_t *p, size_t len);
+
+/* ********************* Byte sets ********************* */
+
+static void cs_add(rs_cset_t *s, int b)
+{
+    s->w[b >> 5] |= 1u << (b & 31);
+}
+
+static void cs_range(rs_cset_t *s, int lo, int hi)
+{
+    for (; lo <= hi; lo++)
+	cs_add(s, lo);
+}
+
+static void cs_invert(rs_cset_t *s)
+{
+    int		i;
+
+    for (i = 0; i < 8; i++)
+	s->w[i] = ~s->w[i];
+}
+
+static int cs_has(const rs_cset_t *s, int b)
+{
+    return (s->w[b >> 5] >> (b & 31)) & 1;
+}
+
+static void rs_set_make(rs_set_t *s, const rs_cset_t *cs)
+{
+    int		b;
+
+    memset(s, 0, sizeof(*s));
+    s->bits = *cs;
+    for (b = 0; b < 256; b++)
+	if (cs_has(cs, b))
+	{
+	    if (b < 0x80)
+		s->lo[b & 15] |= 1 << (b >> 4);
+	    else
+		s->hi[b & 15] |= 1 << ((b >> 4) & 7);
+	}
+}
+
+/* Offset of the first member of s in p, or len */
+static size_t rs_find_sw(const rs_set_t *s, const uint8_t *p, size_t len)
+{
+    size_t	i;
+
+    for (i = 0; i < len; i++)
+	if (cs_has(&s->bits, p[i]))
+	    break;
+    return i;
+}
+
+#ifdef XAMBIT_RS_X86
+__attribute__((target("ssse3")))
+static size_t rs_find_ssse3(const rs_set_t *s, const uint8_t *p, size_t len)
+{
+    __m128i	lo = _mm_loadu_si128((const __m128i *)s->lo);
+    __m128i	hi = _mm_loadu_si128((const __m128i *)s->hi);
+    __m128i	bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+				    1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i	nib = _mm_set1_epi8(0x0f);
+    __m128i	eight = _mm_set1_epi8(8);
+    __m128i	x, h, low, row;
+    uint32_t	m;
+    size_t	i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+	x = _mm_loadu_si128((const __m128i *)(p + i));
+	h = _mm_and_si128(_mm_srli_epi64(x, 4), nib);
+	low = _mm_cmplt_epi8(h, eight);
+	x = _mm_and_si128(x, nib);
+	row = _mm_or_si128(_mm_and_si128(low, _mm_shuffle_epi8(lo, x)),
+			   _mm_andnot_si128(low, _mm_shuffle_epi8(hi, x)));
+	row = _mm_and_si128(row, _mm_shuffle_epi8(bit, h));
+	m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(row, _mm_setzero_si128()))
+	    & 0xffff;
+	if (m != 0)
+	    return i + __builtin_ctz(m);
+    }
+    return i + rs_find_sw(s, p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t rs_find_avx2(const rs_set_t *s, const uint8_t *p, size_t len)
+{
+    __m256i	lo;
+    __m256i	hi;
+    __m256i	bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+				       1, 2, 4, 8, 16, 32, 64, -128,
+				       1, 2, 4, 8, 16, 32, 64, -128,
+				       1, 2, 4, 8, 16, 32, 64, -128);
+    __m256i	nib = _mm256_set1_epi8(0x0f);
+    __m256i	eight = _mm256_set1_epi8(8);
+    __m256i	x, h, low, row;
+    uint32_t	m;
+    size_t	i;
+
+    lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s->lo));
+    hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s->hi));
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+	x = _mm256_loadu_si256((const __m256i *)(p + i));
+	h = _mm256_and_si256(_mm256_srli_epi64(x, 4), nib);
+	low = _mm256_cmpgt_epi8(eight, h);
+	x = _mm256_and_si256(x, nib);
+	row = _mm256_blendv_epi8(_mm256_shuffle_epi8(hi, x),
+				 _mm256_shuffle_epi8(lo, x), low);
+	row = _mm256_and_si256(row, _mm256_shuffle_epi8(bit, h));
+	m = ~(uint32_t)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(row, _mm256_setzero_si256()));
+	if (m != 0)
+	    return i + __builtin_ctz(m);
+    }
+    return i + rs_find_sw(s, p + i, len - i);
+}
+#endif
+
+__attribute__((constructor))
+static void rs_init(void)
+{
+    rs_find_run = rs_find_sw;
+#ifdef XAMBIT_RS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	rs_find_run = rs_find_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+	rs_find_run = rs_find_ssse3;
+#endif
+}
+
+/* ********************* Parsing ********************* */
+
+static int rs_error(rs_comp_t *c, const char *fmt, ...)
+{
+    va_list	ap;
+    int		n = 0;
+
+    if (c->err != NULL && c->errlen > 0)
+    {
+	if (c->line > 0)
+	    n = snprintf(c->err, c->errlen, "line %d: ", c->line);
+	if (n >= 0 && (size_t)n < c->errlen)
+	{
+	    va_start(ap, fmt);
+	    vsnprintf(c->err + n, c->errlen - n, fmt, ap);
+	    va_end(ap);
+	}
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static int rs_node_new(rs_comp_t *c, int type)
+{
+    rs_node_t	*n;
+
+    if (c->nnode == c->capnode)
+    {
+	n = realloc(c->node, (c->capnode ? 2 * c->capnode : 64) * sizeof(*n));
+	if (n == NULL)
+	{
+	    errno = ENOMEM;
+	    return -1;
+	}
+	c->node = n;
+	c->capnode = c->capnode ? 2 * c->capnode : 64;
+    }
+
+    n = &c->node[c->nnode];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->a = -1;
+    n->b = -1;
+    return c->nnode++;
+}
+
+static int rs_node_pair(rs_comp_t *c, int type, int a, int b)
+{
+    int		n;
+
+    if (a < 0)
+	return b;
+    n = rs_node_new(c, type);
+    if (n < 0)
+	return -1;
+    c->node[n].a = a;
+    c->node[n].b = b;
+    return n;
+}
+
+static int rs_hexval(int ch)
+{
+    if (ch >= '0' && ch <= '9')
+	return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+	return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+	return ch - 'A' + 10;
+    return -1;
+}
+
+/* The two hex digits after \x */
+static int rs_parse_hex(rs_comp_t *c)
+{
+    int		h;
+    int		l;
+
+    if (c->end - c->p < 2 || (h = rs_hexval(c->p[0])) < 0 ||
+	(l = rs_hexval(c->p[1])) < 0)
+	return rs_error(c, "bad \\x escape");
+    c->p += 2;
+    return h << 4 | l;
+}
+
+/* The escape after a backslash, as a set of bytes. Returns the byte it
+ * stands for, or 256 for a class such as \d. */
+static int rs_parse_escape(rs_comp_t *c, rs_cset_t *set)
+{
+    int		ch;
+    int		neg = 0;
+
+    memset(set, 0, sizeof(*set));
+    if (c->p == c->end)
+	return rs_error(c, "trailing backslash");
+
+    ch = (unsigned char)*c->p++;
+    switch (ch)
+    {
+	case 'D':
+	case 'W':
+	case 'S':
+	    neg = 1;
+	    ch += 'a' - 'A';
+	    /* Fall through */
+	case 'd':
+	case 'w':
+	case 's':
+	    if (ch == 'd' || ch == 'w')
+		cs_range(set, '0', '9');
+	    if (ch == 'w')
+	    {
+		cs_range(set, 'a', 'z');
+		cs_range(set, 'A', 'Z');
+		cs_add(set, '_');
+	    }
+	    if (ch == 's')
+	    {
+		cs_range(set, '\t', '\r');
+		cs_add(set, ' ');
+	    }
+	    if (neg)
+		cs_invert(set);
+	    return 256;
+	case 'n':
+	    ch = '\n';
+	    break;
+	case 'r':
+	    ch = '\r';
+	    break;
+	case 't':
+	    ch = '\t';
+	    break;
+	case '0':
+	    ch = 0;
+	    break;
+	case 'x':
+	    ch = rs_parse_hex(c);
+	    if (ch < 0)
+		return -1;
+	    break;
+	default:
+	    break;
+    }
+
+    cs_add(set, ch);
+    return ch;
+}
+
+/* A bracketed class, from just after the [ */
+static int rs_parse_class(rs_comp_t *c, rs_cset_t *set)
+{
+    rs_cset_t	es;
+    int		neg = 0;
+    int		first = 1;
+    int		lo;
+    int		hi;
+
+    memset(set, 0, sizeof(*set));
+    if (c->p < c->end && *c->p == '^')
+    {
+	neg = 1;
+	c->p++;
+    }
+
+    for (;;)
+    {
+	if (c->p == c->end)
+	    return rs_error(c, "unterminated [");
+	if (*c->p == ']' && !first)
+	    break;
+	first = 0;
+
+	lo = (unsigned char)*c->p++;
+	if (lo == '\\')
+	{
+	    lo = rs_parse_escape(c, &es);
+	    if (lo < 0)
+		return -1;
+	    if (lo == 256)
+	    {
+		for (hi = 0; hi < 8; hi++)
+		    set->w[hi] |= es.w[hi];
+		continue;
+	    }
+	}
+
+	hi = lo;
+	if (c->end - c->p >= 2 && c->p[0] == '-' && c->p[1] != ']')
+	{
+	    c->p++;
+	    hi = (unsigned char)*c->p++;
+	    if (hi == '\\')
+	    {
+		hi = rs_parse_escape(c, &es);
+		if (hi < 0)
+		    return -1;
+		if (hi == 256)
+		    return rs_error(c, "class in a range");
+	    }
+	    if (hi < lo)
+		return rs_error(c, "bad range");
+	}
+	cs_range(set, lo, hi);
+    }
+
+    c->p++;
+    if (neg)
+	cs_invert(set);
+    return 0;
+}
+
+static int rs_parse_atom(rs_comp_t *c)
+{
+    rs_cset_t	set;
+    int		n;
+
+    memset(&set, 0, sizeof(set));
+    switch (*c->p)
+    {
+	case '(':
+	    c->p++;
+	    n = rs_parse_alt(c);
+	    if (n < 0)
+		return -1;
+	    if (c->p == c->end || *c->p != ')')
+		return rs_error(c, "missing )");
+	    c->p++;
+	    return n;
+	case '[':
+	    c->p++;
+	    if (rs_parse_class(c, &set) < 0)
+		return -1;
+	    break;
+	case '.':
+	    c->p++;
+	    cs_invert(&set);
+	    break;
+	case '\\':
+	    c->p++;
+	    if (rs_parse_escape(c, &set) < 0)
+		return -1;
+	    break;
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+	    return rs_error(c, "nothing to repeat");
+	case '^':
+	case '$':
+	    return rs_error(c, "anchors may only begin or end a pattern");
+	default:
+	    cs_add(&set, (unsigned char)*c->p++);
+	    break;
+    }
+
+    n = rs_node_new(c, RN_SET);
+    if (n >= 0)
+	c->node[n].set = set;
+    return n;
+}
+
+static int rs_parse_count(rs_comp_t *c)
+{
+    int		n = 0;
+
+    if (c->p == c->end || *c->p < '0' || *c->p > '9')
+	return rs_error(c, "bad repeat count");
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9')
+    {
+	n = n * 10 + *c->p++ - '0';
+	if (n > RS_MAX_REPEAT)
+	    return rs_error(c, "repeat count over %d", RS_MAX_REPEAT);
+    }
+    return n;
+}
+
+static int rs_parse_repeat(rs_comp_t *c)
+{
+    int		atom;
+    int		n;
+    int		min;
+    int		max;
+
+    atom = rs_parse_atom(c);
+    while (atom >= 0 && c->p < c->end)
+    {
+	switch (*c->p)
+	{
+	    case '*':
+		min = 0;
+		max = -1;
+		break;
+	    case '+':
+		min = 1;
+		max = -1;
+		break;
+	    case '?':
+		min = 0;
+		max = 1;
+		break;
+	    case '{':
+		c->p++;
+		min = max = rs_parse_count(c);
+		if (min < 0)
+		    return -1;
+		if (c->p < c->end && *c->p == ',')
+		{
+		    c->p++;
+		    max = -1;
+		    if (c->p < c->end && *c->p != '}' &&
+			(max = rs_parse_count(c)) < 0)
+			return -1;
+		}
+		if (c->p == c->end || *c->p != '}')
+		    return rs_error(c, "missing }");
+		if (max >= 0 && max < min)
+		    return rs_error(c, "bad repeat range");
+		break;
+	    default:
+		return atom;
+	}
+
+	c->p++;
+	n = rs_node_new(c, RN_REP);
+	if (n < 0)
+	    return -1;
+	c->node[n].a = atom;
+	c->node[n].min = min;
+	c->node[n].max = max;
+	atom = n;
+    }
+    return atom;
+}
+
+static int rs_parse_cat(rs_comp_t *c)
+{
+    int		cat = -1;
+    int		n;
+
+    while (c->p < c->end && *c->p != '|' && *c->p != ')')
+    {
+	n = rs_parse_repeat(c);
+	if (n < 0)
+	    return -1;
+	cat = rs_node_pair(c, RN_CAT, cat, n);
+	if (cat < 0)
+	    return -1;
+    }
+    return cat < 0 ? rs_node_new(c, RN_EMPTY) : cat;
+}
+
+static int rs_parse_alt(rs_comp_t *c)
+{
+    int		alt;
+    int		n;
+
+    alt = rs_parse_cat(c);
+    while (alt >= 0 && c->p < c->end && *c->p == '|')
+    {
+	c->p++;
+	n = rs_parse_cat(c);
+	if (n < 0)
+	    return -1;
+	alt = rs_node_pair(c, RN_ALT, alt, n);
+    }
+    return alt;
+}
+
+/* A "string" or /regular expression/ at the parse position */
+static int rs_parse_pattern(rs_comp_t *c, rs_pat_t *pat)
+{
+    rs_cset_t	set;
+    const char	*end;
+    const char	*q;
+    int		n;
+    int		ch;
+
+    memset(pat, 0, sizeof(*pat));
+    if (c->p == c->end || (*c->p != '"' && *c->p != '/'))
+	return rs_error(c, "expected a \"string\" or /pattern/");
+
+    /* Find the closing delimiter, passing over escaped ones */
+    for (end = c->p + 1; end < c->end && *end != *c->p; end++)
+	if (*end == '\\' && end + 1 < c->end)
+	    end++;
+    if (end == c->end)
+	return rs_error(c, "unterminated pattern");
+
+    q = c->p++;
+    if (*q == '"')
+    {
+	pat->root = -1;
+	while (c->p < end)
+	{
+	    memset(&set, 0, sizeof(set));
+	    ch = (unsigned char)*c->p++;
+	    if (ch == '\\')
+	    {
+		ch = rs_parse_escape(c, &set);
+		if (ch < 0)
+		    return -1;
+		if (ch == 256)
+		    return rs_error(c, "class in a string");
+	    }
+	    cs_add(&set, ch);
+	    n = rs_node_new(c, RN_SET);
+	    if (n < 0)
+		return -1;
+	    c->node[n].set = set;
+	    pat->root = rs_node_pair(c, RN_CAT, pat->root, n);
+	    if (pat->root < 0)
+		return -1;
+	}
+	if (pat->root < 0)
+	    pat->root = rs_node_new(c, RN_EMPTY);
+    }
+    else
+    {
+	if (c->p < end && *c->p == '^')
+	{
+	    pat->anchored = 1;
+	    c->p++;
+	}
+	if (end > c->p && end[-1] == '$')
+	{
+	    /* Unless the $ is escaped */
+	    for (q = end - 1; q > c->p && q[-1] == '\\'; q--)
+		;
+	    pat->at_end = (end - 1 - q) % 2 == 0;
+	}
+
+	q = c->end;
+	c->end = end - pat->at_end;
+	pat->root = rs_parse_alt(c);
+	if (pat->root >= 0 && c->p != c->end)
+	    pat->root = rs_error(c, "unmatched )");
+	c->end = q;
+    }
+
+    c->p = end + 1;
+    return pat->root < 0 ? -1 : 0;
+}
+
+static int rs_parse_number(rs_comp_t *c, uint64_t *n)
+{
+    if (c->p == c->end || *c->p < '0' || *c->p > '9')
+	return rs_error(c, "expected a number");
+
+    *n = 0;
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9')
+    {
+	if (*n > (UINT64_MAX - 9) / 10)
+	    return rs_error(c, "number too large");
+	*n = *n * 10 + *c->p++ - '0';
+    }
+    return 0;
+}
+
+static void rs_skip_space(rs_comp_t *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t'))
+	c->p++;
+}
+
+static int rs_keyword(rs_comp_t *c, const char *kw)
+{
+    size_t	len = strlen(kw);
+
+    if ((size_t)(c->end - c->p) < len || memcmp(c->p, kw, len) != 0 ||
+	((size_t)(c->end - c->p) > len && c->p[len] != ' ' &&
+	 c->p[len] != '\t'))
+	return 0;
+    c->p += len;
+    rs_skip_space(c);
+    return 1;
+}
+
+/* One line of rules, without its newline */
+static int rs_parse_rule(rs_comp_t *c, xambit_rules_t *r)
+{
+    rs_cset_t	set;
+    rs_field_t	*f;
+    uint64_t	n;
+    int		req;
+    int		ch;
+    int		i;
+
+    rs_skip_space(c);
+    if (c->p == c->end || *c->p == '#')
+	return 0;
+
+    if (rs_keyword(c, "length"))
+    {
+	if (rs_parse_number(c, &r->min_len) < 0)
+	    return -1;
+	rs_skip_space(c);
+	r->max_len = UINT64_MAX;
+	if (c->p < c->end && *c->p != '#' &&
+	    rs_parse_number(c, &r->max_len) < 0)
+	    return -1;
+	if (r->max_len < r->min_len)
+	    return rs_error(c, "maximum length below minimum");
+    }
+    else if (rs_keyword(c, "bytes"))
+    {
+	if (c->p == c->end || *c->p != '[')
+	    return rs_error(c, "expected a [class]");
+	c->p++;
+	if (rs_parse_class(c, &set) < 0)
+	    return -1;
+
+	/* Several rules allow only the bytes all of them allow */
+	cs_invert(&set);
+	for (i = 0; i < 8; i++)
+	    set.w[i] |= r->bad.bits.w[i];
+	rs_set_make(&r->bad, &set);
+	r->check_bytes = 1;
+    }
+    else if ((req = rs_keyword(c, "require")) || rs_keyword(c, "forbid"))
+    {
+	if (c->npat == RS_MAX_PATTERNS)
+	    return rs_error(c, "more than %d patterns", RS_MAX_PATTERNS);
+	if (req)
+	    r->require |= 1ULL << c->npat;
+	else
+	    r->forbid |= 1ULL << c->npat;
+	if (rs_parse_pattern(c, &c->pat[c->npat]) < 0)
+	    return -1;
+	c->npat++;
+    }
+    else if (rs_keyword(c, "field"))
+    {
+	if (r->nfields == RS_MAX_FIELDS)
+	    return rs_error(c, "more than %d fields", RS_MAX_FIELDS);
+	f = realloc(r->fields, (r->nfields + 1) * sizeof(*f));
+	if (f == NULL)
+	{
+	    errno = ENOMEM;
+	    return -1;
+	}
+	r->fields = f;
+	f += r->nfields;
+	memset(f, 0, sizeof(*f));
+	if (rs_parse_number(c, &n) < 0)
+	    return -1;
+	if (n == 0 || n > UINT32_MAX)
+	    return rs_error(c, "fields count from 1");
+	f->n = n;
+
+	rs_skip_space(c);
+	if (c->p == c->end)
+	    return rs_error(c, "expected a separator");
+	ch = (unsigned char)*c->p++;
+	if (ch == '\\')
+	{
+	    ch = rs_parse_escape(c, &set);
+	    if (ch < 0)
+		return -1;
+	    if (ch == 256)
+		return rs_error(c, "separator is a class");
+	}
+	f->sep = ch;
+
+	rs_skip_space(c);
+	if (rs_parse_pattern(c, &c->fpat[r->nfields]) < 0)
+	    return -1;
+	c->fpat[r->nfields].anchored = 1;
+	c->fpat[r->nfields].at_end = 1;
+	r->nfields++;
+    }
+    else
+	return rs_error(c, "unknown rule");
+
+    rs_skip_space(c);
+    if (c->p < c->end && *c->p != '#')
+	return rs_error(c, "junk after rule");
+    return 0;
+}
+
+/* ******************** NFA construction ******************** */
+
+static int rs_nstate_new(rs_nfa_t *nfa, int type, int pat)
+{
+    rs_nstate_t	*st;
+
+    if (nfa->n == RS_MAX_NSTATES)
+    {
+	errno = E2BIG;
+	return -1;
+    }
+    if (nfa->n == nfa->cap)
+    {
+	st = realloc(nfa->st, (nfa->cap ? 2 * nfa->cap : 256) * sizeof(*st));
+	if (st == NULL)
+	{
+	    errno = ENOMEM;
+	    return -1;
+	}
+	nfa->st = st;
+	nfa->cap = nfa->cap ? 2 * nfa->cap : 256;
+    }
+
+    st = &nfa->st[nfa->n];
+    st->type = type;
+    st->pat = pat;
+    st->out = -1;
+    st->out1 = -1;
+    st->set = -1;
+    return nfa->n++;
+}
+
+/* Emit the NFA for a node ahead of the state next, returning its entry.
+ * Building back to front means no dangling exits need to be patched. */
+static int rs_emit(rs_comp_t *c, rs_nfa_t *nfa, int node, int next, int pat)
+{
+    rs_node_t	*n = &c->node[node];
+    rs_cset_t	*sets;
+    int		end = next;
+    int		s;
+    int		a;
+    int		i;
+
+    switch (n->type)
+    {
+	case RN_EMPTY:
+	    return next;
+
+	case RN_SET:
+	    s = rs_nstate_new(nfa, NS_SET, pat);
+	    if (s < 0)
+		return -1;
+	    if (nfa->nsets == nfa->setcap)
+	    {
+		sets = realloc(nfa->sets, (nfa->setcap ? 2 * nfa->setcap : 64) *
+			       sizeof(*sets));
+		if (sets == NULL)
+		{
+		    errno = ENOMEM;
+		    return -1;
+		}
+		nfa->sets = sets;
+		nfa->setcap = nfa->setcap ? 2 * nfa->setcap : 64;
+	    }
+	    nfa->sets[nfa->nsets] = n->set;
+	    nfa->st[s].set = nfa->nsets++;
+	    nfa->st[s].out = next;
+	    return s;
+
+	case RN_CAT:
+	    s = rs_emit(c, nfa, n->b, next, pat);
+	    return s < 0 ? -1 : rs_emit(c, nfa, n->a, s, pat);
+
+	case RN_ALT:
+	    a = rs_emit(c, nfa, n->a, next, pat);
+	    if (a < 0)
+		return -1;
+	    s = rs_emit(c, nfa, n->b, next, pat);
+	    if (s < 0)
+		return -1;
+	    i = rs_nstate_new(nfa, NS_SPLIT, pat);
+	    if (i < 0)
+		return -1;
+	    nfa->st[i].out = a;
+	    nfa->st[i].out1 = s;
+	    return i;
+
+	case RN_REP:
+	    if (n->max < 0)
+	    {
+		/* A loop back through a split, which can also leave */
+		s = rs_nstate_new(nfa, NS_SPLIT, pat);
+		if (s < 0)
+		    return -1;
+		nfa->st[s].out1 = next;
+		a = rs_emit(c, nfa, n->a, s, pat);
+		if (a < 0)
+		    return -1;
+		nfa->st[s].out = a;
+		next = s;
+	    }
+
+	    /* The optional copies, each of which can skip to the end */
+	    for (i = n->min; i < n->max; i++)
+	    {
+		a = rs_emit(c, nfa, n->a, next, pat);
+		if (a < 0)
+		    return -1;
+		s = rs_nstate_new(nfa, NS_SPLIT, pat);
+		if (s < 0)
+		    return -1;
+		nfa->st[s].out = a;
+		nfa->st[s].out1 = end;
+		next = s;
+	    }
+
+	    for (i = 0; i < n->min; i++)
+	    {
+		next = rs_emit(c, nfa, n->a, next, pat);
+		if (next < 0)
+		    return -1;
+	    }
+	    return next;
+
+	default:
+	    break;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* ******************** DFA construction ******************** */
+
+/* Add NFA state s to set, following splits, unless already there */
+static void rs_closure(rs_build_t *b, int32_t *set, int *n, int s)
+{
+    rs_nstate_t	*st;
+    int		sp = 0;
+
+    if (b->stamp[s] == b->gen)
+	return;
+    b->stamp[s] = b->gen;
+    b->stack[sp++] = s;
+
+    while (sp > 0)
+    {
+	s = b->stack[--sp];
+	st = &b->nfa->st[s];
+	if (st->type != NS_SPLIT)
+	{
+	    set[(*n)++] = s;
+	    continue;
+	}
+	if (b->stamp[st->out] != b->gen)
+	{
+	    b->stamp[st->out] = b->gen;
+	    b->stack[sp++] = st->out;
+	}
+	if (b->stamp[st->out1] != b->gen)
+	{
+	    b->stamp[st->out1] = b->gen;
+	    b->stack[sp++] = st->out1;
+	}
+    }
+}
+
+static int rs_cmp(const void *a, const void *b)
+{
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+static int rs_grow(void *pp, size_t size, uint32_t cap)
+{
+    void	*p;
+
+    p = realloc(*(void **)pp, cap * size);
+    if (p == NULL)
+    {
+	errno = ENOMEM;
+	return -1;
+    }
+    *(void **)pp = p;
+    return 0;
+}
+
+/* The DFA state for a set of NFA states reached with the patterns in mask
+ * matched, added if it is new. Returns its number, or -1 on failure. */
+static int rs_dstate(rs_build_t *b, rs_dfa_t *d, int32_t *set, int n,
+		     uint64_t mask)
+{
+    rs_nstate_t	*st;
+    uint64_t	endmask = 0;
+    uint64_t	live = 0;
+    uint32_t	h = 2166136261u;
+    uint32_t	cap;
+    int32_t	id;
+    int		i;
+    int		j;
+
+    /* Patterns matched here stay matched, and need looking for no more */
+    for (i = 0; i < n; i++)
+    {
+	st = &b->nfa->st[set[i]];
+	if (st->type == NS_MATCH && !b->pats[st->pat].at_end)
+	    mask |= 1ULL << st->pat;
+    }
+    for (i = j = 0; i < n; i++)
+    {
+	st = &b->nfa->st[set[i]];
+	if (mask & (1ULL << st->pat))
+	    continue;
+	if (st->type == NS_MATCH)
+	    endmask |= 1ULL << st->pat;
+	set[j++] = set[i];
+    }
+    n = j;
+    qsort(set, n, sizeof(*set), rs_cmp);
+
+    for (i = 0; i < n; i++)
+	h = (h ^ set[i]) * 16777619u;
+    h ^= (uint32_t)mask ^ (uint32_t)(mask >> 32);
+    h *= 0x9e3779b1u;
+
+    for (i = h >> 19; (id = b->hash[i]) >= 0;
+	 i = (i + 1) & (2 * RS_MAX_DSTATES - 1))
+	if (d->mask[id] == mask && b->len[id] == n &&
+	    memcmp(b->pool + b->off[id], set, n * sizeof(*set)) == 0)
+	    return id;
+
+    if (d->nstates == RS_MAX_DSTATES)
+    {
+	errno = E2BIG;
+	return -1;
+    }
+
+    id = d->nstates;
+    if ((id & (id - 1)) == 0)
+    {
+	cap = id ? 2 * id : 1;
+	if (rs_grow(&d->trans, d->nclasses * sizeof(*d->trans), cap) < 0 ||
+	    rs_grow(&d->stop, sizeof(*d->stop), cap) < 0 ||
+	    rs_grow(&d->mask, sizeof(*d->mask), cap) < 0 ||
+	    rs_grow(&d->endmask, sizeof(*d->endmask), cap) < 0 ||
+	    rs_grow(&b->off, sizeof(*b->off), cap) < 0 ||
+	    rs_grow(&b->len, sizeof(*b->len), cap) < 0)
+	    return -1;
+    }
+    if (b->npool + n > b->poolcap)
+    {
+	b->poolcap = 2 * (b->npool + n);
+	if (rs_grow(&b->pool, sizeof(*b->pool), b->poolcap) < 0)
+	    return -1;
+    }
+
+    memcpy(b->pool + b->npool, set, n * sizeof(*set));
+    b->off[id] = b->npool;
+    b->len[id] = n;
+    b->npool += n;
+    b->hash[i] = id;
+
+    /* Nothing more can change once a forbidden pattern is seen, or every
+     * pattern is matched or out of the running */
+    for (i = 0; i < b->npats; i++)
+	if (!b->pats[i].anchored)
+	    live |= 1ULL << i;
+    d->mask[id] = mask;
+    d->endmask[id] = endmask;
+    d->stop[id] = (mask & b->reject) || (n == 0 && !(live & ~mask)) ?
+		  RS_STOP_DONE : 0;
+    d->nstates++;
+    return id;
+}
+
+/* Look for the patterns together in one DFA. Bit i of the masks of its
+ * states is set once pattern i has matched. */
+static int rs_build_dfa(rs_comp_t *c, rs_pat_t *pats, int npats,
+			uint64_t reject, rs_dfa_t *d)
+{
+    rs_build_t	b;
+    rs_nfa_t	nfa;
+    rs_cset_t	esc;
+    uint8_t	rep[256];
+    int16_t	map[512];
+    uint8_t	cls[256];
+    uint32_t	s;
+    uint32_t	k;
+    int32_t	*set;
+    int		n;
+    int		m;
+    int		i;
+    int		t;
+    int		err = -1;
+
+    memset(&b, 0, sizeof(b));
+    memset(&nfa, 0, sizeof(nfa));
+    memset(d, 0, sizeof(*d));
+    b.nfa = &nfa;
+    b.pats = pats;
+    b.npats = npats;
+    b.reject = reject;
+
+    for (i = 0; i < npats; i++)
+    {
+	m = rs_nstate_new(&nfa, NS_MATCH, i);
+	if (m < 0 || (nfa.start[i] = rs_emit(c, &nfa, pats[i].root, m, i)) < 0)
+	    goto out;
+    }
+
+    /* Bytes no pattern tells apart share a class */
+    d->nclasses = 1;
+    for (i = 0; i < nfa.nsets; i++)
+    {
+	memset(map, 0xff, sizeof(map));
+	n = 0;
+	for (k = 0; k < 256; k++)
+	{
+	    t = d->cls[k] << 1 | cs_has(&nfa.sets[i], k);
+	    if (map[t] < 0)
+		map[t] = n++;
+	    cls[k] = map[t];
+	}
+	memcpy(d->cls, cls, sizeof(cls));
+	d->nclasses = n;
+    }
+    for (k = 256; k-- > 0; )
+	rep[d->cls[k]] = k;
+
+    b.hash = malloc(2 * RS_MAX_DSTATES * sizeof(*b.hash));
+    b.stamp = calloc(nfa.n, sizeof(*b.stamp));
+    b.stack = malloc(nfa.n * sizeof(*b.stack));
+    b.work = malloc(nfa.n * sizeof(*b.work));
+    if (b.hash == NULL || b.stamp == NULL || b.stack == NULL ||
+	b.work == NULL)
+    {
+	errno = ENOMEM;
+	goto out;
+    }
+    memset(b.hash, 0xff, 2 * RS_MAX_DSTATES * sizeof(*b.hash));
+
+    b.gen++;
+    n = 0;
+    for (i = 0; i < npats; i++)
+	rs_closure(&b, b.work, &n, nfa.start[i]);
+    if (rs_dstate(&b, d, b.work, n, 0) < 0)
+	goto out;
+
+    for (s = 0; s < d->nstates; s++)
+	for (k = 0; k < d->nclasses; k++)
+	{
+	    if (d->stop[s] == RS_STOP_DONE)
+	    {
+		d->trans[s * d->nclasses + k] = s;
+		continue;
+	    }
+
+	    b.gen++;
+	    n = 0;
+	    set = b.pool + b.off[s];
+	    for (i = 0; i < b.len[s]; i++)
+		if (nfa.st[set[i]].type == NS_SET &&
+		    cs_has(&nfa.sets[nfa.st[set[i]].set], rep[k]))
+		    rs_closure(&b, b.work, &n, nfa.st[set[i]].out);
+
+	    /* Unanchored patterns may begin anywhere */
+	    for (i = 0; i < npats; i++)
+		if (!pats[i].anchored && !(d->mask[s] & (1ULL << i)))
+		    rs_closure(&b, b.work, &n, nfa.start[i]);
+
+	    t = rs_dstate(&b, d, b.work, n, d->mask[s]);
+	    if (t < 0)
+		goto out;
+	    d->trans[s * d->nclasses + k] = t;
+	}
+
+    /* States that few bytes leave are skipped through a set search */
+    d->accel = malloc(d->nstates * sizeof(*d->accel));
+    if (d->accel == NULL)
+    {
+	errno = ENOMEM;
+	goto out;
+    }
+    n = 0;
+    for (s = 0; s < d->nstates; s++)
+    {
+	d->accel[s] = -1;
+	if (d->stop[s] == RS_STOP_DONE)
+	    continue;
+
+	memset(&esc, 0, sizeof(esc));
+	for (i = m = 0; i < 256; i++)
+	    if (d->trans[s * d->nclasses + d->cls[i]] != s)
+	    {
+		cs_add(&esc, i);
+		m++;
+	    }
+	if (m > RS_ACCEL_MAX)
+	    continue;
+
+	if ((n & (n - 1)) == 0 &&
+	    rs_grow(&d->sets, sizeof(*d->sets), n ? 2 * n : 1) < 0)
+	    goto out;
+	rs_set_make(&d->sets[n], &esc);
+	d->accel[s] = n++;
+	d->stop[s] = RS_STOP_ACCEL;
+    }
+    err = 0;
+
+out:
+    if (err < 0 && errno == E2BIG)
+	rs_error(c, "patterns need more than %d states",
+		 nfa.n == RS_MAX_NSTATES ? RS_MAX_NSTATES : RS_MAX_DSTATES);
+    if (err < 0)
+    {
+	rs_dfa_free(d);
+	memset(d, 0, sizeof(*d));
+    }
+    free(nfa.st);
+    free(nfa.sets);
+    free(b.pool);
+    free(b.off);
+    free(b.len);
+    free(b.hash);
+    free(b.stamp);
+    free(b.stack);
+    free(b.work);
+    return err;
+}
+
+static void rs_dfa_free(rs_dfa_t *d)
+{
+    free(d->trans);
+    free(d->stop);
+    free(d->mask);
+    free(d->endmask);
+    free(d->accel);
+    free(d->sets);
+}
+
+/* The patterns of a DFA found in len bytes at p */
+static uint64_t rs_run(const rs_dfa_t *d, const uint8_t *p, size_t len)
+{
+    const uint16_t  *trans = d->trans;
+    const uint8_t   *stop = d->stop;
+    const uint8_t   *cls = d->cls;
+    uint32_t	    ncl = d->nclasses;
+    uint32_t	    s = 0;
+    size_t	    i = 0;
+
+    for (;;)
+    {
+	while (i < len && !stop[s])
+	    s = trans[s * ncl + cls[p[i++]]];
+	if (i == len || stop[s] == RS_STOP_DONE)
+	    break;
+
+	i += rs_find_run(&d->sets[d->accel[s]], p + i, len - i);
+	if (i == len)
+	    break;
+	s = trans[s * ncl + cls[p[i++]]];
+    }
+
+    return d->mask[s] | (i == len ? d->endmask[s] : 0);
+}
+
+/* ******************** Interface ******************** */
+
+/*  Function Name:	xambit_rules_compile
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To compile a set of declarative validation rules.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		The rules can be given to channel_register_type_ops,
+ *			or checked directly with xambit_rules_check. On
+ *			failure a message naming the offending line is left
+ *			in err, if it is not NULL.
+ *
+ *  Return Value:	The compiled rules, or NULL with errno set.
+ */
+xambit_rules_t *xambit_rules_compile(const char *text, char *err,
+				     size_t errlen)
+{
+    xambit_rules_t  *r = NULL;
+    rs_comp_t	    c;
+    const char	    *nl;
+    int		    i;
+
+    memset(&c, 0, sizeof(c));
+    c.err = err;
+    c.errlen = errlen;
+    if (err != NULL && errlen > 0)
+	err[0] = '\0';
+    if (text == NULL)
+    {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+    {
+	errno = ENOMEM;
+	return NULL;
+    }
+    r->refs = 1;
+    r->max_len = UINT64_MAX;
+
+    for (c.p = text; *c.p != '\0'; c.p = nl + (*nl != '\0'))
+    {
+	c.line++;
+	nl = strchr(c.p, '\n');
+	if (nl == NULL)
+	    nl = c.p + strlen(c.p);
+	c.end = nl > c.p && nl[-1] == '\r' ? nl - 1 : nl;
+	if (rs_parse_rule(&c, r) < 0)
+	    goto error;
+    }
+
+    c.line = 0;
+    if (c.npat > 0)
+    {
+	r->search = malloc(sizeof(*r->search));
+	if (r->search == NULL)
+	{
+	    errno = ENOMEM;
+	    goto error;
+	}
+	if (rs_build_dfa(&c, c.pat, c.npat, r->forbid, r->search) < 0)
+	{
+	    free(r->search);
+	    r->search = NULL;
+	    goto error;
+	}
+    }
+
+    for (i = 0; i < r->nfields; i++)
+	if (rs_build_dfa(&c, &c.fpat[i], 1, 0, &r->fields[i].dfa) < 0)
+	    goto error;
+
+    free(c.node);
+    return r;
+
+error:
+    i = errno;
+    free(c.node);
+    xambit_rules_free(r);
+    errno = i;
+    return NULL;
+}
+
+/*  Function Name:	xambit_rules_free
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To give up a set of compiled rules.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Types registered with the rules keep them until they
+ *			are unregistered or replaced.
+ *
+ *  Return Value:	None.
+ */
+void xambit_rules_free(xambit_rules_t *rules)
+{
+    int		i;
+
+    if (rules == NULL ||
+	__atomic_sub_fetch(&rules->refs, 1, __ATOMIC_ACQ_REL))
+	return;
+
+    if (rules->search != NULL)
+	rs_dfa_free(rules->search);
+    free(rules->search);
+    for (i = 0; i < rules->nfields; i++)
+	rs_dfa_free(&rules->fields[i].dfa);
+    free(rules->fields);
+    free(rules);
+}
+
+void rules_hold(xambit_rules_t *rules)
+{
+    __atomic_add_fetch(&rules->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*  Function Name:	xambit_rules_check
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To check len bytes of data against a set of rules.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Safe to call from several threads at once.
+ *
+ *  Return Value:	0 if the data passes, -1 if not.
+ */
+int xambit_rules_check(const xambit_rules_t *rules, const void *data,
+		       size_t len)
+{
+    const uint8_t   *p = data;
+    const uint8_t   *end = p + len;
+    const uint8_t   *q;
+    uint64_t	    m;
+    uint32_t	    n;
+    int		    i;
+
+    if (rules == NULL || (data == NULL && len > 0))
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (len < rules->min_len || len > rules->max_len)
+	return -1;
+
+    if (rules->check_bytes && rs_find_run(&rules->bad, p, len) != len)
+	return -1;
+
+    if (rules->search != NULL)
+    {
+	m = rs_run(rules->search, p, len);
+	if ((m & rules->require) != rules->require || (m & rules->forbid))
+	    return -1;
+    }
+
+    /* A field that is not there does not match */
+    for (i = 0; i < rules->nfields; i++)
+    {
+	q = p;
+	for (n = 1; n < rules->fields[i].n; n++)
+	{
+	    q = memchr(q, rules->fields[i].sep, end - q);
+	    if (q++ == NULL)
+		return -1;
+	}
+	data = memchr(q, rules->fields[i].sep, end - q);
+	if (!(rs_run(&rules->fields[i].dfa, q,
+		     (data != NULL ? (const uint8_t *)data : end) - q) & 1))
+	    return -1;
+    }
+
+    return 0;
+}
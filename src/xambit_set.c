@@ -0,0 +1,364 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Channel sets: any number of reading channels waited on with one epoll
+ * instance, level triggered, so that the cost of a wait depends on the
+ * channels that are ready and not on how many there are.
+ *
+ * Ready channels join the tail of a list and are handed out from its head,
+ * one at a time. The channel handed out last is looked at again before the
+ * next is: if a whole parcel is still buffered in it, which epoll cannot
+ * see, it rejoins the tail. A channel that always has data is so serviced
+ * once per round, after every other ready channel has had its turn. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#define SET_EVENTS	256	    /* Events taken per epoll_wait() */
+
+struct xambit_set_ent_s {
+    xambit_channel_t *ch;
+    void	*arg;
+    xambit_set_t *set;
+    xambit_set_ent_t *prev;	    /* Ready list, if queued */
+    xambit_set_ent_t *next;
+    int		queued;
+    xambit_set_ent_t *mprev;	    /* Every member */
+    xambit_set_ent_t *mnext;
+};
+
+struct xambit_set_s {
+    int		epfd;
+    xambit_set_ent_t *members;
+    xambit_set_ent_t *head;	    /* Ready, in the order handed out */
+    xambit_set_ent_t *tail;
+    int		nready;
+    xambit_set_ent_t *last;	    /* Handed out by xambit_set_next */
+    struct epoll_event ev[SET_EVENTS];
+};
+
+static void set_queue(xambit_set_t *set, xambit_set_ent_t *e);
+static void set_unqueue(xambit_set_t *set, xambit_set_ent_t *e);
+static void set_recheck(xambit_set_t *set);
+
+static void set_queue(xambit_set_t *set, xambit_set_ent_t *e)
+{
+    if (e->queued)
+	return;
+
+    e->prev = set->tail;
+    e->next = NULL;
+    if (set->tail != NULL)
+	set->tail->next = e;
+    else
+	set->head = e;
+    set->tail = e;
+    e->queued = 1;
+    set->nready++;
+}
+
+static void set_unqueue(xambit_set_t *set, xambit_set_ent_t *e)
+{
+    if (!e->queued)
+	return;
+
+    if (e->prev != NULL)
+	e->prev->next = e->next;
+    else
+	set->head = e->next;
+    if (e->next != NULL)
+	e->next->prev = e->prev;
+    else
+	set->tail = e->prev;
+    e->queued = 0;
+    set->nready--;
+}
+
+/* Put the channel last handed out back in line if it still has a parcel
+ * buffered */
+static void set_recheck(xambit_set_t *set)
+{
+    if (set->last != NULL && rx_buffered(set->last->ch))
+	set_queue(set, set->last);
+    set->last = NULL;
+}
+
+/*  Function Name:	xambit_set_new
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To create an empty channel set.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		See xambit_set_wait.
+ *
+ *  Return Value:	The set, or NULL with errno set.
+ */
+xambit_set_t *xambit_set_new(void)
+{
+    xambit_set_t	*set;
+
+    set = calloc(1, sizeof(*set));
+    if (set == NULL)
+    {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    set->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (set->epfd < 0)
+    {
+	free(set);
+	return NULL;
+    }
+    return set;
+}
+
+/*  Function Name:	xambit_set_free
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To free a channel set.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		The channels in it are left open, and out of any set.
+ *
+ *  Return Value:	None.
+ */
+void xambit_set_free(xambit_set_t *set)
+{
+    if (set == NULL)
+	return;
+
+    while (set->members != NULL)
+	xambit_set_remove(set, set->members->ch);
+    close(set->epfd);
+    free(set);
+}
+
+/*  Function Name:	xambit_set_add
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To add a reading channel to a set.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		arg is handed back with the channel by
+ *			xambit_set_next. A channel belongs to one set at a
+ *			time. Shared memory, io_uring and pipelined channels
+ *			have no descriptor that says when they are ready.
+ *
+ *  Return Value:	0 on success, or XAMBIT_ERR_STD with errno set.
+ */
+int xambit_set_add(xambit_set_t *set, xambit_channel_t *ch, void *arg)
+{
+    xambit_set_ent_t	*e;
+    struct epoll_event	ev;
+
+    if (set == NULL || ch == NULL || ch->direction != XAMBIT_CHIN ||
+	ch->type == XAMBIT_CH_SHM || ch->uring != NULL ||
+	ch->pipeline != NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+    if (ch->set_ent != NULL)
+    {
+	errno = EBUSY;
+	return XAMBIT_ERR_STD;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    e->ch = ch;
+    e->arg = arg;
+    e->set = set;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = e;
+    if (epoll_ctl(set->epfd, EPOLL_CTL_ADD, ch->fd, &ev) < 0)
+    {
+	free(e);
+	return XAMBIT_ERR_STD;
+    }
+
+    ch->set_ent = e;
+    e->mnext = set->members;
+    if (set->members != NULL)
+	set->members->mprev = e;
+    set->members = e;
+    if (rx_buffered(ch))
+	set_queue(set, e);
+    return 0;
+}
+
+/*  Function Name:	xambit_set_remove
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To take a channel out of a set.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Closing a channel takes it out of its set.
+ *
+ *  Return Value:	0 on success, or XAMBIT_ERR_STD with errno set.
+ */
+int xambit_set_remove(xambit_set_t *set, xambit_channel_t *ch)
+{
+    xambit_set_ent_t	*e;
+
+    if (set == NULL || ch == NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    e = ch->set_ent;
+    if (e == NULL || e->set != set)
+    {
+	errno = ENOENT;
+	return XAMBIT_ERR_STD;
+    }
+
+    epoll_ctl(set->epfd, EPOLL_CTL_DEL, ch->fd, NULL);
+    set_unqueue(set, e);
+    if (set->last == e)
+	set->last = NULL;
+    if (e->mprev != NULL)
+	e->mprev->mnext = e->mnext;
+    else
+	set->members = e->mnext;
+    if (e->mnext != NULL)
+	e->mnext->mprev = e->mprev;
+    ch->set_ent = NULL;
+    free(e);
+    return 0;
+}
+
+/* Take a channel being closed out of whatever set it is in */
+void set_leave(xambit_channel_t *ch)
+{
+    if (ch->set_ent != NULL)
+	xambit_set_remove(ch->set_ent->set, ch);
+}
+
+/*  Function Name:	xambit_set_wait
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To wait until channels in a set are ready to receive
+ *			from.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		timeout is in milliseconds, as for epoll_wait; -1
+ *			waits for ever. Channels already waiting to be
+ *			handed out mean no wait, but those newly ready are
+ *			still picked up behind them.
+ *
+ *  Return Value:	The number of channels ready, 0 if the time ran out,
+ *			or XAMBIT_ERR_STD with errno set.
+ */
+int xambit_set_wait(xambit_set_t *set, int timeout)
+{
+    xambit_set_ent_t	*e;
+    int			n;
+    int			i;
+
+    if (set == NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    set_recheck(set);
+    n = epoll_wait(set->epfd, set->ev, SET_EVENTS,
+		   set->head != NULL ? 0 : timeout);
+    if (n < 0)
+	return XAMBIT_ERR_STD;
+
+    for (i = 0; i < n; i++)
+    {
+	e = set->ev[i].data.ptr;
+	set_queue(set, e);
+    }
+    return set->nready;
+}
+
+/*  Function Name:	xambit_set_next
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To take the next ready channel from a set.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Does not wait. The caller should receive from the
+ *			channel before taking the next; one opened with
+ *			XAMBIT_NONBLOCK returns EAGAIN, rather than waiting,
+ *			when only part of a parcel has arrived.
+ *
+ *  Return Value:	The channel, with its argument in *arg if arg is not
+ *			NULL, or NULL with errno set to EAGAIN if none is
+ *			ready.
+ */
+xambit_channel_t *xambit_set_next(xambit_set_t *set, void **arg)
+{
+    xambit_set_ent_t	*e;
+
+    if (set == NULL)
+    {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    set_recheck(set);
+    e = set->head;
+    if (e == NULL)
+    {
+	errno = EAGAIN;
+	return NULL;
+    }
+
+    set_unqueue(set, e);
+    set->last = e;
+    if (arg != NULL)
+	*arg = e->arg;
+    return e->ch;
+}
@@ -0,0 +1,195 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SHA-256 (FIPS 180-4) digests, which name files by their content. On x86-64
+ * CPUs with the SHA extensions each block takes the sha256rnds2 and
+ * sha256msg1/2 instructions, some seven times the speed of the portable
+ * rounds used elsewhere. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define XAMBIT_SHA_X86
+#endif
+
+#include "xambit_int.h"
+
+#define SHA256_BLOCK	64
+
+typedef void (*sha_fn_t)(uint32_t *state, const uint8_t *p, size_t nblocks);
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+    0x1f83d9ab, 0x5be0cd19
+};
+
+static sha_fn_t sha256_run;
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_sw(uint32_t *state, const uint8_t *p, size_t nblocks)
+{
+    uint32_t	w[64];
+    uint32_t	a, b, c, d, e, f, g, h;
+    uint32_t	t1, t2;
+    int		i;
+
+    for (; nblocks > 0; nblocks--, p += SHA256_BLOCK)
+    {
+	for (i = 0; i < 16; i++)
+	    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+		   (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 64; i++)
+	    w[i] = w[i - 16] + w[i - 7] +
+		   (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+		   (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i = 0; i < 64; i++)
+	{
+	    t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+		 ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+	    t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+		 ((a & b) ^ (a & c) ^ (b & c));
+	    h = g; g = f; f = e; e = d + t1;
+	    d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef XAMBIT_SHA_X86
+/* The state is held as ABEF and CDGH, the order sha256rnds2 takes it in,
+ * and the message schedule four words at a time in m[] */
+__attribute__((target("sha,sse4.1")))
+static void sha256_ni(uint32_t *state, const uint8_t *p, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					 0x0405060700010203ULL);
+    __m128i	abef, cdgh, abef0, cdgh0;
+    __m128i	m[4];
+    __m128i	t;
+    int		i;
+
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xb1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)),
+			     0x1b);
+    abef = _mm_alignr_epi8(t, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+    for (; nblocks > 0; nblocks--, p += SHA256_BLOCK)
+    {
+	abef0 = abef;
+	cdgh0 = cdgh;
+
+	for (i = 0; i < 16; i++)
+	{
+	    if (i < 4)
+		m[i] = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
+	    else
+		m[i & 3] = _mm_sha256msg2_epu32(
+			_mm_add_epi32(
+			    _mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+			    _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)),
+			m[(i + 3) & 3]);
+
+	    t = _mm_add_epi32(m[i & 3],
+			_mm_loadu_si128((const __m128i *)(sha256_k + 4 * i)));
+	    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, t);
+	    abef = _mm_sha256rnds2_epu32(abef, cdgh,
+					 _mm_shuffle_epi32(t, 0x0e));
+	}
+
+	abef = _mm_add_epi32(abef, abef0);
+	cdgh = _mm_add_epi32(cdgh, cdgh0);
+    }
+
+    t = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(t, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(cdgh, t, 8));
+}
+#endif
+
+__attribute__((constructor))
+static void sha256_init(void)
+{
+    sha256_run = sha256_sw;
+#ifdef XAMBIT_SHA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("sha"))
+	sha256_run = sha256_ni;
+#endif
+}
+
+/* SHA-256 digest of len bytes at buf, into the 32 bytes at digest */
+void sha256(const void *buf, uint64_t len, uint8_t *digest)
+{
+    uint8_t	tail[2 * SHA256_BLOCK];
+    uint32_t	state[8];
+    uint64_t	whole = len / SHA256_BLOCK;
+    size_t	rest = len % SHA256_BLOCK;
+    size_t	n;
+    int		i;
+
+    memcpy(state, sha256_h0, sizeof(state));
+    sha256_run(state, buf, whole);
+
+    /* The last of the data, a 1 bit, and the length in bits, padded out to
+     * one block or two */
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, (const uint8_t *)buf + whole * SHA256_BLOCK, rest);
+    tail[rest] = 0x80;
+    n = rest + 9 > SHA256_BLOCK ? 2 * SHA256_BLOCK : SHA256_BLOCK;
+    for (i = 0; i < 8; i++)
+	tail[n - 1 - i] = (uint8_t)((len << 3) >> (8 * i));
+    sha256_run(state, tail, n / SHA256_BLOCK);
+
+    for (i = 0; i < 8; i++)
+    {
+	digest[4 * i] = state[i] >> 24;
+	digest[4 * i + 1] = state[i] >> 16;
+	digest[4 * i + 2] = state[i] >> 8;
+	digest[4 * i + 3] = state[i];
+    }
+}
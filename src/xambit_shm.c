@@ -0,0 +1,468 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* XAMBIT_CH_SHM channels: a single producer, single consumer ring in a POSIX
+ * shared memory object. The object holds a header page followed by the ring
+ * data, which each end maps twice back to back so that any run of up to a
+ * ring's worth of bytes is contiguous in memory, wherever it wraps.
+ *
+ * The writer copies parcels in and publishes its position; the reader hands
+ * out the ring itself as its read-ahead buffer, so parcels are parsed and
+ * validated where they lie, and gives space back by publishing its own
+ * position. Neither end takes a lock. An end that finds the ring empty or
+ * full sleeps on a futex after flagging that it is doing so, and the other
+ * end only makes the wake-up system call when it sees the flag. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#define SHM_MAGIC	0x58534852	/* "XSHR" */
+#define SHM_VERSION	1
+#define SHM_WRITER	0x1		/* Bits of shm_ring_t.ends */
+#define SHM_READER	0x2
+#define SHM_LINE	64		/* Keep each end's fields apart */
+
+/* The header page shared by both ends */
+typedef struct shm_ring_s {
+    uint32_t	magic;		    /* Set last by the creator */
+    uint32_t	version;
+    uint64_t	size;		    /* Bytes of ring data */
+    uint32_t	ends;		    /* Attached ends; also a futex */
+
+    /* Written by the writer */
+    uint64_t	wpos __attribute__((aligned(SHM_LINE)));
+    uint32_t	wseq;		    /* Futex bumped when wpos moves */
+    uint32_t	tx_wait;	    /* Writer sleeping for space */
+
+    /* Written by the reader */
+    uint64_t	rpos __attribute__((aligned(SHM_LINE)));
+    uint32_t	rseq;		    /* Futex bumped when rpos moves */
+    uint32_t	rx_wait;	    /* Reader sleeping for data */
+} shm_ring_t;
+
+struct xambit_shm_s {
+    shm_ring_t	*ring;
+    uint8_t	*data;		    /* Ring data, mapped twice */
+    uint64_t	size;
+    size_t	map_len;
+    uint64_t	pos;		    /* This end's position */
+    uint64_t	peer;		    /* Last position seen of the other end */
+};
+
+static int shm_futex(uint32_t *addr, int op, uint32_t val);
+static int shm_map(xambit_shm_t *s, int fd, uint64_t size);
+static int shm_attach(xambit_channel_t *ch);
+static void shm_wake(uint32_t *seq);
+
+static int shm_futex(uint32_t *addr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* Move a sequence futex on and wake whoever sleeps on it */
+static void shm_wake(uint32_t *seq)
+{
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    shm_futex(seq, FUTEX_WAKE, INT_MAX);
+}
+
+/* Map the header page and, twice over, the ring data behind it */
+static int shm_map(xambit_shm_t *s, int fd, uint64_t size)
+{
+    size_t	page = sysconf(_SC_PAGESIZE);
+    uint8_t	*base;
+
+    s->map_len = page + 2 * size;
+    base = mmap(NULL, s->map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0);
+    if (base == MAP_FAILED)
+	return XAMBIT_ERR_STD;
+
+    if (mmap(base, page, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	     fd, 0) == MAP_FAILED ||
+	mmap(base + page, size, PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED ||
+	mmap(base + page + size, size, PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED)
+    {
+	munmap(base, s->map_len);
+	return XAMBIT_ERR_STD;
+    }
+
+    s->ring = (shm_ring_t *)base;
+    s->data = base + page;
+    s->size = size;
+    return 0;
+}
+
+/* Join the ring as the channel's end and wait for the other end to do the
+ * same, as open() does on a FIFO */
+static int shm_attach(xambit_channel_t *ch)
+{
+    xambit_shm_t	*s = ch->shm;
+    shm_ring_t		*r = s->ring;
+    uint32_t		me;
+    uint32_t		ends;
+
+    me = ch->direction == XAMBIT_CHOUT ? SHM_WRITER : SHM_READER;
+    ends = __atomic_load_n(&r->ends, __ATOMIC_SEQ_CST);
+    do
+    {
+	if (ends & me)
+	{
+	    errno = EBUSY;
+	    return XAMBIT_ERR_STD;
+	}
+    } while (!__atomic_compare_exchange_n(&r->ends, &ends, ends | me, 0,
+					  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    shm_futex(&r->ends, FUTEX_WAKE, INT_MAX);
+
+    while ((ends = __atomic_load_n(&r->ends, __ATOMIC_SEQ_CST)) !=
+	   (SHM_WRITER | SHM_READER))
+	shm_futex(&r->ends, FUTEX_WAIT, ends);
+
+    if (me == SHM_WRITER)
+    {
+	s->pos = __atomic_load_n(&r->wpos, __ATOMIC_ACQUIRE);
+	s->peer = __atomic_load_n(&r->rpos, __ATOMIC_ACQUIRE);
+    }
+    else
+    {
+	s->pos = __atomic_load_n(&r->rpos, __ATOMIC_ACQUIRE);
+	s->peer = __atomic_load_n(&r->wpos, __ATOMIC_ACQUIRE);
+
+	/* The ring is the read-ahead buffer */
+	ch->rbuf = s->data + s->pos % s->size;
+	ch->rbuf_size = s->size;
+    }
+    return 0;
+}
+
+/*  Function Name:	channel_shm_open
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To open a shared memory ring channel to another process
+ *			on the same host.
+ *
+ *  Assumptions:	name is a POSIX shared memory object name, such as
+ *			"/mychannel".
+ *
+ *  Notes:		The first end to open the ring creates it, with
+ *			XAMBIT_SHM_RING_LEN bytes of data. Like opening a FIFO,
+ *			this blocks until the other end has opened the ring
+ *			too. The last end to close removes it.
+ *
+ *  Return Value:	Pointer to a xambit_channel_t on success, or NULL on
+ *			failure. On failure, errno is set indicating the error
+ *			condition.
+ */
+xambit_channel_t *channel_shm_open(const char *name, int flags, int write)
+{
+    xambit_channel_t	*ch;
+    xambit_shm_t	*s;
+    struct timespec	ts = { 0, 1000000 };
+    struct stat		st;
+    uint64_t		size;
+    size_t		page = sysconf(_SC_PAGESIZE);
+    int			create = 0;
+
+    ch = ch_alloc(name, flags, write, XAMBIT_CH_SHM);
+    if (ch == NULL)
+	return NULL;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+    {
+	errno = ENOMEM;
+	goto out;
+    }
+    ch->shm = s;
+
+    ch->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (ch->fd >= 0)
+    {
+	create = 1;
+	size = (XAMBIT_SHM_RING_LEN + page - 1) & ~(uint64_t)(page - 1);
+	if (ftruncate(ch->fd, page + size) < 0)
+	    goto unlink;
+    }
+    else
+    {
+	if (errno != EEXIST)
+	    goto out;
+	ch->fd = shm_open(name, O_RDWR, 0);
+	if (ch->fd < 0)
+	    goto out;
+
+	/* Wait for the creator to size the object */
+	while (1)
+	{
+	    if (fstat(ch->fd, &st) < 0)
+		goto out;
+	    if (st.st_size > (off_t)page)
+		break;
+	    nanosleep(&ts, NULL);
+	}
+	size = st.st_size - page;
+	if (size % page)
+	{
+	    errno = EINVAL;
+	    goto out;
+	}
+    }
+
+    if (shm_map(s, ch->fd, size) < 0)
+	goto unlink;
+
+    if (create)
+    {
+	s->ring->version = SHM_VERSION;
+	s->ring->size = size;
+	__atomic_store_n(&s->ring->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    else
+    {
+	while (__atomic_load_n(&s->ring->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC)
+	    nanosleep(&ts, NULL);
+	if (s->ring->version != SHM_VERSION || s->ring->size != size)
+	{
+	    errno = EINVAL;
+	    goto unmap;
+	}
+    }
+
+    if (shm_attach(ch) < 0)
+	goto unmap;
+
+    return ch;
+
+unlink:
+    if (create)
+	shm_unlink(name);
+unmap:
+    if (s->ring != NULL)
+	munmap(s->ring, s->map_len);
+out:
+    if (ch->fd >= 0)
+	close(ch->fd);
+    free(s);
+    ch_free(ch);
+    return NULL;
+}
+
+/* Copy as much of iov into the ring as there is room for, waiting for room
+ * if there is none. Returns the bytes taken, or -1 with errno EPIPE once the
+ * reader has gone. */
+ssize_t shm_writev(xambit_channel_t *ch, const struct iovec *iov, int cnt)
+{
+    xambit_shm_t	*s = ch->shm;
+    shm_ring_t		*r = s->ring;
+    uint8_t		*dst;
+    uint64_t		space;
+    size_t		want = 0;
+    size_t		n = 0;
+    size_t		take;
+    uint32_t		seen;
+    int			i;
+
+    for (i = 0; i < cnt; i++)
+	want += iov[i].iov_len;
+
+    space = s->size - (s->pos - s->peer);
+    while (space < want)
+    {
+	s->peer = __atomic_load_n(&r->rpos, __ATOMIC_ACQUIRE);
+	space = s->size - (s->pos - s->peer);
+	if (space > 0)
+	    break;
+
+	seen = __atomic_load_n(&r->rseq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->tx_wait, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->rpos, __ATOMIC_SEQ_CST) == s->peer)
+	{
+	    if (!(__atomic_load_n(&r->ends, __ATOMIC_SEQ_CST) & SHM_READER))
+	    {
+		__atomic_store_n(&r->tx_wait, 0, __ATOMIC_RELAXED);
+		errno = EPIPE;
+		return -1;
+	    }
+	    shm_futex(&r->rseq, FUTEX_WAIT, seen);
+	}
+	__atomic_store_n(&r->tx_wait, 0, __ATOMIC_RELAXED);
+    }
+
+    dst = s->data + s->pos % s->size;
+    for (i = 0; i < cnt && n < space; i++)
+    {
+	take = iov[i].iov_len;
+	if (take > space - n)
+	    take = space - n;
+	memcpy(dst + n, iov[i].iov_base, take);
+	n += take;
+    }
+
+    s->pos += n;
+    __atomic_store_n(&r->wpos, s->pos, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->rx_wait, __ATOMIC_SEQ_CST))
+	shm_wake(&r->wseq);
+
+    return n;
+}
+
+/* Wait until the ring holds at least need bytes past the reader's position.
+ * Returns what it holds, or 0 if the writer has gone first. */
+static uint64_t shm_wait_data(xambit_shm_t *s, uint64_t need)
+{
+    shm_ring_t	*r = s->ring;
+    uint32_t	seen;
+
+    while (s->peer - s->pos < need)
+    {
+	s->peer = __atomic_load_n(&r->wpos, __ATOMIC_ACQUIRE);
+	if (s->peer - s->pos >= need)
+	    break;
+
+	seen = __atomic_load_n(&r->wseq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->rx_wait, 1, __ATOMIC_SEQ_CST);
+	s->peer = __atomic_load_n(&r->wpos, __ATOMIC_SEQ_CST);
+	if (s->peer - s->pos < need)
+	{
+	    if (!(__atomic_load_n(&r->ends, __ATOMIC_SEQ_CST) & SHM_WRITER))
+	    {
+		__atomic_store_n(&r->rx_wait, 0, __ATOMIC_RELAXED);
+		return 0;
+	    }
+	    shm_futex(&r->wseq, FUTEX_WAIT, seen);
+	}
+	__atomic_store_n(&r->rx_wait, 0, __ATOMIC_RELAXED);
+    }
+
+    return s->peer - s->pos;
+}
+
+/* Give the space of everything consumed from the read-ahead buffer back to
+ * the writer */
+static void shm_release(xambit_channel_t *ch)
+{
+    xambit_shm_t	*s = ch->shm;
+    shm_ring_t		*r = s->ring;
+
+    if (ch->rbuf_head == 0)
+	return;
+
+    s->pos += ch->rbuf_head;
+    ch->rbuf_tail -= ch->rbuf_head;
+    ch->rbuf_head = 0;
+    ch->rbuf = s->data + s->pos % s->size;
+
+    __atomic_store_n(&r->rpos, s->pos, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->tx_wait, __ATOMIC_SEQ_CST))
+	shm_wake(&r->rseq);
+}
+
+/* rx_fill() for a ring: the read-ahead buffer is the unread part of the
+ * ring, so filling it is a matter of waiting for the writer. Parcels handed
+ * out of the buffer earlier are given back to the writer here. */
+int shm_rx_fill(xambit_channel_t *ch, size_t need)
+{
+    uint64_t	avail;
+
+    shm_release(ch);
+    if (ch->rbuf_tail >= need)
+	return 0;
+    if (need > ch->rbuf_size)
+    {
+	errno = EMSGSIZE;
+	return XAMBIT_ERR_STD;
+    }
+
+    avail = shm_wait_data(ch->shm, need);
+    if (avail == 0)
+    { /* Warning: send/receive sync error possible */
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+    ch->stats.read_calls++;
+    ch->rbuf_tail = avail > ch->rbuf_size ? ch->rbuf_size : avail;
+    return 0;
+}
+
+/* read() for a ring, used when a parcel is copied straight to its
+ * destination. Anything in the read-ahead buffer must already be used up. */
+ssize_t shm_read(xambit_channel_t *ch, void *buf, size_t len)
+{
+    xambit_shm_t	*s = ch->shm;
+    uint64_t		avail;
+
+    shm_release(ch);
+
+    avail = shm_wait_data(s, 1);
+    if (avail == 0)
+	return 0;
+    if (len > avail)
+	len = avail;
+
+    memcpy(buf, s->data + s->pos % s->size, len);
+    ch->rbuf_head = len;
+    ch->rbuf_tail = len;
+    shm_release(ch);
+    ch->rbuf_tail = 0;
+
+    return len;
+}
+
+/* Leave the ring, waking the other end so it sees we have gone. The last
+ * end out removes the shared memory object. */
+void shm_close(xambit_channel_t *ch)
+{
+    xambit_shm_t	*s = ch->shm;
+    shm_ring_t		*r = s->ring;
+    uint32_t		me;
+
+    if (ch->direction == XAMBIT_CHIN)
+	shm_release(ch);
+
+    me = ch->direction == XAMBIT_CHOUT ? SHM_WRITER : SHM_READER;
+    if (__atomic_and_fetch(&r->ends, ~me, __ATOMIC_SEQ_CST) == 0)
+	shm_unlink(ch->path);
+    shm_futex(&r->ends, FUTEX_WAKE, INT_MAX);
+    shm_wake(me == SHM_WRITER ? &r->wseq : &r->rseq);
+
+    munmap(s->ring, s->map_len);
+    free(s);
+    ch->shm = NULL;
+}
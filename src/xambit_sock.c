@@ -0,0 +1,517 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* XAMBIT_CH_SOCK channels: a connected Unix domain SOCK_SEQPACKET socket.
+ * The sender writes messages of at most XAMBIT_SOCK_MSG_LEN bytes; a parcel
+ * that fits goes as a single message, header and data together. The
+ * receiver always has room past its read-ahead buffer for a whole message,
+ * so it never reads part of one and a header is never split between reads.
+ *
+ * Large files may instead be copied into a memfd that is sealed against
+ * change and passed with the header over SCM_RIGHTS. The receiver maps it
+ * and validates the very pages the sender validated, so the payload never
+ * passes through the socket at all. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+/* Seals an attached memfd must carry for its contents to be trusted */
+#define SOCK_SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#define SOCK_MAX_FDS	4	    /* Descriptors taken per message */
+#define SOCK_QUEUE_FDS	(SOCK_MAX_FDS * 16) /* ... and held at once */
+
+struct xambit_sock_s {
+    /* Descriptors received ahead of the headers they belong to */
+    int		*fds;
+    int		fds_head;
+    int		fds_tail;
+    int		fds_size;
+
+    /* The memfd of the parcel being received, if it came with one */
+    int		att_fd;
+    uint8_t	*att_map;
+    uint64_t	att_len;
+    uint64_t	att_off;	    /* Bytes handed out so far */
+};
+
+static int sock_connect(xambit_channel_t *ch, struct sockaddr_un *sa);
+static int sock_accept(xambit_channel_t *ch, struct sockaddr_un *sa);
+static int sock_queue_fd(xambit_channel_t *ch, int fd);
+static void sock_att_close(xambit_sock_t *s);
+
+/* Connect to the reader, waiting for it to start listening as opening a FIFO
+ * waits for the other end */
+static int sock_connect(xambit_channel_t *ch, struct sockaddr_un *sa)
+{
+    struct timespec	ts = { 0, 1000000 };
+    int			size = XAMBIT_SOCK_MSG_LEN * 2;
+
+    while (connect(ch->fd, (struct sockaddr *)sa, sizeof(*sa)) < 0)
+    {
+	if (errno != ENOENT && errno != ECONNREFUSED && errno != EINTR)
+	    return XAMBIT_ERR_STD;
+	nanosleep(&ts, NULL);
+    }
+
+    /* Room for the largest message; the kernel caps this at wmem_max */
+    setsockopt(ch->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    return 0;
+}
+
+/* Listen at the path for the writer and take its connection. The path is
+ * removed again once connected, leaving it free for the next channel. */
+static int sock_accept(xambit_channel_t *ch, struct sockaddr_un *sa)
+{
+    struct stat	st;
+    int		lfd = ch->fd;
+
+    /* A socket left behind by an earlier reader */
+    if (lstat(ch->path, &st) == 0 && S_ISSOCK(st.st_mode))
+	unlink(ch->path);
+
+    if (bind(lfd, (struct sockaddr *)sa, sizeof(*sa)) < 0)
+	return XAMBIT_ERR_STD;
+
+    if (listen(lfd, 1) < 0)
+	goto error;
+
+    do
+	ch->fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    while (ch->fd < 0 && errno == EINTR);
+    if (ch->fd < 0)
+    {
+	ch->fd = lfd;
+	goto error;
+    }
+
+    close(lfd);
+    unlink(ch->path);
+    return 0;
+
+error:
+    unlink(ch->path);
+    return XAMBIT_ERR_STD;
+}
+
+/*  Function Name:	channel_sock_open
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To open a Unix domain socket channel.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		The reader listens at path and the writer connects to
+ *			it; whichever opens first blocks until the other has,
+ *			as with a FIFO. Each message on the socket holds whole
+ *			parcels or, for large parcels, part of one.
+ *
+ *  Return Value:	Pointer to a xambit_channel_t on success, or NULL on
+ *			failure. On failure, errno is set indicating the error
+ *			condition.
+ */
+xambit_channel_t *channel_sock_open(const char *path, int flags, int write)
+{
+    xambit_channel_t	*ch;
+    struct sockaddr_un	sa;
+    int			err;
+
+    ch = ch_alloc(path, flags, write, XAMBIT_CH_SOCK);
+    if (ch == NULL)
+	return NULL;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path))
+    {
+	errno = ENAMETOOLONG;
+	goto out;
+    }
+    strcpy(sa.sun_path, path);
+
+    ch->sock = calloc(1, sizeof(*ch->sock));
+    if (ch->sock == NULL)
+    {
+	errno = ENOMEM;
+	goto out;
+    }
+    ch->sock->att_fd = -1;
+
+    ch->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (ch->fd < 0)
+	goto out;
+
+    if (write)
+	err = sock_connect(ch, &sa);
+    else
+	err = sock_accept(ch, &sa);
+    if (err < 0)
+	goto out;
+
+    if (ch_nonblock(ch) < 0)
+	goto out;
+
+    return ch;
+
+out:
+    err = errno;
+    if (ch->fd >= 0)
+	close(ch->fd);
+    free(ch->sock);
+    ch_free(ch);
+    errno = err;
+    return NULL;
+}
+
+/* Send up to a message's worth of iov as one message. Returns the bytes
+ * sent, as writev(). */
+ssize_t sock_writev(xambit_channel_t *ch, const struct iovec *iov, int cnt)
+{
+    struct iovec	v[2 * XAMBIT_BATCH_MAX];
+    struct msghdr	msg;
+    size_t		len = 0;
+    int			n;
+
+    for (n = 0; n < cnt && n < 2 * XAMBIT_BATCH_MAX &&
+		len < XAMBIT_SOCK_MSG_LEN; n++)
+    {
+	v[n] = iov[n];
+	if (v[n].iov_len > XAMBIT_SOCK_MSG_LEN - len)
+	    v[n].iov_len = XAMBIT_SOCK_MSG_LEN - len;
+	len += v[n].iov_len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = n;
+    return sendmsg(ch->fd, &msg, 0);
+}
+
+/* Queue a descriptor received ahead of the header it goes with. Past
+ * SOCK_QUEUE_FDS open ones it is closed, and its header finds -1 in its
+ * place. */
+static int sock_queue_fd(xambit_channel_t *ch, int fd)
+{
+    xambit_sock_t *s = ch->sock;
+    int		*nfds;
+    int		i;
+    int		open = 0;
+
+    for (i = s->fds_head; i < s->fds_tail; i++)
+	open += s->fds[i] >= 0;
+    if (open >= SOCK_QUEUE_FDS)
+    {
+	close(fd);
+	ch->stats.fds_refused++;
+	fd = -1;
+    }
+
+    if (s->fds_head > 0 && s->fds_tail == s->fds_size)
+    {
+	memmove(s->fds, s->fds + s->fds_head,
+		(s->fds_tail - s->fds_head) * sizeof(int));
+	s->fds_tail -= s->fds_head;
+	s->fds_head = 0;
+    }
+
+    if (s->fds_tail == s->fds_size)
+    {
+	nfds = realloc(s->fds, (s->fds_size + 16) * sizeof(int));
+	if (nfds == NULL)
+	{
+	    close(fd);
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+	s->fds = nfds;
+	s->fds_size += 16;
+    }
+
+    s->fds[s->fds_tail++] = fd;
+    return 0;
+}
+
+/* Receive one whole message into buf, as read(). The descriptor passed with
+ * a message that is a lone XAMBIT_FD header is queued for sock_rx_attach;
+ * any other is closed. */
+ssize_t sock_read(xambit_channel_t *ch, void *buf, size_t len)
+{
+    union {
+	struct cmsghdr	hdr;
+	char		buf[CMSG_SPACE(SOCK_MAX_FDS * sizeof(int))];
+    } cbuf;
+    struct cmsghdr	*cm;
+    struct msghdr	msg;
+    struct iovec	iov;
+    xambit_parcel_hdr_t	hdr;
+    ssize_t		n;
+    int			*fds;
+    int			nfds;
+    int			claim;
+    int			i;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+
+    n = recvmsg(ch->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0)
+	return n;
+
+    claim = 0;
+    if (n == sizeof(hdr))
+    {
+	memcpy(&hdr, buf, sizeof(hdr));
+	claim = (hdr.flags & XAMBIT_FD) != 0;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+    {
+	if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+	    continue;
+	fds = (int *)CMSG_DATA(cm);
+	nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for (i = 0; i < nfds; i++)
+	{
+	    if (claim)
+	    {
+		sock_queue_fd(ch, fds[i]);
+		claim = 0;
+		continue;
+	    }
+	    close(fds[i]);
+	    ch->stats.fds_refused++;
+	}
+    }
+
+    /* The rest of the message is gone, and the stream with it */
+    if (msg.msg_flags & MSG_TRUNC)
+    {
+	errno = EMSGSIZE;
+	return XAMBIT_ERR_STD;
+    }
+
+    return n;
+}
+
+/* Copy size bytes of fd into a new memfd and seal it, so that what the
+ * sender validates is exactly what the receiver will see. Returns the memfd
+ * or a negetive value with errno set. */
+int sock_memfd(int fd, uint64_t size)
+{
+#ifdef HAVE_MEMFD_CREATE
+    off_t	off = 0;
+    ssize_t	n;
+    int		mfd;
+    int		err;
+
+    mfd = memfd_create("xambit", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mfd < 0)
+	return XAMBIT_ERR_STD;
+
+    /* The copy is made page cache to page cache, inside the kernel */
+    while ((uint64_t)off < size)
+    {
+	n = sendfile(mfd, fd, &off, size - off > XAMBIT_SPLICE_MAX ?
+				    XAMBIT_SPLICE_MAX : size - off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	{
+	    if (n == 0)
+		errno = EIO;
+	    goto error;
+	}
+    }
+
+    if (fcntl(mfd, F_ADD_SEALS, SOCK_SEALS | F_SEAL_SEAL) < 0)
+	goto error;
+
+    return mfd;
+
+error:
+    err = errno;
+    close(mfd);
+    errno = err;
+    return XAMBIT_ERR_STD;
+#else
+    errno = ENOSYS;
+    return XAMBIT_ERR_STD;
+#endif
+}
+
+/* Send a prepared header with fd, which holds its data, attached */
+int sock_send_fd(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr, int fd)
+{
+    union {
+	struct cmsghdr	hdr;
+	char		buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    struct cmsghdr	*cm;
+    struct msghdr	msg;
+    struct iovec	iov;
+    ssize_t		n;
+
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(*hdr);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+    do
+	n = sendmsg(ch->fd, &msg, 0);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+	return XAMBIT_ERR_STD;
+
+    ch->stats.write_calls++;
+    return 0;
+}
+
+static void sock_att_close(xambit_sock_t *s)
+{
+    if (s->att_map != NULL)
+	munmap(s->att_map, s->att_len);
+    if (s->att_fd >= 0)
+	close(s->att_fd);
+    s->att_map = NULL;
+    s->att_fd = -1;
+    s->att_len = 0;
+    s->att_off = 0;
+}
+
+/* Called for each header parsed. The memfd of the last parcel is let go,
+ * and if this one came with its data in a memfd, that is checked and mapped
+ * for sock_att_take. A memfd nothing has been taken from yet belongs to a
+ * header that was put back, and is kept. */
+int sock_rx_attach(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr)
+{
+    xambit_sock_t	*s = ch->sock;
+    struct stat		st;
+    int			seals;
+
+    if ((hdr->flags & XAMBIT_FD) && s->att_map != NULL && s->att_off == 0 &&
+	s->att_len == hdr->length)
+	return 0;
+
+    sock_att_close(s);
+    if (!(hdr->flags & XAMBIT_FD))
+	return 0;
+
+    if ((hdr->flags & XAMBIT_STREAM) || hdr->length == 0 ||
+	s->fds_head == s->fds_tail)
+    { /* Warning: send/receive sync error possible */
+	errno = EBADMSG;
+	return XAMBIT_ERR_STD;
+    }
+    s->att_fd = s->fds[s->fds_head++];
+    if (s->att_fd < 0)
+    { /* Warning: send/receive sync error possible */
+	errno = EMFILE;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* Anything the sender could still change is refused */
+    seals = fcntl(s->att_fd, F_GET_SEALS);
+    if (seals < 0 || (seals & SOCK_SEALS) != SOCK_SEALS)
+    {
+	errno = EPERM;
+	goto error;
+    }
+    if (fstat(s->att_fd, &st) < 0)
+	goto error;
+    if ((uint64_t)st.st_size != hdr->length)
+    {
+	errno = EBADMSG;
+	goto error;
+    }
+
+    s->att_map = mmap(NULL, hdr->length, PROT_READ, MAP_SHARED, s->att_fd, 0);
+    if (s->att_map == MAP_FAILED)
+    {
+	s->att_map = NULL;
+	goto error;
+    }
+    s->att_len = hdr->length;
+    return 0;
+
+error:
+    sock_att_close(s);
+    return XAMBIT_ERR_STD;
+}
+
+/* The next len bytes of the current parcel's memfd, or NULL if its data is
+ * on the socket. The mapping lasts until the next header is parsed. */
+void *sock_att_take(xambit_channel_t *ch, uint64_t len)
+{
+    xambit_sock_t	*s = ch->sock;
+    void		*p;
+
+    if (s == NULL || s->att_map == NULL || len > s->att_len - s->att_off)
+	return NULL;
+
+    p = s->att_map + s->att_off;
+    s->att_off += len;
+    return p;
+}
+
+void sock_close(xambit_channel_t *ch)
+{
+    xambit_sock_t	*s = ch->sock;
+
+    sock_att_close(s);
+    while (s->fds_head < s->fds_tail)
+    {
+	if (s->fds[s->fds_head] >= 0)
+	    close(s->fds[s->fds_head]);
+	s->fds_head++;
+    }
+    free(s->fds);
+    free(s);
+    ch->sock = NULL;
+}
@@ -0,0 +1,591 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* XAMBIT_STREAM parcels. A stream is sent as a run of segments of at most
+ * MAX_STREAM_SIZE bytes, each a parcel of its own carrying the XAMBIT_STREAM
+ * flag. The last segment also carries XAMBIT_STREAM_END, or
+ * XAMBIT_STREAM_ABORT if the sender gave up on the stream. Segments of one
+ * stream are never interleaved with other parcels. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+static int stream_emit(xambit_stream_t *st, uint32_t flags);
+static int stream_segment(xambit_stream_t *st);
+static void stream_send_abort(xambit_stream_t *st);
+static void stream_free(xambit_stream_t *st);
+static int rx_stream_sink(xambit_channel_t *ch, xambit_rx_stream_t *rs,
+			  void *data, uint64_t len, int fd);
+static int rx_stream_final(xambit_channel_t *ch, xambit_rx_stream_t *rs,
+			   xambit_parcel_hdr_t *out, int fd);
+
+/*  Function Name:	channel_stream_open
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To start sending a stream parcel of type tid.
+ *
+ *  Assumptions:	tid has been registered with an incremental validator
+ *			(see channel_register_type_ops).
+ *
+ *  Notes:		No other parcel may be sent on the channel until the
+ *			stream is closed or aborted. On a shared channel the
+ *			stream holds the send lock until then, so other
+ *			senders wait rather than fail.
+ *
+ *  Return Value:	A stream handle, or NULL with errno set. EPERM means
+ *			the validator's init callback refused the stream.
+ */
+xambit_stream_t *channel_stream_open(xambit_channel_t *ch, uint32_t tid)
+{
+    xambit_parcel_hdr_t	hdr;
+    xambit_stream_t	*st;
+
+    if (ch == NULL || ch->direction != XAMBIT_CHOUT)
+    {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    if (ch_lock_held(ch) || (ch->lock == NULL && ch->tx_stream != NULL))
+    {
+	errno = EBUSY;
+	return NULL;
+    }
+
+    st = calloc(1, sizeof(*st));
+    if (st == NULL)
+    {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    st->ch = ch;
+    st->type = tid;
+    st->tv = lookup_type_validator(ch, tid);
+    if (st->tv == NULL || st->tv->update == NULL)
+    {
+	tv_put(st->tv);
+	free(st);
+	errno = EINVAL;
+	return NULL;
+    }
+
+    hdr.version = XAMBIT_HDR_VERSION;
+    hdr.type = tid;
+    hdr.flags = XAMBIT_STREAM;
+    hdr.length = 0;
+    if (st->tv->init != NULL && st->tv->init(&hdr, &st->ctx) < 0)
+    {
+	tv_put(st->tv);
+	free(st);
+	errno = EPERM;
+	return NULL;
+    }
+
+    ch_lock(ch);
+    ch->tx_stream = st;
+    return st;
+}
+
+/*  Function Name:	channel_stream_write
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To append data to an open stream.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Data is sent a segment at a time as segments fill, each
+ *			passed to the validator's update callback first. If a
+ *			segment is refused the stream is aborted and every
+ *			later call fails.
+ *
+ *  Return Value:	0 on success, or a negetive XAMBIT_ERR_* value.
+ */
+int channel_stream_write(xambit_stream_t *st, const void *buf, size_t len)
+{
+    size_t	take;
+    int		err;
+
+    if (st == NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* A non-blocking channel takes nothing that would be sent while its
+     * backlog waits */
+    if (st->err == 0 && len >= MAX_STREAM_SIZE - st->len)
+    {
+	err = ch_tx_ready(st->ch);
+	if (err < 0)
+	{
+	    if (errno != EAGAIN)
+		st->err = err;
+	    return err;
+	}
+    }
+
+    while (len > 0)
+    {
+	if (st->err < 0)
+	    return st->err;
+
+	take = MAX_STREAM_SIZE - st->len;
+	if (take > len)
+	    take = len;
+	memcpy(st->seg + st->len, buf, take);
+	st->len += take;
+	buf = (const uint8_t *)buf + take;
+	len -= take;
+
+	if (st->len == MAX_STREAM_SIZE)
+	{
+	    err = stream_segment(st);
+	    if (err < 0)
+		return err;
+	}
+    }
+
+    return 0;
+}
+
+/*  Function Name:	channel_stream_close
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To finish a stream and free its handle.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		The validator's final callback decides whether the
+ *			stream ends normally or is aborted, in which case the
+ *			receiver discards everything it was sent.
+ *
+ *  Return Value:	0 on success, or a negetive XAMBIT_ERR_* value.
+ */
+int channel_stream_close(xambit_stream_t *st)
+{
+    xambit_parcel_hdr_t	hdr;
+    int			err;
+
+    if (st == NULL)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    err = st->err;
+    if (err == 0 && st->len > 0)
+    {
+	hdr.version = XAMBIT_HDR_VERSION;
+	hdr.type = st->type;
+	hdr.flags = XAMBIT_STREAM | XAMBIT_STREAM_END;
+	hdr.length = st->len;
+	if (st->tv->update(st->ctx, &hdr, st->seg) < 0)
+	    err = XAMBIT_ERR_VALIDATE;
+    }
+
+    if (err == 0 && st->tv->final != NULL)
+    {
+	hdr.version = XAMBIT_HDR_VERSION;
+	hdr.type = st->type;
+	hdr.flags = XAMBIT_STREAM;
+	hdr.length = st->total + st->len;
+	st->final_done = 1;
+	if (st->tv->final(st->ctx, &hdr) < 0)
+	    err = XAMBIT_ERR_VALIDATE;
+    }
+
+    if (err == 0)
+	err = stream_emit(st, XAMBIT_STREAM_END);
+    else if (!st->aborted)
+	stream_send_abort(st);
+
+    stream_free(st);
+    return err;
+}
+
+/*  Function Name:	channel_stream_abort
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To abandon a stream, telling the receiver to discard it,
+ *			and free its handle.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		.
+ */
+void channel_stream_abort(xambit_stream_t *st)
+{
+    if (st == NULL)
+	return;
+
+    if (!st->aborted)
+	stream_send_abort(st);
+    stream_free(st);
+}
+
+/* Validate and send the full segment held in st */
+static int stream_segment(xambit_stream_t *st)
+{
+    xambit_parcel_hdr_t	hdr;
+
+    hdr.version = XAMBIT_HDR_VERSION;
+    hdr.type = st->type;
+    hdr.flags = XAMBIT_STREAM;
+    hdr.length = st->len;
+    if (st->tv->update(st->ctx, &hdr, st->seg) < 0)
+    {
+	st->err = XAMBIT_ERR_VALIDATE;
+	stream_send_abort(st);
+	return st->err;
+    }
+
+    st->err = stream_emit(st, 0);
+    return st->err;
+}
+
+static int stream_emit(xambit_stream_t *st, uint32_t flags)
+{
+    xambit_parcel_hdr_t	hdr;
+    int			err;
+
+    hdr.version = XAMBIT_HDR_VERSION;
+    hdr.type = st->type;
+    hdr.flags = XAMBIT_STREAM | flags;
+    hdr.length = st->len;
+    hdr.data_checksum = 0;
+    if (st->ch->flags & XAMBIT_CHECKSUM)
+	hdr.flags |= XAMBIT_DATA_CSUM;
+
+    err = prepare_parcel(st->ch, &hdr);
+    if (err < 0)
+	return err;
+
+    err = ch_emit(st->ch, &hdr, st->seg);
+    st->total += st->len;
+    st->len = 0;
+    return err;
+}
+
+/* Tell the receiver to throw the stream away. Unsent data is dropped. */
+static void stream_send_abort(xambit_stream_t *st)
+{
+    st->len = 0;
+    st->aborted = 1;
+    stream_emit(st, XAMBIT_STREAM_ABORT);
+}
+
+static void stream_free(xambit_stream_t *st)
+{
+    if (st->ctx != NULL && !st->final_done && st->tv->final != NULL)
+	st->tv->final(st->ctx, NULL);
+    tv_put(st->tv);
+
+    st->ch->tx_stream = NULL;
+    ch_unlock(st->ch);
+    free(st);
+}
+
+/* Pass a segment's data on to where the stream is being assembled: fd when
+ * receiving to a file, otherwise a growing buffer. Anything assembled in
+ * memory before a file was given is moved to the file first. */
+static int rx_stream_sink(xambit_channel_t *ch, xambit_rx_stream_t *rs,
+			  void *data, uint64_t len, int fd)
+{
+    uint8_t	*nbuf;
+    size_t	cap;
+
+    if (fd >= 0)
+    {
+	if (rs->used > 0)
+	{
+	    if (fd_write_all(fd, rs->buf, rs->used) < 0)
+		return XAMBIT_ERR_STD;
+	    free(rs->buf);
+	    rs->buf = NULL;
+	    rs->used = rs->cap = 0;
+	}
+	return fd_write_all(fd, data, len);
+    }
+
+    if (rs->used + len > rs->cap)
+    {
+	cap = rs->cap ? rs->cap : MAX_STREAM_SIZE;
+	while (cap < rs->used + len)
+	    cap *= 2;
+	nbuf = realloc(rs->buf, cap);
+	if (nbuf == NULL)
+	{
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+	ch->stats.allocs++;
+	rs->buf = nbuf;
+	rs->cap = cap;
+    }
+
+    memcpy(rs->buf + rs->used, data, len);
+    rs->used += len;
+    return 0;
+}
+
+/* Deliver the verdict on a completed stream */
+static int rx_stream_final(xambit_channel_t *ch, xambit_rx_stream_t *rs,
+			   xambit_parcel_hdr_t *out, int fd)
+{
+    void	*data;
+    int		err;
+
+    if (rs->tv->final != NULL)
+    {
+	rs->final_done = 1;
+	if (rs->tv->final(rs->ctx, out) < 0)
+	    return XAMBIT_ERR_VALIDATE;
+	if (rs->tv->rules == NULL)
+	    return 0;
+    }
+
+    /* Only a block validator, or rules: they have to see the stream as a
+     * whole */
+    if (out->length == 0)
+	return rs->final_done ? tv_rules(rs->tv, out, "") :
+	       tv_validate(rs->tv, out, "");
+
+    if (fd < 0)
+	data = rs->buf;
+    else
+	data = mmap(NULL, out->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+	return XAMBIT_ERR_STD;
+
+    if (rs->final_done)
+	err = tv_rules(rs->tv, out, data);
+    else if (rx_parallel(ch, out->length))
+	err = rx_par_check(ch, rs->tv, out, data, 0);
+    else
+	err = tv_validate(rs->tv, out, data);
+
+    if (fd >= 0)
+	munmap(data, out->length);
+
+    return err;
+}
+
+/* Feed a received segment to the stream being assembled on the channel,
+ * starting one if need be. Returns 1 with out describing the whole stream
+ * once its last segment has passed validation, 0 while more segments are to
+ * come, or a negetive value if the stream has been dropped. */
+int rx_stream_segment(xambit_channel_t *ch, xambit_parcel_hdr_t *seg,
+		      void *data, int fd, xambit_parcel_hdr_t *out)
+{
+    xambit_rx_stream_t	*rs = ch->rx_stream;
+    int			err;
+
+    if (rs != NULL && rs->type != seg->type)
+    {
+	/* A new stream began without the last one ending */
+	rx_stream_reset(ch);
+	ch->stats.parcels_dropped++;
+	rs = NULL;
+    }
+
+    if (rs == NULL)
+    {
+	rs = calloc(1, sizeof(*rs));
+	if (rs == NULL)
+	{
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+	ch->rx_stream = rs;
+	rs->type = seg->type;
+	rs->tv = lookup_type_validator(ch, seg->type);
+	if (rs->tv == NULL)
+	    rs->err = XAMBIT_ERR_BAD_TYPE;
+	else if (rs->tv->init != NULL && rs->tv->init(seg, &rs->ctx) < 0)
+	    rs->err = XAMBIT_ERR_VALIDATE;
+    }
+
+    if (seg->flags & XAMBIT_STREAM_ABORT)
+    {
+	err = rs->err < 0 ? rs->err : XAMBIT_ERR_VALIDATE;
+	goto drop;
+    }
+
+    if (rs->err == 0)
+	rs->err = rx_check_data(ch, seg, data, NULL);
+
+    /* After a failure the rest of the stream is read and thrown away */
+    if (rs->err == 0 && seg->length > 0)
+    {
+	if (rs->tv->update != NULL && rs->tv->update(rs->ctx, seg, data) < 0)
+	    rs->err = XAMBIT_ERR_VALIDATE;
+	else
+	    rs->err = rx_stream_sink(ch, rs, data, seg->length, fd);
+    }
+    rs->total += seg->length;
+
+    if (!(seg->flags & XAMBIT_STREAM_END))
+	return 0;
+
+    out->version = XAMBIT_HDR_VERSION;
+    out->type = rs->type;
+    out->flags = XAMBIT_STREAM;
+    out->length = rs->total;
+    out->data_checksum = 0;
+    prepare_parcel(ch, out);
+
+    err = rs->err;
+    if (err == 0 && fd >= 0 && rs->used > 0)
+	err = rx_stream_sink(ch, rs, "", 0, fd);
+    if (err == 0)
+	err = rx_stream_final(ch, rs, out, fd);
+    if (err < 0)
+	goto drop;
+
+    ch->stats.parcels_received++;
+    ch->stats.bytes_received += rs->total;
+    return 1;
+
+drop:
+    rx_stream_reset(ch);
+    ch->stats.parcels_dropped++;
+    return err;
+}
+
+/* Hand the assembled data of a completed stream to the caller, who must
+ * free() it, and forget the stream. */
+void *rx_stream_take(xambit_channel_t *ch)
+{
+    void    *data;
+
+    data = ch->rx_stream->buf;
+    ch->rx_stream->buf = NULL;
+    rx_stream_reset(ch);
+
+    if (data == NULL)
+    {
+	data = malloc(1);
+	ch->stats.allocs++;
+    }
+    return data;
+}
+
+void rx_stream_reset(xambit_channel_t *ch)
+{
+    xambit_rx_stream_t	*rs = ch->rx_stream;
+
+    if (rs == NULL)
+	return;
+
+    if (rs->ctx != NULL && !rs->final_done && rs->tv->final != NULL)
+	rs->tv->final(rs->ctx, NULL);
+    tv_put(rs->tv);
+
+    free(rs->buf);
+    free(rs);
+    ch->rx_stream = NULL;
+}
+
+/* Receive the rest of the stream whose segment header first has just been
+ * read into a file, a segment at a time. A non-blocking channel is waited
+ * on, the file being part written. */
+int rx_stream_to_file(xambit_channel_t *ch, xambit_parcel_hdr_t *first,
+		      const char *path, int oflags, mode_t omode)
+{
+    char		tmp[PATH_MAX];
+    xambit_parcel_hdr_t	seg = *first;
+    xambit_parcel_hdr_t	out;
+    void		*data;
+    int			fd;
+    int			err;
+
+    fd = rx_open_temp(path, omode, tmp);
+
+    while (1)
+    {
+	err = rx_fill_wait(ch, seg.length);
+	if (err < 0)
+	    break;
+	data = ch->rbuf + ch->rbuf_head;
+	ch->rbuf_head += seg.length;
+
+	if (fd < 0)
+	{
+	    /* Keep the stream in step, but there is nowhere to put it */
+	    rx_stream_reset(ch);
+	    err = XAMBIT_ERR_STD;
+	    if (seg.flags & (XAMBIT_STREAM_END | XAMBIT_STREAM_ABORT))
+		return err;
+	}
+	else
+	{
+	    err = rx_stream_segment(ch, &seg, data, fd, &out);
+	    if (err < 0)
+		break;
+	    if (err == 1)
+	    {
+		rx_stream_reset(ch);
+		err = rx_install(ch, tmp, fd, path, oflags, omode);
+		close(fd);
+		return err;
+	    }
+	}
+
+	err = rx_fill_wait(ch, sizeof(seg));
+	if (err < 0)
+	    break;
+	err = rx_parse_hdr(ch, &seg);
+	if (err < 0)
+	    break;
+
+	if (!(seg.flags & XAMBIT_STREAM))
+	{
+	    /* The sender started over; leave this parcel for the next call */
+	    ch->rbuf_head -= sizeof(seg);
+	    errno = EIO;
+	    err = XAMBIT_ERR_STD;
+	    break;
+	}
+    }
+
+    rx_stream_reset(ch);
+    if (fd >= 0)
+    {
+	close(fd);
+	unlink(tmp);
+    }
+    return err;
+}
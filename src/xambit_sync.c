@@ -0,0 +1,143 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Finding the next parcel header in a damaged byte stream. Every header
+ * starts with the 4 byte XAMBIT_HDR_SYNC marker; a reader opened with
+ * XAMBIT_RESYNC that comes on a bad header looks for the next marker, and
+ * tries the header there against its checksum. Scanning is 16 or 32 bytes a
+ * step on x86-64 CPUs, comparing each byte of the marker at once with SSE2 or
+ * AVX2. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define XAMBIT_SYNC_X86
+#endif
+
+#include "xambit_int.h"
+
+typedef size_t (*sync_find_fn_t)(const uint8_t *p, size_t len);
+
+static sync_find_fn_t sync_find_run;
+
+static size_t sync_find_sw(const uint8_t *p, size_t len)
+{
+    const uint8_t *q = p;
+    uint32_t	marker = XAMBIT_HDR_SYNC;
+    uint32_t	w;
+
+    while (len - (q - p) >= sizeof(w))
+    {
+	q = memchr(q, marker & 0xff, len - (q - p) - (sizeof(w) - 1));
+	if (q == NULL)
+	    break;
+	memcpy(&w, q, sizeof(w));
+	if (w == marker)
+	    return q - p;
+	q++;
+    }
+    return len < sizeof(w) - 1 ? 0 : len - (sizeof(w) - 1);
+}
+
+#ifdef XAMBIT_SYNC_X86
+/* Part of the x86-64 baseline, so needs no check */
+static size_t sync_find_sse2(const uint8_t *p, size_t len)
+{
+    __m128i	b0 = _mm_set1_epi8((char)(XAMBIT_HDR_SYNC & 0xff));
+    __m128i	b1 = _mm_set1_epi8((char)((XAMBIT_HDR_SYNC >> 8) & 0xff));
+    __m128i	b2 = _mm_set1_epi8((char)((XAMBIT_HDR_SYNC >> 16) & 0xff));
+    __m128i	b3 = _mm_set1_epi8((char)((XAMBIT_HDR_SYNC >> 24) & 0xff));
+    __m128i	m01, m23;
+    uint32_t	m;
+    size_t	i;
+
+    for (i = 0; i + 16 + 3 <= len; i += 16)
+    {
+	m01 = _mm_and_si128(
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), b0),
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 1)),
+			       b1));
+	m23 = _mm_and_si128(
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 2)),
+			       b2),
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 3)),
+			       b3));
+	m = _mm_movemask_epi8(_mm_and_si128(m01, m23));
+	if (m != 0)
+	    return i + __builtin_ctz(m);
+    }
+    return i + sync_find_sw(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t sync_find_avx2(const uint8_t *p, size_t len)
+{
+    __m256i	b0 = _mm256_set1_epi8((char)(XAMBIT_HDR_SYNC & 0xff));
+    __m256i	b1 = _mm256_set1_epi8((char)((XAMBIT_HDR_SYNC >> 8) & 0xff));
+    __m256i	b2 = _mm256_set1_epi8((char)((XAMBIT_HDR_SYNC >> 16) & 0xff));
+    __m256i	b3 = _mm256_set1_epi8((char)((XAMBIT_HDR_SYNC >> 24) & 0xff));
+    __m256i	m01, m23;
+    uint32_t	m;
+    size_t	i;
+
+    for (i = 0; i + 32 + 3 <= len; i += 32)
+    {
+	m01 = _mm256_and_si256(
+		_mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const __m256i *)(p + i)), b0),
+		_mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const __m256i *)(p + i + 1)), b1));
+	m23 = _mm256_and_si256(
+		_mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const __m256i *)(p + i + 2)), b2),
+		_mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const __m256i *)(p + i + 3)), b3));
+	m = _mm256_movemask_epi8(_mm256_and_si256(m01, m23));
+	if (m != 0)
+	    return i + __builtin_ctz(m);
+    }
+    return i + sync_find_sse2(p + i, len - i);
+}
+#endif
+
+__attribute__((constructor))
+static void sync_init(void)
+{
+    sync_find_run = sync_find_sw;
+#ifdef XAMBIT_SYNC_X86
+    sync_find_run = sync_find_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	sync_find_run = sync_find_avx2;
+#endif
+}
+
+/* Offset in p of the first XAMBIT_HDR_SYNC marker, or if there is none, of
+ * the last three bytes, which may be the start of one */
+size_t sync_find(const uint8_t *p, size_t len)
+{
+    return sync_find_run(p, len);
+}
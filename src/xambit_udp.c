@@ -0,0 +1,1153 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* XAMBIT_CH_UDP channels: parcels carried one way over UDP, for links where
+ * nothing can come back. The sender follows the parcel headers in the bytes
+ * it is given and packs parcels into datagrams of at most the channel's MTU,
+ * each holding one or more fragments: small parcels share a datagram, and
+ * large ones run over several. Every fragment says where its bytes lie in
+ * which parcel. Datagrams are sent XAMBIT_UDP_BATCH at a time with sendmmsg(),
+ * paced by a token bucket so that a receiver able to keep up at that rate
+ * never has its socket buffer overrun.
+ *
+ * The receiver puts parcels back together and passes only complete ones up,
+ * so a lost datagram costs the parcels it carried part of and nothing more:
+ * the byte stream the rest of the library reads stays in step. Gaps in the
+ * datagram sequence are counted in the dgrams_lost statistic.
+ *
+ * With forward error correction on, each batch of datagrams is a block
+ * followed by Reed-Solomon repair datagrams (see xambit_fec.c). The receiver
+ * keeps the block's datagrams, reading them out in order until it meets a
+ * gap, and fills the gap from the repairs once enough have come in. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#define UDP_MAGIC	0x58554450	/* "XUDP" */
+#define UDP_FIN		0x0001		/* The sender has closed */
+#define UDP_REPAIR	0x0002		/* FEC repair symbol */
+#define UDP_FIN_COUNT	3		/* Copies sent, in case of loss */
+#define UDP_MTU_MIN	128
+#define UDP_MTU_MAX	65507
+#define UDP_RCVBUF	(0x1 << 24)
+
+/* Leads every datagram. A repair datagram carries its symbol from len
+ * on, and the sequence number of the first datagram of its block. A closing
+ * one carries the number of parcels sent, as a uint32_t. */
+typedef struct udp_dgram_s {
+    uint32_t	magic;
+    uint32_t	seq;		    /* Datagram sequence number */
+    uint32_t	block;		    /* FEC block */
+    uint16_t	flags;
+    uint8_t	index;		    /* Place in the block */
+    uint8_t	count;		    /* Data datagrams in the block, on repairs */
+    uint16_t	len;		    /* Bytes following */
+} PACKED udp_dgram_t;
+
+/* Where the symbol coded by FEC starts: a data datagram's length and the
+ * fragments after it */
+#define UDP_SYM_OFF	offsetof(udp_dgram_t, len)
+
+/* Leads each run of parcel bytes within a datagram */
+typedef struct udp_frag_s {
+    uint32_t	parcel;		    /* Parcel sequence number */
+    uint32_t	len;		    /* Bytes in this fragment */
+    uint64_t	total;		    /* Parcel size, header included */
+    uint64_t	off;		    /* Offset of these bytes in the parcel */
+} PACKED udp_frag_t;
+
+struct xambit_udp_s {
+    size_t	mtu;
+    uint32_t	seq;		    /* Next datagram to send */
+    uint32_t	parcel;		    /* Parcel being sent */
+    struct mmsghdr msgs[XAMBIT_UDP_BATCH];
+    struct iovec iov[XAMBIT_UDP_BATCH];
+
+    /* Sender: datagrams are built in place in tx, tx_cnt of them complete
+     * and the next holding tx_fill bytes, with the fragment being added to
+     * at offset frag, if any */
+    uint8_t	*tx;
+    int		tx_cnt;
+    size_t	tx_fill;
+    size_t	frag;
+    uint64_t	pos;		    /* Bytes of the parcel taken so far */
+    uint64_t	total;		    /* Its size; 0 until its header is in */
+    uint8_t	hdr[sizeof(xambit_parcel_hdr_t)];
+
+    uint32_t	block;		    /* Block being built */
+
+    /* Sender pacing */
+    uint64_t	rate;		    /* Bytes per second; 0 for none */
+    size_t	burst;
+    double	tokens;
+    uint64_t	stamp;		    /* When tokens was last topped up, ns */
+
+    /* Sender loss, for testing: parts per million dropped */
+    uint32_t	loss;
+    uint64_t	rng;
+
+    /* FEC blocks of fec_k data and fec_r repair datagrams, kept in fec:
+     * the repair datagrams on a sender, all of the block on a receiver */
+    int		fec_k;
+    int		fec_r;
+    uint8_t	*fec;
+    int		fec_active;	    /* fec holds part of block fec_block */
+    int		fec_seen;	    /* ... or it is the last block read */
+    uint32_t	fec_block;
+    uint32_t	fec_first;	    /* Sequence number of its datagram 0 */
+    int		fec_n;		    /* Its data datagrams; 0 until known */
+    size_t	fec_sym;	    /* Its symbol size */
+    int		fec_next;	    /* Next datagram to be read out */
+    int		fec_done;	    /* No more is coming, or needed */
+    uint8_t	have[XAMBIT_FEC_MAX];
+    uint8_t	rhave[XAMBIT_FEC_MAX];
+
+    /* Receiver: rx holds rx_cnt datagrams, the one before rx_idx being read
+     * from dgram, at rx_pos of rx_end bytes */
+    uint8_t	*rx;
+    int		rx_cnt;
+    int		rx_idx;
+    uint8_t	*dgram;
+    size_t	rx_pos;
+    size_t	rx_end;
+    int		seq_ok;		    /* next_seq is known */
+    uint32_t	next_seq;
+    int		parcel_ok;	    /* next_parcel is known */
+    uint32_t	next_parcel;	    /* First parcel none of which is seen */
+    int		fin;		    /* The sender has closed */
+
+    /* Receiver reassembly */
+    uint8_t	*asm_buf;
+    size_t	asm_size;
+    int		asm_active;
+    uint32_t	asm_parcel;
+    uint64_t	asm_total;
+    uint64_t	asm_got;
+
+    /* A complete parcel, read out from ready_off */
+    uint8_t	*ready;
+    uint64_t	ready_len;
+    uint64_t	ready_off;
+};
+
+static uint64_t udp_now(void);
+static int udp_buffers(xambit_udp_t *u, uint8_t **buf, int fec);
+static void udp_pace(xambit_udp_t *u, uint64_t bytes);
+static int udp_send(xambit_channel_t *ch, int cnt);
+static int udp_fec_encode(xambit_channel_t *ch);
+static int udp_flush(xambit_channel_t *ch);
+static int udp_next(xambit_channel_t *ch);
+static void udp_rx_start(xambit_udp_t *u, uint8_t *d);
+static void udp_fec_decode(xambit_channel_t *ch);
+static void udp_fec_end(xambit_channel_t *ch);
+static void udp_fec_rx(xambit_channel_t *ch, udp_dgram_t *d, size_t n);
+static int udp_fec_next(xambit_channel_t *ch);
+static int udp_rx_dgram(xambit_channel_t *ch, int i);
+static void udp_rx_frag(xambit_channel_t *ch);
+static void udp_rx_drop(xambit_channel_t *ch);
+
+static uint64_t udp_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Allocate a batch of MTU sized datagram buffers and point the message
+ * headers at them, along with fec datagrams for FEC blocks */
+static int udp_buffers(xambit_udp_t *u, uint8_t **buf, int fec)
+{
+    int		i;
+
+    *buf = malloc(XAMBIT_UDP_BATCH * u->mtu);
+    if (*buf == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    if (fec > 0)
+    {
+	u->fec = malloc(fec * u->mtu);
+	if (u->fec == NULL)
+	{
+	    free(*buf);
+	    *buf = NULL;
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+    }
+
+    memset(u->msgs, 0, sizeof(u->msgs));
+    for (i = 0; i < XAMBIT_UDP_BATCH; i++)
+    {
+	u->iov[i].iov_base = *buf + i * u->mtu;
+	u->iov[i].iov_len = u->mtu;
+	u->msgs[i].msg_hdr.msg_iov = &u->iov[i];
+	u->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+
+/*  Function Name:	channel_udp_open
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To open one end of a one-way UDP channel.
+ *
+ *  Assumptions:	addr is "host:port"; an IPv6 host is written in
+ *			brackets. A reader may leave the host empty to receive
+ *			on every address.
+ *
+ *  Notes:		Unlike the other channel types, neither end waits for
+ *			the other, and nothing is ever sent back to the writer.
+ *			Parcels sent while no reader is listening are lost.
+ *
+ *  Return Value:	Pointer to a xambit_channel_t on success, or NULL on
+ *			failure. On failure, errno is set indicating the error
+ *			condition.
+ */
+xambit_channel_t *channel_udp_open(const char *addr, int flags, int write)
+{
+    xambit_channel_t	*ch;
+    struct addrinfo	hints;
+    struct addrinfo	*ai = NULL;
+    char		host[PATH_MAX];
+    char		*port;
+    char		*h;
+    int			size = UDP_RCVBUF;
+    int			one = 1;
+    int			err;
+
+    ch = ch_alloc(addr, flags, write, XAMBIT_CH_UDP);
+    if (ch == NULL)
+	return NULL;
+
+    strcpy(host, addr);
+    port = strrchr(host, ':');
+    if (port == NULL)
+    {
+	errno = EINVAL;
+	goto out;
+    }
+    *port++ = '\0';
+    h = host;
+    if (*h == '[' && h[strlen(h) - 1] == ']')
+    {
+	h[strlen(h) - 1] = '\0';
+	h++;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = write ? 0 : AI_PASSIVE;
+    err = getaddrinfo(*h ? h : NULL, port, &hints, &ai);
+    if (err != 0)
+    {
+	errno = err == EAI_SYSTEM ? errno : EINVAL;
+	goto out;
+    }
+
+    ch->udp = calloc(1, sizeof(*ch->udp));
+    if (ch->udp == NULL)
+    {
+	errno = ENOMEM;
+	goto out;
+    }
+    ch->udp->mtu = XAMBIT_UDP_MTU;
+    ch->udp->rate = XAMBIT_UDP_RATE;
+    ch->udp->burst = XAMBIT_UDP_BATCH * XAMBIT_UDP_MTU;
+    ch->udp->tokens = ch->udp->burst;
+    ch->udp->stamp = udp_now();
+
+    ch->fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (ch->fd < 0)
+	goto out;
+
+    if (write)
+    {
+	if (connect(ch->fd, ai->ai_addr, ai->ai_addrlen) < 0)
+	    goto out;
+    }
+    else
+    {
+	/* Bursts wait here while the reader is busy; privileged readers may
+	 * go past rmem_max */
+	if (setsockopt(ch->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+		       sizeof(size)) < 0)
+	    setsockopt(ch->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(ch->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(ch->fd, ai->ai_addr, ai->ai_addrlen) < 0)
+	    goto out;
+    }
+
+    if (ch_nonblock(ch) < 0)
+	goto out;
+
+    freeaddrinfo(ai);
+    return ch;
+
+out:
+    err = errno;
+    if (ai != NULL)
+	freeaddrinfo(ai);
+    if (ch->fd >= 0)
+	close(ch->fd);
+    free(ch->udp);
+    ch_free(ch);
+    errno = err;
+    return NULL;
+}
+
+/*  Function Name:	channel_set_pacing
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To set the rate a UDP writer channel sends at.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		A token bucket of burst bytes fills at rate bytes per
+ *			second, and each batch of datagrams waits until the
+ *			bucket holds its size. A rate of 0 sends as fast as the
+ *			socket allows, and a burst of 0 selects a batch of full
+ *			datagrams.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_pacing(xambit_channel_t *ch, uint64_t rate, size_t burst)
+{
+    xambit_udp_t	*u;
+
+    if (ch == NULL || ch->type != XAMBIT_CH_UDP ||
+	ch->direction != XAMBIT_CHOUT)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    u = ch->udp;
+    u->rate = rate;
+    u->burst = burst ? burst : XAMBIT_UDP_BATCH * u->mtu;
+    if (u->tokens > u->burst)
+	u->tokens = u->burst;
+    return 0;
+}
+
+/*  Function Name:	channel_set_mtu
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To set the largest datagram a UDP channel sends or
+ *			receives.
+ *
+ *  Assumptions:	Both ends are set alike.
+ *
+ *  Notes:		Must be called before the first parcel goes through the
+ *			channel. mtu counts the UDP payload, fragment header
+ *			included; the default suits a 1500 byte Ethernet MTU.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_mtu(xambit_channel_t *ch, size_t mtu)
+{
+    if (ch == NULL || ch->type != XAMBIT_CH_UDP ||
+	mtu < UDP_MTU_MIN || mtu > UDP_MTU_MAX)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (ch->udp->tx != NULL || ch->udp->rx != NULL)
+    {
+	errno = EBUSY;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (ch->udp->burst == XAMBIT_UDP_BATCH * ch->udp->mtu)
+	ch->udp->burst = XAMBIT_UDP_BATCH * mtu;
+    ch->udp->mtu = mtu;
+    return 0;
+}
+
+/*  Function Name:	channel_set_fec
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To protect a UDP channel with forward error
+ *			correction.
+ *
+ *  Assumptions:	Both ends are set alike.
+ *
+ *  Notes:		Each block of data datagrams, or fewer where a write
+ *			ends sooner, is followed by repair datagrams, from
+ *			which the reader can rebuild as many lost datagrams of
+ *			the block. data + repair may be at most XAMBIT_UDP_BATCH,
+ *			and repair of 0 turns FEC off. Must be called before
+ *			the first parcel goes through the channel.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_fec(xambit_channel_t *ch, int data, int repair)
+{
+    if (ch == NULL || ch->type != XAMBIT_CH_UDP || repair < 0 ||
+	(repair > 0 && (data < 1 || data + repair > XAMBIT_UDP_BATCH)))
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (ch->udp->tx != NULL || ch->udp->rx != NULL)
+    {
+	errno = EBUSY;
+	return XAMBIT_ERR_STD;
+    }
+
+    ch->udp->fec_k = repair ? data : 0;
+    ch->udp->fec_r = repair;
+    return 0;
+}
+
+/*  Function Name:	channel_set_loss
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To have a UDP writer channel drop datagrams at random,
+ *			standing in for a lossy link.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		ppm datagrams in every million are dropped instead of
+ *			sent, repair and end of channel datagrams included. The
+ *			choice is pseudo-random but the same from run to run.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_loss(xambit_channel_t *ch, uint32_t ppm)
+{
+    if (ch == NULL || ch->type != XAMBIT_CH_UDP ||
+	ch->direction != XAMBIT_CHOUT || ppm > 1000000)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    ch->udp->loss = ppm;
+    ch->udp->rng = 0x9e3779b97f4a7c15ULL;
+    return 0;
+}
+
+/* Wait until the bucket holds bytes, then take them out */
+static void udp_pace(xambit_udp_t *u, uint64_t bytes)
+{
+    struct timespec	ts;
+    uint64_t		now;
+    double		wait;
+
+    if (u->rate == 0)
+	return;
+
+    while (1)
+    {
+	now = udp_now();
+	u->tokens += (double)(now - u->stamp) * u->rate / 1e9;
+	u->stamp = now;
+	if (u->tokens > u->burst)
+	    u->tokens = u->burst;
+	if (u->tokens >= bytes || u->tokens >= u->burst)
+	    break;
+
+	wait = (bytes - u->tokens) * 1e9 / u->rate;
+	ts.tv_sec = wait / 1e9;
+	ts.tv_nsec = wait - ts.tv_sec * 1e9;
+	nanosleep(&ts, NULL);
+    }
+    u->tokens -= bytes;
+}
+
+/* Send the first cnt datagrams of tx, pacing them as a batch */
+static int udp_send(xambit_channel_t *ch, int cnt)
+{
+    xambit_udp_t	*u = ch->udp;
+    struct mmsghdr	lossy[XAMBIT_UDP_BATCH];
+    struct mmsghdr	*msgs = u->loss > 0 ? lossy : u->msgs;
+    uint64_t		bytes = 0;
+    int			done = 0;
+    int			n;
+    int			i;
+
+    for (i = 0; i < cnt; i++)
+	bytes += u->iov[i].iov_len;
+    udp_pace(u, bytes);
+
+    if (u->loss > 0)
+    {
+	for (i = 0, n = 0; i < cnt; i++)
+	{
+	    u->rng ^= u->rng << 13;
+	    u->rng ^= u->rng >> 7;
+	    u->rng ^= u->rng << 17;
+	    if ((u->rng >> 11) % 1000000 >= u->loss)
+		msgs[n++] = u->msgs[i];
+	}
+	cnt = n;
+    }
+
+    while (done < cnt)
+    {
+	n = sendmmsg(ch->fd, msgs + done, cnt - done, 0);
+	if (n < 0)
+	{
+	    /* No one listening yet; on a one-way link that is loss */
+	    if (errno == EINTR || errno == ECONNREFUSED)
+		continue;
+	    return XAMBIT_ERR_STD;
+	}
+	ch->stats.write_calls++;
+	done += n;
+    }
+    return 0;
+}
+
+/* Code the datagrams completed so far as a block, pointing the messages
+ * after them at its repair datagrams. Returns how many there are. */
+static int udp_fec_encode(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+    uint8_t		*data[XAMBIT_FEC_MAX];
+    uint8_t		*repair[XAMBIT_FEC_MAX];
+    udp_dgram_t		*d;
+    size_t		sym = 0;
+    int			n = u->tx_cnt;
+    int			i;
+
+    for (i = 0; i < n; i++)
+    {
+	d = (udp_dgram_t *)(u->tx + i * u->mtu);
+	if (sym < sizeof(d->len) + d->len)
+	    sym = sizeof(d->len) + d->len;
+	data[i] = (uint8_t *)d + UDP_SYM_OFF;
+    }
+
+    /* Short datagrams count as zero filled */
+    for (i = 0; i < n; i++)
+    {
+	d = (udp_dgram_t *)(u->tx + i * u->mtu);
+	memset((uint8_t *)(d + 1) + d->len, 0, sym - sizeof(d->len) - d->len);
+    }
+    for (i = 0; i < u->fec_r; i++)
+	repair[i] = u->fec + i * u->mtu + UDP_SYM_OFF;
+    fec_encode(u->fec_r, n, data, repair, sym);
+
+    for (i = 0; i < u->fec_r; i++)
+    {
+	d = (udp_dgram_t *)(u->fec + i * u->mtu);
+	d->magic = UDP_MAGIC;
+	d->seq = ((udp_dgram_t *)u->tx)->seq;
+	d->block = u->block;
+	d->flags = UDP_REPAIR;
+	d->index = i;
+	d->count = n;
+	u->iov[n + i].iov_base = d;
+	u->iov[n + i].iov_len = UDP_SYM_OFF + sym;
+    }
+    return u->fec_r;
+}
+
+/* Send the datagrams completed so far, and their repairs, as a block */
+static int udp_flush(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+    int			cnt = u->tx_cnt;
+    int			err;
+    int			i;
+
+    if (u->tx_cnt == 0)
+	return 0;
+
+    if (u->fec_r > 0)
+	cnt += udp_fec_encode(ch);
+    err = udp_send(ch, cnt);
+    for (i = u->tx_cnt; i < cnt; i++)
+	u->iov[i].iov_base = u->tx + i * u->mtu;
+    u->block++;
+
+    /* A datagram part built moves to the front */
+    if (u->tx_fill > 0)
+	memmove(u->tx, u->tx + u->tx_cnt * u->mtu, u->tx_fill);
+    u->tx_cnt = 0;
+    return err;
+}
+
+/* Complete the datagram being built, sending the batch once it is full */
+static int udp_next(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+    udp_dgram_t		*d = (udp_dgram_t *)(u->tx + u->tx_cnt * u->mtu);
+
+    d->magic = UDP_MAGIC;
+    d->seq = u->seq++;
+    d->block = u->block;
+    d->flags = 0;
+    d->index = u->tx_cnt;
+    d->count = 0;
+    d->len = u->tx_fill - sizeof(*d);
+    u->iov[u->tx_cnt].iov_len = u->tx_fill;
+    u->tx_cnt++;
+    u->tx_fill = 0;
+    u->frag = 0;
+
+    if (u->tx_cnt == (u->fec_r ? u->fec_k : XAMBIT_UDP_BATCH))
+	return udp_flush(ch);
+    return 0;
+}
+
+/* Pack the bytes of iov into datagrams, following the parcel headers to
+ * find where each parcel ends. Returns the bytes taken, as writev(). */
+ssize_t udp_writev(xambit_channel_t *ch, const struct iovec *iov, int cnt)
+{
+    xambit_udp_t	*u = ch->udp;
+    xambit_parcel_hdr_t	*hdr = (xambit_parcel_hdr_t *)u->hdr;
+    const uint8_t	*src;
+    udp_frag_t		*f;
+    uint8_t		*d;
+    ssize_t		done = 0;
+    size_t		len;
+    size_t		room;
+    uint64_t		want;
+    size_t		n;
+    int			i;
+
+    if (u->tx == NULL && udp_buffers(u, &u->tx, u->fec_r) < 0)
+	return XAMBIT_ERR_STD;
+
+    for (i = 0; i < cnt; i++)
+    {
+	src = iov[i].iov_base;
+	len = iov[i].iov_len;
+	while (len > 0)
+	{
+	    d = u->tx + u->tx_cnt * u->mtu;
+	    if (u->tx_fill == 0)
+		u->tx_fill = sizeof(udp_dgram_t);
+	    room = u->mtu - u->tx_fill;
+
+	    /* A new parcel starts only where its header fits, so the first
+	     * fragment always gives its size */
+	    if (u->frag == 0)
+	    {
+		if (room < sizeof(*f) + (u->pos ? 1 : sizeof(*hdr)))
+		{
+		    if (udp_next(ch) < 0)
+			return XAMBIT_ERR_STD;
+		    continue;
+		}
+		f = (udp_frag_t *)(d + u->tx_fill);
+		f->parcel = u->parcel;
+		f->len = 0;
+		f->off = u->pos;
+		u->frag = u->tx_fill;
+		u->tx_fill += sizeof(*f);
+		room -= sizeof(*f);
+	    }
+	    else if (room == 0)
+	    {
+		if (udp_next(ch) < 0)
+		    return XAMBIT_ERR_STD;
+		continue;
+	    }
+	    f = (udp_frag_t *)(d + u->frag);
+
+	    want = u->total ? u->total - u->pos : sizeof(*hdr) - u->pos;
+	    n = len < room ? len : room;
+	    if (n > want)
+		n = want;
+
+	    memcpy(d + u->tx_fill, src, n);
+	    if (u->total == 0)
+		memcpy(u->hdr + u->pos, src, n);
+	    f->len += n;
+	    u->tx_fill += n;
+	    u->pos += n;
+	    src += n;
+	    len -= n;
+	    done += n;
+
+	    if (u->total == 0 && u->pos == sizeof(*hdr))
+		u->total = sizeof(*hdr) + hdr->length;
+	    f->total = u->total;
+
+	    if (u->total != 0 && u->pos == u->total)
+	    {
+		u->parcel++;
+		u->pos = 0;
+		u->total = 0;
+		u->frag = 0;
+	    }
+	}
+    }
+
+    /* What has been given goes now, unless it ends inside a parcel header,
+     * whose size the fragment could not yet give */
+    if (u->tx_fill > 0 && (u->total != 0 || u->pos == 0) &&
+	udp_next(ch) < 0)
+	return XAMBIT_ERR_STD;
+    if (udp_flush(ch) < 0)
+	return XAMBIT_ERR_STD;
+    return done;
+}
+
+/* Give up on the parcel being reassembled */
+static void udp_rx_drop(xambit_channel_t *ch)
+{
+    if (ch->udp->asm_active)
+	ch->stats.parcels_dropped++;
+    ch->udp->asm_active = 0;
+}
+
+/* Note that parcel has been seen, counting those since the last seen of
+ * which nothing came as dropped, as dgrams_lost counts datagrams. Returns 1
+ * if it is the first sight of parcel. */
+static int udp_rx_parcel(xambit_channel_t *ch, uint32_t parcel)
+{
+    xambit_udp_t	*u = ch->udp;
+
+    if (u->parcel_ok && (int32_t)(parcel - u->next_parcel) < 0)
+	return 0;
+    if (u->parcel_ok)
+	ch->stats.parcels_dropped += parcel - u->next_parcel;
+    u->parcel_ok = 1;
+    u->next_parcel = parcel + 1;
+    return 1;
+}
+
+/* Read fragments from the datagram at d next */
+static void udp_rx_start(xambit_udp_t *u, uint8_t *d)
+{
+    u->dgram = d;
+    u->rx_pos = sizeof(udp_dgram_t);
+    u->rx_end = sizeof(udp_dgram_t) + ((udp_dgram_t *)d)->len;
+}
+
+/* Rebuild what is missing of the current block, if enough has come in */
+static void udp_fec_decode(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+    uint8_t		*data[XAMBIT_FEC_MAX];
+    uint8_t		*repair[XAMBIT_FEC_MAX];
+    udp_dgram_t		*d;
+    int			i;
+
+    for (i = 0; i < u->fec_n; i++)
+    {
+	d = (udp_dgram_t *)(u->fec + i * u->mtu);
+	data[i] = (uint8_t *)d + UDP_SYM_OFF;
+	if (!u->have[i])
+	    continue;
+	if (sizeof(d->len) + d->len > u->fec_sym)
+	    return;
+	memset((uint8_t *)(d + 1) + d->len, 0,
+	       u->fec_sym - sizeof(d->len) - d->len);
+    }
+    for (i = 0; i < u->fec_r; i++)
+	repair[i] = u->fec + (u->fec_k + i) * u->mtu + UDP_SYM_OFF;
+
+    if (fec_decode(u->fec_r, u->fec_n, data, u->have, repair, u->rhave,
+		   u->fec_sym) < 0)
+	return;
+
+    for (i = 0; i < u->fec_n; i++)
+    {
+	d = (udp_dgram_t *)(u->fec + i * u->mtu);
+	if (u->have[i] || sizeof(d->len) + d->len > u->fec_sym)
+	    continue;
+	d->magic = UDP_MAGIC;
+	d->seq = u->fec_first + i;
+	d->block = u->fec_block;
+	d->flags = 0;
+	d->index = i;
+	d->count = 0;
+	u->have[i] = 1;
+	ch->stats.dgrams_recovered++;
+
+	/* Lost off the end of the block, with no later datagram to show it */
+	if ((int32_t)(d->seq - u->next_seq) >= 0)
+	{
+	    ch->stats.dgrams_lost += d->seq - u->next_seq + 1;
+	    u->next_seq = d->seq + 1;
+	}
+    }
+}
+
+/* Nothing more of the current block is coming: rebuild what can be, and
+ * read out the rest past any gaps */
+static void udp_fec_end(xambit_channel_t *ch)
+{
+    if (!ch->udp->fec_done && ch->udp->fec_n > 0)
+	udp_fec_decode(ch);
+    ch->udp->fec_done = 1;
+}
+
+/* Keep datagram d, of n bytes, of the current block */
+static void udp_fec_rx(xambit_channel_t *ch, udp_dgram_t *d, size_t n)
+{
+    xambit_udp_t	*u = ch->udp;
+    int			slot;
+    int			got = 0;
+    int			i;
+
+    if (!u->fec_active)
+    {
+	u->fec_active = 1;
+	u->fec_seen = 1;
+	u->fec_block = d->block;
+	u->fec_n = 0;
+	u->fec_next = 0;
+	u->fec_done = 0;
+	memset(u->have, 0, sizeof(u->have));
+	memset(u->rhave, 0, sizeof(u->rhave));
+    }
+
+    if (d->flags & UDP_REPAIR)
+    {
+	if (d->index >= u->fec_r || d->count == 0 || d->count > u->fec_k ||
+	    n < UDP_SYM_OFF + sizeof(d->len) || u->rhave[d->index] ||
+	    (u->fec_n != 0 && (d->count != u->fec_n ||
+			       n - UDP_SYM_OFF != u->fec_sym)))
+	    return;
+	slot = u->fec_k + d->index;
+	u->rhave[d->index] = 1;
+	u->fec_n = d->count;
+	u->fec_first = d->seq;
+	u->fec_sym = n - UDP_SYM_OFF;
+    }
+    else
+    {
+	if (d->index >= u->fec_k || u->have[d->index])
+	    return;
+	slot = d->index;
+	u->have[d->index] = 1;
+    }
+    memcpy(u->fec + slot * u->mtu, d, n);
+
+    if (u->fec_done || u->fec_n == 0)
+	return;
+
+    /* Decode as soon as there is enough to */
+    for (i = 0; i < u->fec_n; i++)
+	got += u->have[i];
+    if (got == u->fec_n)
+	u->fec_done = 1;
+    else
+    {
+	for (i = 0; i < u->fec_r; i++)
+	    got += u->rhave[i];
+	if (got >= u->fec_n)
+	    udp_fec_end(ch);
+    }
+}
+
+/* Start on the next datagram of the current block to be read, if it is
+ * here. Returns 1 if one was started. */
+static int udp_fec_next(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+
+    if (!u->fec_active)
+	return 0;
+
+    while (u->fec_next < (u->fec_n ? u->fec_n : u->fec_k))
+    {
+	if (u->have[u->fec_next])
+	{
+	    udp_rx_start(u, u->fec + u->fec_next++ * u->mtu);
+	    return 1;
+	}
+	if (!u->fec_done)
+	    return 0;
+
+	/* Lost for good; reassembly drops the parcels it held part of */
+	u->fec_next++;
+    }
+
+    if (u->fec_done)
+	u->fec_active = 0;
+    return 0;
+}
+
+/* Take in datagram i of the batch. Returns 1 if it must wait until the
+ * block before it has been read out. */
+static int udp_rx_dgram(xambit_channel_t *ch, int i)
+{
+    xambit_udp_t	*u = ch->udp;
+    udp_dgram_t		*d = (udp_dgram_t *)(u->rx + i * u->mtu);
+    size_t		n = u->msgs[i].msg_len;
+
+    if (n < sizeof(*d) || d->magic != UDP_MAGIC ||
+	(u->msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+	return 0;
+
+    /* A later block, or the end, means the current one is all in. What
+     * comes after a block is read out, such as its spare repairs, is too
+     * late. */
+    if (u->fec_seen && !(d->flags & UDP_FIN) &&
+	(int32_t)(d->block - u->fec_block) < (u->fec_active ? 0 : 1))
+	return 0;
+    if (u->fec_active && (d->block != u->fec_block || (d->flags & UDP_FIN)))
+    {
+	udp_fec_end(ch);
+	return 1;
+    }
+
+    /* Parcels lost after the last one seen are only known of here */
+    if (d->flags & UDP_FIN)
+    {
+	udp_rx_drop(ch);
+	if (d->len >= sizeof(uint32_t) && n >= sizeof(*d) + sizeof(uint32_t))
+	    udp_rx_parcel(ch, *(uint32_t *)(d + 1));
+	u->fin = 1;
+	return 0;
+    }
+
+    if (d->flags & UDP_REPAIR)
+    {
+	if (u->fec_r > 0)
+	    udp_fec_rx(ch, d, n);
+	return 0;
+    }
+
+    if (d->len > n - sizeof(*d))
+	return 0;
+
+    /* Late or repeated datagrams are ignored */
+    if (u->seq_ok && d->seq != u->next_seq)
+    {
+	if ((int32_t)(d->seq - u->next_seq) < 0)
+	    return 0;
+	ch->stats.dgrams_lost += d->seq - u->next_seq;
+    }
+    u->seq_ok = 1;
+    u->next_seq = d->seq + 1;
+
+    if (u->fec_r > 0)
+	udp_fec_rx(ch, d, sizeof(*d) + d->len);
+    else
+	udp_rx_start(u, (uint8_t *)d);
+    return 0;
+}
+
+/* Take in the next fragment of the current datagram, completing a parcel
+ * if it can */
+static void udp_rx_frag(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+    udp_frag_t		*f = (udp_frag_t *)(u->dgram + u->rx_pos);
+    uint8_t		*data = (uint8_t *)(f + 1);
+    uint8_t		*nbuf;
+
+    if (u->rx_end - u->rx_pos < sizeof(*f) ||
+	f->len > u->rx_end - u->rx_pos - sizeof(*f))
+    {
+	u->rx_pos = u->rx_end;
+	udp_rx_drop(ch);
+	return;
+    }
+    u->rx_pos += sizeof(*f) + f->len;
+
+    /* A parcel first seen part way through has lost its start */
+    if (udp_rx_parcel(ch, f->parcel) && f->off != 0)
+    {
+	udp_rx_drop(ch);
+	ch->stats.parcels_dropped++;
+	return;
+    }
+
+    if (f->off == 0)
+    {
+	udp_rx_drop(ch);
+
+	/* A parcel in a single fragment is read from where it landed */
+	if (f->len == f->total)
+	{
+	    u->ready = data;
+	    u->ready_len = f->len;
+	    u->ready_off = 0;
+	    return;
+	}
+
+	if (f->total > XAMBIT_UDP_PARCEL_MAX || f->len > f->total)
+	{
+	    ch->stats.parcels_dropped++;
+	    return;
+	}
+	if (f->total > u->asm_size)
+	{
+	    nbuf = realloc(u->asm_buf, f->total);
+	    if (nbuf == NULL)
+	    {
+		ch->stats.parcels_dropped++;
+		return;
+	    }
+	    u->asm_buf = nbuf;
+	    u->asm_size = f->total;
+	    ch->stats.allocs++;
+	}
+	u->asm_active = 1;
+	u->asm_parcel = f->parcel;
+	u->asm_total = f->total;
+	u->asm_got = 0;
+    }
+    else if (!u->asm_active || f->parcel != u->asm_parcel ||
+	     f->total != u->asm_total || f->off != u->asm_got ||
+	     f->len > u->asm_total - u->asm_got)
+    {
+	/* Part of a parcel that has lost a piece */
+	udp_rx_drop(ch);
+	return;
+    }
+
+    memcpy(u->asm_buf + u->asm_got, data, f->len);
+    u->asm_got += f->len;
+    if (u->asm_got == u->asm_total)
+    {
+	u->ready = u->asm_buf;
+	u->ready_len = u->asm_total;
+	u->ready_off = 0;
+	u->asm_active = 0;
+    }
+}
+
+/* Read the bytes of complete parcels, as read(), going on to further parcels
+ * as long as they are already received. Returns 0 once the sender has
+ * closed. */
+ssize_t udp_read(xambit_channel_t *ch, void *buf, size_t len)
+{
+    xambit_udp_t	*u = ch->udp;
+    uint8_t		*dst = buf;
+    size_t		done = 0;
+    size_t		n;
+    int			i;
+
+    if (u->rx == NULL &&
+	udp_buffers(u, &u->rx, u->fec_r ? u->fec_k + u->fec_r : 0) < 0)
+	return XAMBIT_ERR_STD;
+
+    while (done < len)
+    {
+	if (u->ready_off < u->ready_len)
+	{
+	    n = u->ready_len - u->ready_off;
+	    if (n > len - done)
+		n = len - done;
+	    memcpy(dst + done, u->ready + u->ready_off, n);
+	    u->ready_off += n;
+	    done += n;
+	    continue;
+	}
+
+	if (u->rx_pos < u->rx_end)
+	{
+	    udp_rx_frag(ch);
+	    continue;
+	}
+
+	if (udp_fec_next(ch))
+	    continue;
+
+	if (u->fin)
+	    break;
+
+	if (u->rx_idx == u->rx_cnt)
+	{
+	    /* Wait only while there is nothing to return */
+	    if (done > 0)
+		break;
+	    for (i = 0; i < XAMBIT_UDP_BATCH; i++)
+		u->iov[i].iov_len = u->mtu;
+	    i = recvmmsg(ch->fd, u->msgs, XAMBIT_UDP_BATCH, MSG_WAITFORONE,
+			 NULL);
+	    if (i < 0)
+		return XAMBIT_ERR_STD;
+	    u->rx_cnt = i;
+	    u->rx_idx = 0;
+	}
+	if (udp_rx_dgram(ch, u->rx_idx) == 0)
+	    u->rx_idx++;
+    }
+
+    return done;
+}
+
+/* Whether udp_read() has data it can return without receiving any more */
+int udp_rx_pending(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+
+    return u->ready_off < u->ready_len || u->rx_pos < u->rx_end ||
+	   u->rx_idx < u->rx_cnt;
+}
+
+/* A writer tells the reader it has gone, with a few copies in case some are
+ * lost */
+void udp_close(xambit_channel_t *ch)
+{
+    xambit_udp_t	*u = ch->udp;
+    udp_dgram_t		*d;
+    int			i;
+
+    if (ch->direction == XAMBIT_CHOUT && u->tx != NULL)
+    {
+	for (i = 0; i < UDP_FIN_COUNT; i++)
+	{
+	    d = (udp_dgram_t *)(u->tx + i * u->mtu);
+	    memset(d, 0, sizeof(*d));
+	    d->magic = UDP_MAGIC;
+	    d->seq = u->seq++;
+	    d->block = u->block;
+	    d->flags = UDP_FIN;
+	    d->len = sizeof(uint32_t);
+	    memcpy(d + 1, &u->parcel, sizeof(uint32_t));
+	    u->iov[i].iov_len = sizeof(*d) + sizeof(uint32_t);
+	}
+	udp_send(ch, UDP_FIN_COUNT);
+    }
+
+    free(u->tx);
+    free(u->rx);
+    free(u->fec);
+    free(u->asm_buf);
+    free(u);
+    ch->udp = NULL;
+}
@@ -0,0 +1,493 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* XAMBIT_URING FIFO channels: an io_uring per channel, with the FIFO
+ * registered as its only fixed file.
+ *
+ * A reader keeps XAMBIT_URING_DEPTH reads in flight into buffers registered
+ * with the ring, and hands the data out in the order it was read. A read of
+ * a FIFO is tried when the kernel is woken by data and completes as soon as
+ * it has taken any, with the pipe locked, so the reads posted to the
+ * completion queue are in the order they took the data, whatever order the
+ * buffers were submitted in; the buffers are taken in that order. Buffers
+ * taken are read into again in batches, on the system call that waits for
+ * data or once half of them are free, so a reader that keeps up with its
+ * writer collects several reads' worth of data per system call.
+ *
+ * A writer sends a file as a write of the parcel header linked to splices
+ * of the file into the FIFO, all submitted and waited for with one system
+ * call. Parcels themselves are still written with writev(): a write to a
+ * pipe through the ring completes once the pipe is full, with a short
+ * count, where writev() would have gone on to write the rest, and writes in
+ * flight together may complete, short, in any order.
+ *
+ * Where the kernel has no io_uring, or will not set one up, the channel is
+ * opened without one and carries on with read() and write(). */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES	(2 * XAMBIT_URING_DEPTH)
+#define URING_BUSY	INT32_MIN	/* uring_s.res of a read in flight */
+#define URING_HDR	(~0ULL)		/* user_data of a linked header write */
+
+struct xambit_uring_s {
+    int		fd;		    /* The ring */
+    uint8_t	*map;		    /* Submission and completion rings */
+    size_t	map_len;
+    struct io_uring_sqe *sqes;
+    size_t	sqes_len;
+    unsigned	*sq_head;
+    unsigned	*sq_tail;
+    unsigned	*sq_array;
+    unsigned	sq_mask;
+    unsigned	*cq_head;
+    unsigned	*cq_tail;
+    unsigned	cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Reader: buffer i holds res[i] bytes read, or -errno. done[] lists
+     * the buffers completed and not yet taken, in the order they were
+     * read, from done[done_head % DEPTH] to done[done_tail % DEPTH]. */
+    uint8_t	*bufs;
+    int32_t	res[XAMBIT_URING_DEPTH];
+    int		done[XAMBIT_URING_DEPTH];
+    unsigned	done_head;
+    unsigned	done_tail;
+    int32_t	off;		    /* Bytes of the first already taken */
+    int		idle;		    /* Buffers taken and not yet resubmitted */
+};
+
+static int uring_setup(xambit_uring_t *u);
+static struct io_uring_sqe *uring_sqe(xambit_uring_t *u);
+static int uring_enter(xambit_channel_t *ch, unsigned wait);
+static int uring_cqe(xambit_uring_t *u, uint64_t *data, int32_t *res);
+static void uring_reap(xambit_uring_t *u);
+static void uring_queue_read(xambit_uring_t *u, int i);
+
+/* Create the ring and map its queues. Only a kernel that maps both rings
+ * at once (5.4) and polls a FIFO for its reads rather than leaving them to
+ * blocking workers (5.7) is used. */
+static int uring_setup(xambit_uring_t *u)
+{
+    struct io_uring_params p;
+    size_t	sq_len;
+    size_t	cq_len;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0)
+	return XAMBIT_ERR_STD;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	!(p.features & IORING_FEAT_RW_CUR_POS) ||
+	!(p.features & IORING_FEAT_FAST_POLL))
+    {
+	errno = ENOSYS;
+	return XAMBIT_ERR_STD;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->map_len = sq_len > cq_len ? sq_len : cq_len;
+    u->map = mmap(NULL, u->map_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->map == MAP_FAILED)
+    {
+	u->map = NULL;
+	return XAMBIT_ERR_STD;
+    }
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+	u->sqes = NULL;
+	return XAMBIT_ERR_STD;
+    }
+
+    u->sq_head = (unsigned *)(u->map + p.sq_off.head);
+    u->sq_tail = (unsigned *)(u->map + p.sq_off.tail);
+    u->sq_array = (unsigned *)(u->map + p.sq_off.array);
+    u->sq_mask = *(unsigned *)(u->map + p.sq_off.ring_mask);
+    u->cq_head = (unsigned *)(u->map + p.cq_off.head);
+    u->cq_tail = (unsigned *)(u->map + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(u->map + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(u->map + p.cq_off.cqes);
+    return 0;
+}
+
+/* Next free submission entry, cleared; queued by the next uring_enter().
+ * Callers never have more than URING_ENTRIES requests outstanding. */
+static struct io_uring_sqe *uring_sqe(xambit_uring_t *u)
+{
+    unsigned		tail = *u->sq_tail;
+    unsigned		i = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* Submit whatever has been queued and, if wait is set, sleep until that
+ * many completions are waiting. Counted as a read or write call. */
+static int uring_enter(xambit_channel_t *ch, unsigned wait)
+{
+    xambit_uring_t *u = ch->uring;
+    unsigned	submit;
+    int		old;
+    int		n;
+
+    submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    /* The one place a pipelined reader waits, and so where it must be
+     * cancelled */
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old);
+    n = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    pthread_setcanceltype(old, NULL);
+    if (n < 0)
+	return XAMBIT_ERR_STD;
+
+    if (ch->direction == XAMBIT_CHOUT)
+	CH_STAT_ADD(ch, write_calls, 1);
+    else
+	ch->stats.read_calls++;
+    return 0;
+}
+
+/* Take the oldest completion; returns 0 if there is none */
+static int uring_cqe(xambit_uring_t *u, uint64_t *data, int32_t *res)
+{
+    unsigned		head = *u->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+	return 0;
+
+    cqe = &u->cqes[head & u->cq_mask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Note the reads that have completed against their buffers, in the order
+ * they completed */
+static void uring_reap(xambit_uring_t *u)
+{
+    uint64_t	data;
+    int32_t	res;
+
+    while (uring_cqe(u, &data, &res))
+    {
+	if (data < XAMBIT_URING_DEPTH)
+	{
+	    u->res[data] = res;
+	    u->done[u->done_tail++ % XAMBIT_URING_DEPTH] = data;
+	}
+    }
+}
+
+static void uring_queue_read(xambit_uring_t *u, int i)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = (uintptr_t)(u->bufs + (size_t)i * XAMBIT_URING_BUF_LEN);
+    sqe->len = XAMBIT_URING_BUF_LEN;
+    sqe->off = (uint64_t)-1;	    /* Wherever the FIFO is */
+    sqe->buf_index = i;
+    sqe->user_data = i;
+    u->res[i] = URING_BUSY;
+}
+
+/* Give a newly opened XAMBIT_URING FIFO channel its ring. Returns 0 with
+ * ch->uring left NULL if the kernel cannot provide one. */
+int uring_open(xambit_channel_t *ch)
+{
+    xambit_uring_t *u;
+    struct iovec iov[XAMBIT_URING_DEPTH];
+    int		i;
+
+    if (!(ch->flags & XAMBIT_URING))
+	return 0;
+
+    u = malloc(sizeof(xambit_uring_t));
+    if (u == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+    memset(u, 0, sizeof(xambit_uring_t));
+    ch->uring = u;
+
+    if (uring_setup(u) < 0)
+	goto fallback;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES,
+		&ch->fd, 1) < 0)
+	goto fallback;
+
+    if (ch->direction == XAMBIT_CHIN)
+    {
+	u->bufs = mmap(NULL, XAMBIT_URING_DEPTH * XAMBIT_URING_BUF_LEN,
+		       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		       -1, 0);
+	if (u->bufs == MAP_FAILED)
+	{
+	    u->bufs = NULL;
+	    goto fallback;
+	}
+	for (i = 0; i < XAMBIT_URING_DEPTH; i++)
+	{
+	    iov[i].iov_base = u->bufs + (size_t)i * XAMBIT_URING_BUF_LEN;
+	    iov[i].iov_len = XAMBIT_URING_BUF_LEN;
+	}
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+		    iov, XAMBIT_URING_DEPTH) < 0)
+	    goto fallback;
+
+	for (i = 0; i < XAMBIT_URING_DEPTH; i++)
+	    uring_queue_read(u, i);
+	if (uring_enter(ch, 0) < 0)
+	    goto fallback;
+    }
+
+    return 0;
+
+fallback:
+    uring_close(ch);
+    return 0;
+}
+
+/*
+ * Take up to len bytes from the reads that have completed, waiting for the
+ * oldest if none have. As read(), returns the count, 0 at end of file or -1
+ * with errno set.
+ */
+ssize_t uring_read(xambit_channel_t *ch, void *buf, size_t len)
+{
+    xambit_uring_t *u = ch->uring;
+    size_t	got = 0;
+    size_t	n;
+    int32_t	res;
+    int		i;
+
+    while (got < len)
+    {
+	uring_reap(u);
+	if (u->done_head == u->done_tail)
+	{
+	    if (got > 0)
+		break;
+	    if (uring_enter(ch, 1) < 0)
+		return -1;
+	    u->idle = 0;
+	    continue;
+	}
+	i = u->done[u->done_head % XAMBIT_URING_DEPTH];
+	res = u->res[i];
+	if (res <= 0)
+	{
+	    if (got > 0)
+		break;
+	    errno = -res;
+	    return res < 0 ? -1 : 0;
+	}
+
+	n = res - u->off;
+	if (n > len - got)
+	    n = len - got;
+	memcpy((uint8_t *)buf + got,
+	       u->bufs + (size_t)i * XAMBIT_URING_BUF_LEN + u->off, n);
+	got += n;
+	u->off += n;
+	if (u->off < res)
+	    break;
+
+	uring_queue_read(u, i);
+	u->done_head++;
+	u->off = 0;
+	u->idle++;
+    }
+
+    /* Keep at least half the reads in flight */
+    if (u->idle >= XAMBIT_URING_DEPTH / 2)
+    {
+	if (uring_enter(ch, 0) == 0)
+	    u->idle = 0;
+    }
+
+    return got;
+}
+
+/*
+ * Write a parcel header and the first len bytes of fd behind it, as one
+ * linked submission. *sent is set to the number of bytes of the file moved;
+ * the caller sends whatever is left. Returns 0, or XAMBIT_ERR_STD with
+ * errno set if the header could not be written.
+ */
+int uring_send_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr, int fd,
+		    uint64_t len, uint64_t *sent)
+{
+    xambit_uring_t *u = ch->uring;
+    struct io_uring_sqe *sqe;
+    uint64_t	off = 0;
+    uint64_t	data;
+    uint64_t	take;
+    int32_t	res;
+    int32_t	hres = -ECANCELED;
+    int		ok = 1;
+    int		cnt = 1;
+    int		err;
+
+    sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_FIXED_FILE | (len > 0 ? IOSQE_IO_LINK : 0);
+    sqe->fd = 0;
+    sqe->addr = (uintptr_t)hdr;
+    sqe->len = sizeof(*hdr);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = URING_HDR;
+
+    /* Each splice moves what the pipe will take, so the rest of a large
+     * file follows on later rounds */
+    while (off < len && cnt < URING_ENTRIES)
+    {
+	take = len - off > XAMBIT_SPLICE_MAX ? XAMBIT_SPLICE_MAX : len - off;
+	sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;
+	sqe->splice_fd_in = fd;
+	sqe->splice_off_in = off;
+	sqe->off = (uint64_t)-1;
+	sqe->len = take;
+	sqe->splice_flags = SPLICE_F_MOVE;
+	sqe->user_data = off;
+	if (off + take < len && cnt + 1 < URING_ENTRIES)
+	    sqe->flags |= IOSQE_IO_LINK;
+	off += take;
+	cnt++;
+    }
+
+    *sent = 0;
+    while (cnt > 0)
+    {
+	if (uring_enter(ch, cnt) < 0 && errno != EINTR && errno != EAGAIN &&
+	    errno != EBUSY)
+	{
+	    /* Nothing can be sent behind requests that may yet complete, so
+	     * they go with the ring */
+	    err = errno;
+	    uring_close(ch);
+	    errno = err;
+	    return XAMBIT_ERR_STD; /* Warning: send/receive sync error possible */
+	}
+	while (uring_cqe(u, &data, &res))
+	{
+	    cnt--;
+	    if (data == URING_HDR)
+		hres = res;
+	    else if (res > 0 && ok && data == *sent)
+		*sent += res;
+	    else
+		ok = 0;
+	}
+    }
+
+    if (hres != (int32_t)sizeof(*hdr))
+    {
+	errno = hres < 0 ? -hres : EIO;
+	return XAMBIT_ERR_STD; /* Warning: send/receive sync error possible */
+    }
+    return 0;
+}
+
+/* Tear down a channel's ring. Reads still in flight are cancelled as it
+ * goes. */
+void uring_close(xambit_channel_t *ch)
+{
+    xambit_uring_t *u = ch->uring;
+
+    if (u == NULL)
+	return;
+
+    if (u->sqes != NULL)
+	munmap(u->sqes, u->sqes_len);
+    if (u->map != NULL)
+	munmap(u->map, u->map_len);
+    if (u->fd >= 0)
+	close(u->fd);
+    /* The kernel holds its own reference to pages still being read into */
+    if (u->bufs != NULL)
+	munmap(u->bufs, XAMBIT_URING_DEPTH * XAMBIT_URING_BUF_LEN);
+    free(u);
+    ch->uring = NULL;
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+int uring_open(xambit_channel_t *ch)
+{
+    return 0;
+}
+
+ssize_t uring_read(xambit_channel_t *ch, void *buf, size_t len)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_send_file(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr, int fd,
+		    uint64_t len, uint64_t *sent)
+{
+    errno = ENOSYS;
+    return XAMBIT_ERR_STD;
+}
+
+void uring_close(xambit_channel_t *ch)
+{
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
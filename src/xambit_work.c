@@ -0,0 +1,333 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Channel worker threads. Jobs are queued on the pool and counted against a
+ * group; a thread waiting on a group runs queued jobs itself rather than
+ * sleeping, so the caller is never idle while its work is outstanding. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xambit.h>
+
+#include "xambit_int.h"
+
+struct xambit_workers_s {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;	    /* Jobs queued, or stopping */
+    pthread_cond_t  done;	    /* A job finished */
+    xw_job_t	    *head;
+    xw_job_t	    *tail;
+    int		    stop;
+    int		    nthreads;
+    pthread_t	    threads[];
+};
+
+/* One piece of a parcel being checked in parallel */
+typedef struct par_chunk_s {
+    xw_job_t		    job;
+    xambit_type_validator_t *tv;
+    xambit_parcel_hdr_t	    *hdr;
+    uint8_t		    *data;	/* Start of the parcel */
+    uint64_t		    off;
+    uint64_t		    len;
+    int			    csum;
+    uint32_t		    crc;
+    int			    err;
+} par_chunk_t;
+
+static void *xw_main(void *arg);
+static xw_job_t *xw_pop(xambit_workers_t *w);
+static void xw_run(xambit_workers_t *w, xw_job_t *job);
+static void par_chunk_run(void *arg);
+
+/* Take the next queued job; called with the lock held */
+static xw_job_t *xw_pop(xambit_workers_t *w)
+{
+    xw_job_t	*job = w->head;
+
+    if (job != NULL)
+    {
+	w->head = job->next;
+	if (w->head == NULL)
+	    w->tail = NULL;
+    }
+    return job;
+}
+
+/* Run a job taken off the queue; called, and returns, with the lock held */
+static void xw_run(xambit_workers_t *w, xw_job_t *job)
+{
+    xw_group_t	*group = job->group;
+
+    pthread_mutex_unlock(&w->lock);
+    job->fn(job->arg);
+    pthread_mutex_lock(&w->lock);
+
+    if (--group->pending == 0)
+	pthread_cond_broadcast(&w->done);
+}
+
+static void *xw_main(void *arg)
+{
+    xambit_workers_t	*w = arg;
+    xw_job_t		*job;
+
+    pthread_mutex_lock(&w->lock);
+    while (1)
+    {
+	job = xw_pop(w);
+	if (job != NULL)
+	{
+	    xw_run(w, job);
+	    continue;
+	}
+	if (w->stop)
+	    break;
+	pthread_cond_wait(&w->work, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+xambit_workers_t *xw_create(int nthreads)
+{
+    xambit_workers_t	*w;
+    int			i;
+
+    w = calloc(1, sizeof(*w) + nthreads * sizeof(pthread_t));
+    if (w == NULL)
+    {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+
+    for (i = 0; i < nthreads; i++)
+    {
+	errno = pthread_create(&w->threads[i], NULL, xw_main, w);
+	if (errno != 0)
+	    break;
+	w->nthreads++;
+    }
+
+    if (w->nthreads < nthreads)
+    {
+	i = errno;
+	xw_destroy(w);
+	errno = i;
+	return NULL;
+    }
+
+    return w;
+}
+
+/* Stop the threads once the queue has drained */
+void xw_destroy(xambit_workers_t *w)
+{
+    int		i;
+
+    if (w == NULL)
+	return;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 0; i < w->nthreads; i++)
+	pthread_join(w->threads[i], NULL);
+
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+int xw_nthreads(xambit_workers_t *w)
+{
+    return w->nthreads;
+}
+
+void xw_submit(xambit_workers_t *w, xw_group_t *group, xw_job_t *job)
+{
+    job->group = group;
+    job->next = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    group->pending++;
+    if (w->tail != NULL)
+	w->tail->next = job;
+    else
+	w->head = job;
+    w->tail = job;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Wait for every job of group to finish, helping out meanwhile */
+void xw_wait(xambit_workers_t *w, xw_group_t *group)
+{
+    xw_job_t	*job;
+
+    pthread_mutex_lock(&w->lock);
+    while (group->pending > 0)
+    {
+	job = xw_pop(w);
+	if (job != NULL)
+	    xw_run(w, job);
+	else
+	    pthread_cond_wait(&w->done, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*  Function Name:	channel_set_workers
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To check large received parcels on several threads.
+ *
+ *  Assumptions:	.
+ *
+ *  Notes:		Parcels of at least two chunks have their data checksum
+ *			and any chunk validator run a chunk at a time across
+ *			nthreads worker threads plus the receiving thread. A
+ *			chunk of 0 selects XAMBIT_PAR_CHUNK, and nthreads of 0
+ *			stops the workers.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_workers(xambit_channel_t *ch, int nthreads, size_t chunk)
+{
+    xambit_workers_t	*w = NULL;
+
+    if (ch == NULL || nthreads < 0)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    /* The pipeline's checks run on the workers */
+    if (ch->pipeline != NULL)
+    {
+	errno = EBUSY;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (nthreads > 0)
+    {
+	w = xw_create(nthreads);
+	if (w == NULL)
+	    return XAMBIT_ERR_STD;
+    }
+
+    xw_destroy(ch->workers);
+    ch->workers = w;
+    ch->par_chunk = chunk ? chunk : XAMBIT_PAR_CHUNK;
+    return 0;
+}
+
+/* Whether a parcel of len bytes is worth splitting up */
+int rx_parallel(xambit_channel_t *ch, uint64_t len)
+{
+    return ch->workers != NULL && len / 2 >= ch->par_chunk;
+}
+
+static void par_chunk_run(void *arg)
+{
+    par_chunk_t	*c = arg;
+
+    if (c->csum)
+	c->crc = crc32c(0, c->data + c->off, c->len);
+    if (c->tv != NULL &&
+	c->tv->chunk(c->hdr, c->data + c->off, c->off, c->len) < 0)
+	c->err = XAMBIT_ERR_VALIDATE;
+}
+
+/* Check the data of a received parcel against its checksum, if csum is set,
+ * and run its validator, with the parcel split into chunks across the
+ * channel's workers. The per-chunk CRCs are combined in order for the
+ * verdict. The chunk callback is only split up where tv_validate() would use
+ * it, when the validator has no other; otherwise the validator, or the rules
+ * of one split up, runs over the whole parcel on this thread meanwhile. */
+int rx_par_check(xambit_channel_t *ch, xambit_type_validator_t *tv,
+		 xambit_parcel_hdr_t *hdr, void *data, int csum)
+{
+    xw_group_t	group;
+    par_chunk_t	*c;
+    uint64_t	n;
+    uint64_t	i;
+    uint32_t	crc = 0;
+    int		verr = 0;
+    int		err = 0;
+    int		split;
+
+    split = tv->chunk != NULL && tv->validate == NULL &&
+	    (tv->update == NULL || tv->final == NULL);
+    n = (hdr->length + ch->par_chunk - 1) / ch->par_chunk;
+    c = calloc(n, sizeof(*c));
+    if (c == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+
+    memset(&group, 0, sizeof(group));
+    for (i = 0; i < n; i++)
+    {
+	c[i].job.fn = par_chunk_run;
+	c[i].job.arg = &c[i];
+	c[i].tv = split ? tv : NULL;
+	c[i].hdr = hdr;
+	c[i].data = data;
+	c[i].off = i * ch->par_chunk;
+	c[i].len = i + 1 < n ? ch->par_chunk : hdr->length - c[i].off;
+	c[i].csum = csum && (hdr->flags & XAMBIT_DATA_CSUM);
+	xw_submit(ch->workers, &group, &c[i].job);
+    }
+
+    if (split)
+	verr = tv_rules(tv, hdr, data);
+    else
+	verr = tv_validate(tv, hdr, data);
+    xw_wait(ch->workers, &group);
+
+    for (i = 0; i < n; i++)
+    {
+	if (c[i].err < 0)
+	    verr = c[i].err;
+	crc = i ? crc32c_combine(crc, c[i].crc, c[i].len) : c[i].crc;
+    }
+    free(c);
+
+    if (csum)
+	err = rx_check_data(ch, hdr, data, &crc);
+    return err < 0 ? err : verr;
+}
@@ -0,0 +1,498 @@
+/*
+ * XAmbit - Cross boundary data transfer library
+ * Copyright (C) 2016-2017 BAE Systems.
+ *
+ * This file is part of XAmbit.
+ *
+ * XAmbit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XAmbit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with XAmbit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Parcel compression. A XAMBIT_COMPRESS writer deflates the data of block
+ * parcels that look worth it, once they have been validated, and marks them
+ * XAMBIT_ZLIB. A XAMBIT_COMPRESS reader inflates them before they are
+ * validated, so the validators at both ends see the data as it was given.
+ *
+ * The data of a deflated parcel is a zl_hdr_t, the deflated length of each
+ * chunk, and the chunks themselves: the parcel cut every chunk bytes, each
+ * piece deflated as a zlib stream of its own, so that both ends can spread a
+ * large parcel across the channel workers. A piece that does not shrink is
+ * carried as it is.
+ *
+ * Whether a parcel is worth deflating is judged from the order-0 entropy of a
+ * sample of it. A type whose parcels do not shrink enough, as JPEG or PNG
+ * images will not, is then passed over for a run of parcels, twice as long
+ * each time in a row that it fails, so that it costs no more than a lookup. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xambit.h>
+#include <zlib.h>
+
+#include "xambit_int.h"
+
+#define ZL_TYPES	64	    /* Types the policy remembers */
+#define ZL_SAMPLE	16	    /* Windows sampled for the entropy */
+#define ZL_WINDOW	256	    /* ... of this many bytes each */
+#define ZL_ENTROPY_MAX	7.5	    /* Bits per byte past which data is taken
+				       to be compressed already */
+#define ZL_GAIN		16	    /* Deflating must save 1/16 of the data */
+#define ZL_BACKOFF_MAX	10	    /* Pass a type over for at most 1024 */
+#define ZL_RATIO_MAX	1032	    /* Most that deflate can shrink data by */
+#define ZL_STORED	0x80000000  /* Chunk length flag: not deflated */
+
+struct xambit_zlib_s {
+    int		level;
+    size_t	min;
+    /* Type ID, times in a row it has failed to shrink, and parcels of it
+     * still to pass over, packed 32:8:24 */
+    uint64_t	types[ZL_TYPES];
+};
+
+/* One piece of a parcel being deflated or inflated */
+typedef struct zl_chunk_s {
+    xw_job_t	job;
+    const uint8_t *src;
+    size_t	slen;
+    uint8_t	*dst;
+    size_t	dlen;		    /* Room at dst; deflating, what it took */
+    int		level;		    /* 0 to inflate */
+    int		err;
+    uint64_t	usec;		    /* CPU time spent on it */
+} zl_chunk_t;
+
+static uint64_t cpu_usec(void);
+static double zl_entropy(const uint8_t *buf, size_t len);
+static int zl_pass_over(xambit_zlib_t *z, uint32_t tid);
+static void zl_learn(xambit_zlib_t *z, uint32_t tid, int shrank);
+static void zl_chunk_run(void *arg);
+static uint64_t zl_run(xambit_channel_t *ch, zl_chunk_t *c, uint32_t n);
+
+static uint64_t cpu_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Order-0 entropy, in bits per byte, of evenly spaced windows of buf */
+static double zl_entropy(const uint8_t *buf, size_t len)
+{
+    uint32_t	count[256];
+    size_t	step;
+    size_t	n;
+    size_t	i;
+    size_t	j;
+    double	p;
+    double	h = 0;
+
+    memset(count, 0, sizeof(count));
+    if (len <= ZL_SAMPLE * ZL_WINDOW)
+    {
+	for (i = 0; i < len; i++)
+	    count[buf[i]]++;
+	n = len;
+    }
+    else
+    {
+	step = (len - ZL_WINDOW) / (ZL_SAMPLE - 1);
+	for (i = 0; i < ZL_SAMPLE; i++)
+	    for (j = 0; j < ZL_WINDOW; j++)
+		count[buf[i * step + j]]++;
+	n = ZL_SAMPLE * ZL_WINDOW;
+    }
+
+    for (i = 0; i < 256; i++)
+    {
+	if (count[i] == 0)
+	    continue;
+	p = (double)count[i] / n;
+	h -= p * log2(p);
+    }
+    return h;
+}
+
+/* Whether a parcel of type tid is to be sent as it is without a look, the
+ * type having lately failed to shrink. Concurrent senders may race here; the
+ * worst that comes of it is a parcel looked at, or not, out of turn. */
+static int zl_pass_over(xambit_zlib_t *z, uint32_t tid)
+{
+    uint64_t	*slot = &z->types[tid % ZL_TYPES];
+    uint64_t	v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+
+    if (v >> 32 != tid || (v & 0xffffff) == 0)
+	return 0;
+
+    __atomic_store_n(slot, v - 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Remember whether the last look at a type paid off */
+static void zl_learn(xambit_zlib_t *z, uint32_t tid, int shrank)
+{
+    uint64_t	*slot = &z->types[tid % ZL_TYPES];
+    uint64_t	v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    uint64_t	fails = v >> 32 == tid ? (v >> 24) & 0xff : 0;
+
+    if (shrank)
+    {
+	if (v != (uint64_t)tid << 32)
+	    __atomic_store_n(slot, (uint64_t)tid << 32, __ATOMIC_RELAXED);
+	return;
+    }
+
+    if (fails < ZL_BACKOFF_MAX)
+	fails++;
+    __atomic_store_n(slot, (uint64_t)tid << 32 | fails << 24 |
+		     (uint64_t)1 << fails, __ATOMIC_RELAXED);
+}
+
+static void zl_chunk_run(void *arg)
+{
+    zl_chunk_t	*c = arg;
+    z_stream	zs;
+    uint64_t	t0;
+    int		wbits;
+    int		err;
+
+    /* A stored piece, already copied */
+    if (c->dlen == 0)
+	return;
+
+    t0 = cpu_usec();
+    memset(&zs, 0, sizeof(zs));
+    zs.next_in = (Bytef *)c->src;
+    zs.avail_in = c->slen;
+    zs.next_out = c->dst;
+    zs.avail_out = c->dlen;
+
+    if (c->level == 0)
+    {
+	/* It must come out at exactly the length it claims */
+	c->err = XAMBIT_ERR_INFLATE;
+	if (inflateInit(&zs) == Z_OK)
+	{
+	    if (inflate(&zs, Z_FINISH) == Z_STREAM_END &&
+		zs.avail_in == 0 && zs.avail_out == 0)
+		c->err = 0;
+	    inflateEnd(&zs);
+	}
+    }
+    else
+    {
+	/* No bigger a window, nor hash, than a piece this size can use */
+	for (wbits = 9; wbits < 15 && ((size_t)1 << wbits) < c->slen; wbits++)
+	    ;
+	c->err = XAMBIT_ERR_STD;
+	if (deflateInit2(&zs, c->level, Z_DEFLATED, wbits, wbits - 7,
+			 Z_DEFAULT_STRATEGY) == Z_OK)
+	{
+	    /* Out of room means it did not shrink enough */
+	    err = deflate(&zs, Z_FINISH);
+	    if (err == Z_STREAM_END)
+	    {
+		c->dlen -= zs.avail_out;
+		c->err = 0;
+	    }
+	    deflateEnd(&zs);
+	}
+    }
+
+    c->usec = cpu_usec() - t0;
+}
+
+/* Run the pieces of a parcel, across the channel workers if it has them,
+ * returning the CPU time they took */
+static uint64_t zl_run(xambit_channel_t *ch, zl_chunk_t *c, uint32_t n)
+{
+    xw_group_t	group;
+    uint64_t	usec = 0;
+    uint32_t	i;
+
+    if (ch->workers != NULL && n > 1)
+    {
+	memset(&group, 0, sizeof(group));
+	for (i = 1; i < n; i++)
+	{
+	    c[i].job.fn = zl_chunk_run;
+	    c[i].job.arg = &c[i];
+	    xw_submit(ch->workers, &group, &c[i].job);
+	}
+	zl_chunk_run(&c[0]);
+	xw_wait(ch->workers, &group);
+    }
+    else
+    {
+	for (i = 0; i < n; i++)
+	    zl_chunk_run(&c[i]);
+    }
+
+    for (i = 0; i < n; i++)
+	usec += c[i].usec;
+    return usec;
+}
+
+/* Deflate the data of a checked outgoing block parcel, if the policy thinks
+ * it worth it and it shrinks enough. Returns the data to send in its place,
+ * for the caller to free, with hdr changed to match and resealed; or NULL,
+ * with hdr untouched, to send the parcel as it is. */
+void *zl_deflate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+		 const void *buf)
+{
+    xambit_zlib_t   *z = ch->zlib;
+    zl_hdr_t	    zh;
+    zl_chunk_t	    *c = NULL;
+    uint8_t	    *out = NULL;
+    uint64_t	    len = hdr->length;
+    uint64_t	    t0;
+    uint64_t	    usec;
+    size_t	    hlen;
+    size_t	    off;
+    uint32_t	    clen;
+    uint32_t	    n;
+    uint32_t	    i;
+
+    if (z == NULL || len < z->min || len > SIZE_MAX / 2)
+	return NULL;
+
+    if (zl_pass_over(z, hdr->type))
+    {
+	CH_STAT_ADD(ch, zlib_skipped, 1);
+	return NULL;
+    }
+
+    t0 = cpu_usec();
+    if (zl_entropy(buf, len) > ZL_ENTROPY_MAX)
+    {
+	CH_STAT_ADD(ch, zlib_usec, cpu_usec() - t0);
+	goto skip;
+    }
+    usec = cpu_usec() - t0;
+
+    n = (len + XAMBIT_ZLIB_CHUNK - 1) / XAMBIT_ZLIB_CHUNK;
+    hlen = sizeof(zh) + n * sizeof(uint32_t);
+    c = calloc(n, sizeof(*c));
+    out = malloc(hlen + len);
+    if (c == NULL || out == NULL)
+	goto skip;
+
+    /* Each piece is deflated into where it would go stored */
+    for (i = 0; i < n; i++)
+    {
+	c[i].src = (const uint8_t *)buf + (uint64_t)i * XAMBIT_ZLIB_CHUNK;
+	c[i].slen = i + 1 < n ? XAMBIT_ZLIB_CHUNK :
+		    len - (uint64_t)i * XAMBIT_ZLIB_CHUNK;
+	c[i].dst = out + hlen + (c[i].src - (const uint8_t *)buf);
+	c[i].dlen = c[i].slen - c[i].slen / ZL_GAIN;
+	c[i].level = z->level;
+    }
+    usec += zl_run(ch, c, n);
+    CH_STAT_ADD(ch, zlib_usec, usec);
+
+    off = hlen;
+    for (i = 0; i < n; i++)
+    {
+	if (c[i].err < 0)
+	{
+	    memmove(out + off, c[i].src, c[i].slen);
+	    clen = c[i].slen | ZL_STORED;
+	    off += c[i].slen;
+	}
+	else
+	{
+	    memmove(out + off, c[i].dst, c[i].dlen);
+	    clen = c[i].dlen;
+	    off += c[i].dlen;
+	}
+	memcpy(out + sizeof(zh) + i * sizeof(clen), &clen, sizeof(clen));
+    }
+
+    if (off > len - len / ZL_GAIN)
+	goto skip;
+
+    zh.length = len;
+    zh.chunk = XAMBIT_ZLIB_CHUNK;
+    zh.count = n;
+    memcpy(out, &zh, sizeof(zh));
+    free(c);
+
+    zl_learn(z, hdr->type, 1);
+    CH_STAT_ADD(ch, zlib_parcels, 1);
+    CH_STAT_ADD(ch, zlib_saved, len - off);
+
+    hdr->length = off;
+    hdr->flags |= XAMBIT_ZLIB;
+    prepare_parcel(ch, hdr);
+    return out;
+
+skip:
+    zl_learn(z, hdr->type, 0);
+    CH_STAT_ADD(ch, zlib_skipped, 1);
+    free(c);
+    free(out);
+    return NULL;
+}
+
+/* The inflated length of a received deflated parcel, from the start of its
+ * data at src, which must hold sizeof(zl_hdr_t) bytes if the parcel has that
+ * many. It is refused if the channel does not take deflated parcels, or if
+ * it is more than deflate could have come from the data that crossed. */
+int zl_length(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+	      const void *src, uint64_t *len)
+{
+    zl_hdr_t	zh;
+
+    if (ch->zlib == NULL || hdr->length < sizeof(zh))
+	return XAMBIT_ERR_INFLATE;
+
+    memcpy(&zh, src, sizeof(zh));
+    if (zh.length > SIZE_MAX / 2 || zh.length / ZL_RATIO_MAX > hdr->length)
+	return XAMBIT_ERR_INFLATE;
+
+    *len = zh.length;
+    return 0;
+}
+
+/* Inflate a received deflated parcel, whose data is at src, into dst, which
+ * holds the length zl_length gave. Every piece must account for exactly its
+ * share of the data at both ends. hdr is left describing the inflated
+ * parcel, and what it took is added to stats. */
+int zl_inflate(xambit_channel_t *ch, xambit_parcel_hdr_t *hdr,
+	       const void *src, void *dst, xambit_stats_t *stats)
+{
+    const uint8_t   *in = src;
+    zl_hdr_t	    zh;
+    zl_chunk_t	    *c;
+    uint64_t	    off;
+    uint64_t	    usec;
+    uint64_t	    i;
+    uint32_t	    clen;
+    int		    err = 0;
+
+    memcpy(&zh, src, sizeof(zh));
+    if (zh.chunk == 0 || zh.chunk >= ZL_STORED ||
+	zh.count != (zh.length + zh.chunk - 1) / zh.chunk ||
+	zh.count > (hdr->length - sizeof(zh)) / sizeof(clen))
+	return XAMBIT_ERR_INFLATE;
+
+    c = calloc(zh.count ? zh.count : 1, sizeof(*c));
+    if (c == NULL)
+    {
+	errno = ENOMEM;
+	return XAMBIT_ERR_STD;
+    }
+
+    off = sizeof(zh) + zh.count * sizeof(clen);
+    for (i = 0; i < zh.count; i++)
+    {
+	memcpy(&clen, in + sizeof(zh) + i * sizeof(clen), sizeof(clen));
+	c[i].src = in + off;
+	c[i].slen = clen & ~ZL_STORED;
+	c[i].dst = (uint8_t *)dst + i * zh.chunk;
+	c[i].dlen = i + 1 < zh.count ? zh.chunk : zh.length - i * zh.chunk;
+	if (c[i].slen > hdr->length - off ||
+	    ((clen & ZL_STORED) && c[i].slen != c[i].dlen))
+	{
+	    err = XAMBIT_ERR_INFLATE;
+	    goto out;
+	}
+	off += c[i].slen;
+
+	/* Stored pieces are copied now, leaving the rest to inflate */
+	if (clen & ZL_STORED)
+	{
+	    memcpy(c[i].dst, c[i].src, c[i].slen);
+	    c[i].slen = 0;
+	    c[i].dlen = 0;
+	}
+    }
+    if (off != hdr->length)
+    {
+	err = XAMBIT_ERR_INFLATE;
+	goto out;
+    }
+
+    usec = zl_run(ch, c, zh.count);
+    for (i = 0; i < zh.count; i++)
+	if (c[i].err < 0)
+	    err = XAMBIT_ERR_INFLATE;
+
+    stats->zlib_usec += usec;
+    if (err == 0)
+    {
+	stats->zlib_parcels++;
+	stats->zlib_saved += zh.length - hdr->length;
+	hdr->length = zh.length;
+    }
+
+out:
+    free(c);
+    return err;
+}
+
+/*  Function Name:	channel_set_compression
+ *
+ *  Scope:		Module
+ *
+ *  Purpose:		To have a writer deflate the parcels it sends, or a
+ *			reader take deflated parcels.
+ *
+ *  Assumptions:	Called before the channel is used.
+ *
+ *  Notes:		level is that of deflate, 1 (fastest) to 9 (smallest),
+ *			and 0 turns compression off. Parcels under min bytes
+ *			are never deflated; 0 selects XAMBIT_ZLIB_MIN. A reader
+ *			only looks at whether level is 0. Opening a channel
+ *			with XAMBIT_COMPRESS does the same as a call with
+ *			XAMBIT_ZLIB_LEVEL and 0.
+ *
+ *  Return Value:	0 on success, negetive on failure with errno set.
+ */
+int channel_set_compression(xambit_channel_t *ch, int level, size_t min)
+{
+    if (ch == NULL || level < 0 || level > 9)
+    {
+	errno = EINVAL;
+	return XAMBIT_ERR_STD;
+    }
+
+    if (level == 0)
+    {
+	free(ch->zlib);
+	ch->zlib = NULL;
+	return 0;
+    }
+
+    if (ch->zlib == NULL)
+    {
+	ch->zlib = calloc(1, sizeof(*ch->zlib));
+	if (ch->zlib == NULL)
+	{
+	    errno = ENOMEM;
+	    return XAMBIT_ERR_STD;
+	}
+    }
+
+    ch->zlib->level = level;
+    ch->zlib->min = min ? min : XAMBIT_ZLIB_MIN;
+    return 0;
+}